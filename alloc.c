@@ -0,0 +1,386 @@
+/* alloc.c */
+#include "main.h"
+
+// Object sizes of the Leaf size classes. The smallest class fits a short key
+// with a few bytes of inline value; the largest fits a LeafKeyMax key with an
+// out-of-line value.
+static const uint16_t leaf_class_sizes[LeafClassCount] = {48, 64, 80, 96, 128, 176};
+
+void pages_init(Pages *pages, int node, size_t huge)
+{
+    assert(pages != NULL && "Error: Pages cannot be NULL for pages_init.");
+
+    zero((uint8_t *)pages, sizeof(Pages));
+    pthread_mutex_init(&pages->lock, NULL);
+    pages->node = node;
+    pages->huge = huge;
+}
+
+// Returns the index of the smallest block size holding `bytes`.
+static uint32_t pages_class(size_t bytes)
+{
+    uint32_t pclass = 0;
+
+    while (((size_t)PagesMinBlock << pclass) < bytes)
+    {
+        pclass++;
+    }
+
+    return pclass;
+}
+
+Chunk *pages_alloc(Pages *pages, size_t size)
+{
+    Chunk *chunk, *region;
+    size_t block, region_size, tail;
+    uint32_t pclass;
+
+    assert(pages != NULL && "Error: Pages cannot be NULL for pages_alloc.");
+    assert(sizeof(Chunk) + size <= PagesMaxBlock && "Error: Chunk too large for pages_alloc.");
+
+    pclass = pages_class(sizeof(Chunk) + size);
+    block = (size_t)PagesMinBlock << pclass;
+
+    pthread_mutex_lock(&pages->lock);
+    chunk = pages->free[pclass];
+    if (chunk != NULL)
+    {
+        pages->free[pclass] = chunk->next;
+        pthread_mutex_unlock(&pages->lock);
+        return chunk;
+    }
+
+    if (pages->cursor == NULL || pages->cursor + block > pages->end)
+    {
+        region = (Chunk *)numa_map(&region_size, pages->node, pages->huge);
+        if (region == NULL)
+        {
+            pthread_mutex_unlock(&pages->lock);
+            reterr(ENOMEM);
+        }
+
+        // What is left of the old region goes to the free lists, largest blocks first.
+        for (pclass = PagesClassCount; pclass-- > 0;)
+        {
+            tail = (size_t)PagesMinBlock << pclass;
+            while (pages->cursor != NULL && pages->cursor + tail <= pages->end)
+            {
+                chunk = (Chunk *)pages->cursor;
+                chunk->size = tail - sizeof(Chunk);
+                chunk->next = pages->free[pclass];
+                pages->free[pclass] = chunk;
+                pages->cursor += tail;
+            }
+        }
+
+        region->size = region_size;
+        region->next = pages->regions;
+        pages->regions = region;
+        pages->cursor = region->data;
+        pages->end = (uint8_t *)region + region_size;
+        pages->reserved += region_size;
+    }
+
+    chunk = (Chunk *)pages->cursor;
+    pages->cursor += block;
+    pthread_mutex_unlock(&pages->lock);
+    chunk->size = block - sizeof(Chunk);
+
+    return chunk;
+}
+
+void pages_free(Pages *pages, Chunk *chunk)
+{
+    uint32_t pclass = pages_class(sizeof(Chunk) + chunk->size);
+
+    assert(pages != NULL && "Error: Pages cannot be NULL for pages_free.");
+
+    pthread_mutex_lock(&pages->lock);
+    chunk->next = pages->free[pclass];
+    pages->free[pclass] = chunk;
+    pthread_mutex_unlock(&pages->lock);
+}
+
+void pages_release(Pages *pages)
+{
+    Chunk *region, *next;
+
+    assert(pages != NULL && "Error: Pages cannot be NULL for pages_release.");
+
+    for (region = pages->regions; region != NULL; region = next)
+    {
+        next = region->next;
+        numa_unmap(region, region->size);
+    }
+    pthread_mutex_destroy(&pages->lock);
+    pages_init(pages, pages->node, pages->huge);
+}
+
+// Takes a chunk of `size` usable bytes from `pages`, or from malloc if there
+// is none or the chunk is too large for it. Returns NULL with errno set.
+static Chunk *chunk_alloc(Pages *pages, size_t size)
+{
+    Chunk *chunk;
+
+    if (pages != NULL && sizeof(Chunk) + size <= PagesMaxBlock)
+    {
+        return pages_alloc(pages, size);
+    }
+
+    chunk = (Chunk *)malloc(sizeof(Chunk) + size);
+    if (chunk == NULL)
+    {
+        reterr(ENOMEM);
+    }
+    chunk->size = size;
+
+    return chunk;
+}
+
+// Returns a chunk taken by chunk_alloc with the same `pages`.
+static void chunk_free(Pages *pages, Chunk *chunk)
+{
+    if (pages != NULL && sizeof(Chunk) + chunk->size <= PagesMaxBlock)
+    {
+        pages_free(pages, chunk);
+    }
+    else
+    {
+        free(chunk);
+    }
+}
+
+void slab_init(Slab *slab, size_t object_size)
+{
+    assert(slab != NULL && "Error: Slab cannot be NULL for slab_init.");
+    // Every free object must be able to hold the free-list link.
+    assert(object_size >= sizeof(void *) && "Error: Slab objects are too small to be recycled.");
+
+    zero((uint8_t *)slab, sizeof(Slab));
+    slab->object_size = align_up(object_size, SlabAlign);
+}
+
+void *slab_alloc(Slab *slab)
+{
+    Chunk *chunk;
+    void *object;
+
+    assert(slab != NULL && "Error: Slab cannot be NULL for slab_alloc.");
+
+    // Recycle a freed object first; this keeps the working set compact.
+    if (slab->free_list != NULL)
+    {
+        object = slab->free_list;
+        slab->free_list = *(void **)object;
+        __atomic_store_n(&slab->live, slab->live + 1, __ATOMIC_RELAXED); // Read by the stats without the lock.
+        meter_add(slab->meter, slab->object_size);
+        return object;
+    }
+
+    // Otherwise carve the next never-used object out of the newest chunk.
+    if (slab->cursor == NULL || slab->cursor + slab->object_size > slab->end)
+    {
+        chunk = chunk_alloc(slab->pages, SlabChunkSize - sizeof(Chunk));
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+        __atomic_store_n(&slab->reserved, slab->reserved + chunk->size, __ATOMIC_RELAXED);
+        // Chunk::data follows two machine words, so it is already SlabAlign-aligned
+        // on every supported platform.
+        slab->cursor = chunk->data;
+        slab->end = chunk->data + chunk->size;
+    }
+
+    object = slab->cursor;
+    slab->cursor += slab->object_size;
+    __atomic_store_n(&slab->live, slab->live + 1, __ATOMIC_RELAXED);
+    meter_add(slab->meter, slab->object_size);
+
+    return object;
+}
+
+void slab_free(Slab *slab, void *ptr)
+{
+    assert(slab != NULL && "Error: Slab cannot be NULL for slab_free.");
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    *(void **)ptr = slab->free_list;
+    slab->free_list = ptr;
+    __atomic_store_n(&slab->live, slab->live - 1, __ATOMIC_RELAXED);
+    meter_sub(slab->meter, slab->object_size);
+}
+
+void slab_release(Slab *slab)
+{
+    Chunk *chunk, *next;
+    size_t *meter = slab->meter;
+    Pages *pages = slab->pages;
+
+    assert(slab != NULL && "Error: Slab cannot be NULL for slab_release.");
+
+    for (chunk = slab->chunks; chunk != NULL; chunk = next)
+    {
+        next = chunk->next;
+        chunk_free(pages, chunk);
+    }
+
+    meter_sub(meter, slab->live * slab->object_size);
+    slab_init(slab, slab->object_size);
+    slab->meter = meter;
+    slab->pages = pages;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    Chunk *chunk;
+    size_t chunk_size;
+    void *block;
+
+    assert(arena != NULL && "Error: Arena cannot be NULL for arena_alloc.");
+
+    size = align_up(size == 0 ? 1 : size, sizeof(void *));
+
+    if (arena->cursor == NULL || arena->cursor + size > arena->end)
+    {
+        // Start small so that Nodes holding a handful of values stay cheap, then
+        // double with every chunk until ArenaMaxChunk. Sizes count the chunk
+        // header, so every chunk fills a block of a Pages exactly.
+        chunk_size = arena->chunks == NULL ? ArenaMinChunk : (sizeof(Chunk) + arena->chunks->size) * 2;
+        if (chunk_size > ArenaMaxChunk)
+        {
+            chunk_size = ArenaMaxChunk;
+        }
+        if (chunk_size < sizeof(Chunk) + size)
+        {
+            chunk_size = sizeof(Chunk) + size;
+        }
+
+        chunk = chunk_alloc(arena->pages, chunk_size - sizeof(Chunk));
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->cursor = chunk->data;
+        arena->end = chunk->data + chunk->size;
+        __atomic_store_n(&arena->bytes, arena->bytes + chunk->size, __ATOMIC_RELAXED);
+        meter_add(arena->meter, chunk->size);
+    }
+
+    block = arena->cursor;
+    arena->cursor += size;
+
+    return block;
+}
+
+void arena_release(Arena *arena)
+{
+    Chunk *chunk, *next;
+    size_t *meter = arena->meter;
+    Pages *pages = arena->pages;
+
+    assert(arena != NULL && "Error: Arena cannot be NULL for arena_release.");
+
+    for (chunk = arena->chunks; chunk != NULL; chunk = next)
+    {
+        next = chunk->next;
+        chunk_free(pages, chunk);
+    }
+
+    meter_sub(meter, arena->bytes);
+    zero((uint8_t *)arena, sizeof(Arena));
+    arena->meter = meter;
+    arena->pages = pages;
+}
+
+int8_t leaf_class(size_t size)
+{
+    int8_t sclass;
+
+    for (sclass = 0; sclass < LeafClassCount; sclass++)
+    {
+        if (size <= leaf_class_sizes[sclass])
+        {
+            return sclass;
+        }
+    }
+
+    return -1;
+}
+
+size_t leaf_class_size(uint8_t sclass)
+{
+    assert(sclass < LeafClassCount && "Error: Invalid Leaf size class.");
+
+    return leaf_class_sizes[sclass];
+}
+
+void allocator_init(Allocator *alloc)
+{
+    uint8_t sclass;
+
+    assert(alloc != NULL && "Error: Allocator cannot be NULL for allocator_init.");
+
+    zero((uint8_t *)&alloc->limbo, sizeof(Limbo));
+    alloc->reap = NULL;
+    alloc->background = 0;
+    alloc->bytes = 0;
+    alloc->pages = NULL;
+    slab_init(&alloc->nodes, sizeof(struct s_node));
+    alloc->nodes.meter = &alloc->bytes;
+    for (sclass = 0; sclass < LeafClassCount; sclass++)
+    {
+        slab_init(&alloc->leaves[sclass], leaf_class_sizes[sclass]);
+        alloc->leaves[sclass].meter = &alloc->bytes;
+    }
+    for (sclass = 0; sclass < SkipMaxLevel; sclass++)
+    {
+        slab_init(&alloc->towers[sclass], offsetof(Skip, next) + (sclass + 1) * sizeof(Skip *));
+        alloc->towers[sclass].meter = &alloc->bytes;
+    }
+}
+
+void allocator_place(Allocator *alloc, Pages *pages)
+{
+    uint8_t sclass;
+
+    assert(alloc != NULL && "Error: Allocator cannot be NULL for allocator_place.");
+
+    alloc->pages = pages;
+    alloc->nodes.pages = pages;
+    for (sclass = 0; sclass < LeafClassCount; sclass++)
+    {
+        alloc->leaves[sclass].pages = pages;
+    }
+    for (sclass = 0; sclass < SkipMaxLevel; sclass++)
+    {
+        alloc->towers[sclass].pages = pages;
+    }
+}
+
+void allocator_release(Allocator *alloc)
+{
+    uint8_t sclass;
+
+    assert(alloc != NULL && "Error: Allocator cannot be NULL for allocator_release.");
+
+    // Retired objects are still carved out of the slabs; let them go first.
+    limbo_drain(&alloc->limbo);
+    slab_release(&alloc->nodes);
+    for (sclass = 0; sclass < LeafClassCount; sclass++)
+    {
+        slab_release(&alloc->leaves[sclass]);
+    }
+    for (sclass = 0; sclass < SkipMaxLevel; sclass++)
+    {
+        slab_release(&alloc->towers[sclass]);
+    }
+}
@@ -0,0 +1,274 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint8_t)
+#include <stddef.h> // For size_t and NULL
+#include <pthread.h> // For the lock of a Pages
+
+#include "epoch.h"  // For the Limbo that defers frees past concurrent readers
+#include "skiplist.h" // For the skiplist towers kept beside the Leaves
+
+// =============================================================================
+// Allocator Constants
+// =============================================================================
+#define SlabChunkSize (64 * 1024)  /* Bytes per slab chunk, its header included */
+#define SlabAlign 16               /* Alignment (and rounding) of every slab object */
+#define ArenaMinChunk 1024         /* Size of the first chunk of a value arena, its header included */
+#define ArenaMaxChunk (64 * 1024)  /* Chunks stop doubling once they reach this size, header included */
+#define ArenaSmallValue 256        /* Values up to this many bytes are bump-allocated from an arena */
+#define LeafClassCount 6           /* Number of Leaf size classes (see leaf_class) */
+#define PagesMinBlock 1024         /* Smallest block a Pages hands out */
+#define PagesMaxBlock (64 * 1024)  /* Largest block a Pages hands out; larger chunks come from malloc */
+#define PagesClassCount 7          /* Block sizes: PagesMinBlock times each power of two up to PagesMaxBlock */
+#define PagesRegionSize (2 * 1024 * 1024) /* Bytes a Pages maps at a time without explicit huge pages */
+
+// Rounds `size` up to the next multiple of `align` (which must be a power of two).
+#define align_up(size, align) (((size_t)(size) + (align) - 1) & ~((size_t)(align) - 1))
+
+// meter_add / meter_sub: Charge or uncharge `n` bytes to a meter (a size_t
+// counter of the bytes some owner holds), unless it is NULL. Meters are read
+// without locks by memory_used, and the snapshot loader charges them without
+// the writer lock, so they are updated atomically.
+#define meter_add(meter, n) \
+    do { \
+        if ((meter) != NULL) \
+            __atomic_add_fetch((meter), (size_t)(n), __ATOMIC_RELAXED); \
+    } while(0)
+#define meter_sub(meter, n) \
+    do { \
+        if ((meter) != NULL) \
+            __atomic_sub_fetch((meter), (size_t)(n), __ATOMIC_RELAXED); \
+    } while(0)
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+/**
+ * @brief A chunk of raw memory owned by a Slab or an Arena.
+ *
+ * Chunks form a singly linked list so the owner can release them in bulk.
+ */
+struct s_chunk {
+    struct s_chunk *next; ///< The next chunk owned by the same Slab or Arena.
+    size_t size;          ///< Usable size of `data` in bytes.
+    uint8_t data[];       ///< The memory handed out to callers.
+};
+typedef struct s_chunk Chunk;
+
+/**
+ * @brief A source of chunks placed on one NUMA node, optionally backed by huge pages.
+ *
+ * Maps whole regions (PagesRegionSize, or one huge page) bound to its node,
+ * and carves them into power-of-two blocks, from PagesMinBlock to
+ * PagesMaxBlock, that are recycled through one free list per size; regions
+ * are only unmapped by pages_release. Slabs and arenas that have a Pages take
+ * their chunks from it rather than from malloc, so a shard's memory lives on
+ * the node of the worker that owns the shard, and walking its tree touches
+ * fewer pages (and TLB entries). Shared by every shard of the node, and used
+ * from any thread, so it has a lock of its own.
+ */
+struct s_pages {
+    pthread_mutex_t lock;           ///< Protects everything below.
+    int node;                       ///< The NUMA node regions are bound to, or -1 for none.
+    size_t huge;                    ///< The huge page size to map regions with (0: normal pages).
+    Chunk *free[PagesClassCount];   ///< Free blocks of each size, linked through `next`.
+    Chunk *regions;                 ///< Every region mapped, newest first (the header starts the region).
+    uint8_t *cursor;                ///< Next never-used byte of the newest region.
+    uint8_t *end;                   ///< End of the newest region.
+    size_t reserved;                ///< Bytes mapped.
+};
+typedef struct s_pages Pages;
+
+/**
+ * @brief A fixed-size-class object allocator.
+ *
+ * Objects are carved out of large chunks and recycled through an intrusive
+ * free list, so allocating and freeing are a few pointer operations and never
+ * reach malloc once the slab has warmed up.
+ */
+struct s_slab {
+    size_t object_size; ///< Size of every object, rounded up to SlabAlign.
+    void *free_list;    ///< Freed objects; the first word of each links to the next.
+    Chunk *chunks;      ///< Every chunk owned by the slab, newest first.
+    uint8_t *cursor;    ///< Next never-used object in the newest chunk.
+    uint8_t *end;       ///< End of the newest chunk.
+    size_t live;        ///< Number of objects currently handed out.
+    size_t reserved;    ///< Bytes of every chunk owned by the slab.
+    size_t *meter;      ///< Charged with `object_size` per live object, or NULL.
+    Pages *pages;       ///< Where chunks come from, or NULL for malloc.
+};
+typedef struct s_slab Slab;
+
+/**
+ * @brief A bump allocator for small variable-size blocks.
+ *
+ * Blocks cannot be freed individually; the whole arena is released at once.
+ * A zeroed Arena is a valid empty arena.
+ */
+struct s_arena {
+    Chunk *chunks;   ///< Every chunk owned by the arena, newest first.
+    uint8_t *cursor; ///< Next free byte in the newest chunk.
+    uint8_t *end;    ///< End of the newest chunk.
+    size_t bytes;    ///< Total chunk bytes reserved by the arena.
+    size_t *meter;   ///< Charged with `bytes`, or NULL.
+    Pages *pages;    ///< Where chunks come from, or NULL for malloc.
+};
+typedef struct s_arena Arena;
+
+/**
+ * @brief The per-tree set of size classes used for Node and Leaf structures.
+ *
+ * Leaves vary in size with their key and inline value, so they are spread over
+ * several size classes rather than a single one; skiplist towers likewise get
+ * one class per height. Memory unlinked from the tree
+ * passes through `limbo` before it returns to a slab, so that lock-free readers
+ * never see it reused. The allocator is protected by the tree's writer lock.
+ *
+ * `bytes` meters what the tree really costs: every live object of the slabs,
+ * and, charged by their owners, the value arenas and indexes of its Nodes
+ * and the heap values of its Leaves (see node_cost and leaf_cost). Memory
+ * waiting in `limbo` stays charged until it is reclaimed.
+ */
+struct s_allocator {
+    Slab nodes;                  ///< Size class for `struct s_node`.
+    Slab leaves[LeafClassCount]; ///< Size classes for variable-size `struct s_leaf`.
+    Slab towers[SkipMaxLevel];   ///< Size classes for skiplist towers; towers[h - 1] holds height h.
+    Limbo limbo;                 ///< Unlinked Nodes, Leaves and tables waiting for their grace period.
+    struct s_node *reap;         ///< Dropped Nodes past their grace period, waiting for the reaper (linked through `north`).
+    uint8_t background;          ///< Whether dropped subtrees are handed to the reaper rather than freed in place.
+    size_t bytes;                ///< Bytes the tree holds (see above).
+    Pages *pages;                ///< Where the slabs, and the arenas of the tree's Nodes, take chunks from (NULL: malloc).
+};
+typedef struct s_allocator Allocator;
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Initializes an empty Pages.
+ *
+ * @param pages A pointer to the Pages to initialize.
+ * @param node  The NUMA node to bind its regions to, or -1.
+ * @param huge  The huge page size to map regions with (e.g. 2 MiB or 1 GiB), or 0 for normal pages.
+ */
+void pages_init(Pages *pages, int node, size_t huge);
+
+/**
+ * @brief Takes a chunk of at least `size` usable bytes from a Pages.
+ *
+ * @param pages A pointer to the Pages.
+ * @param size  The usable bytes needed; `sizeof(Chunk) + size` must not exceed PagesMaxBlock.
+ * @return      The chunk, its `size` set to the usable bytes of its block, or NULL with errno set.
+ */
+Chunk *pages_alloc(Pages *pages, size_t size);
+
+/**
+ * @brief Returns a chunk to the Pages it came from.
+ *
+ * @param pages A pointer to the Pages.
+ * @param chunk The chunk, as pages_alloc returned it.
+ */
+void pages_free(Pages *pages, Chunk *chunk);
+
+/**
+ * @brief Unmaps every region of a Pages, invalidating all of its chunks.
+ *
+ * @param pages A pointer to the Pages to release.
+ */
+void pages_release(Pages *pages);
+
+/**
+ * @brief Initializes an empty slab for objects of the given size.
+ *
+ * @param slab        A pointer to the slab to initialize.
+ * @param object_size The size of every object handed out by the slab.
+ */
+void slab_init(Slab *slab, size_t object_size);
+
+/**
+ * @brief Allocates one object from a slab.
+ *
+ * @param slab A pointer to the slab to allocate from.
+ * @return     A pointer to the object, or NULL with errno set to ENOMEM.
+ */
+void *slab_alloc(Slab *slab);
+
+/**
+ * @brief Returns an object to the slab's free list.
+ *
+ * @param slab A pointer to the slab the object was allocated from.
+ * @param ptr  A pointer to the object (NULL is ignored).
+ */
+void slab_free(Slab *slab, void *ptr);
+
+/**
+ * @brief Frees every chunk owned by a slab, invalidating all of its objects.
+ *
+ * @param slab A pointer to the slab to release.
+ */
+void slab_release(Slab *slab);
+
+/**
+ * @brief Bump-allocates a block from an arena.
+ *
+ * @param arena A pointer to the arena to allocate from.
+ * @param size  The number of bytes required.
+ * @return      A pointer to the block, or NULL with errno set to ENOMEM.
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * @brief Frees every chunk owned by an arena and resets it to the empty state, keeping its meter.
+ *
+ * @param arena A pointer to the arena to release.
+ */
+void arena_release(Arena *arena);
+
+/**
+ * @brief Returns the smallest Leaf size class that can hold `size` bytes.
+ *
+ * @param size The total size of the leaf (header, key and any inline value).
+ * @return     The class index, or -1 if `size` exceeds the largest class.
+ */
+int8_t leaf_class(size_t size);
+
+/**
+ * @brief Returns the object size of a Leaf size class.
+ *
+ * @param sclass A class index returned by leaf_class.
+ * @return       The number of bytes available to a leaf in that class.
+ */
+size_t leaf_class_size(uint8_t sclass);
+
+/**
+ * @brief Initializes the Node and Leaf size classes of an allocator, metered by its `bytes`.
+ *
+ * @param alloc A pointer to the allocator to initialize.
+ */
+void allocator_init(Allocator *alloc);
+
+/**
+ * @brief Makes an allocator's slabs (and, through node_meter, its Nodes' arenas) take their chunks from `pages`.
+ *
+ * Must be called before anything is allocated from the allocator.
+ *
+ * @param alloc A pointer to the allocator.
+ * @param pages The Pages, or NULL for malloc.
+ */
+void allocator_place(Allocator *alloc, Pages *pages);
+
+/**
+ * @brief Releases all memory owned by an allocator's size classes.
+ *
+ * Waits for every pending retirement in the allocator's limbo first.
+ *
+ * @param alloc A pointer to the allocator to release.
+ */
+void allocator_release(Allocator *alloc);
+
+#endif /* ALLOC_H */
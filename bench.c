@@ -0,0 +1,741 @@
+/* bench.c */
+// Microbenchmarks for the tree operations. Built and run by `make bench`:
+//
+//   bench.exe [max keys] [workload]
+//
+// Every workload runs at 1K, 10K, 100K, ... keys up to `max keys` (default
+// 1M; pass 100000000 for the full range), once per key distribution, and
+// prints throughput, latency percentiles and the memory used per entry. The
+// optional second argument runs only the workloads whose name contains it.
+#include "main.h"
+
+#include <time.h>   // For clock_gettime
+#include <math.h>   // For pow, used by the zipfian generator
+#include <malloc.h> // For mallinfo2, used to measure bytes per entry
+
+// =============================================================================
+// Benchmark Constants
+// =============================================================================
+#define BenchDefaultMax 1000000ULL  /* Largest key count when none is given */
+#define BenchMaxNodes 10000000ULL   /* create_node stops here; Nodes are ~300 bytes each */
+#define BenchSampleEvery 16         /* One operation in this many is timed individually */
+#define BenchScanLength 100         /* Leaves read per scan */
+#define BenchValueSize 16           /* Bytes in every benchmark value */
+#define BenchMixedPaths 64          /* Nodes the mixed workload spreads its keys over */
+#define BenchMixedWrites 10         /* Percentage of writes in the mixed workload */
+#define BenchBatch 32               /* Keys per store_get_many call in the store_get_many workload */
+#define BenchZipfTheta 0.99         /* Skew of the zipfian distribution (as in YCSB) */
+
+#define DistSequential 0 /* Keys inserted and looked up in ascending order */
+#define DistUniform 1    /* Keys inserted in random order and looked up uniformly at random */
+#define DistZipfian 2    /* Keys inserted in random order and looked up with a zipfian skew */
+#define DistCount 3
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+/**
+ * @brief Draws key ranks for one run of a workload.
+ */
+struct s_keygen {
+    uint8_t dist;     ///< DistSequential, DistUniform or DistZipfian.
+    uint64_t n;       ///< Number of keys.
+    uint64_t next;    ///< Next rank for DistSequential.
+    uint64_t rng;     ///< xorshift64 state.
+    double alpha;     ///< Zipfian constants (see keygen_init).
+    double zetan;
+    double eta;
+};
+typedef struct s_keygen KeyGen;
+
+/**
+ * @brief The measurements of one workload run.
+ */
+struct s_result {
+    uint64_t ops;      ///< Operations performed.
+    uint64_t elapsed;  ///< Wall time of the whole run, in nanoseconds.
+    uint64_t *samples; ///< Latencies of the individually timed operations, in nanoseconds.
+    uint64_t count;    ///< Number of samples.
+    uint64_t bytes;    ///< Heap bytes still in use at the end of the run, minus those before it.
+    uint64_t entries;  ///< Entries those bytes are spread over (0 to leave bytes/entry out).
+};
+typedef struct s_result Result;
+
+/**
+ * @brief One workload: sets up its own data, runs `ops` operations and cleans up.
+ */
+struct s_workload {
+    const char *name;                          ///< Name printed in the report.
+    void (*run)(KeyGen *gen, Result *result);  ///< Runs the workload.
+};
+typedef struct s_workload Workload;
+
+static const char *dist_names[DistCount] = {"sequential", "uniform", "zipfian"};
+
+// =============================================================================
+// Helpers
+// =============================================================================
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Returns the heap bytes currently allocated by the process.
+static uint64_t heap_bytes(void)
+{
+    struct mallinfo2 info = mallinfo2();
+
+    return (uint64_t)info.uordblks + (uint64_t)info.hblkhd;
+}
+
+// A bijective 64-bit mixer (splitmix64 finalizer): gives every rank a distinct
+// key scattered over the key space.
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t xorshift64(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Writes the NUL-terminated key of rank `rank` into `key`. Sequential keys
+// sort in rank order; the others are scattered (see mix64), so inserting
+// ranks 0, 1, 2, ... inserts them in random key order.
+static void key_of(const KeyGen *gen, uint64_t rank, uint8_t *key)
+{
+    uint64_t x = gen->dist == DistSequential ? rank : mix64(rank);
+
+    snprintf((char *)key, LeafKeyMax + 1, "k%016llx", (unsigned long long)x);
+}
+
+// Returns the integer key of rank `rank` for the fixed-width trees: the same
+// order as key_of, without the string.
+static uint64_t fixed_key_of(const KeyGen *gen, uint64_t rank)
+{
+    return gen->dist == DistSequential ? rank : mix64(rank);
+}
+
+// Prepares a generator over `n` keys. The zipfian constants follow Gray et al.,
+// "Quickly Generating Billion-Record Synthetic Databases" (as used by YCSB).
+static void keygen_init(KeyGen *gen, uint8_t dist, uint64_t n)
+{
+    static double zeta_cache = 0;
+    static uint64_t zeta_n = 0;
+    double zeta2;
+    uint64_t i;
+
+    zero((uint8_t *)gen, sizeof(KeyGen));
+    gen->dist = dist;
+    gen->n = n;
+    gen->rng = 0x9e3779b97f4a7c15ULL ^ n;
+
+    if (dist == DistZipfian)
+    {
+        if (zeta_n != n)
+        {
+            zeta_cache = 0;
+            for (i = 1; i <= n; i++)
+            {
+                zeta_cache += 1.0 / pow((double)i, BenchZipfTheta);
+            }
+            zeta_n = n;
+        }
+        zeta2 = 1.0 + 1.0 / pow(2.0, BenchZipfTheta);
+        gen->zetan = zeta_cache;
+        gen->alpha = 1.0 / (1.0 - BenchZipfTheta);
+        gen->eta = (1.0 - pow(2.0 / (double)n, 1.0 - BenchZipfTheta)) / (1.0 - zeta2 / gen->zetan);
+    }
+}
+
+// Returns the rank of the next key to look up.
+static uint64_t keygen_next(KeyGen *gen)
+{
+    double u, uz;
+    uint64_t rank;
+
+    switch (gen->dist)
+    {
+    case DistSequential:
+        rank = gen->next;
+        gen->next = (gen->next + 1) % gen->n;
+        return rank;
+
+    case DistUniform:
+        return xorshift64(&gen->rng) % gen->n;
+
+    default:
+        u = (double)(xorshift64(&gen->rng) >> 11) / (double)(1ULL << 53);
+        uz = u * gen->zetan;
+        if (uz < 1.0)
+        {
+            return 0;
+        }
+        if (uz < 1.0 + pow(0.5, BenchZipfTheta))
+        {
+            return 1 < gen->n ? 1 : 0;
+        }
+        rank = (uint64_t)((double)gen->n * pow(gen->eta * u - gen->eta + 1.0, gen->alpha));
+        return rank < gen->n ? rank : gen->n - 1;
+    }
+}
+
+// Records the latency of one individually timed operation.
+static void sample(Result *result, uint64_t start)
+{
+    result->samples[result->count++] = now_ns() - start;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Returns the p-th percentile (0 < p < 100) of the sorted samples.
+static uint64_t percentile(const Result *result, double p)
+{
+    uint64_t at;
+
+    if (result->count == 0)
+    {
+        return 0;
+    }
+    at = (uint64_t)(p / 100.0 * (double)(result->count - 1));
+    return result->samples[at];
+}
+
+// Makes an empty root Node with its own allocator, like a single shard.
+static Node *bench_root(Allocator *alloc)
+{
+    Node *root = (Node *)calloc(1, sizeof(Node));
+
+    if (root == NULL)
+    {
+        perror("ERROR: Failed to allocate the benchmark root");
+        exit(1);
+    }
+    allocator_init(alloc);
+    root->tag = TagRoot;
+    root->alloc = alloc;
+    return root;
+}
+
+// Frees a root made by bench_root together with everything below it.
+static void bench_release(Node *root, Allocator *alloc)
+{
+    Node *child;
+    uint32_t cursor = 0;
+
+    while ((child = (Node *)index_next(&root->children, &cursor)) != NULL)
+    {
+        drop_subtree(child);
+    }
+    limbo_drain(&alloc->limbo);
+    index_release(&root->children);
+    allocator_release(alloc);
+    free(root);
+}
+
+// Fills `node` with the generator's keys in insertion order.
+static void fill_leaves(KeyGen *gen, Node *node, uint8_t *value)
+{
+    uint8_t key[LeafKeyMax + 1];
+    uint64_t i;
+
+    for (i = 0; i < gen->n; i++)
+    {
+        key_of(gen, i, key);
+        if (create_leaf(node, key, BenchValueSize, value) == NULL)
+        {
+            perror("ERROR: create_leaf failed while filling");
+            exit(1);
+        }
+    }
+}
+
+// =============================================================================
+// Workloads
+// =============================================================================
+
+static void run_create_node(KeyGen *gen, Result *result)
+{
+    Allocator alloc;
+    Node *root;
+    uint8_t key[LeafKeyMax + 1];
+    uint64_t i, n = gen->n < BenchMaxNodes ? gen->n : BenchMaxNodes, before, start, began;
+
+    before = heap_bytes();
+    root = bench_root(&alloc);
+    began = now_ns();
+    for (i = 0; i < n; i++)
+    {
+        key_of(gen, i, key);
+        start = i % BenchSampleEvery == 0 ? now_ns() : 0;
+        if (create_node(root, (int8_t *)key) == NULL)
+        {
+            perror("ERROR: create_node failed");
+            exit(1);
+        }
+        if (start != 0)
+        {
+            sample(result, start);
+        }
+    }
+    result->elapsed = now_ns() - began;
+    result->ops = n;
+    result->bytes = heap_bytes() - before;
+    result->entries = n;
+    bench_release(root, &alloc);
+}
+
+static void run_create_leaf(KeyGen *gen, Result *result)
+{
+    Allocator alloc;
+    Node *root, *node;
+    uint8_t key[LeafKeyMax + 1], value[BenchValueSize] = {0};
+    uint64_t i, before, start, began;
+
+    before = heap_bytes();
+    root = bench_root(&alloc);
+    node = create_node(root, (int8_t *)"bench");
+    began = now_ns();
+    for (i = 0; i < gen->n; i++)
+    {
+        key_of(gen, i, key);
+        start = i % BenchSampleEvery == 0 ? now_ns() : 0;
+        if (create_leaf(node, key, BenchValueSize, value) == NULL)
+        {
+            perror("ERROR: create_leaf failed");
+            exit(1);
+        }
+        if (start != 0)
+        {
+            sample(result, start);
+        }
+    }
+    result->elapsed = now_ns() - began;
+    result->ops = gen->n;
+    result->bytes = heap_bytes() - before;
+    result->entries = gen->n;
+    bench_release(root, &alloc);
+}
+
+static void run_find_last(KeyGen *gen, Result *result)
+{
+    Allocator alloc;
+    Node *root, *node;
+    uint8_t value[BenchValueSize] = {0};
+    uint64_t i, start, began;
+    volatile Leaf *sink;
+
+    root = bench_root(&alloc);
+    node = create_node(root, (int8_t *)"bench");
+    fill_leaves(gen, node, value);
+    began = now_ns();
+    for (i = 0; i < gen->n; i++)
+    {
+        start = i % BenchSampleEvery == 0 ? now_ns() : 0;
+        sink = find_last(node);
+        if (start != 0)
+        {
+            sample(result, start);
+        }
+    }
+    (void)sink;
+    result->elapsed = now_ns() - began;
+    result->ops = gen->n;
+    bench_release(root, &alloc);
+}
+
+static void run_lookup(KeyGen *gen, Result *result)
+{
+    Allocator alloc;
+    Node *root, *node;
+    uint8_t key[LeafKeyMax + 1], value[BenchValueSize] = {0};
+    uint64_t i, start, began, found = 0;
+
+    root = bench_root(&alloc);
+    node = create_node(root, (int8_t *)"bench");
+    fill_leaves(gen, node, value);
+    began = now_ns();
+    for (i = 0; i < gen->n; i++)
+    {
+        key_of(gen, keygen_next(gen), key);
+        start = i % BenchSampleEvery == 0 ? now_ns() : 0;
+        epoch_enter();
+        found += find_leaf(node, key) != NULL;
+        epoch_exit();
+        if (start != 0)
+        {
+            sample(result, start);
+        }
+    }
+    result->elapsed = now_ns() - began;
+    result->ops = gen->n;
+    if (found != gen->n)
+    {
+        fprintf(stderr, "WARNING: lookup found %llu of %llu keys\n", (unsigned long long)found,
+                (unsigned long long)gen->n);
+    }
+    bench_release(root, &alloc);
+}
+
+static void run_scan(KeyGen *gen, Result *result)
+{
+    Allocator alloc;
+    Node *root, *node;
+    Cursor cursor;
+    Leaf *leaf;
+    uint8_t key[LeafKeyMax + 1], value[BenchValueSize] = {0};
+    uint64_t i, ops, start, began, bytes = 0;
+    uint32_t j;
+
+    root = bench_root(&alloc);
+    node = create_node(root, (int8_t *)"bench");
+    fill_leaves(gen, node, value);
+    ops = gen->n / BenchScanLength > 0 ? gen->n / BenchScanLength : 1;
+    began = now_ns();
+    for (i = 0; i < ops; i++)
+    {
+        key_of(gen, keygen_next(gen), key);
+        start = i % BenchSampleEvery == 0 ? now_ns() : 0;
+        epoch_enter();
+        leaf = cursor_seek(&cursor, node, key, (uint16_t)strlen((char *)key));
+        for (j = 0; leaf != NULL && j < BenchScanLength; j++, leaf = cursor_next(&cursor))
+        {
+            bytes += leaf->size;
+        }
+        epoch_exit();
+        if (start != 0)
+        {
+            sample(result, start);
+        }
+    }
+    result->elapsed = now_ns() - began;
+    result->ops = ops;
+    (void)bytes;
+    bench_release(root, &alloc);
+}
+
+static void run_mixed(KeyGen *gen, Result *result)
+{
+    char path[32];
+    uint8_t key[LeafKeyMax + 1], value[BenchValueSize] = {0};
+    uint64_t i, rank, start, began, before;
+
+    // The full store path: shard routing, path resolution and the writer locks.
+    before = heap_bytes();
+    shards_init();
+    for (i = 0; i < gen->n; i++)
+    {
+        rank = i;
+        snprintf(path, sizeof(path), "/m%02u", (unsigned)(rank % BenchMixedPaths));
+        key_of(gen, rank, key);
+        if (store_set(path, key, BenchValueSize, value) != NoError)
+        {
+            perror("ERROR: store_set failed while filling");
+            exit(1);
+        }
+    }
+    result->bytes = heap_bytes() - before;
+    result->entries = gen->n;
+
+    began = now_ns();
+    for (i = 0; i < gen->n; i++)
+    {
+        rank = keygen_next(gen);
+        snprintf(path, sizeof(path), "/m%02u", (unsigned)(rank % BenchMixedPaths));
+        key_of(gen, rank, key);
+        start = i % BenchSampleEvery == 0 ? now_ns() : 0;
+        if (xorshift64(&gen->rng) % 100 < BenchMixedWrites)
+        {
+            store_set(path, key, BenchValueSize, value);
+        }
+        else
+        {
+            epoch_enter();
+            store_get(path, key);
+            epoch_exit();
+        }
+        if (start != 0)
+        {
+            sample(result, start);
+        }
+    }
+    result->elapsed = now_ns() - began;
+    result->ops = gen->n;
+    shards_release();
+}
+
+// Fills the shards like the mixed workload, then reads keys through the store
+// one at a time (`batch` 1, store_get) or `batch` at a time (store_get_many).
+// For batches, every latency sample covers a whole batch.
+static void run_store_reads(KeyGen *gen, Result *result, uint32_t batch)
+{
+    char paths[BenchBatch][32];
+    uint8_t keys[BenchBatch][LeafKeyMax + 1], value[BenchValueSize] = {0};
+    BatchOp ops[BenchBatch];
+    uint64_t i, rank, start, began, found = 0;
+    uint32_t j;
+
+    shards_init();
+    for (i = 0; i < gen->n; i++)
+    {
+        snprintf(paths[0], sizeof(paths[0]), "/m%02u", (unsigned)(i % BenchMixedPaths));
+        key_of(gen, i, keys[0]);
+        if (store_set(paths[0], keys[0], BenchValueSize, value) != NoError)
+        {
+            perror("ERROR: store_set failed while filling");
+            exit(1);
+        }
+    }
+
+    began = now_ns();
+    for (i = 0; i < gen->n; i += batch)
+    {
+        for (j = 0; j < batch; j++)
+        {
+            rank = keygen_next(gen);
+            snprintf(paths[j], sizeof(paths[j]), "/m%02u", (unsigned)(rank % BenchMixedPaths));
+            key_of(gen, rank, keys[j]);
+            ops[j].path = paths[j];
+            ops[j].key = keys[j];
+        }
+        start = (i / batch) % BenchSampleEvery == 0 ? now_ns() : 0;
+        epoch_enter();
+        if (batch == 1)
+        {
+            found += store_get(paths[0], keys[0]) != NULL;
+        }
+        else
+        {
+            store_get_many(ops, batch);
+            for (j = 0; j < batch; j++)
+            {
+                found += ops[j].leaf != NULL;
+            }
+        }
+        epoch_exit();
+        if (start != 0)
+        {
+            sample(result, start);
+        }
+    }
+    result->elapsed = now_ns() - began;
+    result->ops = i;
+    if (found != i)
+    {
+        fprintf(stderr, "WARNING: store reads found %llu of %llu keys\n", (unsigned long long)found,
+                (unsigned long long)i);
+    }
+    shards_release();
+}
+
+static void run_store_get(KeyGen *gen, Result *result)
+{
+    run_store_reads(gen, result, 1);
+}
+
+static void run_store_get_many(KeyGen *gen, Result *result)
+{
+    run_store_reads(gen, result, BenchBatch);
+}
+
+// Fills a u64 tree with the generator's keys in insertion order.
+static void fill_u64(KeyGen *gen, U64Tree *tree)
+{
+    uint64_t i;
+
+    for (i = 0; i < gen->n; i++)
+    {
+        if (u64_create_leaf(tree, fixed_key_of(gen, i), i) == NULL)
+        {
+            perror("ERROR: u64_create_leaf failed while filling");
+            exit(1);
+        }
+    }
+}
+
+static void run_u64_create_leaf(KeyGen *gen, Result *result)
+{
+    U64Tree tree;
+    uint64_t i, before, start, began;
+
+    before = heap_bytes();
+    u64_tree_init(&tree);
+    began = now_ns();
+    for (i = 0; i < gen->n; i++)
+    {
+        start = i % BenchSampleEvery == 0 ? now_ns() : 0;
+        if (u64_create_leaf(&tree, fixed_key_of(gen, i), i) == NULL)
+        {
+            perror("ERROR: u64_create_leaf failed");
+            exit(1);
+        }
+        if (start != 0)
+        {
+            sample(result, start);
+        }
+    }
+    result->elapsed = now_ns() - began;
+    result->ops = gen->n;
+    result->bytes = heap_bytes() - before;
+    result->entries = gen->n;
+    u64_tree_release(&tree);
+}
+
+static void run_u64_lookup(KeyGen *gen, Result *result)
+{
+    U64Tree tree;
+    uint64_t i, rank, start, began, found = 0;
+    uint64_t *value;
+
+    u64_tree_init(&tree);
+    fill_u64(gen, &tree);
+    began = now_ns();
+    for (i = 0; i < gen->n; i++)
+    {
+        rank = keygen_next(gen);
+        start = i % BenchSampleEvery == 0 ? now_ns() : 0;
+        value = u64_find_leaf(&tree, fixed_key_of(gen, rank));
+        found += value != NULL && *value == rank;
+        if (start != 0)
+        {
+            sample(result, start);
+        }
+    }
+    result->elapsed = now_ns() - began;
+    result->ops = gen->n;
+    if (found != gen->n)
+    {
+        fprintf(stderr, "WARNING: u64 lookup found %llu of %llu keys\n", (unsigned long long)found,
+                (unsigned long long)gen->n);
+    }
+    u64_tree_release(&tree);
+}
+
+static void run_u64_scan(KeyGen *gen, Result *result)
+{
+    U64Tree tree;
+    uint64_t keys[BenchScanLength], values[BenchScanLength];
+    uint64_t i, ops, start, began, total = 0;
+
+    u64_tree_init(&tree);
+    fill_u64(gen, &tree);
+    ops = gen->n / BenchScanLength > 0 ? gen->n / BenchScanLength : 1;
+    began = now_ns();
+    for (i = 0; i < ops; i++)
+    {
+        start = i % BenchSampleEvery == 0 ? now_ns() : 0;
+        total += u64_scan(&tree, fixed_key_of(gen, keygen_next(gen)), keys, values, BenchScanLength);
+        if (start != 0)
+        {
+            sample(result, start);
+        }
+    }
+    result->elapsed = now_ns() - began;
+    result->ops = ops;
+    (void)total;
+    u64_tree_release(&tree);
+}
+
+static const Workload workloads[] = {
+    {"create_node", run_create_node},
+    {"create_leaf", run_create_leaf},
+    {"find_last", run_find_last},
+    {"lookup", run_lookup},
+    {"scan100", run_scan},
+    {"mixed90/10", run_mixed},
+    {"store_get", run_store_get},
+    {"store_get_many", run_store_get_many},
+    {"u64_create_leaf", run_u64_create_leaf},
+    {"u64_lookup", run_u64_lookup},
+    {"u64_scan100", run_u64_scan},
+};
+
+// =============================================================================
+// Main
+// =============================================================================
+
+int main(int argc, const char *argv[])
+{
+    uint64_t max = BenchDefaultMax, n;
+    const char *filter = argc > 2 ? argv[2] : NULL;
+    KeyGen gen;
+    Result result;
+    size_t w;
+    uint8_t dist;
+    char *end;
+
+    if (argc > 1)
+    {
+        max = strtoull(argv[1], &end, 10);
+        if (*end != '\0' || max < 1000)
+        {
+            fprintf(stderr, "Usage: %s [max keys >= 1000] [workload]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%-12s %-10s %10s %12s %9s %9s %9s %11s\n",
+           "workload", "keys", "dist", "ops/s", "p50 ns", "p99 ns", "p999 ns", "bytes/entry");
+
+    for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        if (filter != NULL && strstr(workloads[w].name, filter) == NULL)
+        {
+            continue;
+        }
+        for (n = 1000; n <= max; n *= 10)
+        {
+            for (dist = 0; dist < DistCount; dist++)
+            {
+                keygen_init(&gen, dist, n);
+                zero((uint8_t *)&result, sizeof(Result));
+                result.samples = (uint64_t *)malloc((n / BenchSampleEvery + 1) * sizeof(uint64_t));
+                if (result.samples == NULL)
+                {
+                    perror("ERROR: Failed to allocate latency samples");
+                    return 1;
+                }
+
+                workloads[w].run(&gen, &result);
+
+                qsort(result.samples, result.count, sizeof(uint64_t), compare_u64);
+                printf("%-12s %-10llu %10s %12.0f %9llu %9llu %9llu",
+                       workloads[w].name, (unsigned long long)n, dist_names[dist],
+                       (double)result.ops * 1e9 / (double)(result.elapsed > 0 ? result.elapsed : 1),
+                       (unsigned long long)percentile(&result, 50), (unsigned long long)percentile(&result, 99),
+                       (unsigned long long)percentile(&result, 99.9));
+                if (result.entries > 0)
+                {
+                    printf(" %11.1f\n", (double)result.bytes / (double)result.entries);
+                }
+                else
+                {
+                    printf(" %11s\n", "-");
+                }
+                fflush(stdout);
+                free(result.samples);
+            }
+        }
+    }
+
+    return 0;
+}
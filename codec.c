@@ -0,0 +1,329 @@
+/* codec.c */
+#include "main.h"
+
+#define CodecMfLimit 12    /* A match must start at least this many bytes before the end */
+#define CodecLastLiterals 5 /* The last bytes of a block are always literals */
+#define CodecMaxOffset 65535 /* Farthest a match may reach back */
+
+// Reads 4 bytes of the window formed by the dictionary followed by the value,
+// at window position `pos`; only the rare read across the seam goes byte by byte.
+static uint32_t window_read32(const uint8_t *src, const uint8_t *dict, uint32_t dict_size, uint32_t pos)
+{
+    uint8_t bytes[4];
+    uint32_t i, word;
+
+    if (pos >= dict_size)
+    {
+        memcpy(&word, src + (pos - dict_size), sizeof(word));
+        return word;
+    }
+    if (pos + 4 <= dict_size)
+    {
+        memcpy(&word, dict + pos, sizeof(word));
+        return word;
+    }
+    for (i = 0; i < 4; i++)
+    {
+        bytes[i] = pos + i < dict_size ? dict[pos + i] : src[pos + i - dict_size];
+    }
+    memcpy(&word, bytes, sizeof(word));
+
+    return word;
+}
+
+// Hashes the 4 bytes at a position into a table of 2^bits entries (Knuth's multiplicative hash).
+static uint32_t codec_hash(uint32_t word, uint32_t bits)
+{
+    return (word * 2654435761u) >> (32 - bits);
+}
+
+// Returns how far the bytes at window position `ref` match those at `ip` in
+// the value, up to `limit`. A match that starts in the dictionary may run on
+// into the value.
+static uint32_t match_length(const uint8_t *src, uint32_t ip, uint32_t ref, uint32_t limit,
+                             const uint8_t *dict, uint32_t dict_size)
+{
+    uint32_t len = 0, from;
+
+    while (ref + len < dict_size && ip + len < limit && dict[ref + len] == src[ip + len])
+    {
+        len++;
+    }
+    if (ref + len < dict_size)
+    {
+        return len;
+    }
+
+    // Compare a word at a time while both sides are in the value; `from` is
+    // where the match continues in it.
+    from = ref + len - dict_size;
+    while (ip + len + 8 <= limit && memcmp(src + from, src + ip + len, 8) == 0)
+    {
+        len += 8;
+        from += 8;
+    }
+    while (ip + len < limit && src[from] == src[ip + len])
+    {
+        len++;
+        from++;
+    }
+
+    return len;
+}
+
+// Appends one sequence: `lit_len` literals, then a match of `match_len` bytes
+// at `offset` (none if `match_len` is 0, which ends the block). Returns the new
+// output length, or UINT32_MAX if it would not fit in `cap`.
+static uint32_t codec_emit(uint8_t *dst, uint32_t out, uint32_t cap, const uint8_t *lit, uint32_t lit_len,
+                           uint32_t offset, uint32_t match_len)
+{
+    uint64_t need;
+    uint32_t token, n;
+
+    need = 1 + (uint64_t)lit_len + lit_len / 255 + 1;
+    if (match_len > 0)
+    {
+        need += 2 + (match_len - CodecMinMatch) / 255 + 1;
+    }
+    if (need > (uint64_t)(cap - out))
+    {
+        return UINT32_MAX;
+    }
+
+    token = out++;
+    dst[token] = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15)
+    {
+        for (n = lit_len - 15; n >= 255; n -= 255)
+        {
+            dst[out++] = 255;
+        }
+        dst[out++] = (uint8_t)n;
+    }
+    memcpy(dst + out, lit, lit_len);
+    out += lit_len;
+
+    if (match_len > 0)
+    {
+        put_u16(dst + out, (uint16_t)offset);
+        out += 2;
+        n = match_len - CodecMinMatch;
+        dst[token] |= (uint8_t)(n >= 15 ? 15 : n);
+        if (n >= 15)
+        {
+            for (n -= 15; n >= 255; n -= 255)
+            {
+                dst[out++] = 255;
+            }
+            dst[out++] = (uint8_t)n;
+        }
+    }
+
+    return out;
+}
+
+uint32_t codec_compress(const uint8_t *src, uint32_t size, uint8_t *dst, uint32_t cap, const CodecDict *dict)
+{
+    uint32_t table[1u << CodecHashLog]; // Window position + 1 of the last occurrence of each hash, 0 if none.
+    const uint8_t *dict_data = dict != NULL ? dict->data : NULL;
+    uint32_t dict_size = dict != NULL ? dict->size : 0;
+    uint32_t bits = 8, ip = 0, anchor = 0, out = 0, limit, match_limit, pos, ref, len, word, hash;
+
+    assert(src != NULL && dst != NULL && "Error: Buffers cannot be NULL for codec_compress.");
+
+    // A small window does not need (or pay for clearing) the whole table.
+    while (bits < CodecHashLog && (1u << bits) < dict_size + size)
+    {
+        bits++;
+    }
+    memset(table, 0, sizeof(uint32_t) << bits);
+
+    if (size > CodecMfLimit)
+    {
+        // Every third position of the dictionary is enough to find what the value shares with it.
+        for (pos = 0; pos + 4 <= dict_size; pos += 3)
+        {
+            table[codec_hash(window_read32(src, dict_data, dict_size, pos), bits)] = pos + 1;
+        }
+
+        limit = size - CodecMfLimit;
+        match_limit = size - CodecLastLiterals;
+        while (ip < limit)
+        {
+            memcpy(&word, src + ip, sizeof(word));
+            hash = codec_hash(word, bits);
+            pos = dict_size + ip;
+            ref = table[hash];
+            table[hash] = pos + 1;
+            if (ref == 0 || pos - (ref - 1) > CodecMaxOffset ||
+                window_read32(src, dict_data, dict_size, ref - 1) != word)
+            {
+                // Step faster through input that keeps failing to match.
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            ref--;
+
+            // Extend the match backwards over literals that repeat too.
+            while (ip > anchor && ref > 0 &&
+                   (ref - 1 < dict_size ? dict_data[ref - 1] : src[ref - 1 - dict_size]) == src[ip - 1])
+            {
+                ip--;
+                ref--;
+            }
+            len = CodecMinMatch + match_length(src, ip + CodecMinMatch, ref + CodecMinMatch, match_limit,
+                                               dict_data, dict_size);
+
+            out = codec_emit(dst, out, cap, src + anchor, ip - anchor, dict_size + ip - ref, len);
+            if (out == UINT32_MAX)
+            {
+                return 0;
+            }
+            ip += len;
+            anchor = ip;
+
+            // The bytes just before the next position are often where the next match starts.
+            if (ip < limit)
+            {
+                memcpy(&word, src + ip - 2, sizeof(word));
+                table[codec_hash(word, bits)] = dict_size + ip - 2 + 1;
+            }
+        }
+    }
+
+    out = codec_emit(dst, out, cap, src + anchor, size - anchor, 0, 0);
+
+    return out == UINT32_MAX ? 0 : out;
+}
+
+// Reads the extra length bytes of a token nibble that was 15, adding them to `*n`.
+static int8_t codec_length(const uint8_t *src, uint32_t len, uint32_t *ip, uint64_t *n)
+{
+    uint8_t byte;
+
+    do
+    {
+        if (*ip >= len)
+        {
+            retfail(EINVAL);
+        }
+        byte = src[(*ip)++];
+        *n += byte;
+    } while (byte == 255);
+
+    return NoError;
+}
+
+int8_t codec_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t size, const CodecDict *dict)
+{
+    uint32_t dict_size = dict != NULL ? dict->size : 0;
+    uint32_t ip = 0, op = 0, offset, from, take;
+    uint64_t n;
+    uint8_t token;
+
+    assert(src != NULL && dst != NULL && "Error: Buffers cannot be NULL for codec_decompress.");
+
+    for (;;)
+    {
+        if (ip >= len)
+        {
+            retfail(EINVAL);
+        }
+        token = src[ip++];
+
+        // Literals.
+        n = token >> 4;
+        if (n == 15 && codec_length(src, len, &ip, &n) != NoError)
+        {
+            return -1;
+        }
+        if (n > len - ip || n > size - op)
+        {
+            retfail(EINVAL);
+        }
+        memcpy(dst + op, src + ip, (size_t)n);
+        ip += (uint32_t)n;
+        op += (uint32_t)n;
+        if (ip == len)
+        {
+            break; // The last sequence has no match.
+        }
+
+        // Match.
+        if (len - ip < 2)
+        {
+            retfail(EINVAL);
+        }
+        offset = get_u16(src + ip);
+        ip += 2;
+        n = token & 15;
+        if (n == 15 && codec_length(src, len, &ip, &n) != NoError)
+        {
+            return -1;
+        }
+        n += CodecMinMatch;
+        if (offset == 0 || offset > op + dict_size || n > size - op)
+        {
+            retfail(EINVAL);
+        }
+
+        // The part of the match that lies in the dictionary, then the rest,
+        // which may overlap the bytes it produces (a run).
+        from = op - offset;
+        if (offset > op)
+        {
+            take = offset - op < n ? offset - op : (uint32_t)n;
+            memcpy(dst + op, dict->data + dict_size - (offset - op), take);
+            op += take;
+            n -= take;
+            from = 0;
+        }
+        if (from + n <= op)
+        {
+            memcpy(dst + op, dst + from, (size_t)n);
+            op += (uint32_t)n;
+        }
+        else
+        {
+            for (; n > 0; n--)
+            {
+                dst[op++] = dst[from++];
+            }
+        }
+    }
+
+    if (op != size)
+    {
+        retfail(EINVAL);
+    }
+
+    return NoError;
+}
+
+int8_t codec_sample(CodecDict **dict, const uint8_t *src, uint32_t size)
+{
+    CodecDict *grown;
+    uint32_t have = *dict != NULL ? (*dict)->size : 0, take = size < CodecSampleSize ? size : CodecSampleSize;
+
+    assert(dict != NULL && src != NULL && "Error: Dictionary and sample cannot be NULL for codec_sample.");
+
+    if (take > CodecDictSize - have)
+    {
+        take = CodecDictSize - have;
+    }
+    grown = (CodecDict *)realloc(*dict, sizeof(CodecDict) + have + take);
+    if (grown == NULL)
+    {
+        retfail(ENOMEM);
+    }
+    if (*dict == NULL)
+    {
+        grown->size = grown->samples = 0;
+    }
+    *dict = grown;
+    memcpy(grown->data + grown->size, src, take);
+    grown->size += take;
+    grown->samples++;
+
+    return grown->size == CodecDictSize || grown->samples == CodecSamples;
+}
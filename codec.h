@@ -0,0 +1,92 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint32_t)
+
+// =============================================================================
+// Codec Definitions
+// =============================================================================
+// Values are compressed in the LZ4 block format: a sequence is a token (high
+// nibble: literal count, low nibble: match length - 4, 15 meaning "more bytes
+// follow"), the literals, a u16 little-endian match offset and the rest of the
+// match length; the block ends with a sequence of literals only. A match may
+// reach back into a dictionary, which behaves as if it had been written right
+// before the value, so values too short to repeat themselves still compress
+// against what their siblings have in common (keys of the same JSON schema,
+// protobuf field tags). Compression is greedy with a single hash probe per
+// position, which is what keeps LZ4 fast; decompression never reads or writes
+// outside the buffers it is given, whatever the input.
+#define CodecOff 0   /* Codec mode: values are stored as they are */
+#define CodecFast 1  /* Codec mode: values are compressed on their own */
+#define CodecSampled 2  /* Codec mode: values are compressed against a dictionary sampled per Node */
+
+#define CodecMinSize 128      /* Smaller values are never compressed */
+#define CodecMinMatch 4       /* Shortest match the format can express */
+#define CodecHashLog 12       /* log2 of the compressor's hash table entries (at most) */
+#define CodecDictSize 4096    /* Bytes of a per-Node dictionary (at most) */
+#define CodecSampleSize 256   /* Bytes each sampled value contributes to its Node's dictionary */
+#define CodecSamples 16       /* Values sampled into a dictionary before it is used (fewer if it fills up first) */
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+/**
+ * @brief A dictionary: bytes a compressed value may refer back to. Immutable once in use.
+ */
+struct s_codec_dict {
+    uint32_t size;    ///< Bytes in `data`.
+    uint32_t samples; ///< Values sampled into it so far.
+    uint8_t data[];   ///< The dictionary content.
+};
+typedef struct s_codec_dict CodecDict;
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Compresses `size` bytes into `dst` if the result fits in `cap` bytes.
+ *
+ * @param src  The bytes to compress.
+ * @param size The number of bytes.
+ * @param dst  Output buffer.
+ * @param cap  Size of `dst`; pass less than `size` to only accept output that saves space.
+ * @param dict Dictionary to compress against, or NULL.
+ * @return     The compressed length, or 0 if it would not fit in `cap`.
+ */
+uint32_t codec_compress(const uint8_t *src, uint32_t size, uint8_t *dst, uint32_t cap, const CodecDict *dict);
+
+/**
+ * @brief Decompresses a block made by codec_compress.
+ *
+ * @param src  The compressed bytes.
+ * @param len  Their length.
+ * @param dst  Output buffer of exactly `size` bytes.
+ * @param size The decompressed length.
+ * @param dict The dictionary the block was compressed against, or NULL.
+ * @return     0 on success, or -1 with errno set to EINVAL if the block is corrupt.
+ */
+int8_t codec_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t size, const CodecDict *dict);
+
+/**
+ * @brief Adds the first CodecSampleSize bytes of a value to a dictionary being sampled.
+ *
+ * What values of the same Node share most is their structure, which their
+ * beginnings show best, so the dictionary is simply their prefixes laid end
+ * to end. It grows with each sample, so a Node with few values never holds
+ * more than they are worth.
+ *
+ * @param dict The dictionary, or NULL to start one; it may move.
+ * @param src  The value.
+ * @param size Its length.
+ * @return     1 once the dictionary is complete (CodecSamples values or
+ *             CodecDictSize bytes), 0 if it takes more samples, or -1 with
+ *             errno set to ENOMEM (the dictionary is unchanged).
+ */
+int8_t codec_sample(CodecDict **dict, const uint8_t *src, uint32_t size);
+
+#endif /* CODEC_H */
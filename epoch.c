@@ -0,0 +1,204 @@
+/* epoch.c */
+#include "main.h"
+
+#include <sched.h> // For sched_yield
+
+/**
+ * @brief Per-thread epoch state, padded to its own cache line.
+ *
+ * `state` is the epoch the thread observed on entry shifted left by one, with
+ * the low bit set while the thread is inside a read-side critical section.
+ */
+struct s_epoch_record {
+    uint64_t state;   ///< (observed epoch << 1) | active.
+    uint32_t nesting; ///< Depth of nested epoch_enter calls (owner thread only).
+    uint32_t in_use;  ///< Non-zero while a thread owns this record.
+    uint8_t pad[48];  ///< Keeps records of different threads on different cache lines.
+};
+typedef struct s_epoch_record EpochRecord;
+
+static uint64_t global_epoch = 1;                        // The current global epoch.
+static EpochRecord records[EpochMaxThreads];             // One record per registered thread.
+static _Thread_local EpochRecord *self = NULL;           // The calling thread's record.
+
+// Claims a free record for the calling thread.
+static EpochRecord *epoch_register(void)
+{
+    uint32_t i, expected;
+
+    for (i = 0; i < EpochMaxThreads; i++)
+    {
+        expected = 0;
+        if (__atomic_compare_exchange_n(&records[i].in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            records[i].nesting = 0;
+            __atomic_store_n(&records[i].state, 0, __ATOMIC_RELEASE);
+            return &records[i];
+        }
+    }
+
+    assert(0 && "Error: Too many threads registered with the epoch reclaimer.");
+    abort();
+}
+
+// Advances the global epoch if every active reader has observed the current one.
+// Returns the (possibly new) global epoch.
+static uint64_t epoch_try_advance(void)
+{
+    uint64_t epoch, state;
+    uint32_t i;
+
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (i = 0; i < EpochMaxThreads; i++)
+    {
+        if (!__atomic_load_n(&records[i].in_use, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+        state = __atomic_load_n(&records[i].state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch)
+        {
+            return epoch; // A reader is still in an older epoch.
+        }
+    }
+
+    // Losing this race is fine: someone else advanced the epoch for us.
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+void epoch_enter(void)
+{
+    uint64_t epoch;
+
+    if (self == NULL)
+    {
+        self = epoch_register();
+    }
+
+    if (self->nesting++ > 0)
+    {
+        return;
+    }
+
+    // Publish "active in epoch E" before touching any shared pointer; the
+    // sequentially consistent store orders it against the reads that follow.
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&self->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void)
+{
+    assert(self != NULL && self->nesting > 0 && "Error: epoch_exit without a matching epoch_enter.");
+
+    if (--self->nesting > 0)
+    {
+        return;
+    }
+
+    __atomic_store_n(&self->state, self->state & ~(uint64_t)1, __ATOMIC_RELEASE);
+}
+
+void epoch_thread_exit(void)
+{
+    if (self == NULL)
+    {
+        return;
+    }
+
+    assert(self->nesting == 0 && "Error: Thread exiting inside an epoch section.");
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&self->in_use, 0, __ATOMIC_RELEASE);
+    self = NULL;
+}
+
+void epoch_synchronize(void)
+{
+    uint64_t target;
+
+    assert((self == NULL || self->nesting == 0) && "Error: epoch_synchronize called inside an epoch section.");
+
+    // Two advances guarantee that every reader active on entry has left.
+    target = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) + 2;
+    while (epoch_try_advance() < target)
+    {
+        sched_yield();
+    }
+}
+
+void limbo_retire(Limbo *limbo, void *ptr, ReclaimFn reclaim, void *ctx)
+{
+    Retired *items;
+    size_t capacity;
+
+    assert(limbo != NULL && "Error: Limbo cannot be NULL for limbo_retire.");
+    assert(reclaim != NULL && "Error: A reclaim callback is required for limbo_retire.");
+
+    if (limbo->count == limbo->capacity)
+    {
+        capacity = limbo->capacity == 0 ? LimboBatch : limbo->capacity * 2;
+        items = (Retired *)realloc(limbo->items, capacity * sizeof(Retired));
+        if (items == NULL)
+        {
+            // No room to defer: wait out the grace period right here instead.
+            epoch_synchronize();
+            reclaim(ctx, ptr);
+            return;
+        }
+        limbo->items = items;
+        limbo->capacity = capacity;
+    }
+
+    limbo->items[limbo->count].ptr = ptr;
+    limbo->items[limbo->count].reclaim = reclaim;
+    limbo->items[limbo->count].ctx = ctx;
+    limbo->items[limbo->count].epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    limbo->count++;
+
+    // Amortize reclamation over retirements so the limbo stays short.
+    if (limbo->count % LimboBatch == 0)
+    {
+        limbo_reclaim(limbo);
+    }
+}
+
+size_t limbo_reclaim(Limbo *limbo)
+{
+    uint64_t epoch;
+    size_t done;
+
+    assert(limbo != NULL && "Error: Limbo cannot be NULL for limbo_reclaim.");
+
+    if (limbo->count == 0)
+    {
+        return 0;
+    }
+
+    // Items retired in epoch E are unreachable once the global epoch is E + 2.
+    epoch = epoch_try_advance();
+    for (done = 0; done < limbo->count && limbo->items[done].epoch + 2 <= epoch; done++)
+    {
+        limbo->items[done].reclaim(limbo->items[done].ctx, limbo->items[done].ptr);
+    }
+
+    memmove(limbo->items, limbo->items + done, (limbo->count - done) * sizeof(Retired));
+    limbo->count -= done;
+
+    return done;
+}
+
+void limbo_drain(Limbo *limbo)
+{
+    assert(limbo != NULL && "Error: Limbo cannot be NULL for limbo_drain.");
+
+    while (limbo->count > 0)
+    {
+        epoch_synchronize();
+        limbo_reclaim(limbo);
+    }
+
+    free(limbo->items);
+    zero((uint8_t *)limbo, sizeof(Limbo));
+}
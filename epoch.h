@@ -0,0 +1,120 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint64_t)
+#include <stddef.h> // For size_t and NULL
+
+// =============================================================================
+// Epoch Constants
+// =============================================================================
+// Readers traverse the tree without locks inside an epoch_enter/epoch_exit
+// section. Writers never free memory that a reader might still be looking at;
+// instead they retire it into a Limbo, and it is reclaimed once every reader
+// that could have seen it has left its read section (two epoch advances later).
+#define EpochMaxThreads 256 /* Maximum number of threads that can be registered at once */
+#define LimboBatch 64       /* Retired items that trigger an automatic reclamation pass */
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+/**
+ * @brief Callback that frees a retired item once no reader can reach it.
+ *
+ * @param ctx The context pointer passed to limbo_retire (e.g. the owning Allocator).
+ * @param ptr The retired item.
+ */
+typedef void (*ReclaimFn)(void *ctx, void *ptr);
+
+/**
+ * @brief One item waiting in a Limbo for its grace period to end.
+ */
+struct s_retired {
+    void *ptr;         ///< The retired item.
+    ReclaimFn reclaim; ///< Frees the item.
+    void *ctx;         ///< Passed to `reclaim`.
+    uint64_t epoch;    ///< Global epoch at the time the item was retired.
+};
+typedef struct s_retired Retired;
+
+/**
+ * @brief A list of retired items owned by one writer domain (e.g. one tree).
+ *
+ * A Limbo is not thread-safe: it must only be used while holding the lock that
+ * serializes the writers of its domain, which is also the lock that makes the
+ * reclaim callbacks safe to run. A zeroed Limbo is a valid empty limbo.
+ */
+struct s_limbo {
+    Retired *items;  ///< Retired items, in retirement (and therefore epoch) order.
+    size_t count;    ///< Number of items waiting.
+    size_t capacity; ///< Allocated length of `items`.
+};
+typedef struct s_limbo Limbo;
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Begins a read-side critical section on the calling thread.
+ *
+ * Anything reachable from the tree while inside the section stays valid until
+ * the matching epoch_exit. Sections may nest. The first call on a thread
+ * registers it (up to EpochMaxThreads threads).
+ */
+void epoch_enter(void);
+
+/**
+ * @brief Ends the read-side critical section begun by epoch_enter.
+ */
+void epoch_exit(void);
+
+/**
+ * @brief Releases the calling thread's epoch registration.
+ *
+ * Call before a thread that used epoch_enter terminates, so its slot can be reused.
+ */
+void epoch_thread_exit(void);
+
+/**
+ * @brief Waits until every reader that was active on entry has left its section.
+ *
+ * Must not be called from inside a read-side critical section.
+ */
+void epoch_synchronize(void);
+
+/**
+ * @brief Defers freeing an item until no reader can still reach it.
+ *
+ * The item must already be unreachable from the tree. If the limbo cannot grow,
+ * waits for a grace period and reclaims the item immediately instead.
+ *
+ * @param limbo   A pointer to the limbo of the writer domain.
+ * @param ptr     The item to retire.
+ * @param reclaim The callback that frees the item.
+ * @param ctx     The context passed to `reclaim`.
+ */
+void limbo_retire(Limbo *limbo, void *ptr, ReclaimFn reclaim, void *ctx);
+
+/**
+ * @brief Tries to advance the global epoch and frees every item whose grace period has ended.
+ *
+ * @param limbo A pointer to the limbo to reclaim from.
+ * @return      The number of items reclaimed.
+ */
+size_t limbo_reclaim(Limbo *limbo);
+
+/**
+ * @brief Waits for a grace period and frees every item in the limbo.
+ *
+ * Used when a writer domain is torn down. Must not be called from inside a
+ * read-side critical section.
+ *
+ * @param limbo A pointer to the limbo to drain.
+ */
+void limbo_drain(Limbo *limbo);
+
+#endif /* EPOCH_H */
@@ -0,0 +1,199 @@
+/* expire.c */
+#include "main.h"
+
+#include <time.h> // For clock_gettime
+
+uint32_t expire_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+    return (uint32_t)ts.tv_sec;
+}
+
+Timer *timer_new(const char *path, size_t path_len, const uint8_t *key, uint8_t key_len, uint32_t due)
+{
+    Timer *timer;
+
+    assert(path != NULL && "Error: Path cannot be NULL for timer_new.");
+    assert(key != NULL && "Error: Key cannot be NULL for timer_new.");
+
+    timer = (Timer *)malloc(sizeof(Timer) + path_len + 1 + key_len + 1);
+    if (timer == NULL)
+    {
+        reterr(ENOMEM);
+    }
+    timer->next = NULL;
+    timer->due = due;
+    timer->path_len = (uint32_t)path_len;
+    timer->key_len = key_len;
+    memcpy(timer->text, path, path_len);
+    timer->text[path_len] = '\0';
+    memcpy(timer->text + path_len + 1, key, key_len);
+    timer->text[path_len + 1 + key_len] = '\0';
+
+    return timer;
+}
+
+void wheel_init(Wheel *wheel, uint32_t now)
+{
+    assert(wheel != NULL && "Error: Wheel cannot be NULL for wheel_init.");
+
+    zero((uint8_t *)wheel, sizeof(Wheel));
+    wheel->now = now;
+}
+
+// Puts a timer in the slot its due time maps to from the wheel's clock: at
+// the lowest level where the two only differ within one span of the level
+// above, so the slot comes up (and moves down) before the timer is due. A
+// timer already due goes in the slot of the current second.
+static void wheel_place(Wheel *wheel, Timer *timer)
+{
+    Timer **list;
+    uint32_t level;
+
+    if (timer->due <= wheel->now)
+    {
+        list = &wheel->slots[0][wheel->now & (WheelSlots - 1)];
+    }
+    else
+    {
+        level = (uint32_t)(31 - __builtin_clz(timer->due ^ wheel->now)) / WheelBits;
+        list = level < WheelLevels ? &wheel->slots[level][(timer->due >> (level * WheelBits)) & (WheelSlots - 1)]
+                                   : &wheel->far;
+    }
+    timer->next = *list;
+    *list = timer;
+}
+
+void wheel_add(Wheel *wheel, Timer *timer)
+{
+    assert(wheel != NULL && timer != NULL && "Error: wheel_add needs a wheel and a timer.");
+
+    wheel_place(wheel, timer);
+    __atomic_add_fetch(&wheel->count, 1, __ATOMIC_RELAXED);
+}
+
+void wheel_post(Wheel *wheel, Timer *timer)
+{
+    assert(wheel != NULL && timer != NULL && "Error: wheel_post needs a wheel and a timer.");
+
+    // Counted first, so the owner never sees a posted timer it does not count.
+    __atomic_add_fetch(&wheel->count, 1, __ATOMIC_RELAXED);
+    timer->next = __atomic_load_n(&wheel->inbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&wheel->inbox, &timer->next, timer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        // timer->next now holds the current head; try again on top of it.
+    }
+}
+
+uint32_t wheel_advance(Wheel *wheel, uint32_t now, uint32_t budget, TimerFire fire, void *ctx)
+{
+    Timer *timer, **list;
+    uint32_t steps = 0, level;
+
+    assert(wheel != NULL && fire != NULL && "Error: wheel_advance needs a wheel and a fire function.");
+
+    if (__atomic_load_n(&wheel->count, __ATOMIC_RELAXED) == 0)
+    {
+        // Nothing to fire: the clock can jump instead of ticking through the seconds.
+        if (wheel->now <= now)
+        {
+            __atomic_store_n(&wheel->now, now + 1, __ATOMIC_RELAXED);
+            wheel->cascade = 0;
+        }
+        return 0;
+    }
+
+    while (steps < budget)
+    {
+        steps++;
+
+        // Place what moves down a level (or was posted) before anything fires:
+        // some of it may be due this very second.
+        if (wheel->moving == NULL && __atomic_load_n(&wheel->inbox, __ATOMIC_RELAXED) != NULL)
+        {
+            wheel->moving = __atomic_exchange_n(&wheel->inbox, NULL, __ATOMIC_ACQUIRE);
+        }
+        if ((timer = wheel->moving) != NULL)
+        {
+            wheel->moving = timer->next;
+            wheel_place(wheel, timer);
+            continue;
+        }
+        if (wheel->cascade > 0)
+        {
+            // Highest level first, so its timers reach the lower slots before those move too.
+            level = wheel->cascade--;
+            list = level < WheelLevels ? &wheel->slots[level][(wheel->now >> (level * WheelBits)) & (WheelSlots - 1)]
+                                       : &wheel->far;
+            wheel->moving = *list;
+            *list = NULL;
+            continue;
+        }
+
+        if (wheel->now > now)
+        {
+            steps--;
+            break; // Up to date.
+        }
+        list = &wheel->slots[0][wheel->now & (WheelSlots - 1)];
+        if ((timer = *list) != NULL)
+        {
+            *list = timer->next;
+            __atomic_sub_fetch(&wheel->count, 1, __ATOMIC_RELAXED);
+            fire(ctx, timer, now);
+            continue;
+        }
+
+        // The second is over. If the next one starts a new span of some
+        // levels, their slots for it come down next.
+        __atomic_store_n(&wheel->now, wheel->now + 1, __ATOMIC_RELAXED);
+        for (level = 1; level <= WheelLevels && (wheel->now & ((1u << (level * WheelBits)) - 1)) == 0; level++)
+        {
+        }
+        wheel->cascade = (uint8_t)(level - 1);
+    }
+
+    return steps;
+}
+
+int wheel_due(const Wheel *wheel, uint32_t now)
+{
+    assert(wheel != NULL && "Error: Wheel cannot be NULL for wheel_due.");
+
+    return __atomic_load_n(&wheel->inbox, __ATOMIC_RELAXED) != NULL ||
+           (__atomic_load_n(&wheel->count, __ATOMIC_RELAXED) > 0 && __atomic_load_n(&wheel->now, __ATOMIC_RELAXED) <= now);
+}
+
+// Frees a list of timers.
+static void timers_free(Timer *timer)
+{
+    Timer *next;
+
+    for (; timer != NULL; timer = next)
+    {
+        next = timer->next;
+        free(timer);
+    }
+}
+
+void wheel_release(Wheel *wheel)
+{
+    uint32_t level, slot;
+
+    assert(wheel != NULL && "Error: Wheel cannot be NULL for wheel_release.");
+
+    timers_free(__atomic_exchange_n(&wheel->inbox, NULL, __ATOMIC_ACQUIRE));
+    timers_free(wheel->moving);
+    timers_free(wheel->far);
+    for (level = 0; level < WheelLevels; level++)
+    {
+        for (slot = 0; slot < WheelSlots; slot++)
+        {
+            timers_free(wheel->slots[level][slot]);
+        }
+    }
+    wheel_init(wheel, wheel->now);
+}
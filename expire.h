@@ -0,0 +1,165 @@
+#ifndef EXPIRE_H
+#define EXPIRE_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint32_t)
+#include <stddef.h> // For size_t
+
+// =============================================================================
+// Expiry Definitions
+// =============================================================================
+// A Leaf may carry an expiry time, in whole seconds of the Unix clock. Once it
+// has passed, the leaf reads as absent (lazy expiry), and its shard's
+// maintenance task deletes it soon after (active expiry). The task finds what
+// to delete through a hierarchical timing wheel per shard: level L has
+// WheelSlots slots of 64^L seconds each, and a timer sits at the lowest level
+// whose slots still tell its due time apart from the wheel's clock. Adding a
+// timer is O(1), and every second that passes looks at one slot of level 0,
+// plus, whenever a span of a higher level begins, the slot whose timers
+// move down a level; timers due further out than the last level covers wait
+// in an overflow list. All of it, firing included, is done a few timers at a
+// time, so a million keys expiring in the same second never hold a shard's
+// lock for longer than any other maintenance slice.
+//
+// Timers name their Leaf by path and key rather than by pointer, so deleting
+// a Leaf or dropping its subtree never has to find and cancel its timer: a
+// timer that finds its Leaf gone or no longer expiring goes away, and one that
+// finds a later expiry waits again.
+#define ExpireNever 0               /* Leaf::expires of a leaf that never expires */
+#define WheelBits 6                 /* log2 of the slots per level */
+#define WheelSlots (1 << WheelBits) /* Slots per level */
+#define WheelLevels 4               /* Levels: 64 s, ~68 min, ~73 h and ~194 days */
+#define ExpireSlice 256             /* Timers fired or moved (or seconds passed) per maintenance slice */
+#define ExpireTickMs 1000           /* How often the expiry clock wakes the shards that have timers */
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+/**
+ * @brief A pending expiry: which Leaf to look at, and when.
+ */
+struct s_timer {
+    struct s_timer *next; ///< Next timer of the same slot or list.
+    uint32_t due;         ///< When to look at the leaf, in Unix seconds.
+    uint32_t path_len;    ///< Length of the path in `text`.
+    uint8_t key_len;      ///< Length of the key in `text`.
+    char text[];          ///< The path and then the key, each followed by a NUL.
+};
+typedef struct s_timer Timer;
+
+/**
+ * @brief A hierarchical timing wheel. A zeroed Wheel is valid (and empty) once wheel_init sets its clock.
+ *
+ * Owned by one shard: everything but wheel_post and wheel_due must be called
+ * with the shard's writer lock held.
+ */
+struct s_wheel {
+    uint32_t now;     ///< The next second to fire: every timer due before it has fired.
+    uint32_t count;   ///< Timers held, in slots or lists (including posted ones).
+    uint8_t cascade;  ///< Levels whose slot for `now` still has to move down (WheelLevels: the overflow list too).
+    Timer *inbox;     ///< Timers posted without the lock, newest first (lock-free stack).
+    Timer *moving;    ///< Timers taken off a higher level or the inbox, to be placed again.
+    Timer *far;       ///< Timers due beyond what the last level covers.
+    Timer *slots[WheelLevels][WheelSlots]; ///< Timers by level and slot, in no particular order.
+};
+typedef struct s_wheel Wheel;
+
+/**
+ * @brief Called by wheel_advance for every timer due, which it then owns.
+ *
+ * It either frees the timer or hands it back with wheel_add, with a later due time.
+ *
+ * @param ctx   The context given to wheel_advance.
+ * @param timer The due timer.
+ * @param now   The current time, in Unix seconds.
+ */
+typedef void (*TimerFire)(void *ctx, Timer *timer, uint32_t now);
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Returns the current time in Unix seconds, as leaf expiry times count it.
+ *
+ * Reads a coarse clock, which costs a few nanoseconds without a system call.
+ */
+uint32_t expire_clock(void);
+
+/**
+ * @brief Allocates a timer for the Leaf under `key` at `path`.
+ *
+ * @param path     The path bytes.
+ * @param path_len Their length.
+ * @param key      The key bytes.
+ * @param key_len  Their length.
+ * @param due      When the timer fires, in Unix seconds.
+ * @return         The timer (free it with free), or NULL with errno set to ENOMEM.
+ */
+Timer *timer_new(const char *path, size_t path_len, const uint8_t *key, uint8_t key_len, uint32_t due);
+
+/**
+ * @brief Empties a wheel and sets its clock.
+ *
+ * @param wheel A pointer to the wheel.
+ * @param now   The current time, in Unix seconds.
+ */
+void wheel_init(Wheel *wheel, uint32_t now);
+
+/**
+ * @brief Adds a timer to a wheel. The wheel owns it from then on.
+ *
+ * @param wheel A pointer to the wheel.
+ * @param timer The timer; one due already fires at the next wheel_advance.
+ */
+void wheel_add(Wheel *wheel, Timer *timer);
+
+/**
+ * @brief Adds a timer like wheel_add, from any thread and without the owner's lock.
+ *
+ * The timer is placed by the next wheel_advance.
+ *
+ * @param wheel A pointer to the wheel.
+ * @param timer The timer.
+ */
+void wheel_post(Wheel *wheel, Timer *timer);
+
+/**
+ * @brief Fires the timers due up to `now` and moves the clock on, doing at most `budget` steps.
+ *
+ * A step fires a timer, places one that moves down a level (or was posted),
+ * or moves the clock on by a second. Timers fire in due order from one
+ * second to the next, in no particular order within a second.
+ *
+ * @param wheel  A pointer to the wheel.
+ * @param now    The current time, in Unix seconds.
+ * @param budget The most steps to take.
+ * @param fire   The function that takes each due timer.
+ * @param ctx    Passed to `fire`.
+ * @return       The number of steps taken; less than `budget` once nothing is left to do up to `now`.
+ */
+uint32_t wheel_advance(Wheel *wheel, uint32_t now, uint32_t budget, TimerFire fire, void *ctx);
+
+/**
+ * @brief Reports whether wheel_advance has anything to do up to `now`. Any thread may call it.
+ *
+ * From another thread than the owner the answer may be stale, which only
+ * ever delays the next pass.
+ *
+ * @param wheel A pointer to the wheel.
+ * @param now   The current time, in Unix seconds.
+ * @return      Non-zero if some timer is due, or was taken but not placed yet.
+ */
+int wheel_due(const Wheel *wheel, uint32_t now);
+
+/**
+ * @brief Frees every timer of a wheel, posted ones included. No other thread may use it meanwhile.
+ *
+ * @param wheel A pointer to the wheel.
+ */
+void wheel_release(Wheel *wheel);
+
+#endif /* EXPIRE_H */
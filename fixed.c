@@ -0,0 +1,6 @@
+/* fixed.c */
+#include "main.h"
+
+// The fixed-width trees declared at the end of fixed.h.
+fixed_define(U64, u64, uint64_t, uint64_t)
+fixed_define(U128, u128, FixedKey128, uint64_t)
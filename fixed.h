@@ -0,0 +1,357 @@
+#ifndef FIXED_H
+#define FIXED_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint64_t)
+#include <stddef.h> // For size_t
+#include <string.h> // For memmove and memcpy in the generated functions
+
+#include "alloc.h" // For the slabs the generated trees allocate from
+
+// =============================================================================
+// Fixed-Width Tree Definitions
+// =============================================================================
+// Tables whose keys and values all have one fixed width do not need what a
+// Leaf pays for variable data: a key buffer, a length, a value pointer and an
+// index entry, per entry. fixed_declare and fixed_define generate, for one key
+// type and one value type, a B+-tree specialized for them: Nodes hold sorted
+// separator keys and children, and Leaves hold up to FixedLeafSlots keys and
+// values inline, in two dense sorted arrays, chained in key order for scans.
+// Keys are unsigned integers, compared as such (no key_compare, no hashing),
+// and every search within a Node or Leaf is a branch-free binary search that
+// the compiler turns into conditional moves, so it never mispredicts.
+//
+// A Leaf that overflows is split in half, except when the key goes after its
+// last key and it is the last Leaf: then the new key starts an empty Leaf, so
+// ascending loads leave every Leaf full. Leaves that deletes empty stay
+// chained (scans skip them) until the tree is released.
+//
+// A generated tree has a single writer and no lock-free readers: the caller
+// serializes every call on a tree, e.g. with the lock of the shard holding it.
+//
+// Instantiate with fixed_declare in a header and fixed_define in one source
+// file; fixed.c instantiates u64 (64-bit keys) and u128 (128-bit keys), both
+// to 64-bit values. For `fixed_declare(Type, prefix, Key, Value)`:
+//
+//   Type##Tree, Type##Node, Type##Leaf    the tree and its parts
+//   prefix##_tree_init(tree)              initializes an empty tree
+//   prefix##_tree_release(tree)           frees everything the tree holds
+//   prefix##_create_leaf(tree, k, v)      inserts an entry; returns its value, or
+//                                         NULL with errno EEXIST (k present) or ENOMEM
+//   prefix##_find_leaf(tree, k)           returns the value of k, or NULL
+//   prefix##_delete_leaf(tree, k)         removes k; 0, or -1 with errno ENOENT
+//   prefix##_scan(tree, from, ks, vs, n)  copies up to n entries with keys >= from,
+//                                         in key order; returns how many
+//
+// Values are returned as pointers into their Leaf; they may be updated in
+// place, and are valid until the next create_leaf or delete_leaf.
+#define FixedLeafSlots 32  /* Entries per Leaf */
+#define FixedNodeSlots 32  /* Separator keys per Node (one more child) */
+#define FixedMaxHeight 16  /* Node levels above the Leaves, far more than memory allows */
+
+// An unsigned 128-bit integer: the key type of 16-byte keys.
+typedef unsigned __int128 FixedKey128;
+
+// fixed_declare: Declares the types and functions of a fixed-width tree.
+#define fixed_declare(Type, prefix, Key, Value) \
+    struct s_##prefix##_leaf { \
+        uint32_t count;                     /* Entries in use */ \
+        struct s_##prefix##_leaf *next;     /* The Leaf holding the next keys, or NULL */ \
+        Key keys[FixedLeafSlots];           /* Sorted keys */ \
+        Value values[FixedLeafSlots];       /* values[i] belongs to keys[i] */ \
+    }; \
+    typedef struct s_##prefix##_leaf Type##Leaf; \
+    struct s_##prefix##_node { \
+        uint32_t count;                     /* Separator keys in use (one more child) */ \
+        Key keys[FixedNodeSlots];           /* keys[i] is the lowest key under children[i + 1] */ \
+        void *children[FixedNodeSlots + 1]; /* Nodes, or Leaves on the lowest level */ \
+    }; \
+    typedef struct s_##prefix##_node Type##Node; \
+    struct s_##prefix##_tree { \
+        void *root;                         /* A Leaf while height is 0, else a Node, or NULL */ \
+        uint32_t height;                    /* Node levels above the Leaves */ \
+        size_t count;                       /* Entries */ \
+        size_t bytes;                       /* Bytes of Nodes and Leaves (the slabs' meter) */ \
+        Slab leaves;                        /* Where Leaves come from */ \
+        Slab nodes;                         /* Where Nodes come from */ \
+    }; \
+    typedef struct s_##prefix##_tree Type##Tree; \
+    void prefix##_tree_init(Type##Tree *tree); \
+    void prefix##_tree_release(Type##Tree *tree); \
+    Value *prefix##_create_leaf(Type##Tree *tree, Key key, Value value); \
+    Value *prefix##_find_leaf(Type##Tree *tree, Key key); \
+    int8_t prefix##_delete_leaf(Type##Tree *tree, Key key); \
+    uint32_t prefix##_scan(Type##Tree *tree, Key from, Key *keys, Value *values, uint32_t limit)
+
+// fixed_define: Defines the functions declared by fixed_declare with the same arguments.
+#define fixed_define(Type, prefix, Key, Value) \
+    /* Returns how many of the `count` sorted keys are below `key` (or, with */ \
+    /* `upto`, not above it), without a data-dependent branch. */ \
+    static inline uint32_t prefix##_rank(const Key *keys, uint32_t count, Key key, int upto) \
+    { \
+        const Key *base = keys; \
+        uint32_t half; \
+        if (count == 0) \
+        { \
+            return 0; \
+        } \
+        while (count > 1) \
+        { \
+            half = count / 2; \
+            base = (upto ? base[half] <= key : base[half] < key) ? base + half : base; \
+            count -= half; \
+        } \
+        return (uint32_t)(base - keys) + (upto ? *base <= key : *base < key); \
+    } \
+    \
+    /* Returns the Leaf that holds (or would hold) `key`, recording the Nodes */ \
+    /* above it and the child taken in each, top down, if `path` is not NULL. */ \
+    static Type##Leaf *prefix##_descend(Type##Tree *tree, Key key, Type##Node **path, uint32_t *slot) \
+    { \
+        void *child = tree->root; \
+        Type##Node *node; \
+        uint32_t level, pos; \
+        for (level = 0; level < tree->height; level++) \
+        { \
+            node = (Type##Node *)child; \
+            pos = prefix##_rank(node->keys, node->count, key, 1); \
+            if (path != NULL) \
+            { \
+                path[level] = node; \
+                slot[level] = pos; \
+            } \
+            child = node->children[pos]; \
+        } \
+        return (Type##Leaf *)child; \
+    } \
+    \
+    void prefix##_tree_init(Type##Tree *tree) \
+    { \
+        assert(tree != NULL && "Error: Tree cannot be NULL for " #prefix "_tree_init."); \
+        zero((uint8_t *)tree, sizeof(Type##Tree)); \
+        slab_init(&tree->leaves, sizeof(Type##Leaf)); \
+        slab_init(&tree->nodes, sizeof(Type##Node)); \
+        tree->leaves.meter = &tree->bytes; \
+        tree->nodes.meter = &tree->bytes; \
+    } \
+    \
+    void prefix##_tree_release(Type##Tree *tree) \
+    { \
+        assert(tree != NULL && "Error: Tree cannot be NULL for " #prefix "_tree_release."); \
+        slab_release(&tree->leaves); \
+        slab_release(&tree->nodes); \
+        prefix##_tree_init(tree); \
+    } \
+    \
+    Value *prefix##_create_leaf(Type##Tree *tree, Key key, Value value) \
+    { \
+        Type##Node *path[FixedMaxHeight], *node, *sibling, *spare[FixedMaxHeight + 1]; \
+        uint32_t slot[FixedMaxHeight], pos, half, level, need, i; \
+        Key keys[FixedNodeSlots + 1], separator; \
+        void *children[FixedNodeSlots + 2], *child; \
+        Type##Leaf *leaf, *right; \
+        Value *result; \
+        \
+        assert(tree != NULL && "Error: Tree cannot be NULL for " #prefix "_create_leaf."); \
+        \
+        if (tree->root == NULL) \
+        { \
+            leaf = (Type##Leaf *)slab_alloc(&tree->leaves); \
+            if (leaf == NULL) \
+            { \
+                return NULL; \
+            } \
+            leaf->count = 0; \
+            leaf->next = NULL; \
+            tree->root = leaf; \
+        } \
+        \
+        leaf = prefix##_descend(tree, key, path, slot); \
+        pos = prefix##_rank(leaf->keys, leaf->count, key, 0); \
+        if (pos < leaf->count && leaf->keys[pos] == key) \
+        { \
+            reterr(EEXIST); \
+        } \
+        \
+        if (leaf->count < FixedLeafSlots) \
+        { \
+            memmove(&leaf->keys[pos + 1], &leaf->keys[pos], (leaf->count - pos) * sizeof(Key)); \
+            memmove(&leaf->values[pos + 1], &leaf->values[pos], (leaf->count - pos) * sizeof(Value)); \
+            leaf->keys[pos] = key; \
+            leaf->values[pos] = value; \
+            leaf->count++; \
+            tree->count++; \
+            return &leaf->values[pos]; \
+        } \
+        \
+        /* The Leaf splits, and so does every full Node above it up to the first */ \
+        /* one with room (or the root, which gets a new Node above it). All of */ \
+        /* them are allocated first, so that running out of memory changes nothing. */ \
+        for (need = 0; need < tree->height && path[tree->height - 1 - need]->count == FixedNodeSlots; need++) \
+        { \
+        } \
+        need += need == tree->height; \
+        right = (Type##Leaf *)slab_alloc(&tree->leaves); \
+        for (i = 0; right != NULL && i < need; i++) \
+        { \
+            spare[i] = (Type##Node *)slab_alloc(&tree->nodes); \
+            if (spare[i] == NULL) \
+            { \
+                break; \
+            } \
+        } \
+        if (right == NULL || i < need) \
+        { \
+            while (i-- > 0) \
+            { \
+                slab_free(&tree->nodes, spare[i]); \
+            } \
+            if (right != NULL) \
+            { \
+                slab_free(&tree->leaves, right); \
+            } \
+            reterr(ENOMEM); \
+        } \
+        \
+        half = pos == FixedLeafSlots && leaf->next == NULL ? FixedLeafSlots : FixedLeafSlots / 2; \
+        memcpy(right->keys, &leaf->keys[half], (FixedLeafSlots - half) * sizeof(Key)); \
+        memcpy(right->values, &leaf->values[half], (FixedLeafSlots - half) * sizeof(Value)); \
+        right->count = FixedLeafSlots - half; \
+        right->next = leaf->next; \
+        leaf->count = half; \
+        leaf->next = right; \
+        if (pos >= half) \
+        { \
+            leaf = right; \
+            pos -= half; \
+        } \
+        memmove(&leaf->keys[pos + 1], &leaf->keys[pos], (leaf->count - pos) * sizeof(Key)); \
+        memmove(&leaf->values[pos + 1], &leaf->values[pos], (leaf->count - pos) * sizeof(Value)); \
+        leaf->keys[pos] = key; \
+        leaf->values[pos] = value; \
+        leaf->count++; \
+        tree->count++; \
+        result = &leaf->values[pos]; \
+        \
+        /* Hand the new right half up: each full Node splits around its middle */ \
+        /* key, which goes up in turn along with the Node's new right half. */ \
+        separator = right->keys[0]; \
+        child = right; \
+        for (level = tree->height; level-- > 0 && child != NULL;) \
+        { \
+            node = path[level]; \
+            pos = slot[level]; \
+            if (node->count < FixedNodeSlots) \
+            { \
+                memmove(&node->keys[pos + 1], &node->keys[pos], (node->count - pos) * sizeof(Key)); \
+                memmove(&node->children[pos + 2], &node->children[pos + 1], (node->count - pos) * sizeof(void *)); \
+                node->keys[pos] = separator; \
+                node->children[pos + 1] = child; \
+                node->count++; \
+                child = NULL; \
+                break; \
+            } \
+            memcpy(keys, node->keys, pos * sizeof(Key)); \
+            keys[pos] = separator; \
+            memcpy(&keys[pos + 1], &node->keys[pos], (FixedNodeSlots - pos) * sizeof(Key)); \
+            memcpy(children, node->children, (pos + 1) * sizeof(void *)); \
+            children[pos + 1] = child; \
+            memcpy(&children[pos + 2], &node->children[pos + 1], (FixedNodeSlots - pos) * sizeof(void *)); \
+            sibling = spare[--need]; \
+            half = (FixedNodeSlots + 1) / 2; \
+            node->count = half; \
+            memcpy(node->keys, keys, half * sizeof(Key)); \
+            memcpy(node->children, children, (half + 1) * sizeof(void *)); \
+            sibling->count = FixedNodeSlots - half; \
+            memcpy(sibling->keys, &keys[half + 1], sibling->count * sizeof(Key)); \
+            memcpy(sibling->children, &children[half + 1], (sibling->count + 1) * sizeof(void *)); \
+            separator = keys[half]; \
+            child = sibling; \
+        } \
+        if (child != NULL) \
+        { \
+            assert(tree->height < FixedMaxHeight && "Error: Fixed-width tree too high."); \
+            node = spare[--need]; \
+            node->count = 1; \
+            node->keys[0] = separator; \
+            node->children[0] = tree->root; \
+            node->children[1] = child; \
+            tree->root = node; \
+            tree->height++; \
+        } \
+        \
+        return result; \
+    } \
+    \
+    Value *prefix##_find_leaf(Type##Tree *tree, Key key) \
+    { \
+        Type##Leaf *leaf; \
+        uint32_t pos; \
+        \
+        assert(tree != NULL && "Error: Tree cannot be NULL for " #prefix "_find_leaf."); \
+        \
+        if (tree->root == NULL) \
+        { \
+            return NULL; \
+        } \
+        leaf = prefix##_descend(tree, key, NULL, NULL); \
+        pos = prefix##_rank(leaf->keys, leaf->count, key, 0); \
+        return pos < leaf->count && leaf->keys[pos] == key ? &leaf->values[pos] : NULL; \
+    } \
+    \
+    int8_t prefix##_delete_leaf(Type##Tree *tree, Key key) \
+    { \
+        Type##Leaf *leaf; \
+        uint32_t pos; \
+        \
+        assert(tree != NULL && "Error: Tree cannot be NULL for " #prefix "_delete_leaf."); \
+        \
+        if (tree->root == NULL) \
+        { \
+            retfail(ENOENT); \
+        } \
+        leaf = prefix##_descend(tree, key, NULL, NULL); \
+        pos = prefix##_rank(leaf->keys, leaf->count, key, 0); \
+        if (pos == leaf->count || leaf->keys[pos] != key) \
+        { \
+            retfail(ENOENT); \
+        } \
+        memmove(&leaf->keys[pos], &leaf->keys[pos + 1], (leaf->count - pos - 1) * sizeof(Key)); \
+        memmove(&leaf->values[pos], &leaf->values[pos + 1], (leaf->count - pos - 1) * sizeof(Value)); \
+        leaf->count--; \
+        tree->count--; \
+        return NoError; \
+    } \
+    \
+    uint32_t prefix##_scan(Type##Tree *tree, Key from, Key *keys, Value *values, uint32_t limit) \
+    { \
+        Type##Leaf *leaf; \
+        uint32_t pos, n, found = 0; \
+        \
+        assert(tree != NULL && "Error: Tree cannot be NULL for " #prefix "_scan."); \
+        \
+        if (tree->root == NULL) \
+        { \
+            return 0; \
+        } \
+        leaf = prefix##_descend(tree, from, NULL, NULL); \
+        pos = prefix##_rank(leaf->keys, leaf->count, from, 0); \
+        for (; leaf != NULL && found < limit; leaf = leaf->next, pos = 0) \
+        { \
+            n = leaf->count - pos < limit - found ? leaf->count - pos : limit - found; \
+            memcpy(&keys[found], &leaf->keys[pos], n * sizeof(Key)); \
+            memcpy(&values[found], &leaf->values[pos], n * sizeof(Value)); \
+            found += n; \
+        } \
+        return found; \
+    }
+
+// =============================================================================
+// Instantiations (see fixed.c)
+// =============================================================================
+fixed_declare(U64, u64, uint64_t, uint64_t);        // 8-byte keys to 8-byte values
+fixed_declare(U128, u128, FixedKey128, uint64_t);   // 16-byte keys to 8-byte values
+
+#endif /* FIXED_H */
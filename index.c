@@ -0,0 +1,449 @@
+/* index.c */
+#include "main.h"
+
+#if IndexGroup != SimdLanes
+#error "IndexGroup must match the lanes simd.match_lanes compares"
+#endif
+
+// Returns a bitmask with bit `lane` set for every lane of the group whose stored
+// hash equals `hash`, comparing the whole group in one or two vector compares.
+// Lanes are aligned 32-bit words that writers store with atomic stores and the
+// kernels load with relaxed atomic loads (see simd.c), so a reader racing with
+// a writer sees either the old or the new hash of a lane.
+static uint32_t index_group_match(const uint32_t *group, uint32_t hash)
+{
+    return simd.match_lanes(group, hash);
+}
+
+// Returns the size of the block holding a table of `capacity` lanes.
+static size_t index_table_bytes(uint32_t capacity)
+{
+    return sizeof(IndexTable) + capacity * (sizeof(uint32_t) + sizeof(void *));
+}
+
+// Allocates an empty table of `capacity` lanes as a single block.
+static IndexTable *index_table_alloc(uint32_t capacity)
+{
+    IndexTable *table;
+
+    table = (IndexTable *)calloc(1, index_table_bytes(capacity));
+    if (table == NULL)
+    {
+        reterr(ENOMEM);
+    }
+
+    table->capacity = capacity;
+    // `capacity` is a multiple of IndexGroup, so the slot array stays pointer-aligned.
+    table->slots = (void **)(table->hashes + capacity);
+
+    return table;
+}
+
+// ReclaimFn for tables replaced by a rehash.
+static void index_table_reclaim(void *ctx, void *ptr)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+// Moves every live item into a freshly allocated table of `capacity` lanes,
+// dropping all tombstones along the way, and publishes it.
+static int8_t index_rehash(Index *index, uint32_t capacity, Limbo *limbo)
+{
+    IndexTable *old = index->table, *table;
+    uint32_t i, pos, mask, free_lanes;
+
+    table = index_table_alloc(capacity);
+    if (table == NULL)
+    {
+        return -1;
+    }
+
+    mask = capacity - 1;
+    for (i = 0; old != NULL && i < old->capacity; i++)
+    {
+        if (old->hashes[i] == IndexEmpty || old->hashes[i] == IndexTombstone)
+        {
+            continue;
+        }
+
+        // The new table holds no tombstones, so the first empty lane along the
+        // probe sequence is where the item belongs.
+        pos = old->hashes[i] & mask & ~(uint32_t)(IndexGroup - 1);
+        while ((free_lanes = index_group_match(table->hashes + pos, IndexEmpty)) == 0)
+        {
+            pos = (pos + IndexGroup) & mask;
+        }
+        pos += (uint32_t)__builtin_ctz(free_lanes);
+        table->hashes[pos] = old->hashes[i];
+        table->slots[pos] = old->slots[i];
+    }
+
+    // Readers pick up either the old or the new table, both complete.
+    store_ptr(index->table, table);
+    index->used = index->count;
+    meter_add(index->meter, index_table_bytes(capacity));
+
+    if (old != NULL)
+    {
+        meter_sub(index->meter, index_table_bytes(old->capacity));
+        if (limbo != NULL)
+        {
+            limbo_retire(limbo, old, index_table_reclaim, NULL);
+        }
+        else
+        {
+            free(old);
+        }
+    }
+
+    return NoError;
+}
+
+uint32_t index_hash(const uint8_t *key, uint16_t len)
+{
+    uint32_t hash = 2166136261u; // FNV-1a offset basis.
+    uint16_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        hash ^= key[i];
+        hash *= 16777619u; // FNV-1a prime.
+    }
+
+    // Keep real hashes out of the range reserved for the lane markers.
+    if (hash <= IndexTombstone)
+    {
+        hash += 2;
+    }
+
+    return hash;
+}
+
+void *index_find(Index *index, uint32_t hash, IndexMatch match, const uint8_t *key, uint16_t len)
+{
+    IndexTable *table;
+    uint32_t pos, mask, probed, hits;
+    void *item;
+
+    assert(index != NULL && "Error: Index cannot be NULL for index_find.");
+    assert(match != NULL && "Error: A match callback is required for index_find.");
+
+    table = load_ptr(index->table);
+    if (table == NULL)
+    {
+        reterr(NoError);
+    }
+
+    mask = table->capacity - 1;
+    pos = hash & mask & ~(uint32_t)(IndexGroup - 1);
+
+    for (probed = 0; probed < table->capacity; probed += IndexGroup)
+    {
+        // Only items whose stored hash matches are ever dereferenced. A slot
+        // can be NULL if a writer removed the item after the hash was read.
+        hits = index_group_match(table->hashes + pos, hash);
+        while (hits != 0)
+        {
+            item = load_ptr(table->slots[pos + (uint32_t)__builtin_ctz(hits)]);
+            if (item != NULL && match(item, key, len))
+            {
+                return item;
+            }
+            hits &= hits - 1;
+        }
+
+        // A group with an empty lane ends every probe sequence that reaches it.
+        if (index_group_match(table->hashes + pos, IndexEmpty) != 0)
+        {
+            break;
+        }
+
+        pos = (pos + IndexGroup) & mask;
+    }
+
+    reterr(NoError);
+}
+
+void index_prefetch(Index *index, uint32_t hash)
+{
+    IndexTable *table = load_ptr(index->table);
+    uint32_t pos;
+
+    if (table != NULL)
+    {
+        pos = hash & (table->capacity - 1) & ~(uint32_t)(IndexGroup - 1);
+        __builtin_prefetch(table->hashes + pos);
+        __builtin_prefetch(table->slots + pos);
+    }
+}
+
+void *index_peek(Index *index, uint32_t hash)
+{
+    IndexTable *table = load_ptr(index->table);
+    uint32_t pos, hits;
+
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    pos = hash & (table->capacity - 1) & ~(uint32_t)(IndexGroup - 1);
+    hits = index_group_match(table->hashes + pos, hash);
+
+    return hits != 0 ? load_ptr(table->slots[pos + (uint32_t)__builtin_ctz(hits)]) : NULL;
+}
+
+int8_t index_insert(Index *index, uint32_t hash, void *item, Limbo *limbo)
+{
+    IndexTable *table;
+    uint32_t pos, mask, free_lanes, capacity;
+
+    assert(index != NULL && "Error: Index cannot be NULL for index_insert.");
+    assert(hash > IndexTombstone && "Error: Hash collides with an index lane marker.");
+
+    // Keep the load (including tombstones) at or below 3/4. If most used lanes
+    // are tombstones, rehashing at the same size is enough to reclaim them.
+    capacity = index->table == NULL ? 0 : index->table->capacity;
+    if ((index->used + 1) * 4 > capacity * 3)
+    {
+        capacity = capacity == 0 ? IndexGroup : capacity;
+        if ((index->count + 1) * 2 > capacity)
+        {
+            capacity *= 2;
+        }
+        if (index_rehash(index, capacity, limbo) != NoError)
+        {
+            return -1;
+        }
+    }
+
+    table = index->table;
+    mask = table->capacity - 1;
+    pos = hash & mask & ~(uint32_t)(IndexGroup - 1);
+
+    for (;;)
+    {
+        free_lanes = index_group_match(table->hashes + pos, IndexEmpty) |
+                     index_group_match(table->hashes + pos, IndexTombstone);
+        if (free_lanes != 0)
+        {
+            break;
+        }
+        pos = (pos + IndexGroup) & mask;
+    }
+
+    pos += (uint32_t)__builtin_ctz(free_lanes);
+    if (table->hashes[pos] == IndexEmpty)
+    {
+        index->used++;
+    }
+
+    // Publish the item before its hash, so a reader that matches the hash
+    // finds either this item or NULL, never an uninitialized one.
+    store_ptr(table->slots[pos], item);
+    __atomic_store_n(&table->hashes[pos], hash, __ATOMIC_RELEASE);
+    index->count++;
+
+    return NoError;
+}
+
+int8_t index_reserve(Index *index, uint32_t extra, Limbo *limbo)
+{
+    uint32_t capacity;
+
+    assert(index != NULL && "Error: Index cannot be NULL for index_reserve.");
+
+    // Same load limit as index_insert: the used lanes, including tombstones,
+    // must stay at or below 3/4 once all `extra` items are in.
+    capacity = index->table == NULL ? 0 : index->table->capacity;
+    if ((uint64_t)(index->used + extra) * 4 <= (uint64_t)capacity * 3)
+    {
+        return NoError;
+    }
+
+    // Size for the live items alone; the rehash drops every tombstone.
+    capacity = capacity == 0 ? IndexGroup : capacity;
+    while ((uint64_t)(index->count + extra) * 2 > capacity)
+    {
+        if (capacity >= (1u << 31))
+        {
+            retfail(ENOMEM);
+        }
+        capacity *= 2;
+    }
+
+    return index_rehash(index, capacity, limbo);
+}
+
+int index_sparse(const Index *index)
+{
+    uint32_t capacity;
+
+    assert(index != NULL && "Error: Index cannot be NULL for index_sparse.");
+
+    if (index->table == NULL || index->table->capacity <= IndexGroup)
+    {
+        return 0;
+    }
+    capacity = index->table->capacity;
+
+    return (uint64_t)index->count * 8 < capacity || (uint64_t)(index->used - index->count) * 2 > capacity;
+}
+
+int8_t index_compact(Index *index, Limbo *limbo)
+{
+    uint32_t capacity = IndexGroup;
+
+    assert(index != NULL && "Error: Index cannot be NULL for index_compact.");
+
+    if (!index_sparse(index))
+    {
+        return NoError;
+    }
+
+    // Same sizing as a growing rehash: the live items fill at most half the lanes.
+    while ((uint64_t)index->count * 2 > capacity)
+    {
+        capacity *= 2;
+    }
+
+    return index_rehash(index, capacity, limbo);
+}
+
+int8_t index_remove(Index *index, uint32_t hash, void *item)
+{
+    IndexTable *table = index->table;
+    uint32_t pos, mask, probed, hits, lane, marker;
+
+    assert(index != NULL && "Error: Index cannot be NULL for index_remove.");
+
+    if (table == NULL)
+    {
+        retfail(ENOENT);
+    }
+
+    mask = table->capacity - 1;
+    pos = hash & mask & ~(uint32_t)(IndexGroup - 1);
+
+    for (probed = 0; probed < table->capacity; probed += IndexGroup)
+    {
+        hits = index_group_match(table->hashes + pos, hash);
+        while (hits != 0)
+        {
+            lane = (uint32_t)__builtin_ctz(hits);
+            if (table->slots[pos + lane] == item)
+            {
+                // If the group already has an empty lane, no probe sequence ever
+                // continues past it, so the lane can go straight back to empty.
+                marker = IndexTombstone;
+                if (index_group_match(table->hashes + pos, IndexEmpty) != 0)
+                {
+                    marker = IndexEmpty;
+                    index->used--;
+                }
+                __atomic_store_n(&table->hashes[pos + lane], marker, __ATOMIC_RELEASE);
+                store_ptr(table->slots[pos + lane], NULL);
+                index->count--;
+                return NoError;
+            }
+            hits &= hits - 1;
+        }
+
+        if (index_group_match(table->hashes + pos, IndexEmpty) != 0)
+        {
+            break;
+        }
+
+        pos = (pos + IndexGroup) & mask;
+    }
+
+    retfail(ENOENT);
+}
+
+void *index_next(Index *index, uint32_t *cursor)
+{
+    IndexTable *table;
+    uint32_t pos, hash;
+    void *item;
+
+    assert(index != NULL && "Error: Index cannot be NULL for index_next.");
+    assert(cursor != NULL && "Error: Cursor cannot be NULL for index_next.");
+
+    table = load_ptr(index->table);
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    for (pos = *cursor; pos < table->capacity; pos++)
+    {
+        hash = __atomic_load_n(&table->hashes[pos], __ATOMIC_ACQUIRE);
+        if (hash == IndexEmpty || hash == IndexTombstone)
+        {
+            continue;
+        }
+        item = load_ptr(table->slots[pos]);
+        if (item != NULL)
+        {
+            *cursor = pos + 1;
+            return item;
+        }
+    }
+
+    *cursor = table->capacity;
+    return NULL;
+}
+
+uint32_t index_cursor(Index *index, uint32_t hash, void *item)
+{
+    IndexTable *table = index->table;
+    uint32_t pos, mask, probed, hits, lane;
+
+    assert(index != NULL && "Error: Index cannot be NULL for index_cursor.");
+
+    if (table == NULL)
+    {
+        return 0;
+    }
+
+    // Probe as index_remove does, for the lane holding the item itself.
+    mask = table->capacity - 1;
+    pos = hash & mask & ~(uint32_t)(IndexGroup - 1);
+    for (probed = 0; probed < table->capacity; probed += IndexGroup)
+    {
+        hits = index_group_match(table->hashes + pos, hash);
+        while (hits != 0)
+        {
+            lane = (uint32_t)__builtin_ctz(hits);
+            if (table->slots[pos + lane] == item)
+            {
+                return pos + lane + 1;
+            }
+            hits &= hits - 1;
+        }
+        if (index_group_match(table->hashes + pos, IndexEmpty) != 0)
+        {
+            break;
+        }
+        pos = (pos + IndexGroup) & mask;
+    }
+
+    return table->capacity;
+}
+
+void index_release(Index *index)
+{
+    size_t *meter;
+
+    assert(index != NULL && "Error: Index cannot be NULL for index_release.");
+
+    meter = index->meter;
+    if (index->table != NULL)
+    {
+        meter_sub(meter, index_table_bytes(index->table->capacity));
+    }
+    free(index->table);
+    zero((uint8_t *)index, sizeof(Index));
+    index->meter = meter;
+}
@@ -0,0 +1,216 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint32_t)
+#include <stddef.h> // For size_t and NULL
+
+#include "epoch.h"  // For retiring replaced tables while readers may still use them
+
+// =============================================================================
+// Index Constants
+// =============================================================================
+// The index is an open-addressing hash table that stores the 32-bit hash of
+// every key next to the pointer it maps to. Probing works on groups of
+// `IndexGroup` consecutive hashes, so a lookup compares a whole group at once
+// and only dereferences the items whose stored hash matches.
+#define IndexGroup 8     /* Number of hash lanes examined per probe step */
+#define IndexEmpty 0     /* Stored hash value marking a never-used lane */
+#define IndexTombstone 1 /* Stored hash value marking a lane whose item was removed */
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+/**
+ * @brief Callback used by index_find to confirm that an item really matches a key.
+ *
+ * Hashes can collide, so every candidate with a matching hash is passed to this
+ * function together with the key being looked up.
+ *
+ * @param item The stored item (e.g. a Leaf pointer).
+ * @param key  The key being searched for.
+ * @param len  The length of the key in bytes.
+ * @return     Non-zero if the item's key equals `key`, zero otherwise.
+ */
+typedef int (*IndexMatch)(const void *item, const uint8_t *key, uint16_t len);
+
+/**
+ * @brief The storage of an Index, allocated as a single block.
+ *
+ * `hashes` and `slots` are parallel arrays of `capacity` entries. A table is
+ * never resized in place: growing builds a new table and publishes it, so
+ * lock-free readers always see a complete table.
+ */
+struct s_index_table {
+    uint32_t capacity;  ///< Number of lanes; always a power of two >= IndexGroup.
+    uint32_t reserved;  ///< Padding; keeps `slots` and `hashes` 8-byte aligned.
+    void **slots;       ///< Item pointers, parallel to `hashes` (stored after it in the same block).
+    uint32_t hashes[];  ///< Stored key hashes (or IndexEmpty / IndexTombstone markers).
+};
+typedef struct s_index_table IndexTable;
+
+/**
+ * @brief An open-addressing hash index mapping key hashes to item pointers.
+ *
+ * A zeroed Index is a valid empty index; storage is allocated on first insert.
+ * Writers must be serialized by the caller. Readers may call index_find and
+ * index_next concurrently with a writer as long as they are inside an epoch
+ * section and writers retire replaced tables through a Limbo.
+ */
+struct s_index {
+    IndexTable *table;  ///< Current storage, or NULL while the index has never held an item.
+    uint32_t count;     ///< Number of live items.
+    uint32_t used;      ///< Number of non-empty lanes (live items plus tombstones).
+    size_t *meter;      ///< Charged with the bytes of `table` (see meter_add), or NULL.
+};
+typedef struct s_index Index;
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Computes the index hash of a key.
+ *
+ * The result never collides with the IndexEmpty or IndexTombstone markers.
+ *
+ * @param key A pointer to the key bytes.
+ * @param len The length of the key in bytes.
+ * @return    The 32-bit hash of the key.
+ */
+uint32_t index_hash(const uint8_t *key, uint16_t len);
+
+/**
+ * @brief Looks up the item stored under a key.
+ *
+ * @param index A pointer to the index to search.
+ * @param hash  The hash of the key, as returned by index_hash.
+ * @param match The callback used to compare candidate items against the key.
+ * @param key   A pointer to the key bytes.
+ * @param len   The length of the key in bytes.
+ * @return      The matching item, or NULL (with errno set to NoError) if the key is not present.
+ */
+void *index_find(Index *index, uint32_t hash, IndexMatch match, const uint8_t *key, uint16_t len);
+
+/**
+ * @brief Starts loading the lanes a lookup of `hash` probes first into the cache, without waiting for them.
+ *
+ * For batched lookups that overlap the cache misses of many keys: prefetch,
+ * work on other keys, then call index_peek and index_find. Lock-free, like index_find.
+ *
+ * @param index A pointer to the index that will be searched.
+ * @param hash  The hash of the key.
+ */
+void index_prefetch(Index *index, uint32_t hash);
+
+/**
+ * @brief Returns the first item of the group a lookup of `hash` probes first whose stored hash matches, if any.
+ *
+ * The key is not compared, so the item is only a likely match, worth
+ * prefetching before index_find confirms it. Lock-free, like index_find.
+ *
+ * @param index A pointer to the index that will be searched.
+ * @param hash  The hash of the key.
+ * @return      The candidate item, or NULL.
+ */
+void *index_peek(Index *index, uint32_t hash);
+
+/**
+ * @brief Inserts an item under the given hash.
+ *
+ * The caller is responsible for ensuring that the key is not already present.
+ *
+ * @param index A pointer to the index to insert into.
+ * @param hash  The hash of the item's key.
+ * @param item  The item to store.
+ * @param limbo Where the old table is retired if the index grows, or NULL to
+ *              free it immediately (only when there are no concurrent readers).
+ * @return      0 on success, or -1 with errno set to ENOMEM if the index could not grow.
+ */
+int8_t index_insert(Index *index, uint32_t hash, void *item, Limbo *limbo);
+
+/**
+ * @brief Grows the index ahead of time so that `extra` more items can be inserted without a rehash.
+ *
+ * After a successful call, the next `extra` index_insert calls cannot fail.
+ *
+ * @param index A pointer to the index to grow.
+ * @param extra The number of items about to be inserted.
+ * @param limbo Where the old table is retired, as for index_insert.
+ * @return      0 on success, or -1 with errno set to ENOMEM if the index could not grow.
+ */
+int8_t index_reserve(Index *index, uint32_t extra, Limbo *limbo);
+
+/**
+ * @brief Removes an item from the index.
+ *
+ * @param index A pointer to the index to remove from.
+ * @param hash  The hash of the item's key.
+ * @param item  The exact item pointer to remove.
+ * @return      0 on success, or -1 with errno set to ENOENT if the item is not in the index.
+ */
+int8_t index_remove(Index *index, uint32_t hash, void *item);
+
+/**
+ * @brief Reports whether deletes have left an index far emptier than its table.
+ *
+ * True once the live items fill under 1/8 of the lanes, or tombstones fill
+ * half of them; index_compact then shrinks or cleans up the table.
+ *
+ * @param index A pointer to the index.
+ * @return      Non-zero if index_compact would rebuild the table.
+ */
+int index_sparse(const Index *index);
+
+/**
+ * @brief Rebuilds a sparse index into the smallest table that holds its items, without tombstones.
+ *
+ * Does nothing unless index_sparse is true. Readers keep working throughout,
+ * as when the index grows.
+ *
+ * @param index A pointer to the index to compact.
+ * @param limbo Where the old table is retired, as for index_insert.
+ * @return      0 on success, or -1 with errno set to ENOMEM if the new table could not be allocated.
+ */
+int8_t index_compact(Index *index, Limbo *limbo);
+
+/**
+ * @brief Iterates over the live items of an index in lane order.
+ *
+ * Start with `*cursor` set to 0 and call repeatedly until NULL is returned.
+ * If a writer modifies the index during the iteration, items inserted or
+ * removed meanwhile may or may not be returned.
+ *
+ * @param index  A pointer to the index to iterate over.
+ * @param cursor A pointer to the iteration position, advanced on every call.
+ * @return       The next live item, or NULL once every item has been returned.
+ */
+void *index_next(Index *index, uint32_t *cursor);
+
+/**
+ * @brief Returns the position just after `item` in lane order, as index_next leaves `*cursor` after returning it.
+ *
+ * Lets an iteration resume after an item whose position was not kept: the
+ * next index_next from there returns the item's successor.
+ *
+ * @param index A pointer to the index.
+ * @param hash  The hash of the item's key.
+ * @param item  The exact item pointer.
+ * @return      The cursor, or the end of the table if the item is not in the index.
+ */
+uint32_t index_cursor(Index *index, uint32_t hash, void *item);
+
+/**
+ * @brief Frees the storage owned by an index and resets it to the empty state, keeping its meter.
+ *
+ * The stored items themselves are not freed, and the storage is freed
+ * immediately, so no reader may still be able to reach the index.
+ *
+ * @param index A pointer to the index to release.
+ */
+void index_release(Index *index);
+
+#endif /* INDEX_H */
@@ -1,7 +1,189 @@
 /* main.c */
 #include "main.h"
 
-void zero(uint8_t *ptr, uint16_t size)
+#include <time.h> // For clock_gettime, CLOCK_REALTIME
+
+// The largest leaf (a LeafKeyMax key with an out-of-line value) must fit the largest Leaf size class.
+_Static_assert(offsetof(Leaf, key) + LeafKeyMax + 1 <= 176, "Leaf size classes are too small for LeafKeyMax");
+_Static_assert(LeafInlineSize <= 176, "LeafInlineSize exceeds the largest Leaf size class");
+
+// The memory limit (see memory_limit). While it is set, small values go to the
+// heap instead of their Node's arena, so that deleting their leaf frees them.
+static size_t max_memory = 0;
+static uint8_t evict_policy = EvictClock;
+
+// Returns the length of a key as stored in a Leaf (keys are truncated to LeafKeyMax bytes).
+static uint16_t key_length(uint8_t *key)
+{
+    return (uint16_t)strnlen((char *)key, LeafKeyMax);
+}
+
+ValueBlock *value_alloc(uint32_t size)
+{
+    ValueBlock *block;
+
+    block = (ValueBlock *)malloc(sizeof(ValueBlock) + (size_t)size);
+    if (block == NULL)
+    {
+        reterr(ENOMEM);
+    }
+    block->refs = 1;
+    block->capacity = size;
+
+    return block;
+}
+
+void value_unref(ValueBlock *block)
+{
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(block);
+    }
+}
+
+// Returns the bytes a ValueBlock is charged for.
+static size_t block_bytes(const ValueBlock *block)
+{
+    return sizeof(ValueBlock) + block->capacity;
+}
+
+// Frees the out-of-line value of a leaf, if it has one on the heap (or drops
+// the leaf's reference, if views still pin it), and uncharges it from `alloc`
+// unless that is NULL (the block was never charged). Arena-backed values are
+// released together with their Node's arena, and inline values together with
+// the leaf itself.
+static void value_free(Allocator *alloc, Leaf *leaf)
+{
+    if (leaf->flags & LeafHeap)
+    {
+        if (alloc != NULL)
+        {
+            meter_sub(&alloc->bytes, block_bytes(value_block(leaf->value)));
+        }
+        value_unref(value_block(leaf->value));
+    }
+}
+
+// ReclaimFn for leaves unlinked by delete_leaf; `ctx` is the owning Allocator.
+static void reclaim_leaf(void *ctx, void *ptr)
+{
+    Leaf *leaf = (Leaf *)ptr;
+
+    value_free((Allocator *)ctx, leaf);
+    if (!(leaf->flags & LeafArena))
+    {
+        slab_free(&((Allocator *)ctx)->leaves[leaf->sclass], leaf);
+    }
+}
+
+// IndexMatch callback comparing a stored Node's path segment against a lookup segment.
+static int node_matches(const void *item, const uint8_t *key, uint16_t len)
+{
+    const Node *node = (const Node *)item;
+
+    return node->path[len] == '\0' && simd.equal(node->path, key, len);
+}
+
+// Returns the child-table hash of a stored path segment.
+static uint32_t path_hash(const uint8_t *path)
+{
+    return index_hash(path, (uint16_t)strnlen((const char *)path, PathSegmentMax));
+}
+
+// IndexMatch callback comparing a stored Leaf's key against a lookup key.
+static int leaf_matches(const void *item, const uint8_t *key, uint16_t len)
+{
+    const Leaf *leaf = (const Leaf *)item;
+
+    return leaf->keylen == len && simd.equal(leaf->key, key, len);
+}
+
+// IndexMatch callback comparing a LeafSpec's key against a lookup key, used to
+// catch keys repeated within one create_leaf_batch call.
+static int spec_matches(const void *item, const uint8_t *key, uint16_t len)
+{
+    const LeafSpec *spec = (const LeafSpec *)item;
+
+    return key_length(spec->key) == len && simd.equal(spec->key, key, len);
+}
+
+// Returns the bytes a leaf created by create_leaf_batch takes in the arena
+// block: the leaf, followed by its value unless the value is inline.
+static size_t batch_leaf_bytes(uint16_t key_len, uint32_t count)
+{
+    size_t size = offsetof(Leaf, key) + key_len + 1;
+
+    if (count <= LeafInlineSize - size)
+    {
+        return align_up(size + count, sizeof(void *));
+    }
+
+    return align_up(size, sizeof(void *)) + align_up(count, sizeof(void *));
+}
+
+// Compresses a value for `node` if the Node's codec mode asks for it and that
+// saves at least an eighth of the bytes; CodecSampled Nodes sample their first
+// values into the dictionary the later ones are compressed against. Returns
+// a ValueBlock holding the PackedValue, or NULL to store the value raw (also
+// for small or zero-filled values, or when memory is short). The caller holds
+// the shard's writer lock.
+static ValueBlock *value_pack(Node *node, const uint8_t *src, uint32_t count)
+{
+    ValueBlock *block, *shrunk;
+    PackedValue *packed;
+    uint32_t cap, len;
+
+    if (node->codec == CodecOff || count < CodecMinSize || src == NULL)
+    {
+        return NULL;
+    }
+    if (node->codec == CodecSampled && node->dict == NULL && codec_sample(&node->samples, src, count) == 1)
+    {
+        // From now on the dictionary is read by whoever decompresses, so it never changes again.
+        node->dict = node->samples;
+        node->samples = NULL;
+    }
+
+    cap = count - count / 8;
+    block = value_alloc((uint32_t)sizeof(PackedValue) + cap);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    packed = (PackedValue *)block->data;
+    packed->dict = node->codec == CodecSampled ? node->dict : NULL;
+    packed->reserved = 0;
+    len = codec_compress(src, count, packed->data, cap, packed->dict);
+    if (len == 0)
+    {
+        value_unref(block);
+        return NULL;
+    }
+    packed->len = len;
+
+    // Hand back what the compressed value does not use; nobody else has the block yet.
+    shrunk = (ValueBlock *)realloc(block, sizeof(ValueBlock) + sizeof(PackedValue) + len);
+    if (shrunk != NULL)
+    {
+        block = shrunk;
+        block->capacity = (uint32_t)sizeof(PackedValue) + len;
+    }
+    metric_count(MetricPackValue);
+
+    return block;
+}
+
+void node_meter(Node *node)
+{
+    assert(node != NULL && node->alloc != NULL && "Error: node_meter needs a Node with an allocator.");
+
+    node->values.meter = &node->alloc->bytes;
+    node->values.pages = node->alloc->pages;
+    node->index.meter = &node->alloc->bytes;
+    node->children.meter = &node->alloc->bytes;
+}
+
+void zero(uint8_t *ptr, size_t size)
 {
     // Pre-condition check: Ensure the pointer is valid before attempting to dereference.
     // `assert` is used for debugging; it will terminate the program if the condition is false.
@@ -16,14 +198,32 @@ Node *create_node(Node *parent, int8_t *path)
 {
     Node *node;         // Pointer to hold the address of the newly allocated Node.
     uint16_t node_size; // Stores the calculated size of the Node structure.
+    uint32_t hash;      // Hash of the path segment, the key in the parent's child table.
+    size_t path_len;    // Length of the path segment, excluding the NUL.
 
     // Pre-condition check: A parent node is required to create a new child node.
     assert(parent != NULL && "Error: Parent node cannot be NULL when creating a new node.");
+    assert(parent->alloc != NULL && "Error: Parent node has no allocator.");
+    assert(path != NULL && "Error: Path segment cannot be NULL when creating a new node.");
+
+    // A segment must be non-empty and free of '/', or resolve_path could never reach it.
+    if (path[0] == '\0' || strchr((char *)path, '/') != NULL)
+    {
+        reterr(EINVAL);
+    }
+    if (node_ready(parent) != NoError)
+    {
+        return NULL;
+    }
+    if (find_node(parent, path) != NULL)
+    {
+        reterr(EEXIST);
+    }
 
     // Determine the exact size required for a `Node` structure.
     node_size = sizeof(struct s_node);
-    // Allocate memory from the heap for the new Node.
-    node = (Node *)malloc(node_size);
+    // Take the new Node from the tree's Node size class.
+    node = (Node *)slab_alloc(&parent->alloc->nodes);
 
     // Error handling: Check if memory allocation was successful.
     if (node == NULL)
@@ -37,23 +237,33 @@ Node *create_node(Node *parent, int8_t *path)
     // undefined behavior from uninitialized pointers or data.
     zero((uint8_t *)node, node_size);
 
-    // --- Debugging Output ---
-    printf("--- Node Creation Details ---\n");
-    printf("  Node structure size: %u bytes\n", node_size);
-    printf("  Address of new Node in memory: %p\n", (void *)node);
+    // Copy the path segment into the new node's `path` field, truncated to
+    // PathSegmentMax bytes so the terminating NUL always fits.
+    path_len = strnlen((char *)path, PathSegmentMax);
+    memcpy(node->path, path, path_len);
+    node->path[path_len] = '\0';
 
-    // Link the newly created node into the tree structure.
-    parent->west = node;  // Link the parent's 'west' child pointer to this new node.
+    // Initialize the node completely before it becomes reachable.
     node->tag = TagNode;  // Assign the appropriate tag to identify this as a Node.
     node->north = parent; // Set the new node's 'north' (parent) pointer.
+    node->alloc = parent->alloc; // Children share the allocator of the tree they belong to.
     node->east = NULL;    // Initialize 'east' (pointer to first Leaf) to NULL.
+    node->tail = NULL;    // No leaves yet, so no tail either.
+    node->count = 0;
+    node->codec = parent->codec; // New subtrees compress the way their parent does.
+    node_meter(node);
 
-    // Safely copy the provided path segment into the new node's `path` field.
-    // `snprintf` is used to prevent buffer overflows by limiting the number of characters copied.
-    snprintf((char *)node->path, sizeof(node->path), "%s", (char *)path);
+    // Link the node into the tree by publishing it in its parent's child table.
+    // Siblings are unique by path segment.
+    hash = path_hash(node->path);
+    if (index_insert(&parent->children, hash, node, &parent->alloc->limbo) != NoError)
+    {
+        slab_free(&parent->alloc->nodes, node);
+        reterr(ENOMEM);
+    }
 
-    printf("  New Node path initialized to: '%s'\n", (char *)node->path);
-    printf("-----------------------------\n");
+    metric_count(MetricCreateNode);
+    trace(TraceDebug, "create_node: node %#llx under parent %#llx", (uintptr_t)node, (uintptr_t)parent);
 
     return node; // Return the pointer to the newly created node.
 }
@@ -88,145 +298,2770 @@ Leaf *find_last_linear(Node *parent)
     return current_leaf; // Return the last leaf found.
 }
 
-Leaf *create_leaf(Node *parent, uint8_t *key, uint16_t count, uint8_t value)
+Leaf *find_last_tail(Node *parent)
+{
+    // Pre-condition check: Ensure the parent node is valid.
+    assert(parent != NULL && "Error: Parent node cannot be NULL for find_last_tail.");
+
+    // An empty list has no tail; this is not an error.
+    if (parent->tail == NULL)
+    {
+        reterr(NoError);
+    }
+
+    // The cached tail must always be the end of the 'east' chain.
+    assert(parent->tail->east == NULL && "Error: Cached tail leaf is not the last leaf.");
+
+    return parent->tail;
+}
+
+// Shared body of create_leaf and create_leaf_owned. When `owned` is set, the
+// value is read from it, and it becomes the leaf's value block if the value
+// does not go inline; it is only consumed if the leaf is created.
+static Leaf *leaf_create(Node *parent, uint8_t *key, uint32_t count, uint8_t *value, ValueBlock *owned)
 {
-    Leaf *leaf, *new_leaf;
-    uint16_t size;
+    Leaf *new_leaf, *existing;
+    ValueBlock *block;
+    uint16_t size, key_len;
+    uint32_t hash;
+    int8_t sclass;
+    int inline_value;
 
     // Pre-condition check: The 'west' link (parent/sibling) must be valid.
     assert(parent != NULL && "Error: 'parent' link cannot be NULL when creating a new leaf.");
+    assert(parent->alloc != NULL && "Error: Parent node has no allocator.");
 
-    leaf = find_last(parent);
-    size = sizeof(struct s_leaf);
-    new_leaf = (Leaf *)malloc(size);
-    assert(new_leaf);
-    if (!leaf)
+    if (node_ready(parent) != NoError)
     {
-        // directly connected to the node
-        (*parent).east = new_leaf;
+        return NULL;
     }
-    else
+
+    // Keys are unique per Node; refuse to shadow an existing leaf, unless it
+    // has expired and only waits to be deleted.
+    key_len = key_length(key);
+    hash = index_hash(key, key_len);
+    existing = (Leaf *)index_find(&parent->index, hash, leaf_matches, key, key_len);
+    if (existing != NULL && !leaf_expired(existing, 0))
     {
-        // leaf is a leaf
-        (*leaf).east = new_leaf;
+        reterr(EEXIST);
+    }
+    if (existing != NULL)
+    {
+        delete_leaf(parent, key);
+    }
+
+    // Pick the leaf layout: the value goes inline, right after the key, when the
+    // whole leaf still fits in LeafInlineSize bytes.
+    size = (uint16_t)(offsetof(Leaf, key) + key_len + 1);
+    inline_value = count <= (uint32_t)(LeafInlineSize - size);
+    if (inline_value)
+    {
+        size = (uint16_t)(size + count);
     }
 
+    // Take the leaf from the matching Leaf size class and any out-of-line value
+    // from the parent's arena (or the heap, for large values) before linking
+    // anything, so an allocation failure leaves the list untouched.
+    sclass = leaf_class(size);
+    new_leaf = (Leaf *)slab_alloc(&parent->alloc->leaves[sclass]);
+    if (new_leaf == NULL)
+    {
+        reterr(ENOMEM);
+    }
     zero((uint8_t *)new_leaf, size);
-    new_leaf->tag = TagLeaf;
+    new_leaf->sclass = (uint8_t)sclass;
 
-    // Set the west pointer - this needs to handle the union type properly
-    if (!leaf)
+    if (inline_value)
     {
-        // First leaf points back to parent node
-        new_leaf->west = (Tree *)parent;
+        new_leaf->flags = LeafInline;
+        new_leaf->value = new_leaf->key + key_len + 1;
+    }
+    else if ((block = value_pack(parent, owned != NULL ? owned->data : value, count)) != NULL)
+    {
+        new_leaf->flags = LeafHeap | LeafPacked;
+        new_leaf->value = block->data;
+    }
+    else if (owned != NULL)
+    {
+        // Adopt the caller's block instead of copying out of it.
+        new_leaf->flags = LeafHeap;
+        new_leaf->value = owned->data;
+    }
+    else if (count <= ArenaSmallValue && __atomic_load_n(&max_memory, __ATOMIC_RELAXED) == 0)
+    {
+        new_leaf->value = (uint8_t *)arena_alloc(&parent->values, count);
     }
     else
     {
-        // Subsequent leaves point to previous leaf
-        // Need to cast leaf to Tree* to match the expected type
-        new_leaf->west = (Tree *)leaf;
+        // Large values get a reference-counted block, so views can pin them.
+        block = value_alloc(count);
+        if (block != NULL)
+        {
+            new_leaf->flags = LeafHeap;
+            new_leaf->value = block->data;
+        }
+    }
+    if (new_leaf->value == NULL)
+    {
+        slab_free(&parent->alloc->leaves[sclass], new_leaf);
+        reterr(ENOMEM);
     }
 
-    strncpy((char *)new_leaf->key, (char *)key, 127);
+    new_leaf->tag = TagLeaf;
+    new_leaf->referenced = 1; // A new leaf gets a full turn of the CLOCK hand.
 
-    new_leaf->value = (uint8_t *)malloc(count);
-    zero(new_leaf->value, count);
-    assert(new_leaf->value);
+    // Store the length-prefixed key (NUL-terminated for convenience) and the value.
+    memcpy(new_leaf->key, key, key_len);
+    new_leaf->key[key_len] = '\0';
+    new_leaf->keylen = (uint8_t)key_len;
 
-    strncpy((char *)new_leaf->value, (char *)value, count);
+    if (new_leaf->flags & LeafPacked)
+    {
+        // value_pack has already stored the compressed value.
+    }
+    else if (owned != NULL)
+    {
+        if (new_leaf->value != owned->data)
+        {
+            memcpy(new_leaf->value, owned->data, count);
+        }
+    }
+    else if (value != NULL)
+    {
+        memcpy(new_leaf->value, value, count);
+    }
+    else
+    {
+        zero(new_leaf->value, count);
+    }
     new_leaf->size = count;
 
-    return leaf; // Return the pointer to the newly created leaf.
+    // Make the leaf reachable by key. It is fully initialized, so readers may
+    // find it through the index before it is linked into the list. If the index
+    // cannot grow, nothing has been published and the leaf can be freed at once.
+    if (index_insert(&parent->index, hash, new_leaf, &parent->alloc->limbo) != NoError)
+    {
+        // An adopted block still belongs to the caller.
+        if (owned == NULL || new_leaf->value != owned->data)
+        {
+            value_free(NULL, new_leaf);
+        }
+        slab_free(&parent->alloc->leaves[sclass], new_leaf);
+        reterr(ENOMEM);
+    }
+
+    // Publish the leaf in the 'east' list at its key's position; this also
+    // keeps the cached tail in sync.
+    skip_insert(parent, new_leaf, hash);
+    __atomic_store_n(&parent->count, parent->count + 1, __ATOMIC_RELAXED); // Read by the stats without the lock.
+    if (new_leaf->flags & LeafHeap)
+    {
+        meter_add(&parent->alloc->bytes, block_bytes(value_block(new_leaf->value)));
+    }
+
+    // A block whose bytes were copied inline is no longer needed.
+    if (owned != NULL && new_leaf->value != owned->data)
+    {
+        value_unref(owned);
+    }
+    metric_count(MetricCreateLeaf);
+
+    return new_leaf; // Return the pointer to the newly created leaf.
 }
 
-/**
- * @brief The global root of the in-memory database tree.
- *
- * This `Tree` union variable serves as the entry point to the entire database
- * structure. It is initialized as a `Node` and tagged as `TagRoot`.
- */
-Tree root;
+Leaf *create_leaf(Node *parent, uint8_t *key, uint32_t count, uint8_t *value)
+{
+    return leaf_create(parent, key, count, value, NULL);
+}
 
-int main(int argc, const char *argv[])
+Leaf *create_leaf_owned(Node *parent, uint8_t *key, ValueBlock *block, uint32_t count)
 {
-    // Suppress unused parameter warnings for `argc` and `argv`.
-    // This is a common practice when these parameters are not used in the function body.
-    (void)argc;
-    (void)argv;
-
-    Node *newNode = NULL;  // Pointer to hold a newly created node.
-    Leaf *newLeaf = NULL;  // Pointer to hold a newly created leaf.
-    Node *rootNodeAddress; // Pointer to the Node part of the global `root` Tree union.
-
-    // Get the address of the `node` member within the `root` union.
-    rootNodeAddress = (Node *)&root;
-
-    // --- Initialize the Database Root ---
-    // The `root` is treated as a `Node` type for structural purposes,
-    // serving as the top-level container for the database.
-    printf("\n--- Initializing Database Root ---\n");
-    root.node.north = NULL;   // The root has no parent.
-    root.node.west = NULL;    // Initially, no child nodes or sub-paths.
-    root.node.east = NULL;    // Initially, no child leaves directly under root.
-    root.node.tag = TagRoot;  // Set the tag to explicitly identify this as the root.
-    root.node.path[0] = '\0'; // Initialize the root's path to an empty string.
-
-    printf("  Root tag: %d\n", root.node.tag);
-    printf("  Root tree address: %p\n", (void *)&root);
-    printf("----------------------------------\n\n");
-
-    // --- Demonstrate Node Creation ---
-    printf("Attempting to create a new Node under the root...\n");
-    // Create a new node under the root.
-    // The path for the new node is currently an empty string (copied from root.node.path).
-    newNode = create_node(rootNodeAddress, (int8_t *)root.node.path);
-
-    // Check if the node creation was successful.
-    if (newNode == NULL)
-    {
-        fprintf(stderr, "FATAL ERROR: Failed to create initial node. Exiting.\n");
-        return 1; // Exit with an error code if critical allocation fails.
-    }
-
-    printf("Successfully created a new Node under root.\n\n");
-
-    // --- Demonstrate Leaf Creation ---
-    printf("Attempting to create a new Leaf linked to the new Node...\n");
-    // Create a new leaf and link it to the newly created node.
-    // The 'west' parameter for create_leaf expects a Tree*, so we pass the newNode cast to Tree*.
-    // Provide a sample key and size for the leaf.
-    newLeaf = create_leaf((Node *)newNode, (uint8_t *)"sample_key", 10, 200 ); // Example key and size
-
-    // Check if the leaf creation was successful.
-    if (newLeaf == NULL)
-    {
-        fprintf(stderr, "FATAL ERROR: Failed to create initial leaf. Exiting.\n");
-        // Remember to free previously allocated memory if an error occurs.
-        free(newNode);
-        newNode = NULL;
-        return 1;
+    assert(block != NULL && "Error: Value block cannot be NULL for create_leaf_owned.");
+
+    return leaf_create(parent, key, count, NULL, block);
+}
+
+// First pass of create_leaf_batch: hashes every key into `hashes`, rejects keys
+// that already exist under the Node or repeat within the batch, and returns the
+// size of the arena block the batch needs in `bytes`. `*append` is set if the
+// keys are ascending and all sort after the Node's current tail, so that the
+// batch can be appended as a single run.
+static int8_t batch_prepare(Node *parent, const LeafSpec *specs, uint32_t count, uint32_t *hashes, size_t *bytes,
+                            int *append)
+{
+    Index seen;       // Keys of the batch checked so far.
+    uint16_t key_len, prev_len = 0;
+    uint32_t i;
+    int8_t status = NoError;
+
+    zero((uint8_t *)&seen, sizeof(Index));
+    *bytes = 0;
+    *append = 1;
+
+    for (i = 0; i < count && status == NoError; i++)
+    {
+        assert(specs[i].key != NULL && "Error: Leaf spec has a NULL key.");
+
+        key_len = key_length(specs[i].key);
+        if (i == 0)
+        {
+            *append = parent->tail == NULL || leaf_compare(parent->tail, specs[i].key, key_len) < 0;
+        }
+        else if (*append)
+        {
+            *append = key_compare(specs[i - 1].key, prev_len, specs[i].key, key_len) < 0;
+        }
+        prev_len = key_len;
+
+        hashes[i] = index_hash(specs[i].key, key_len);
+        if (index_find(&parent->index, hashes[i], leaf_matches, specs[i].key, key_len) != NULL ||
+            index_find(&seen, hashes[i], spec_matches, specs[i].key, key_len) != NULL)
+        {
+            errno = EEXIST;
+            status = -1;
+        }
+        else
+        {
+            // `seen` is private to this call, so its old tables can be freed at once.
+            status = index_insert(&seen, hashes[i], (void *)&specs[i], NULL);
+        }
+        *bytes += batch_leaf_bytes(key_len, specs[i].size);
     }
 
-    printf("Successfully created a new Leaf.\n\n");
+    index_release(&seen);
 
-    // --- Cleanup: Free Allocated Memory ---
-    // In a full database server, memory management would be more sophisticated
-    // (e.g., a garbage collector or a dedicated memory pool).
-    // For this simple example, we explicitly free the allocated nodes/leaves.
-    printf("--- Cleaning up allocated memory ---\n");
-    if (newLeaf != NULL)
+    return status;
+}
+
+int8_t create_leaf_batch(Node *parent, const LeafSpec *specs, uint32_t count)
+{
+    uint32_t *hashes;    // Index hash of every key in the batch.
+    uint32_t i;
+    uint16_t key_len;
+    size_t bytes, size;
+    uint8_t *cursor;     // Next free byte of the batch block.
+    Leaf *last, *first = NULL, *prev = NULL, *leaf;
+    int error, append;
+
+    // Pre-condition checks: A parent and the batch description are required.
+    assert(parent != NULL && "Error: Parent node cannot be NULL for create_leaf_batch.");
+    assert(parent->alloc != NULL && "Error: Parent node has no allocator.");
+    assert((specs != NULL || count == 0) && "Error: Leaf specs cannot be NULL for create_leaf_batch.");
+
+    if (count == 0)
+    {
+        return NoError;
+    }
+    if (node_ready(parent) != NoError)
+    {
+        return -1;
+    }
+
+    hashes = (uint32_t *)malloc((size_t)count * sizeof(uint32_t));
+    if (hashes == NULL)
+    {
+        retfail(ENOMEM);
+    }
+
+    // Validate the batch, grow the key index once for all of it (after which
+    // the inserts below cannot fail) and take one block for every leaf and
+    // value, before anything is published: a failing batch leaves the Node untouched.
+    cursor = NULL;
+    if (batch_prepare(parent, specs, count, hashes, &bytes, &append) == NoError &&
+        index_reserve(&parent->index, count, &parent->alloc->limbo) == NoError)
+    {
+        cursor = (uint8_t *)arena_alloc(&parent->values, bytes);
+    }
+    if (cursor == NULL)
+    {
+        error = errno;
+        free(hashes);
+        retfail(error);
+    }
+
+    // Build the leaves. An appendable batch is chained together as it goes;
+    // none of it is reachable yet, so plain stores are enough. Otherwise each
+    // leaf is published at its key's position as soon as it is complete.
+    last = find_last(parent);
+    for (i = 0; i < count; i++)
+    {
+        leaf = (Leaf *)cursor;
+        key_len = key_length(specs[i].key);
+        size = offsetof(Leaf, key) + key_len + 1;
+
+        zero((uint8_t *)leaf, offsetof(Leaf, key));
+        leaf->tag = TagLeaf;
+        leaf->flags = LeafArena;
+        memcpy(leaf->key, specs[i].key, key_len);
+        leaf->key[key_len] = '\0';
+        leaf->keylen = (uint8_t)key_len;
+
+        if (specs[i].size <= LeafInlineSize - size)
+        {
+            leaf->flags |= LeafInline;
+            leaf->value = leaf->key + key_len + 1;
+        }
+        else
+        {
+            leaf->value = cursor + align_up(size, sizeof(void *));
+        }
+        cursor += batch_leaf_bytes(key_len, specs[i].size);
+
+        if (specs[i].value != NULL)
+        {
+            memcpy(leaf->value, specs[i].value, specs[i].size);
+        }
+        else
+        {
+            zero(leaf->value, specs[i].size);
+        }
+        leaf->size = specs[i].size;
+
+        if (!append)
+        {
+            index_insert(&parent->index, hashes[i], leaf, &parent->alloc->limbo);
+            skip_insert(parent, leaf, hashes[i]);
+            continue;
+        }
+
+        // The first leaf of the batch follows the current tail (or the Node itself).
+        if (prev == NULL)
+        {
+            first = leaf;
+            leaf->west = last == NULL ? (Tree *)parent : (Tree *)last;
+        }
+        else
+        {
+            leaf->west = (Tree *)prev;
+            prev->east = leaf;
+        }
+        prev = leaf;
+    }
+
+    // Make every leaf of an appendable batch reachable by key, then publish
+    // the whole chain at the end of the 'east' list with a single store and
+    // give it its towers.
+    if (append)
+    {
+        for (i = 0, leaf = first; i < count; i++, leaf = leaf->east)
+        {
+            index_insert(&parent->index, hashes[i], leaf, &parent->alloc->limbo);
+        }
+        if (last == NULL)
+        {
+            store_ptr(parent->east, first);
+        }
+        else
+        {
+            store_ptr(last->east, first);
+        }
+        parent->tail = prev;
+        skip_append_run(parent, first, NULL);
+    }
+    __atomic_store_n(&parent->count, parent->count + count, __ATOMIC_RELAXED);
+
+    free(hashes);
+    metric_count(MetricLeafBatch);
+    trace(TraceDebug, "create_leaf_batch: %llu leaves under node %#llx", count, (uintptr_t)parent);
+
+    return NoError;
+}
+
+// Maintenance state (see reaper_start).
+static uint8_t reaper_running = 0;
+
+// The expiry clock (see expire_tick), started and stopped with the reaper.
+static pthread_t expire_thread;
+static pthread_mutex_t expire_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t expire_wake = PTHREAD_COND_INITIALIZER;
+static uint8_t expire_stopping = 0;
+
+// Returns the shard an allocator belongs to. Only shard allocators run in the
+// background, so only call this when `alloc->background` is set.
+static Shard *shard_of(Allocator *alloc)
+{
+    return (Shard *)((uint8_t *)alloc - offsetof(Shard, alloc));
+}
+
+// Returns the shard an allocator belongs to, or NULL for the allocator of a
+// standalone tree.
+static Shard *shard_owning(Allocator *alloc)
+{
+    uintptr_t at = (uintptr_t)alloc - (uintptr_t)&shards[0].alloc;
+
+    return at < sizeof(shards) && at % sizeof(Shard) == 0 ? &shards[at / sizeof(Shard)] : NULL;
+}
+
+// Asks for a maintenance pass of the shard. Only one pass is queued or
+// running at a time; a request made during a pass makes it go round again.
+static void maintenance_request(Shard *shard)
+{
+    __atomic_add_fetch(&shard->requests, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_exchange_n(&shard->maintaining, 1, __ATOMIC_SEQ_CST))
+    {
+        pool_submit(&shard->maintenance, (uint32_t)(shard - shards));
+    }
+}
+
+// Queues a Node for index compaction if a delete left either of its indexes
+// sparse. The caller holds the shard's writer lock.
+static void compact_request(Node *node)
+{
+    Shard *shard;
+
+    if (!node->alloc->background || (node->flags & NodeCompact) ||
+        (!index_sparse(&node->index) && !index_sparse(&node->children)))
+    {
+        return;
+    }
+    shard = shard_of(node->alloc);
+    if (shard->compact_count == ShardCompactMax)
+    {
+        return; // The node gets another chance at its next delete.
+    }
+    node->flags |= NodeCompact;
+    shard->compact[shard->compact_count++] = node;
+    maintenance_request(shard);
+}
+
+// Takes a Node that is about to be freed off its shard's compaction list.
+static void compact_forget(Node *node)
+{
+    Shard *shard = shard_of(node->alloc);
+    uint32_t i;
+
+    for (i = 0; i < shard->compact_count; i++)
+    {
+        if (shard->compact[i] == node)
+        {
+            shard->compact[i] = shard->compact[--shard->compact_count];
+            break;
+        }
+    }
+    node->flags &= ~NodeCompact;
+}
+
+Leaf *find_leaf(Node *parent, uint8_t *key)
+{
+    Leaf *leaf;
+    uint16_t key_len;
+
+    // Pre-condition checks: Both the node and the key must be valid.
+    assert(parent != NULL && "Error: Parent node cannot be NULL for find_leaf.");
+    assert(key != NULL && "Error: Key cannot be NULL for find_leaf.");
+
+    if (node_ready(parent) != NoError)
+    {
+        return NULL;
+    }
+
+    key_len = key_length(key);
+    leaf = (Leaf *)index_find(&parent->index, index_hash(key, key_len), leaf_matches, key, key_len);
+    if (leaf != NULL && leaf_expired(leaf, 0))
+    {
+        // Gone as far as readers are concerned; the next writer of the key or
+        // the shard's wheel deletes it.
+        errno = NoError;
+        return NULL;
+    }
+    if (leaf != NULL)
+    {
+        leaf_touch(leaf);
+    }
+
+    return leaf;
+}
+
+int leaf_expired(const Leaf *leaf, uint32_t now)
+{
+    uint32_t expires = __atomic_load_n(&leaf->expires, __ATOMIC_RELAXED);
+
+    if (expires == ExpireNever)
+    {
+        return 0;
+    }
+
+    return expires <= (now != 0 ? now : expire_clock());
+}
+
+// Returns the path of a Node from its shard root ("/a/b"), built back to
+// front into a malloc'd string, and its length in `*len`; or NULL with errno
+// set to ENOMEM.
+static char *node_path(const Node *node, size_t *len)
+{
+    const Node *at;
+    char *path;
+    size_t end = 0, seg;
+
+    for (at = node; at->tag != TagRoot; at = at->north)
+    {
+        end += 1 + strnlen((const char *)at->path, PathSegmentMax);
+    }
+    path = (char *)malloc(end + 1);
+    if (path == NULL)
+    {
+        reterr(ENOMEM);
+    }
+    *len = end;
+    path[end] = '\0';
+    for (at = node; at->tag != TagRoot; at = at->north)
+    {
+        seg = strnlen((const char *)at->path, PathSegmentMax);
+        end -= seg;
+        memcpy(path + end, at->path, seg);
+        path[--end] = '/';
+    }
+
+    return path;
+}
+
+int8_t expire_post(Node *node)
+{
+    Shard *shard;
+    Timer *timer;
+    Leaf *leaf;
+    char *path;
+    size_t len;
+    int8_t status = NoError;
+
+    assert(node != NULL && "Error: Node cannot be NULL for expire_post.");
+
+    // Timers name the Node by its path from the shard root.
+    path = node_path(node, &len);
+    if (path == NULL)
+    {
+        return -1;
+    }
+
+    shard = shard_of(node->alloc);
+    for (leaf = node->east; leaf != NULL; leaf = leaf->east)
+    {
+        if (leaf->expires == ExpireNever)
+        {
+            continue;
+        }
+        timer = timer_new(path, len, leaf->key, leaf->keylen, leaf->expires);
+        if (timer == NULL)
+        {
+            status = -1; // The leaf still expires, lazily.
+            continue;
+        }
+        wheel_post(&shard->wheel, timer);
+    }
+    free(path);
+
+    return status;
+}
+
+int8_t delete_leaf(Node *parent, uint8_t *key)
+{
+    Leaf *leaf;
+    uint16_t key_len;
+    uint32_t hash;
+    int expired;
+
+    // Pre-condition checks: Both the node and the key must be valid.
+    assert(parent != NULL && "Error: Parent node cannot be NULL for delete_leaf.");
+    assert(key != NULL && "Error: Key cannot be NULL for delete_leaf.");
+
+    if (node_ready(parent) != NoError)
     {
-        printf("  Freeing newLeaf at %p\n", (void *)newLeaf);
-        free(newLeaf);
-        newLeaf = NULL;
+        return -1;
     }
-    if (newNode != NULL)
+
+    key_len = key_length(key);
+    hash = index_hash(key, key_len);
+    leaf = (Leaf *)index_find(&parent->index, hash, leaf_matches, key, key_len);
+    if (leaf == NULL)
     {
-        printf("  Freeing newNode at %p\n", (void *)newNode);
-        free(newNode);
-        newNode = NULL;
+        retfail(ENOENT);
     }
-    printf("------------------------------------\n");
+    expired = leaf_expired(leaf, 0);
 
-    return 0; // Program executed successfully.
-}
\ No newline at end of file
+    index_remove(&parent->index, hash, leaf);
+    skip_remove(parent, leaf, hash);
+
+    // Unlink from the predecessor, which is either the parent Node or a Leaf.
+    // The leaf keeps its own 'east' link, so a reader standing on it can still
+    // move on to the rest of the list.
+    if ((Node *)leaf->west == parent)
+    {
+        store_ptr(parent->east, leaf->east);
+    }
+    else
+    {
+        store_ptr(leaf->west->leaf.east, leaf->east);
+    }
+
+    // Unlink from the successor, or move the cached tail back if this was the last leaf.
+    if (leaf->east != NULL)
+    {
+        store_ptr(leaf->east->west, leaf->west);
+    }
+    else
+    {
+        parent->tail = ((Node *)leaf->west == parent) ? NULL : &leaf->west->leaf;
+    }
+    __atomic_store_n(&parent->count, parent->count - 1, __ATOMIC_RELAXED);
+
+    // Readers may still be looking at the leaf; free it after their grace period.
+    limbo_retire(&parent->alloc->limbo, leaf, reclaim_leaf, parent->alloc);
+    compact_request(parent);
+    metric_count(MetricDeleteLeaf);
+    trace(TraceDebug, "delete_leaf: leaf %#llx from node %#llx", (uintptr_t)leaf, (uintptr_t)parent);
+
+    // An expired leaf is deleted all the same, but it was already gone.
+    if (expired)
+    {
+        retfail(ENOENT);
+    }
+
+    return NoError;
+}
+
+uint32_t leaf_read_begin(const Leaf *leaf, const uint8_t **value, uint32_t *size, uint8_t *flags)
+{
+    uint32_t version;
+
+    assert(leaf != NULL && value != NULL && size != NULL && "Error: Leaf and outputs cannot be NULL for leaf_read_begin.");
+
+    for (;;)
+    {
+        // Updates only hold the version odd for a memcpy, so just spin.
+        version = __atomic_load_n(&leaf->version, __ATOMIC_ACQUIRE);
+        if (version & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        // A pointer and size from different updates could overrun the
+        // storage, so they are validated before the caller follows them.
+        *value = __atomic_load_n(&leaf->value, __ATOMIC_RELAXED);
+        *size = __atomic_load_n(&leaf->size, __ATOMIC_RELAXED);
+        if (flags != NULL)
+        {
+            *flags = __atomic_load_n(&leaf->flags, __ATOMIC_RELAXED);
+        }
+        if (!leaf_read_retry(leaf, version))
+        {
+            return version;
+        }
+    }
+}
+
+int leaf_read_retry(const Leaf *leaf, uint32_t version)
+{
+    // The value reads before the fence cannot move after the version check.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&leaf->version, __ATOMIC_RELAXED) != version;
+}
+
+// Value bytes rewritten in place are read and written like the fields of a
+// trace event (see trace.c): through relaxed atomics, so that the race the
+// seqlock tolerates stays a benign one. A reader may still copy a mix of old
+// and new bytes, which leaf_read_retry then throws away. Words are moved
+// whole where the shared side is aligned, so a copy costs about a memcpy.
+typedef uint64_t __attribute__((may_alias)) ValueWord;
+
+// Copies `size` value bytes that an update may be rewriting into `dst`.
+static void value_load(uint8_t *dst, const uint8_t *src, uint32_t size)
+{
+    ValueWord word;
+    uint32_t i = 0;
+
+    for (; i < size && ((uintptr_t)(src + i) & (sizeof(word) - 1)) != 0; i++)
+    {
+        dst[i] = __atomic_load_n(src + i, __ATOMIC_RELAXED);
+    }
+    for (; i + sizeof(word) <= size; i += sizeof(word))
+    {
+        word = __atomic_load_n((const ValueWord *)(src + i), __ATOMIC_RELAXED);
+        memcpy(dst + i, &word, sizeof(word));
+    }
+    for (; i < size; i++)
+    {
+        dst[i] = __atomic_load_n(src + i, __ATOMIC_RELAXED);
+    }
+}
+
+// Rewrites `count` value bytes that readers may be copying with `src` (which
+// may overlap them, as with memmove), or with zeros if `src` is NULL.
+static void value_store(uint8_t *dst, const uint8_t *src, uint32_t count)
+{
+    ValueWord word = 0;
+    uint32_t i = 0;
+
+    if (src != NULL && src < dst && src + count > dst)
+    {
+        // Backwards, so that every source byte is read before it is overwritten.
+        while (count-- > 0)
+        {
+            __atomic_store_n(dst + count, src[count], __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    for (; i < count && ((uintptr_t)(dst + i) & (sizeof(word) - 1)) != 0; i++)
+    {
+        __atomic_store_n(dst + i, src != NULL ? src[i] : 0, __ATOMIC_RELAXED);
+    }
+    for (; i + sizeof(word) <= count; i += sizeof(word))
+    {
+        if (src != NULL)
+        {
+            memcpy(&word, src + i, sizeof(word));
+        }
+        __atomic_store_n((ValueWord *)(dst + i), word, __ATOMIC_RELAXED);
+    }
+    for (; i < count; i++)
+    {
+        __atomic_store_n(dst + i, src != NULL ? src[i] : 0, __ATOMIC_RELAXED);
+    }
+}
+
+int8_t value_copy(uint8_t *dst, const uint8_t *value, uint32_t size, uint8_t flags)
+{
+    const PackedValue *packed;
+
+    if (!(flags & LeafPacked))
+    {
+        value_load(dst, value, size);
+        return NoError;
+    }
+
+    // A packed block is never rewritten, so it cannot tear under the decompressor.
+    packed = (const PackedValue *)value;
+    return codec_decompress(packed->data, packed->len, dst, size, packed->dict);
+}
+
+// ReclaimFn for the heap blocks that update_leaf switched a leaf away from;
+// `ctx` is the Allocator they are charged to.
+static void reclaim_block(void *ctx, void *ptr)
+{
+    meter_sub(&((Allocator *)ctx)->bytes, block_bytes((ValueBlock *)ptr));
+    value_unref((ValueBlock *)ptr);
+}
+
+// Returns how many value bytes a leaf's current storage can take without
+// moving: the rest of its size class when inline, the block capacity on the
+// heap, and the old size in an arena (nothing more of it is known to be free).
+static uint32_t value_capacity(const Leaf *leaf)
+{
+    if (leaf->flags & (LeafMapped | LeafPacked))
+    {
+        return 0; // The snapshot mapping is read-only, and a packed value is rewritten whole.
+    }
+    if (leaf->flags & LeafHeap)
+    {
+        return value_block(leaf->value)->capacity;
+    }
+    if ((leaf->flags & LeafInline) && !(leaf->flags & LeafArena))
+    {
+        return (uint32_t)(leaf_class_size(leaf->sclass) - (offsetof(Leaf, key) + leaf->keylen + 1));
+    }
+
+    return leaf->size;
+}
+
+// Shared body of update_leaf, update_leaf_cas and store_write: gives `leaf` a
+// new value (see update_leaf). An `owned` block is used instead of `value`,
+// adopted unless the value goes inline, and consumed only on success.
+static int8_t leaf_update(Node *parent, Leaf *leaf, uint32_t count, uint8_t *value, ValueBlock *owned)
+{
+    const uint8_t *src = owned != NULL ? owned->data : value;
+    ValueBlock *block, *old = NULL, *packed;
+    uint8_t *storage;
+    uint8_t flags;
+    uint32_t version = leaf->version; // Only writers change it, and they are serialized.
+
+    // A value the Node compresses always gets new storage.
+    packed = value_pack(parent, src, count);
+
+    // In place: announce the write, then make sure no view pins a heap block.
+    // Pinning (leaf_view) takes its reference before checking the version,
+    // so one of the two sides always sees the other.
+    if (packed == NULL && count <= value_capacity(leaf) && !(leaf->flags & (LeafMapped | LeafPacked)) &&
+        (owned == NULL || (leaf->flags & LeafInline)))
+    {
+        __atomic_store_n(&leaf->version, version + 1, __ATOMIC_SEQ_CST);
+        if (!(leaf->flags & LeafHeap) || __atomic_load_n(&value_block(leaf->value)->refs, __ATOMIC_SEQ_CST) == 1)
+        {
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            value_store(leaf->value, src, count);
+            __atomic_store_n(&leaf->size, count, __ATOMIC_RELAXED);
+            __atomic_store_n(&leaf->version, version + 2, __ATOMIC_RELEASE);
+
+            if (owned != NULL)
+            {
+                value_unref(owned);
+            }
+            metric_count(MetricUpdateLeaf);
+            metric_count(MetricUpdateInPlace);
+            return NoError;
+        }
+
+        // Pinned: nothing was written, but a reader may have seen the odd
+        // version; move it on and switch storage instead.
+        version += 2;
+        __atomic_store_n(&leaf->version, version, __ATOMIC_RELEASE);
+    }
+
+    // New storage, picked as leaf_create does, filled before anything changes.
+    if (packed != NULL)
+    {
+        flags = LeafHeap | LeafPacked;
+        storage = packed->data;
+    }
+    else if (owned != NULL)
+    {
+        flags = LeafHeap;
+        storage = owned->data;
+    }
+    else if (count <= ArenaSmallValue && __atomic_load_n(&max_memory, __ATOMIC_RELAXED) == 0)
+    {
+        flags = 0;
+        storage = (uint8_t *)arena_alloc(&parent->values, count);
+    }
+    else
+    {
+        flags = LeafHeap;
+        block = value_alloc(count);
+        storage = block != NULL ? block->data : NULL;
+    }
+    if (storage == NULL)
+    {
+        retfail(ENOMEM);
+    }
+    if (packed == NULL && owned == NULL && src != NULL)
+    {
+        memcpy(storage, src, count);
+    }
+    else if (packed == NULL && owned == NULL)
+    {
+        zero(storage, count);
+    }
+    if (leaf->flags & LeafHeap)
+    {
+        old = value_block(leaf->value);
+    }
+
+    __atomic_store_n(&leaf->version, version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&leaf->value, storage, __ATOMIC_RELAXED);
+    __atomic_store_n(&leaf->size, count, __ATOMIC_RELAXED);
+    __atomic_store_n(&leaf->flags, (uint8_t)((leaf->flags & LeafArena) | flags), __ATOMIC_RELAXED);
+    __atomic_store_n(&leaf->version, version + 2, __ATOMIC_RELEASE);
+    if (flags & LeafHeap)
+    {
+        meter_add(&parent->alloc->bytes, block_bytes(value_block(storage)));
+    }
+
+    // Readers may still be copying out of the old block (or sending from it).
+    if (old != NULL)
+    {
+        limbo_retire(&parent->alloc->limbo, old, reclaim_block, parent->alloc);
+    }
+    if (packed != NULL && owned != NULL)
+    {
+        value_unref(owned); // Its bytes were compressed into `packed`.
+    }
+    metric_count(MetricUpdateLeaf);
+
+    return NoError;
+}
+
+int8_t update_leaf(Node *parent, uint8_t *key, uint32_t count, uint8_t *value)
+{
+    Leaf *leaf;
+
+    // Pre-condition checks: Both the node and the key must be valid.
+    assert(parent != NULL && "Error: Parent node cannot be NULL for update_leaf.");
+    assert(key != NULL && "Error: Key cannot be NULL for update_leaf.");
+
+    leaf = find_leaf(parent, key);
+    if (leaf == NULL)
+    {
+        retfail(errno == NoError ? ENOENT : errno);
+    }
+
+    return leaf_update(parent, leaf, count, value, NULL);
+}
+
+int8_t update_leaf_cas(Node *parent, uint8_t *key, uint32_t *version, uint32_t count, uint8_t *value)
+{
+    Leaf *leaf;
+
+    // Pre-condition checks: The node, the key and the expected version must be valid.
+    assert(parent != NULL && "Error: Parent node cannot be NULL for update_leaf_cas.");
+    assert(key != NULL && "Error: Key cannot be NULL for update_leaf_cas.");
+    assert(version != NULL && "Error: Version cannot be NULL for update_leaf_cas.");
+
+    leaf = find_leaf(parent, key);
+    if (leaf == NULL)
+    {
+        retfail(errno == NoError ? ENOENT : errno);
+    }
+    if (leaf->version != *version)
+    {
+        *version = leaf->version;
+        retfail(ECANCELED);
+    }
+    if (leaf_update(parent, leaf, count, value, NULL) != NoError)
+    {
+        return -1;
+    }
+    *version = leaf->version;
+
+    return NoError;
+}
+
+// Frees a single Node together with its leaves, without touching its children.
+static void drop_node(Node *node)
+{
+    Allocator *alloc = node->alloc;
+    Leaf *leaf, *next_leaf;
+
+    // Small values live in the node's arena and go away with it in one step;
+    // only large values and the leaves themselves are returned individually.
+    for (leaf = node->east; leaf != NULL; leaf = next_leaf)
+    {
+        next_leaf = leaf->east;
+        value_free(alloc, leaf);
+        if (!(leaf->flags & LeafArena))
+        {
+            slab_free(&alloc->leaves[leaf->sclass], leaf);
+        }
+    }
+
+    if (node->flags & NodeCompact)
+    {
+        compact_forget(node);
+    }
+    skip_release(node);
+    arena_release(&node->values);
+    index_release(&node->index);
+    index_release(&node->children);
+    free(node->dict); // Its packed values went with the leaves above.
+    free(node->samples);
+    if (node->flags & NodeHeap)
+    {
+        meter_sub(&alloc->bytes, sizeof(Node));
+        free(node);
+    }
+    else
+    {
+        slab_free(&alloc->nodes, node);
+    }
+}
+
+// Frees `top` and every Node below it. Pending nodes are kept on an explicit
+// stack rather than the call stack, so arbitrarily deep or wide subtrees are
+// fine; only if that stack cannot grow does a child get dropped recursively.
+static void drop_nodes(Node *top)
+{
+    Node *local[64];
+    Node **stack = local, **grown;
+    uint32_t depth = 0, capacity = 64, cursor;
+    Node *node, *child;
+
+    stack[depth++] = top;
+    while (depth > 0)
+    {
+        node = stack[--depth];
+
+        // Queue the children before the node (and its child table) is freed.
+        cursor = 0;
+        while ((child = (Node *)index_next(&node->children, &cursor)) != NULL)
+        {
+            if (depth == capacity)
+            {
+                grown = (Node **)malloc(2 * capacity * sizeof(Node *));
+                if (grown == NULL)
+                {
+                    drop_nodes(child);
+                    continue;
+                }
+                memcpy(grown, stack, depth * sizeof(Node *));
+                if (stack != local)
+                {
+                    free(stack);
+                }
+                stack = grown;
+                capacity *= 2;
+            }
+            stack[depth++] = child;
+        }
+
+        drop_node(node);
+    }
+
+    if (stack != local)
+    {
+        free(stack);
+    }
+}
+
+// ReclaimFn for subtrees detached by drop_subtree; `ctx` is the owning
+// Allocator. Runs under the shard's writer lock once the grace period is over.
+static void reclaim_subtree(void *ctx, void *ptr)
+{
+    Allocator *alloc = (Allocator *)ctx;
+    Node *node = (Node *)ptr;
+
+    if (alloc->background)
+    {
+        // Nothing can reach the subtree any more, so its parent link is free
+        // to queue it for the reaper.
+        node->north = alloc->reap;
+        alloc->reap = node;
+        maintenance_request(shard_of(alloc));
+        return;
+    }
+
+    drop_nodes(node);
+}
+
+// Frees up to `budget` objects of the subtrees queued for the reaper, and
+// returns how many it freed. A Node whose leaves take more than one slice
+// stays at the front of the queue with the rest of its leaves. The caller
+// holds the shard's writer lock.
+static size_t reap_some(Allocator *alloc, size_t budget)
+{
+    Node *node, *child;
+    Leaf *leaf;
+    uint32_t cursor;
+    size_t done = 0;
+
+    while (alloc->reap != NULL && done < budget)
+    {
+        node = alloc->reap;
+        alloc->reap = node->north;
+
+        // Queue the children and forget them, so a Node taking several
+        // slices queues them only once.
+        cursor = 0;
+        while ((child = (Node *)index_next(&node->children, &cursor)) != NULL)
+        {
+            child->north = alloc->reap;
+            alloc->reap = child;
+        }
+        index_release(&node->children);
+
+        while (done < budget && (leaf = node->east) != NULL)
+        {
+            node->east = leaf->east;
+            value_free(alloc, leaf);
+            if (!(leaf->flags & LeafArena))
+            {
+                slab_free(&alloc->leaves[leaf->sclass], leaf);
+            }
+            done++;
+        }
+        if (node->east == NULL)
+        {
+            done += skip_release_some(node, budget - done);
+        }
+
+        if (node->east != NULL || node->skip != NULL)
+        {
+            node->north = alloc->reap; // Out of budget: resume here next time.
+            alloc->reap = node;
+        }
+        else
+        {
+            drop_node(node);
+            done++;
+        }
+    }
+
+    return done;
+}
+
+void drop_subtree(Node *node)
+{
+    Allocator *alloc;
+    Shard *shard;
+    Node *parent, *at;
+
+    // Pre-condition checks: Only nodes created by create_node can be dropped.
+    assert(node != NULL && "Error: Node cannot be NULL for drop_subtree.");
+    assert(node->tag != TagRoot && "Error: The root node cannot be dropped.");
+
+    // Detach the subtree from its parent first so it is no longer reachable,
+    // then free it once no reader can still be walking it.
+    if (node->north != NULL)
+    {
+        index_remove(&node->north->children, path_hash(node->path), node);
+    }
+    metric_count(MetricDropSubtree);
+    trace(TraceDebug, "drop_subtree: node %#llx under parent %#llx", (uintptr_t)node, (uintptr_t)node->north);
+
+    // A CLOCK hand inside the subtree starts over from the root.
+    shard = shard_owning(node->alloc);
+    for (at = shard != NULL ? shard->hand : NULL; at != NULL; at = at->north)
+    {
+        if (at == node)
+        {
+            shard->hand = NULL;
+            shard->hand_len = 0;
+            break;
+        }
+    }
+
+    // The node may be freed (or queued for the reaper) as soon as it is retired.
+    alloc = node->alloc;
+    parent = node->north;
+    limbo_retire(&alloc->limbo, node, reclaim_subtree, alloc);
+    if (alloc->background)
+    {
+        maintenance_request(shard_of(alloc)); // Let the reaper start on the grace period.
+    }
+    if (parent != NULL)
+    {
+        compact_request(parent);
+    }
+}
+
+int8_t delete_node(Node *parent, int8_t *segment)
+{
+    Node *node;
+
+    // Pre-condition checks: Both the node and the segment must be valid.
+    assert(parent != NULL && "Error: Parent node cannot be NULL for delete_node.");
+    assert(segment != NULL && "Error: Path segment cannot be NULL for delete_node.");
+
+    errno = NoError;
+    node = find_node(parent, segment);
+    if (node == NULL)
+    {
+        retfail(errno == NoError ? ENOENT : errno);
+    }
+    drop_subtree(node);
+
+    return NoError;
+}
+
+Node *find_node(Node *parent, int8_t *segment)
+{
+    uint16_t len;
+
+    // Pre-condition checks: Both the node and the segment must be valid.
+    assert(parent != NULL && "Error: Parent node cannot be NULL for find_node.");
+    assert(segment != NULL && "Error: Path segment cannot be NULL for find_node.");
+
+    // A Node restored from a snapshot loads its children on first use.
+    if (node_ready(parent) != NoError)
+    {
+        return NULL;
+    }
+
+    len = (uint16_t)strnlen((char *)segment, PathSegmentMax);
+    return (Node *)index_find(&parent->children, index_hash((uint8_t *)segment, len),
+                              node_matches, (uint8_t *)segment, len);
+}
+
+Node *resolve_path(Node *root, const char *path)
+{
+    Node *node = root;
+    const char *segment, *end;
+    uint16_t len;
+
+    // Pre-condition checks: Both the starting node and the path must be valid.
+    assert(root != NULL && "Error: Root node cannot be NULL for resolve_path.");
+    assert(path != NULL && "Error: Path cannot be NULL for resolve_path.");
+
+    // Walk one '/'-separated segment at a time; empty segments ("//", leading
+    // or trailing '/') are skipped. Each level is a single hashed lookup.
+    for (segment = path; *segment != '\0'; segment = end)
+    {
+        while (*segment == '/')
+        {
+            segment++;
+        }
+        if (*segment == '\0')
+        {
+            break;
+        }
+
+        end = strchr(segment, '/');
+        if (end == NULL)
+        {
+            end = segment + strlen(segment);
+        }
+        if (end - segment > PathSegmentMax)
+        {
+            reterr(ENAMETOOLONG);
+        }
+
+        if (node_ready(node) != NoError)
+        {
+            return NULL;
+        }
+
+        len = (uint16_t)(end - segment);
+        node = (Node *)index_find(&node->children, index_hash((const uint8_t *)segment, len),
+                                  node_matches, (const uint8_t *)segment, len);
+        if (node == NULL)
+        {
+            reterr(NoError);
+        }
+    }
+
+    return node;
+}
+
+/**
+ * @brief The shards of the in-memory database.
+ *
+ * The keyspace is partitioned by top-level path segment: every shard is an
+ * independent tree with its own root, allocator and writer lock, so writes to
+ * different shards never contend.
+ */
+Shard shards[ShardCount];
+
+// Compacts the indexes of up to `budget` Nodes of the shard's compaction
+// list. The caller holds the shard's writer lock.
+static void compact_some(Shard *shard, uint32_t budget)
+{
+    Node *node;
+
+    while (shard->compact_count > 0 && budget-- > 0)
+    {
+        node = shard->compact[--shard->compact_count];
+        node->flags &= ~NodeCompact;
+
+        // Failing to allocate the smaller table leaves the index as it was.
+        index_compact(&node->index, &shard->alloc.limbo);
+        index_compact(&node->children, &shard->alloc.limbo);
+        metric_count(MetricCompact);
+    }
+}
+
+size_t leaf_cost(const Leaf *leaf)
+{
+    size_t cost = 0;
+
+    assert(leaf != NULL && "Error: Leaf cannot be NULL for leaf_cost.");
+
+    if (!(leaf->flags & LeafArena))
+    {
+        cost += leaf_class_size(leaf->sclass);
+    }
+    if (leaf->flags & LeafHeap)
+    {
+        cost += block_bytes(value_block(leaf->value));
+    }
+
+    return cost;
+}
+
+size_t node_cost(const Node *node)
+{
+    size_t cost;
+
+    assert(node != NULL && "Error: Node cannot be NULL for node_cost.");
+
+    cost = (node->flags & NodeHeap) ? sizeof(Node) : node->alloc->nodes.object_size;
+    cost += node->values.bytes;
+    if (node->index.table != NULL)
+    {
+        cost += sizeof(IndexTable) + node->index.table->capacity * (sizeof(uint32_t) + sizeof(void *));
+    }
+    if (node->children.table != NULL)
+    {
+        cost += sizeof(IndexTable) + node->children.table->capacity * (sizeof(uint32_t) + sizeof(void *));
+    }
+
+    return cost;
+}
+
+void memory_limit(size_t bytes, uint8_t policy)
+{
+    assert((policy == EvictNone || policy == EvictClock) && "Error: Unknown eviction policy.");
+
+    __atomic_store_n(&evict_policy, policy, __ATOMIC_RELAXED);
+    __atomic_store_n(&max_memory, bytes, __ATOMIC_RELAXED);
+    trace(TraceInfo, "memory_limit: %llu bytes, policy %llu", bytes, policy);
+}
+
+size_t memory_used(void)
+{
+    size_t used = 0;
+    uint32_t i;
+
+    for (i = 0; i < ShardCount; i++)
+    {
+        used += __atomic_load_n(&shards[i].alloc.bytes, __ATOMIC_RELAXED);
+    }
+
+    return used;
+}
+
+size_t memory_max(void)
+{
+    return __atomic_load_n(&max_memory, __ATOMIC_RELAXED);
+}
+
+// Returns how many bytes memory is over the limit (0 without a limit).
+static size_t memory_over(void)
+{
+    size_t limit = memory_max(), used;
+
+    if (limit == 0)
+    {
+        return 0;
+    }
+    used = memory_used();
+
+    return used > limit ? used - limit : 0;
+}
+
+// Returns the Node after `node` in the depth-first order the CLOCK hand
+// sweeps a shard in: its first child, else the next sibling of the nearest
+// ancestor (itself included) that has one, else the root again. Nodes still
+// waiting to be loaded from the snapshot are passed over with their subtree.
+static Node *evict_next(Node *node)
+{
+    Node *child, *parent;
+    uint32_t cursor = 0;
+
+    if (load_ptr(node->pending) == NULL && (child = (Node *)index_next(&node->children, &cursor)) != NULL)
+    {
+        return child;
+    }
+    for (; node->tag != TagRoot; node = parent)
+    {
+        parent = node->north;
+        cursor = index_cursor(&parent->children, path_hash(node->path), node);
+        if ((child = (Node *)index_next(&parent->children, &cursor)) != NULL)
+        {
+            return child;
+        }
+    }
+
+    return node;
+}
+
+// Moves the CLOCK hand of the shard on, evicting until `want` bytes (by
+// leaf_cost) are released or EvictSlice leaves and Nodes have been visited,
+// and returns the bytes released. A leaf used since the hand last went by
+// gets its bit cleared and stays; an expired one goes whatever its bit.
+// Evictions are logged as deletes, so a restart does not bring the leaves
+// back. The caller holds the shard's writer lock.
+static size_t evict_some(Shard *shard, size_t want)
+{
+    Node *node = shard->hand != NULL ? shard->hand : &shard->root.node;
+    Leaf *leaf = NULL, *next;
+    Cursor cursor;
+    char *path = NULL;
+    size_t path_len, released = 0, cost;
+    uint32_t visits = 0, now = expire_clock();
+
+    if (load_ptr(node->pending) == NULL)
+    {
+        leaf = shard->hand_len > 0 ? cursor_seek(&cursor, node, shard->hand_key, shard->hand_len) : node->east;
+    }
+    while (released < want && visits++ < EvictSlice)
+    {
+        if (leaf == NULL)
+        {
+            free(path);
+            path = NULL;
+            node = evict_next(node);
+            leaf = load_ptr(node->pending) == NULL ? node->east : NULL;
+            continue;
+        }
+
+        next = leaf->east;
+        cost = leaf_cost(leaf);
+        if (cost == 0 || (__atomic_load_n(&leaf->referenced, __ATOMIC_RELAXED) && !leaf_expired(leaf, now)))
+        {
+            __atomic_store_n(&leaf->referenced, 0, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            // The WAL only needs the path once per Node.
+            if (path == NULL && (path = node_path(node, &path_len)) == NULL)
+            {
+                break;
+            }
+            wal_append(WalDel, path, leaf->key, leaf->keylen, NULL, 0);
+            delete_leaf(node, leaf->key);
+            released += cost;
+            metric_count(MetricEvict);
+        }
+        leaf = next;
+    }
+    free(path);
+
+    // Park the hand on the leaf it stopped at, or on the next Node.
+    if (leaf == NULL)
+    {
+        node = evict_next(node);
+    }
+    shard->hand = node;
+    shard->hand_len = leaf != NULL ? leaf->keylen : 0;
+    if (leaf != NULL)
+    {
+        memcpy(shard->hand_key, leaf->key, leaf->keylen);
+    }
+
+    return released;
+}
+
+// Makes room for a write to the shard while memory is over the limit: under
+// EvictClock by evicting from the shard itself, and, if that is not enough,
+// by waking the maintenance of every shard to evict the rest; under EvictNone
+// by refusing the write with ENOMEM. The caller holds the shard's writer lock.
+static int8_t memory_reserve(Shard *shard)
+{
+    size_t over = memory_over();
+    uint32_t i;
+
+    if (over == 0)
+    {
+        return NoError;
+    }
+    if (__atomic_load_n(&evict_policy, __ATOMIC_RELAXED) == EvictNone)
+    {
+        retfail(ENOMEM);
+    }
+
+    if (evict_some(shard, over) < over && __atomic_load_n(&reaper_running, __ATOMIC_ACQUIRE))
+    {
+        for (i = 0; i < ShardCount; i++)
+        {
+            maintenance_request(&shards[i]);
+        }
+    }
+    // Give the evicted memory back as soon as no reader can still see it.
+    limbo_reclaim(&shard->alloc.limbo);
+
+    return NoError;
+}
+
+// TimerFire of the shard wheels; `ctx` is the Shard, whose writer lock is
+// held. Deletes the leaf the timer names if it has expired, waits again if
+// its expiry was moved later, and drops the timer if the leaf is gone or no
+// longer expires.
+static void expire_fire(void *ctx, Timer *timer, uint32_t now)
+{
+    Shard *shard = (Shard *)ctx;
+    uint8_t *key = (uint8_t *)timer->text + timer->path_len + 1;
+    Node *node;
+    Leaf *leaf = NULL;
+    uint32_t expires = ExpireNever;
+
+    node = resolve_path(&shard->root.node, timer->text);
+    if (node != NULL && node_ready(node) == NoError)
+    {
+        // Not find_leaf, which hides the very leaves looked for here.
+        leaf = (Leaf *)index_find(&node->index, index_hash(key, timer->key_len), leaf_matches, key, timer->key_len);
+    }
+    if (leaf != NULL)
+    {
+        expires = leaf->expires;
+    }
+
+    if (expires != ExpireNever && expires > now)
+    {
+        timer->due = expires;
+        wheel_add(&shard->wheel, timer);
+        return;
+    }
+    if (expires != ExpireNever)
+    {
+        // Unlinked at once; the memory goes back to the slab after the grace period.
+        delete_leaf(node, key);
+        metric_count(MetricExpire);
+    }
+    free(timer);
+}
+
+// The expiry clock thread: every ExpireTickMs, asks for a maintenance pass of
+// every shard whose wheel has timers due, until reaper_stop.
+static void *expire_tick(void *arg)
+{
+    struct timespec deadline;
+    uint32_t i, now;
+
+    (void)arg;
+
+    pthread_mutex_lock(&expire_lock);
+    while (!expire_stopping)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ExpireTickMs / 1000;
+        deadline.tv_nsec += (long)(ExpireTickMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&expire_wake, &expire_lock, &deadline);
+
+        now = expire_clock();
+        for (i = 0; i < ShardCount && !expire_stopping; i++)
+        {
+            if (wheel_due(&shards[i].wheel, now))
+            {
+                maintenance_request(&shards[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&expire_lock);
+
+    return NULL;
+}
+
+// A shard's maintenance task: reclaims its limbo, frees one slice of its
+// queued subtrees, compacts a few sparse indexes and fires a slice of its
+// due timers, taking the writer lock for just that. Goes round again after whatever else its worker has queued
+// while work is left, checks back after PoolDeferMs while retired items are
+// still waiting for their grace period, and otherwise stops until the next
+// request.
+static void shard_maintain(Task *task)
+{
+    Shard *shard = (Shard *)((uint8_t *)task - offsetof(Shard, maintenance));
+    uint32_t home = (uint32_t)(shard - shards), requests, now;
+    size_t over, used, released = 0;
+    int more, waiting;
+
+    requests = __atomic_load_n(&shard->requests, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->alloc.limbo.count > 0)
+    {
+        limbo_reclaim(&shard->alloc.limbo);
+    }
+    reap_some(&shard->alloc, ReapSlice);
+    compact_some(shard, CompactSlice);
+    now = expire_clock();
+    wheel_advance(&shard->wheel, now, ExpireSlice, expire_fire, shard);
+    if ((over = memory_over()) > 0 && __atomic_load_n(&evict_policy, __ATOMIC_RELAXED) == EvictClock)
+    {
+        // Every shard evicts its share of the excess, by the bytes it holds.
+        used = memory_used();
+        released = evict_some(shard, (size_t)((double)over * ((double)shard->alloc.bytes / (double)used)) + 1);
+    }
+    more = shard->alloc.reap != NULL || shard->compact_count > 0 || wheel_due(&shard->wheel, now) ||
+           (released > 0 && memory_over() > 0);
+    waiting = shard->alloc.background && shard->alloc.limbo.count > 0;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (more)
+    {
+        pool_submit(task, home); // Let waiting writers have the lock before the next slice.
+        return;
+    }
+    if (waiting)
+    {
+        pool_defer(task, home);
+        return;
+    }
+
+    __atomic_store_n(&shard->maintaining, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shard->requests, __ATOMIC_SEQ_CST) != requests &&
+        !__atomic_exchange_n(&shard->maintaining, 1, __ATOMIC_SEQ_CST))
+    {
+        pool_submit(task, home);
+    }
+}
+
+int8_t reaper_start(void)
+{
+    uint32_t i;
+
+    if (__atomic_load_n(&reaper_running, __ATOMIC_ACQUIRE))
+    {
+        return NoError;
+    }
+    if (pool_workers() == 0)
+    {
+        retfail(EINVAL);
+    }
+
+    for (i = 0; i < ShardCount; i++)
+    {
+        pthread_mutex_lock(&shards[i].lock);
+        shards[i].maintenance.run = shard_maintain;
+        shards[i].alloc.background = 1;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    expire_stopping = 0;
+    if ((errno = pthread_create(&expire_thread, NULL, expire_tick, NULL)) != 0)
+    {
+        for (i = 0; i < ShardCount; i++)
+        {
+            pthread_mutex_lock(&shards[i].lock);
+            shards[i].alloc.background = 0;
+            pthread_mutex_unlock(&shards[i].lock);
+        }
+        return -1;
+    }
+    __atomic_store_n(&reaper_running, 1, __ATOMIC_RELEASE);
+    trace(TraceInfo, "reaper_start: maintaining %llu shards on the pool, %llu per slice", ShardCount, ReapSlice);
+
+    return NoError;
+}
+
+void reaper_stop(void)
+{
+    uint32_t i;
+
+    if (!__atomic_load_n(&reaper_running, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    // Stop queueing first, so nothing is left behind once the passes are done.
+    pthread_mutex_lock(&expire_lock);
+    expire_stopping = 1;
+    pthread_cond_signal(&expire_wake);
+    pthread_mutex_unlock(&expire_lock);
+    pthread_join(expire_thread, NULL);
+    for (i = 0; i < ShardCount; i++)
+    {
+        pthread_mutex_lock(&shards[i].lock);
+        shards[i].alloc.background = 0;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    for (i = 0; i < ShardCount; i++)
+    {
+        while (__atomic_load_n(&shards[i].maintaining, __ATOMIC_SEQ_CST))
+        {
+            sched_yield();
+        }
+    }
+    __atomic_store_n(&reaper_running, 0, __ATOMIC_RELEASE);
+
+    for (i = 0; i < ShardCount; i++)
+    {
+        pthread_mutex_lock(&shards[i].lock);
+        reap_some(&shards[i].alloc, SIZE_MAX);
+        while (shards[i].compact_count > 0)
+        {
+            shards[i].compact[--shards[i].compact_count]->flags &= ~NodeCompact;
+        }
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    trace(TraceInfo, "reaper_stop: stopped maintaining %llu shards, %llu per slice", ShardCount, ReapSlice);
+}
+
+void shards_init(void)
+{
+    uint32_t i;
+    Node *root;
+
+    simd_init();
+    for (i = 0; i < ShardCount; i++)
+    {
+        // The root is treated as a `Node` type for structural purposes,
+        // serving as the top-level container for its shard.
+        root = &shards[i].root.node;
+        zero((uint8_t *)root, sizeof(Node)); // No parent, children, or leaves yet.
+        root->tag = TagRoot;  // Set the tag to explicitly identify this as the root.
+        root->path[0] = '\0'; // The root's path is the empty string.
+
+        allocator_init(&shards[i].alloc);
+        allocator_place(&shards[i].alloc, numa_pages(i)); // On the node of the worker that owns the shard.
+        root->alloc = &shards[i].alloc; // Every node created under the root allocates from here.
+        node_meter(root);
+        pthread_mutex_init(&shards[i].lock, NULL);
+        wheel_init(&shards[i].wheel, expire_clock());
+    }
+}
+
+void shards_release(void)
+{
+    uint32_t i, cursor;
+    Node *root, *child;
+
+    // Whatever the reaper still holds is freed first; the rest of the
+    // teardown drops subtrees in place.
+    reaper_stop();
+
+    for (i = 0; i < ShardCount; i++)
+    {
+        root = &shards[i].root.node;
+
+        pthread_mutex_lock(&shards[i].lock);
+        // Removing a child only rewrites its own lane, so the iteration can continue.
+        cursor = 0;
+        while ((child = (Node *)index_next(&root->children, &cursor)) != NULL)
+        {
+            drop_subtree(child);
+        }
+        while (root->east != NULL)
+        {
+            delete_leaf(root, root->east->key);
+        }
+        pthread_mutex_unlock(&shards[i].lock);
+
+        wheel_release(&shards[i].wheel);
+        shards[i].hand = NULL;
+        shards[i].hand_len = 0;
+        allocator_release(&shards[i].alloc);
+        index_release(&root->children);
+        index_release(&root->index);
+        arena_release(&root->values);
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+}
+
+Shard *shard_for_path(const char *path)
+{
+    const char *end;
+
+    assert(path != NULL && "Error: Path cannot be NULL for shard_for_path.");
+
+    // Only the top-level segment decides the shard, so a whole subtree lives in one shard.
+    while (*path == '/')
+    {
+        path++;
+    }
+    end = strchr(path, '/');
+    if (end == NULL)
+    {
+        end = path + strlen(path);
+    }
+    if (end - path > PathSegmentMax)
+    {
+        end = path + PathSegmentMax;
+    }
+
+    return &shards[index_hash((const uint8_t *)path, (uint16_t)(end - path)) % ShardCount];
+}
+
+Node *create_path(Node *root, const char *path)
+{
+    uint8_t segment[PathSegmentMax + 1];
+    const char *start, *end;
+    Node *node = root, *child;
+    size_t len;
+
+    // Pre-condition checks: Both the starting node and the path must be valid.
+    assert(root != NULL && "Error: Root node cannot be NULL for create_path.");
+    assert(path != NULL && "Error: Path cannot be NULL for create_path.");
+
+    for (start = path; *start != '\0'; start = end)
+    {
+        while (*start == '/')
+        {
+            start++;
+        }
+        if (*start == '\0')
+        {
+            break;
+        }
+
+        end = strchr(start, '/');
+        if (end == NULL)
+        {
+            end = start + strlen(start);
+        }
+        len = (size_t)(end - start);
+        if (len > PathSegmentMax)
+        {
+            reterr(ENAMETOOLONG);
+        }
+
+        // create_node and find_node take NUL-terminated segments.
+        memcpy(segment, start, len);
+        segment[len] = '\0';
+
+        child = find_node(node, (int8_t *)segment);
+        if (child == NULL)
+        {
+            child = create_node(node, (int8_t *)segment);
+            if (child == NULL)
+            {
+                return NULL;
+            }
+        }
+        node = child;
+    }
+
+    return node;
+}
+
+Node *store_resolve(const char *path)
+{
+    return resolve_path(&shard_for_path(path)->root.node, path);
+}
+
+Leaf *store_get(const char *path, uint8_t *key)
+{
+    Node *node;
+    Leaf *leaf = NULL;
+    uint64_t start = metric_start();
+
+    node = store_resolve(path);
+    if (node != NULL)
+    {
+        leaf = find_leaf(node, key);
+    }
+    metric_time(MetricGet, start);
+
+    return leaf;
+}
+
+/**
+ * @brief A lookup of store_get_many or store_set_many in flight.
+ */
+struct s_probe {
+    BatchOp *op;            ///< The entry being resolved.
+    Node *node;             ///< The Node reached so far.
+    const char *rest;       ///< The path after the segment being looked up.
+    const uint8_t *segment; ///< The path segment (or, once `at_key` is set, the key) being looked up.
+    uint32_t hash;          ///< Its index hash.
+    uint16_t len;           ///< Its length in bytes.
+    uint8_t at_key;         ///< Set once every path segment is resolved.
+    uint8_t stage;          ///< What the next step does (Probe*).
+};
+typedef struct s_probe Probe;
+
+// Starts resolving a batch entry from the root of its shard.
+static void probe_start(Probe *probe, BatchOp *op)
+{
+    op->node = NULL;
+    op->leaf = NULL;
+    op->error = NoError;
+    probe->op = op;
+    probe->node = &shard_for_path(op->path)->root.node;
+    probe->rest = op->path;
+    probe->at_key = 0;
+    probe->stage = ProbeSegment;
+}
+
+// Ends a lookup with `error` (NoError once its leaf is found).
+static void probe_finish(Probe *probe, int error)
+{
+    probe->op->error = error;
+    probe->stage = ProbeDone;
+}
+
+// Advances a lookup by one step. Each step ends by prefetching what the next
+// one reads, so a step only stalls if the window is too small to hide the
+// latency. Path segments are split as resolve_path splits them.
+static void probe_step(Probe *probe)
+{
+    Index *index = probe->at_key ? &probe->node->index : &probe->node->children;
+    const char *end;
+    uint8_t *item;
+    Node *child;
+
+    switch (probe->stage)
+    {
+    case ProbeSegment:
+        if (node_ready(probe->node) != NoError)
+        {
+            probe_finish(probe, errno);
+            return;
+        }
+        while (*probe->rest == '/')
+        {
+            probe->rest++;
+        }
+        if (*probe->rest == '\0')
+        {
+            probe->op->node = probe->node;
+            probe->segment = probe->op->key;
+            probe->len = key_length(probe->op->key);
+            probe->at_key = 1;
+            index = &probe->node->index;
+        }
+        else
+        {
+            end = strchr(probe->rest, '/');
+            if (end == NULL)
+            {
+                end = probe->rest + strlen(probe->rest);
+            }
+            if (end - probe->rest > PathSegmentMax)
+            {
+                probe_finish(probe, ENAMETOOLONG);
+                return;
+            }
+            probe->segment = (const uint8_t *)probe->rest;
+            probe->len = (uint16_t)(end - probe->rest);
+            probe->rest = end;
+        }
+        probe->hash = index_hash(probe->segment, probe->len);
+        index_prefetch(index, probe->hash);
+        probe->stage = ProbePeek;
+        return;
+
+    case ProbePeek:
+        // A Node is matched on its path and then searched through its
+        // indexes and `pending`, which span its first three cache lines; a
+        // Leaf's header and key fit in two.
+        item = (uint8_t *)index_peek(index, probe->hash);
+        if (item != NULL)
+        {
+            __builtin_prefetch(item);
+            __builtin_prefetch(item + 64);
+            if (!probe->at_key)
+            {
+                __builtin_prefetch(item + 128);
+            }
+        }
+        probe->stage = ProbeFind;
+        return;
+
+    case ProbeFind:
+        if (probe->at_key)
+        {
+            probe->op->leaf = (Leaf *)index_find(index, probe->hash, leaf_matches, probe->segment, probe->len);
+            if (probe->op->leaf == NULL || leaf_expired(probe->op->leaf, 0))
+            {
+                probe->op->leaf = NULL;
+                probe_finish(probe, ENOENT);
+                return;
+            }
+            // The caller reads the value next. A stale pointer (the value is
+            // being replaced) only wastes the prefetch.
+            leaf_touch(probe->op->leaf);
+            __builtin_prefetch(__atomic_load_n(&probe->op->leaf->value, __ATOMIC_RELAXED));
+            probe_finish(probe, NoError);
+            return;
+        }
+        child = (Node *)index_find(index, probe->hash, node_matches, probe->segment, probe->len);
+        if (child == NULL)
+        {
+            probe_finish(probe, ENOENT);
+            return;
+        }
+        probe->node = child;
+        probe->stage = ProbeSegment;
+        return;
+
+    default:
+        return;
+    }
+}
+
+// Resolves the Node and Leaf of every entry, keeping up to BatchWindow
+// lookups in flight and stepping them round-robin; a finished lookup makes
+// room for the next entry. Readers call it in an epoch section, writers with
+// the locks of every shard involved.
+static void batch_resolve(BatchOp *ops, uint32_t count)
+{
+    Probe window[BatchWindow];
+    uint32_t next = 0, active = 0, i;
+
+    for (i = 0; i < BatchWindow; i++)
+    {
+        window[i].stage = ProbeDone;
+        if (next < count)
+        {
+            probe_start(&window[i], &ops[next++]);
+            active++;
+        }
+    }
+
+    while (active > 0)
+    {
+        for (i = 0; i < BatchWindow; i++)
+        {
+            if (window[i].stage == ProbeDone)
+            {
+                continue;
+            }
+            probe_step(&window[i]);
+            if (window[i].stage == ProbeDone)
+            {
+                if (next < count)
+                {
+                    probe_start(&window[i], &ops[next++]);
+                }
+                else
+                {
+                    active--;
+                }
+            }
+        }
+    }
+}
+
+void store_get_many(BatchOp *ops, uint32_t count)
+{
+    uint64_t start = metric_start();
+
+    assert((ops != NULL || count == 0) && "Error: Entries cannot be NULL for store_get_many.");
+
+    batch_resolve(ops, count);
+    metric_time(MetricGetMany, start);
+}
+
+int8_t leaf_view(Leaf *leaf, ValueView *view)
+{
+    ValueBlock *block;
+    const uint8_t *data;
+    uint32_t version;
+    uint8_t flags;
+
+    assert(leaf != NULL && view != NULL && "Error: Leaf and view cannot be NULL for leaf_view.");
+
+    for (;;)
+    {
+        version = leaf_read_begin(leaf, &data, &view->size, &flags);
+        if (flags & LeafPacked)
+        {
+            // Views never pin a packed block: it would have to be decompressed per send anyway.
+            block = value_alloc(view->size);
+            if (block == NULL)
+            {
+                return -1;
+            }
+            if (value_copy(block->data, data, view->size, flags) != NoError)
+            {
+                value_unref(block);
+                return -1;
+            }
+            view->block = block;
+            view->data = block->data;
+            return NoError;
+        }
+        else if (flags & LeafHeap)
+        {
+            // The caller's epoch section keeps the block alive while this
+            // reference is taken, so the count cannot already be zero. Taking
+            // it before checking the version again keeps update_leaf from
+            // rewriting the block in place under the view (see leaf_update).
+            block = value_block(data);
+            __atomic_add_fetch(&block->refs, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&leaf->version, __ATOMIC_SEQ_CST) == version)
+            {
+                view->block = block;
+                view->data = data;
+                return NoError;
+            }
+            value_unref(block);
+        }
+        else if (flags & LeafMapped)
+        {
+            // The snapshot stays mapped (and unchanged) until shutdown.
+            view->block = NULL;
+            view->data = data;
+            return NoError;
+        }
+        else
+        {
+            // Inline and arena values go away with their leaf or Node; they
+            // are small, so copy them out.
+            block = value_alloc(view->size);
+            if (block == NULL)
+            {
+                return -1;
+            }
+            value_copy(block->data, data, view->size, flags);
+            if (!leaf_read_retry(leaf, version))
+            {
+                view->block = block;
+                view->data = block->data;
+                return NoError;
+            }
+            value_unref(block);
+        }
+    }
+}
+
+int8_t store_view(const char *path, uint8_t *key, ValueView *view)
+{
+    Leaf *leaf;
+    Node *node;
+    int8_t status;
+    int error;
+    uint64_t start = metric_start();
+
+    epoch_enter();
+    errno = NoError;
+    node = store_resolve(path);
+    leaf = node != NULL ? find_leaf(node, key) : NULL;
+    if (leaf == NULL)
+    {
+        error = errno == NoError ? ENOENT : errno;
+        epoch_exit();
+        metric_time(MetricView, start);
+        retfail(error);
+    }
+    status = leaf_view(leaf, view);
+    epoch_exit();
+    metric_time(MetricView, start);
+
+    return status;
+}
+
+void view_release(ValueView *view)
+{
+    assert(view != NULL && "Error: View cannot be NULL for view_release.");
+
+    if (view->block != NULL)
+    {
+        value_unref(view->block);
+    }
+    zero((uint8_t *)view, sizeof(ValueView));
+}
+
+// Takes the timer an expiry needs before the leaf (NULL if it does not
+// exist yet) is given it. None is needed to clear the expiry, or to move it
+// later: the timer already pending, due no later, finds the new expiry when
+// it fires (see expire_fire). Sets `*timer` to the timer or NULL.
+static int8_t expiry_timer(const char *path, uint8_t *key, const Leaf *leaf, uint32_t expires, Timer **timer)
+{
+    *timer = NULL;
+    if (expires == ExpireNever ||
+        (leaf != NULL && leaf->expires != ExpireNever && leaf->expires <= expires))
+    {
+        return NoError;
+    }
+    *timer = timer_new(path, strlen(path), key, (uint8_t)key_length(key), expires);
+
+    return *timer != NULL ? NoError : -1;
+}
+
+// Shared body of store_set, store_set_expiring and store_set_owned (see
+// leaf_create). Stores a value and its expiry and logs the write; the caller
+// holds the shard's writer lock and keeps `owned` (if any) alive until the
+// call returns. `node` and `leaf` are what a lookup already found at `path`
+// and `key`, or NULL to look (and create) here. Returns the leaf, or NULL
+// with errno set.
+static Leaf *store_apply(Shard *shard, const char *path, Node *node, Leaf *leaf, uint8_t *key,
+                         uint32_t size, uint8_t *value, ValueBlock *owned, uint32_t expires)
+{
+    const uint8_t *src = owned != NULL ? owned->data : value;
+    Timer *timer = NULL;
+
+    if (node == NULL)
+    {
+        node = create_path(&shard->root.node, path);
+    }
+    if (node != NULL && leaf == NULL)
+    {
+        leaf = find_leaf(node, key);
+    }
+    if (node != NULL && expiry_timer(path, key, leaf, expires, &timer) != NoError)
+    {
+        node = NULL;
+        leaf = NULL;
+    }
+    if (node != NULL)
+    {
+        // Update an existing value where it is, or create the leaf.
+        if (leaf != NULL && leaf_update(node, leaf, size, value, owned) != NoError)
+        {
+            leaf = NULL;
+        }
+        else if (leaf == NULL)
+        {
+            leaf = leaf_create(node, key, size, value, owned);
+        }
+    }
+    if (leaf == NULL)
+    {
+        free(timer);
+        if (owned != NULL)
+        {
+            value_unref(owned); // store_set_owned consumes the block even when it fails.
+        }
+        return NULL;
+    }
+
+    __atomic_store_n(&leaf->expires, expires, __ATOMIC_RELAXED);
+    if (timer != NULL)
+    {
+        wheel_add(&shard->wheel, timer);
+    }
+
+    // Log the write while still holding the lock, so writes to the same path
+    // reach the log in the order they were applied.
+    if (wal_append_set(path, leaf->key, leaf->keylen, expires, src, size) != NoError)
+    {
+        return NULL;
+    }
+
+    return leaf;
+}
+
+static int8_t store_write(const char *path, uint8_t *key, uint32_t size, uint8_t *value, ValueBlock *owned,
+                          uint32_t expires)
+{
+    Shard *shard = shard_for_path(path);
+    Leaf *leaf;
+    uint64_t start = metric_start();
+
+    // The log takes the value as written, so keep the caller's block alive
+    // even if the leaf compresses it instead of adopting it.
+    if (owned != NULL)
+    {
+        __atomic_add_fetch(&owned->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    leaf = NULL;
+    if (memory_reserve(shard) == NoError)
+    {
+        leaf = store_apply(shard, path, NULL, NULL, key, size, value, owned, expires);
+    }
+    else if (owned != NULL)
+    {
+        value_unref(owned); // Consumed even when the write is refused.
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (owned != NULL)
+    {
+        value_unref(owned);
+    }
+    metric_time(MetricSet, start);
+
+    return leaf != NULL ? NoError : -1;
+}
+
+int8_t store_set(const char *path, uint8_t *key, uint32_t size, uint8_t *value)
+{
+    return store_write(path, key, size, value, NULL, ExpireNever);
+}
+
+int8_t store_set_expiring(const char *path, uint8_t *key, uint32_t size, uint8_t *value, uint32_t expires)
+{
+    return store_write(path, key, size, value, NULL, expires);
+}
+
+int8_t store_set_many(BatchOp *ops, uint32_t count)
+{
+    uint8_t locked[ShardCount] = {0};
+    Shard *shard;
+    uint32_t i;
+    int error = NoError;
+    uint64_t start = metric_start();
+
+    assert((ops != NULL || count == 0) && "Error: Entries cannot be NULL for store_set_many.");
+
+    // Lock in shard order, as any writer that holds several shard locks must.
+    for (i = 0; i < count; i++)
+    {
+        locked[shard_for_path(ops[i].path) - shards] = 1;
+    }
+    for (i = 0; i < ShardCount; i++)
+    {
+        if (locked[i])
+        {
+            pthread_mutex_lock(&shards[i].lock);
+        }
+    }
+
+    // Room is made before the lookups, whose leaves an eviction could take away.
+    for (i = 0; i < ShardCount && error == NoError; i++)
+    {
+        if (locked[i] && memory_reserve(&shards[i]) != NoError)
+        {
+            error = errno;
+        }
+    }
+
+    // Whatever the lookups did not find (including paths and keys an earlier
+    // entry of the batch creates) is looked up again, and created, as it is applied.
+    if (error == NoError)
+    {
+        batch_resolve(ops, count);
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (error != NoError)
+        {
+            ops[i].leaf = NULL; // Refused as a whole.
+            ops[i].error = error;
+            continue;
+        }
+        shard = shard_for_path(ops[i].path);
+        ops[i].leaf = store_apply(shard, ops[i].path, ops[i].node, ops[i].leaf, ops[i].key,
+                                  ops[i].size, ops[i].value, NULL, ExpireNever);
+        ops[i].error = ops[i].leaf != NULL ? NoError : errno;
+    }
+    for (i = 0; i < count && error == NoError; i++)
+    {
+        error = ops[i].error;
+    }
+
+    for (i = 0; i < ShardCount; i++)
+    {
+        if (locked[i])
+        {
+            pthread_mutex_unlock(&shards[i].lock);
+        }
+    }
+    metric_time(MetricSetMany, start);
+
+    if (error != NoError)
+    {
+        retfail(error);
+    }
+
+    return NoError;
+}
+
+int8_t store_set_owned(const char *path, uint8_t *key, ValueBlock *block, uint32_t size)
+{
+    assert(block != NULL && "Error: Value block cannot be NULL for store_set_owned.");
+
+    return store_write(path, key, size, NULL, block, ExpireNever);
+}
+
+int8_t store_cas(const char *path, uint8_t *key, uint32_t *version, uint32_t size, uint8_t *value)
+{
+    Shard *shard = shard_for_path(path);
+    Node *node;
+    Leaf *leaf;
+    int8_t status = -1;
+    uint64_t start = metric_start();
+
+    pthread_mutex_lock(&shard->lock);
+
+    node = resolve_path(&shard->root.node, path);
+    if (node == NULL)
+    {
+        errno = ENOENT;
+    }
+    else if (memory_reserve(shard) == NoError && update_leaf_cas(node, key, version, size, value) == NoError)
+    {
+        leaf = find_leaf(node, key);
+        status = wal_append_set(path, leaf->key, leaf->keylen, leaf->expires, value, size);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    metric_time(MetricSet, start);
+
+    return status;
+}
+
+int8_t store_del(const char *path, uint8_t *key)
+{
+    Shard *shard = shard_for_path(path);
+    Node *node;
+    uint8_t key_len;
+    int8_t status = NoError;
+    uint64_t start = metric_start();
+
+    pthread_mutex_lock(&shard->lock);
+
+    node = resolve_path(&shard->root.node, path);
+    if (node == NULL)
+    {
+        errno = ENOENT;
+        status = -1;
+    }
+    else if (key != NULL && key[0] != '\0')
+    {
+        status = delete_leaf(node, key);
+    }
+    else if (node->tag == TagRoot)
+    {
+        // The shard roots themselves can never be dropped.
+        errno = EINVAL;
+        status = -1;
+    }
+    else
+    {
+        drop_subtree(node);
+    }
+
+    if (status == NoError)
+    {
+        key_len = key != NULL ? (uint8_t)key_length(key) : 0;
+        status = wal_append(WalDel, path, key, key_len, NULL, 0);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    metric_time(MetricDel, start);
+
+    return status;
+}
+
+int8_t store_expire(const char *path, uint8_t *key, uint32_t expires)
+{
+    Shard *shard = shard_for_path(path);
+    Node *node;
+    Leaf *leaf = NULL;
+    Timer *timer;
+    uint8_t word[4];
+    int8_t status = -1;
+
+    assert(key != NULL && "Error: Key cannot be NULL for store_expire.");
+
+    pthread_mutex_lock(&shard->lock);
+
+    node = resolve_path(&shard->root.node, path);
+    if (node != NULL)
+    {
+        leaf = find_leaf(node, key);
+    }
+    if (leaf == NULL)
+    {
+        errno = ENOENT;
+    }
+    else if (expires != ExpireNever && expires <= expire_clock())
+    {
+        // Already over: the value goes now, and is logged as a delete.
+        delete_leaf(node, key);
+        status = wal_append(WalDel, path, key, (uint8_t)key_length(key), NULL, 0);
+    }
+    else if (expiry_timer(path, key, leaf, expires, &timer) == NoError)
+    {
+        __atomic_store_n(&leaf->expires, expires, __ATOMIC_RELAXED);
+        if (timer != NULL)
+        {
+            wheel_add(&shard->wheel, timer);
+        }
+        put_u32(word, expires);
+        status = wal_append(WalExpire, path, leaf->key, leaf->keylen, word, sizeof(word));
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return status;
+}
+
+// Sets the codec mode of `top` and every Node below it, loading Nodes still
+// pending in the snapshot on the way. Like drop_nodes, it keeps the Nodes to
+// visit on an explicit stack. The caller holds the shard's writer lock.
+static int8_t subtree_compress(Node *top, uint8_t codec)
+{
+    Node *local[64];
+    Node **stack = local, **grown;
+    uint32_t depth = 0, capacity = 64, cursor;
+    Node *node, *child;
+    int8_t status = NoError;
+
+    stack[depth++] = top;
+    while (depth > 0)
+    {
+        node = stack[--depth];
+        node->codec = codec;
+        if (node_ready(node) != NoError)
+        {
+            status = -1;
+            continue;
+        }
+
+        cursor = 0;
+        while ((child = (Node *)index_next(&node->children, &cursor)) != NULL)
+        {
+            if (depth == capacity)
+            {
+                grown = (Node **)malloc(2 * capacity * sizeof(Node *));
+                if (grown == NULL)
+                {
+                    errno = ENOMEM;
+                    status = -1;
+                    break;
+                }
+                memcpy(grown, stack, depth * sizeof(Node *));
+                if (stack != local)
+                {
+                    free(stack);
+                }
+                stack = grown;
+                capacity *= 2;
+            }
+            stack[depth++] = child;
+        }
+    }
+
+    if (stack != local)
+    {
+        free(stack);
+    }
+
+    return status;
+}
+
+int8_t store_compress(const char *path, uint8_t codec)
+{
+    Shard *shard;
+    Node *node;
+    uint32_t i;
+    int8_t status = NoError;
+
+    assert(path != NULL && "Error: Path cannot be NULL for store_compress.");
+
+    if (codec > CodecSampled)
+    {
+        retfail(EINVAL);
+    }
+
+    // Without a segment the path names the shard roots, all of them.
+    if (path[strspn(path, "/")] == '\0')
+    {
+        for (i = 0; i < ShardCount; i++)
+        {
+            pthread_mutex_lock(&shards[i].lock);
+            if (subtree_compress(&shards[i].root.node, codec) != NoError)
+            {
+                status = -1;
+            }
+            pthread_mutex_unlock(&shards[i].lock);
+        }
+        if (status == NoError)
+        {
+            status = wal_append(WalCodec, path, NULL, 0, &codec, 1);
+        }
+        return status;
+    }
+
+    shard = shard_for_path(path);
+    pthread_mutex_lock(&shard->lock);
+    node = create_path(&shard->root.node, path);
+    status = node != NULL ? subtree_compress(node, codec) : -1;
+    if (status == NoError)
+    {
+        status = wal_append(WalCodec, path, NULL, 0, &codec, 1);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return status;
+}
+
+// Built with -DNoMain (see the bench target in the Makefile), the store links
+// into other programs, which bring their own entry point.
+#ifndef NoMain
+int main(int argc, const char *argv[])
+{
+    long port = ServerDefaultPort; // TCP port to listen on.
+    long workers;                  // Worker threads from the environment (0: one per CPU).
+    const char *wal_path, *sync;   // Write-ahead log settings from the environment.
+    const char *snapshot_path;     // Snapshot file from the environment.
+    const char *eviction;          // Eviction policy from the environment.
+    const char *huge;              // Huge page size from the environment.
+    const char *primary;           // The primary to replicate, from the environment.
+    char host[64];                 // Its address, before the port.
+    long repl_port;                // Replication port to serve, or that of the primary.
+    unsigned long long limit;      // Memory limit from the environment, before its unit.
+    unsigned shift;                // log2 of the unit of the memory limit.
+    uint8_t policy;
+    char *end;
+    int status;
+
+    // --- Parse Command-Line Arguments ---
+    // Usage: my_in_memory_db.exe [port]
+    if (argc > 2)
+    {
+        fprintf(stderr, "Usage: %s [port]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2)
+    {
+        port = strtol(argv[1], &end, 10);
+        if (*end != '\0' || port <= 0 || port > 65535)
+        {
+            fprintf(stderr, "ERROR: Invalid port '%s'.\n", argv[1]);
+            return 1;
+        }
+    }
+
+    // --- Tracing ---
+    // DB_TRACE=1 records trace events in memory; they are printed on shutdown.
+    trace_enable(getenv("DB_TRACE") != NULL && strcmp(getenv("DB_TRACE"), "0") != 0);
+
+    // --- Place the Shards ---
+    // DB_WORKERS sets the number of worker threads that execute requests and
+    // background maintenance (default: one per CPU). Each shard's memory is
+    // placed on the NUMA node of the worker that owns it, unless DB_NUMA is
+    // "off"; DB_HUGEPAGES ("2m" or "1g") backs it with huge pages.
+    workers = getenv("DB_WORKERS") != NULL ? strtol(getenv("DB_WORKERS"), &end, 10) : 0;
+    if (workers < 0 || workers > PoolMaxWorkers)
+    {
+        fprintf(stderr, "ERROR: DB_WORKERS must be between 0 (one per CPU) and %d.\n", PoolMaxWorkers);
+        return 1;
+    }
+    huge = getenv("DB_HUGEPAGES") != NULL ? getenv("DB_HUGEPAGES") : "off";
+    if (strcmp(huge, "off") != 0 && strcmp(huge, "2m") != 0 && strcmp(huge, "1g") != 0)
+    {
+        fprintf(stderr, "ERROR: DB_HUGEPAGES must be \"off\", \"2m\" or \"1g\".\n");
+        return 1;
+    }
+    numa_init((uint32_t)workers, getenv("DB_NUMA") == NULL || strcmp(getenv("DB_NUMA"), "off") != 0,
+              strcmp(huge, "2m") == 0 ? NumaHuge2M : strcmp(huge, "1g") == 0 ? NumaHuge1G : 0);
+
+    // --- Initialize the Database Roots ---
+    shards_init();
+
+    // --- Pick the Key Comparison Kernels ---
+    // DB_SIMD forces a kernel set ("avx2", "sse2", "neon" or "scalar") instead
+    // of the fastest one this CPU supports.
+    if (getenv("DB_SIMD") != NULL && simd_select(getenv("DB_SIMD")) != NoError)
+    {
+        fprintf(stderr, "ERROR: DB_SIMD '%s' is unknown or not supported by this CPU.\n", getenv("DB_SIMD"));
+        shards_release();
+        return 1;
+    }
+
+    // --- Bound the Memory ---
+    // DB_MAXMEMORY caps the bytes the tree may hold (a number, optionally
+    // followed by k, m or g; 0 or unset: no cap). DB_EVICTION picks what
+    // happens at the cap: "clock" (the default) evicts the least recently
+    // used leaves, "none" refuses writes.
+    if (getenv("DB_MAXMEMORY") != NULL)
+    {
+        limit = strtoull(getenv("DB_MAXMEMORY"), &end, 10);
+        shift = *end == 'k' || *end == 'K' ? 10 : *end == 'm' || *end == 'M' ? 20 : *end == 'g' || *end == 'G' ? 30 : 0;
+        eviction = getenv("DB_EVICTION") != NULL ? getenv("DB_EVICTION") : "clock";
+        if ((shift > 0 ? end[1] : end[0]) != '\0' || limit > (SIZE_MAX >> shift) ||
+            (strcmp(eviction, "clock") != 0 && strcmp(eviction, "none") != 0))
+        {
+            fprintf(stderr, "ERROR: DB_MAXMEMORY must be a byte count (with an optional k, m or g), "
+                            "and DB_EVICTION \"clock\" or \"none\".\n");
+            shards_release();
+            return 1;
+        }
+        memory_limit((size_t)limit << shift, strcmp(eviction, "none") == 0 ? EvictNone : EvictClock);
+    }
+
+    // --- Restore the Latest Snapshot ---
+    // DB_SNAPSHOT names the snapshot file ("off" disables snapshots). It is
+    // mapped, not read: Nodes are loaded as they are first used.
+    snapshot_path = getenv("DB_SNAPSHOT") != NULL ? getenv("DB_SNAPSHOT") : SnapshotDefaultPath;
+    primary = getenv("DB_REPLICAOF");
+    if (primary == NULL && strcmp(snapshot_path, "off") != 0 && snapshot_load(snapshot_path) != NoError &&
+        errno != ENOENT)
+    {
+        perror("ERROR: Failed to load the snapshot");
+        shards_release();
+        return 1;
+    }
+
+    // --- Bootstrap a Replica ---
+    // DB_REPLICAOF=ip:port makes this server a read replica of the primary
+    // serving replication on that port. It starts from a snapshot of the
+    // primary's store, saved to DB_SNAPSHOT, and keeps no log of its own.
+    if (primary != NULL)
+    {
+        repl_port = strchr(primary, ':') != NULL ? strtol(strchr(primary, ':') + 1, &end, 10) : 0;
+        if (repl_port <= 0 || repl_port > 65535 || *end != '\0' ||
+            (size_t)(strchr(primary, ':') - primary) >= sizeof(host) || strcmp(snapshot_path, "off") == 0)
+        {
+            fprintf(stderr, "ERROR: DB_REPLICAOF must be ip:port, and a replica needs DB_SNAPSHOT.\n");
+            shards_release();
+            return 1;
+        }
+        memcpy(host, primary, (size_t)(strchr(primary, ':') - primary));
+        host[strchr(primary, ':') - primary] = '\0';
+        if (repl_bootstrap(host, (uint16_t)repl_port, snapshot_path) != NoError)
+        {
+            perror("ERROR: Failed to bootstrap from the primary");
+            shards_release();
+            snapshot_release();
+            return 1;
+        }
+    }
+
+    // --- Recover from the Write-Ahead Log ---
+    // DB_WAL names the log file ("off" disables logging); DB_WAL_SYNC picks the
+    // sync policy: "always", "interval" (the default) or "none".
+    wal_path = primary != NULL ? "off" : getenv("DB_WAL") != NULL ? getenv("DB_WAL") : WalDefaultPath;
+    sync = getenv("DB_WAL_SYNC");
+    policy = WalSyncInterval;
+    if (sync != NULL && strcmp(sync, "always") == 0)
+    {
+        policy = WalSyncAlways;
+    }
+    else if (sync != NULL && strcmp(sync, "none") == 0)
+    {
+        policy = WalSyncNone;
+    }
+
+    // DB_REPL_PORT makes this server a primary that streams its log to the
+    // replicas connecting to that port.
+    repl_port = getenv("DB_REPL_PORT") != NULL && primary == NULL ? strtol(getenv("DB_REPL_PORT"), &end, 10) : 0;
+    if (getenv("DB_REPL_PORT") != NULL && primary == NULL &&
+        (*end != '\0' || repl_port <= 0 || repl_port > 65535 || strcmp(wal_path, "off") == 0))
+    {
+        fprintf(stderr, "ERROR: DB_REPL_PORT must be a port, and a primary needs DB_WAL.\n");
+        shards_release();
+        snapshot_release();
+        return 1;
+    }
+    if (strcmp(wal_path, "off") != 0 && wal_open(wal_path, policy) != NoError)
+    {
+        perror("ERROR: Failed to open the write-ahead log");
+        shards_release();
+        snapshot_release();
+        return 1;
+    }
+
+    // --- Start the Workers ---
+    if (pool_start((uint32_t)workers) != NoError || reaper_start() != NoError)
+    {
+        perror("ERROR: Failed to start the worker threads");
+        repl_stop();
+        pool_stop();
+        wal_close();
+        shards_release();
+        snapshot_release();
+        return 1;
+    }
+
+    // --- Pin the Network Thread ---
+    // DB_NET_NODE pins the thread that accepts connections and parses requests
+    // (this one), and the replication threads it starts, to the CPUs of a NUMA
+    // node, so that it shares a socket with the shards it hands most work to.
+    if (getenv("DB_NET_NODE") != NULL && numa_pin((int)strtol(getenv("DB_NET_NODE"), &end, 10)) != NoError)
+    {
+        perror("ERROR: Failed to pin the network thread (DB_NET_NODE)");
+    }
+
+    // --- Replicate ---
+    // A primary starts streaming its log to the replicas that connect; a
+    // replica starts applying the stream from its primary.
+    status = primary != NULL ? repl_follow() : repl_port > 0 ? repl_serve((uint16_t)repl_port, wal_path) : NoError;
+    if (status != NoError)
+    {
+        perror("ERROR: Failed to start replication");
+        repl_stop();
+        pool_stop();
+        wal_close();
+        shards_release();
+        snapshot_release();
+        return 1;
+    }
+
+    // --- Serve Requests ---
+    // server_run only returns once the server is stopped (SIGINT / SIGTERM) or fails to start.
+    status = server_run((uint16_t)port);
+
+    // Everything acknowledged so far reaches the disk before the tree is dropped.
+    repl_stop();
+    wal_close();
+
+    // A snapshot of the final state makes the log redundant, so the next start
+    // neither replays it nor loads anything but the snapshot header.
+    if (strcmp(snapshot_path, "off") != 0)
+    {
+        if (snapshot_save(snapshot_path) != NoError)
+        {
+            perror("ERROR: Failed to save the snapshot");
+        }
+        else if (strcmp(wal_path, "off") != 0 && truncate(wal_path, 0) != 0)
+        {
+            perror("ERROR: Failed to truncate the write-ahead log");
+        }
+    }
+
+    // --- Cleanup: Free Allocated Memory ---
+    // Dropping every shard returns all nodes and leaves to the slabs and then
+    // hands the slab chunks back to the system.
+    shards_release();
+    pool_stop(); // After the reaper, which finishes its last maintenance tasks on the pool.
+    snapshot_release(); // Materialized leaves may point into the mapping until here.
+    numa_release();     // The shards' slab and arena chunks, if they were placed.
+
+    if (trace_enabled)
+    {
+        trace_dump(stderr);
+    }
+
+    return status == NoError ? 0 : 1; // Non-zero if the server could not run.
+}
+#endif /* NoMain */
@@ -1,6 +1,14 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+// =============================================================================
+// Compiler-Specific Features
+// =============================================================================
+// _GNU_SOURCE: Enables GNU extensions for various standard library functions.
+//              Consider removing if strict portability to non-GNU systems is required.
+//              Must be defined before any system header is included to take effect.
+#define _GNU_SOURCE
+
 // =============================================================================
 // Standard Library Includes
 // =============================================================================
@@ -11,13 +19,28 @@
 #include <stdint.h> // For fixed-width integer types (e.g., uint8_t, int16_t)
 #include <assert.h> // For the assert() macro, used for debugging and pre-condition checks
 #include <errno.h>  // For error number definitions (e.g., EFAULT, ENOMEM)
+#include <pthread.h> // For the mutex that serializes tree writers
 
 // =============================================================================
-// Compiler-Specific Features
+// Project Includes
 // =============================================================================
-// _GNU_SOURCE: Enables GNU extensions for various standard library functions.
-//              Consider removing if strict portability to non-GNU systems is required.
-#define _GNU_SOURCE
+#include "epoch.h" // For epoch-based reclamation behind lock-free readers
+#include "index.h" // For the per-Node hashed key index
+#include "alloc.h" // For the slab and arena allocators backing Nodes, Leaves and values
+#include "server.h" // For the TCP request server
+#include "trace.h"  // For compile-time trace levels and the in-memory trace ring
+#include "wal.h"    // For the write-ahead log that makes the store durable
+#include "snapshot.h" // For memory-mapped snapshots and lazy Node loading
+#include "skiplist.h" // For key-ordered leaves, range seeks and cursors
+#include "metrics.h"  // For per-operation counters, latency histograms and the stats endpoint
+#include "uring.h"    // For the io_uring rings behind the write-ahead log
+#include "pool.h"     // For the work-stealing pool that runs requests and background work
+#include "codec.h"    // For value compression
+#include "simd.h"     // For the vectorized key comparison kernels
+#include "expire.h"   // For leaf expiry times and the timing wheels that delete expired leaves
+#include "repl.h"     // For streaming the write-ahead log to read replicas
+#include "numa.h"     // For placing shards on the NUMA nodes of their workers, and huge pages
+#include "fixed.h"    // For B+-trees specialized for fixed-width keys and values
 
 // =============================================================================
 // Database Node Tag Definitions
@@ -28,13 +51,125 @@
 #define TagNode 2 /* Represents an internal node in the tree structure */
 #define TagLeaf 3 /* Represents a leaf node, holding actual data entries */
 
+// =============================================================================
+// Sharding Definitions
+// =============================================================================
+// ShardCount: Number of independent trees the keyspace is partitioned into.
+// Override at build time (e.g. -DShardCount=1 for a single unsharded tree).
+#ifndef ShardCount
+#define ShardCount 16
+#endif
+
+// =============================================================================
+// Background Maintenance Definitions
+// =============================================================================
+// While the reaper runs (see reaper_start), each shard's maintenance task on
+// the pool frees dropped subtrees in slices, releasing the shard's writer
+// lock between slices, so dropping a huge subtree never stalls the writers of
+// its shard for long. The same task shrinks the hashed indexes of Nodes that
+// deletes have left mostly empty.
+#define ReapSlice 4096      /* Objects (Nodes, Leaves, towers) the reaper frees per lock hold */
+#define CompactSlice 16     /* Nodes whose indexes are compacted per lock hold */
+#define ShardCompactMax 64  /* Nodes per shard waiting for compaction; further candidates wait for their next delete */
+
+// =============================================================================
+// Memory Limit Definitions
+// =============================================================================
+// With a limit set (see memory_limit), the bytes the shards' allocators meter
+// are kept under it. Under EvictClock, every write that finds memory over the
+// limit evicts leaves of its own shard with the CLOCK algorithm: a hand per
+// shard sweeps its Nodes and their leaves in order, clearing the reference
+// bit that every read and write sets, and evicts the leaves whose bit is
+// already clear, i.e. that nobody used since the hand last went by. If that
+// is not enough, the maintenance tasks of every shard evict in the background
+// until memory is back under the limit. Under EvictNone, writes fail with
+// ENOMEM instead. Only leaves whose memory a delete gives back are evicted
+// (not those of snapshot Nodes), and in memory-bounded mode small values go
+// to the heap rather than to their Node's arena, so that they do too.
+#define EvictNone 0     /* Over the limit, writes fail */
+#define EvictClock 1    /* Over the limit, writes evict leaves not used since the CLOCK hand last passed */
+#define EvictSlice 256  /* Leaves (or Nodes) the hand visits per lock hold */
+
+// =============================================================================
+// Batch Definitions
+// =============================================================================
+// store_get_many and store_set_many resolve the paths and keys of a batch
+// interleaved. Every lookup in flight takes one dependent step per round (the
+// index lanes of a segment, the candidate they point to, the match) and
+// prefetches what its next step reads, so while one lookup waits on memory
+// the others proceed, and the misses of a whole window overlap instead of
+// following one another.
+#define BatchWindow 16 /* Lookups of a batch in flight at once */
+#define ProbeSegment 0 /* Batch lookup stage: take the next path segment (or the key) and prefetch its index lanes */
+#define ProbePeek 1    /* Batch lookup stage: prefetch the item the lanes point to */
+#define ProbeFind 2    /* Batch lookup stage: confirm the item and move on to it */
+#define ProbeDone 3    /* Batch lookup stage: the entry is resolved (or not found) */
+
+// =============================================================================
+// Node and Leaf Layout Definitions
+// =============================================================================
+#define PathSegmentMax 255 /* Longest path segment a Node can store, in bytes */
+#define LeafKeyMax 127     /* Longest key a Leaf can store, in bytes */
+#define LeafInlineSize 128 /* Leaves up to this size (header, key and value) store the value inline */
+#define LeafInline 0x01    /* Leaf flag: the value is stored inside the leaf, after the key */
+#define LeafHeap 0x02      /* Leaf flag: the value lives in a reference-counted ValueBlock on the heap (not in the Node's arena) */
+#define LeafArena 0x04     /* Leaf flag: the leaf itself lives in the Node's arena (see create_leaf_batch) */
+#define LeafMapped 0x08    /* Leaf flag: the value points into the read-only snapshot mapping */
+#define LeafPacked 0x10    /* Leaf flag: the value is compressed, in a LeafHeap block holding a PackedValue */
+#define NodeHeap 0x01      /* Node flag: the node was allocated with malloc (by the snapshot loader) */
+#define NodeCompact 0x02   /* Node flag: the node is waiting in its shard's compaction list */
+
 // =============================================================================
 // Macro Definitions
 // =============================================================================
 
 // find_last: A macro to abstract the underlying implementation of finding the last element.
-// Currently maps to find_last_linear, but can be changed to a more efficient algorithm later.
-#define find_last(x) find_last_linear(x)
+// Maps to find_last_tail, which reads the Node's cached tail pointer in O(1).
+// Switch back to find_last_linear to walk the 'east' chain instead (e.g. when
+// validating that the cached tail is consistent with the list).
+#define find_last(x) find_last_tail(x)
+
+// load_ptr / store_ptr: Access a link that lock-free readers may follow while a
+// writer updates it. Writers fully initialize an object before publishing it with
+// store_ptr (release), and readers pick it up with load_ptr (acquire), so a reader
+// that sees the pointer also sees everything written before it was published.
+#define load_ptr(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define store_ptr(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// value_block: Returns the ValueBlock that a LeafHeap value pointer points into.
+#define value_block(v) ((ValueBlock *)((uint8_t *)(v) - offsetof(ValueBlock, data)))
+
+// leaf_touch: Sets a Leaf's CLOCK reference bit, from any thread and without a
+// lock. The bit is only written when it is clear, so hot leaves do not keep
+// dirtying their cache line.
+#define leaf_touch(l) \
+    do { \
+        if (!__atomic_load_n(&(l)->referenced, __ATOMIC_RELAXED)) \
+            __atomic_store_n(&(l)->referenced, 1, __ATOMIC_RELAXED); \
+    } while(0)
+
+// get_u16 / get_u32 / get_u64 / put_u16 / put_u32 / put_u64: Read and write
+// little-endian integers at a byte pointer, whatever the host byte order. Used for
+// everything that leaves the process (the wire protocol, the write-ahead log).
+// `p` is evaluated more than once.
+#define get_u16(p) ((uint16_t)((p)[0] | ((p)[1] << 8)))
+#define get_u32(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+#define get_u64(p) ((uint64_t)get_u32(p) | ((uint64_t)get_u32((p) + 4) << 32))
+#define put_u16(p, v) \
+    do { \
+        (p)[0] = (uint8_t)(v); \
+        (p)[1] = (uint8_t)((v) >> 8); \
+    } while(0)
+#define put_u32(p, v) \
+    do { \
+        put_u16((p), (uint16_t)(v)); \
+        put_u16((p) + 2, (uint16_t)((uint32_t)(v) >> 16)); \
+    } while(0)
+#define put_u64(p, v) \
+    do { \
+        put_u32((p), (uint32_t)(v)); \
+        put_u32((p) + 4, (uint32_t)((uint64_t)(v) >> 32)); \
+    } while(0)
 
 // NoError: A custom error code indicating successful operation or no error.
 // Typically used with the `errno` variable.
@@ -49,6 +184,14 @@
         return NULL; \
     } while(0)
 
+// retfail: The status-code counterpart of reterr, for functions that return an
+// integer status (0 on success) instead of a pointer. Sets `errno` and returns -1.
+#define retfail(x) \
+    do { \
+        errno = (x); \
+        return -1; \
+    } while(0)
+
 // =============================================================================
 // Type Definitions
 // =============================================================================
@@ -69,29 +212,123 @@ union u_tree;
  * A Leaf node typically holds the actual key-value data. It forms a linked list
  * with other Leaf nodes via the `east` pointer, and can link back to a `Tree`
  * (Node or Leaf) via the `west` pointer, forming a double-linked structure
- * at the leaf level.
+ * at the leaf level. The list is kept in key order (see skiplist.h).
+ *
+ * Leaves are variable-sized: the key is stored right after the fixed header,
+ * and values small enough to keep the whole leaf within LeafInlineSize bytes
+ * are stored right after the key, so a short key/value pair is read from a
+ * single cache line. Larger values live out-of-line, compressed if their
+ * Node asks for it (see store_compress); `size` is always the size of the
+ * value as written and read. A leaf whose expiry has passed reads as absent
+ * until its shard's maintenance task deletes it (see expire.h).
  */
 struct s_leaf {
     union u_tree *west;  ///< Pointer to the preceding Tree (Node or Leaf) in the west direction.
     struct s_leaf *east; ///< Pointer to the next Leaf in the east (sibling) direction.
-    int8_t key[128];     ///< Fixed-size array for the key data (128 bytes).
-    uint8_t *value;       ///< Pointer to the dynamically allocated value data.
-    int16_t size;        ///< Size of the value data in bytes.
+    uint8_t *value;      ///< Pointer to the value data: into `key[]` when inline, else out-of-line.
+    uint32_t size;       ///< Size of the value data in bytes; values are arbitrary binary data.
+    uint32_t version;    ///< Value sequence number: odd while an update is rewriting the value (see leaf_read_begin).
+    uint8_t keylen;      ///< Length of the key in bytes (excluding the NUL terminator).
+    uint8_t sclass;      ///< Leaf size class the leaf was allocated from.
+    uint8_t flags;       ///< Storage flags (LeafInline, LeafHeap, LeafArena, LeafMapped, LeafPacked).
     Tag tag;             ///< Tag indicating this is a Leaf node (TagLeaf).
+    uint32_t expires;    ///< When the leaf expires, in Unix seconds, or ExpireNever.
+    uint8_t referenced;  ///< CLOCK reference bit: set, without a lock, by every read and write (see leaf_touch).
+    uint8_t key[];       ///< `keylen` key bytes and a NUL, followed by the value when LeafInline is set.
 };
 typedef struct s_leaf Leaf;
 
+/**
+ * @brief The heap allocation behind a LeafHeap value: a reference count followed by the value bytes.
+ *
+ * The leaf holds one reference, and every pinned ValueView one more; the
+ * block is freed by whoever drops the last one, without any lock.
+ */
+struct s_value_block {
+    uint32_t refs;     ///< Number of owners (the leaf, then one per pinned view).
+    uint32_t capacity; ///< Bytes allocated for `data` (a value updated in place may be shorter).
+    uint8_t data[];  ///< The value bytes; Leaf::value points here.
+};
+typedef struct s_value_block ValueBlock;
+
+/**
+ * @brief A compressed value: the contents of the ValueBlock of a LeafPacked leaf.
+ *
+ * Packed values are never updated in place and never pinned by a view (views
+ * get a decompressed copy), so readers only ever decompress them inside the
+ * epoch section they found the leaf in. The dictionary belongs to the Node
+ * and is freed with it.
+ */
+struct s_packed_value {
+    const CodecDict *dict; ///< The dictionary the value was compressed against, or NULL.
+    uint32_t len;          ///< Bytes in `data`.
+    uint32_t reserved;     ///< Padding; keeps `data` 8-byte aligned.
+    uint8_t data[];        ///< The compressed value (see codec.h).
+};
+typedef struct s_packed_value PackedValue;
+
+/**
+ * @brief A read-only view of a Leaf's value that stays valid until view_release.
+ *
+ * Unlike the Leaf it came from, a view may be kept after the epoch section
+ * ends, for instance until a slow client has been sent the bytes, and it
+ * survives the leaf being replaced or deleted meanwhile.
+ */
+struct s_value_view {
+    const uint8_t *data; ///< The value bytes.
+    uint32_t size;       ///< Size of the value data in bytes.
+    ValueBlock *block;   ///< The reference held on the value, or NULL if `data` needs none (snapshot mapping).
+};
+typedef struct s_value_view ValueView;
+
+/**
+ * @brief Describes one Leaf to create with create_leaf_batch.
+ */
+struct s_leaf_spec {
+    uint8_t *key;   ///< The NUL-terminated key.
+    uint8_t *value; ///< `size` bytes of value data, or NULL for a zero-filled value.
+    uint32_t size;  ///< Size of the value data in bytes.
+};
+typedef struct s_leaf_spec LeafSpec;
+
+/**
+ * @brief One entry of a store_get_many or store_set_many batch.
+ */
+struct s_batch_op {
+    const char *path;    ///< The NUL-terminated path of the Node.
+    uint8_t *key;        ///< The NUL-terminated key.
+    uint8_t *value;      ///< store_set_many: the value bytes.
+    uint32_t size;       ///< store_set_many: the size of the value in bytes.
+    int error;           ///< Set by the call: 0, or the errno the entry failed with.
+    struct s_node *node; ///< Set by the call: the Node at `path`, or NULL.
+    struct s_leaf *leaf; ///< Set by the call: the Leaf under `key`, or NULL.
+};
+typedef struct s_batch_op BatchOp;
+
 /**
  * @brief Represents an internal Node in the database tree.
  *
  * A Node typically organizes other Nodes and Leaves. It forms the hierarchical
- * structure of the database, allowing for path-based navigation.
+ * structure of the database, allowing for path-based navigation: every Node
+ * keeps a hashed child table keyed by path segment, so resolving "/a/b/c"
+ * costs one constant-time lookup per segment however many siblings exist.
  */
 struct s_node {
     struct s_node *north; ///< Pointer to the parent Node.
-    struct s_node *west;  ///< Pointer to a child Node (e.g., for sub-paths).
-    struct s_leaf *east;  ///< Pointer to the first Leaf in the list associated with this Node.
+    Index children;       ///< Child Nodes (sub-paths), keyed by their path segment.
+    struct s_leaf *east;  ///< Pointer to the first Leaf in the list associated with this Node, in key order.
+    struct s_leaf *tail;  ///< Pointer to the last Leaf in the 'east' list, kept for O(1) appends.
+    uint32_t count;       ///< Number of Leaves in the 'east' list (stored atomically: the stats read it without the lock).
+    Index index;          ///< Hashed key index over the Leaves in the 'east' list.
+    Skip *skip;           ///< Skiplist head over the 'east' list, or NULL until a leaf gets a tower.
+    struct s_allocator *alloc; ///< Size classes this Node and its descendants are allocated from.
+    Arena values;         ///< Bump arena holding the small values of this Node's Leaves.
+    const uint8_t *pending; ///< Snapshot record whose children and leaves are not loaded yet, or NULL (see node_ready).
     uint8_t path[256];    ///< Fixed-size array for the path segment represented by this Node.
+    CodecDict *dict;      ///< Dictionary values are compressed against (CodecSampled only), or NULL until sampled.
+    CodecDict *samples;   ///< Dictionary being sampled from the first values written (CodecSampled only), or NULL.
+    uint8_t flags;        ///< Storage flags (NodeHeap, NodeCompact).
+    uint8_t codec;        ///< Codec mode (CodecOff, CodecFast, CodecSampled) for values written here; inherited by new children.
     Tag tag;              ///< Tag indicating this is a Node (TagNode or TagRoot).
 };
 typedef struct s_node Node;
@@ -109,9 +346,43 @@ union u_tree {
 };
 typedef union u_tree Tree;
 
+/**
+ * @brief One partition of the keyspace.
+ *
+ * Each shard is a complete tree with its own allocator and writer lock. Every
+ * top-level path segment maps to exactly one shard (see shard_for_path), so a
+ * subtree never spans shards.
+ */
+struct s_shard {
+    Tree root;             ///< The root of this shard's tree (tagged TagRoot).
+    Allocator alloc;       ///< Node, Leaf and retirement state for this shard only.
+    pthread_mutex_t lock;  ///< Serializes the writers of this shard.
+    uint64_t lsn;          ///< Last WAL LSN already contained in the tree (from a snapshot); replay skips up to it.
+    Task maintenance;      ///< Reaps and compacts this shard on the pool (see reaper_start).
+    uint8_t maintaining;   ///< Set while `maintenance` is queued or running.
+    uint32_t requests;     ///< Maintenance requests so far, so none made during a pass is lost.
+    uint32_t compact_count; ///< Nodes in `compact`.
+    struct s_node *compact[ShardCompactMax]; ///< Nodes whose indexes deletes left sparse (flagged NodeCompact).
+    Wheel wheel;           ///< Timers of the leaves of this shard that expire.
+    struct s_node *hand;   ///< Node the CLOCK hand is in, or NULL to start at the root (reset when its subtree is dropped).
+    uint8_t hand_len;      ///< Length of `hand_key`.
+    uint8_t hand_key[LeafKeyMax + 1]; ///< The hand is at the first leaf of `hand` whose key is not below this one.
+};
+typedef struct s_shard Shard;
+
+/**
+ * @brief The shards of the in-memory database (see main.c).
+ */
+extern Shard shards[ShardCount];
+
 // =============================================================================
 // Function Prototypes
 // =============================================================================
+// Concurrency: functions that modify the tree (create_*, delete_*, drop_subtree)
+// must be serialized by the caller, e.g. with the tree's writer lock. Lookups
+// (find_*, resolve_path) take no locks and may run concurrently with a writer
+// from inside an epoch_enter/epoch_exit section; any Node or Leaf they return
+// stays valid until the section ends.
 
 /**
  * @brief Zeros out a specified block of memory.
@@ -119,19 +390,53 @@ typedef union u_tree Tree;
  * @param ptr   A pointer to the beginning of the memory block.
  * @param size  The number of bytes to set to zero.
  */
-void zero(uint8_t *ptr, uint16_t size);
+void zero(uint8_t *ptr, size_t size);
 
 /**
  * @brief Creates and initializes a new Node in the tree structure.
  *
- * The new node is linked as a 'west' child of the provided parent node.
+ * The new node is registered in the parent's child table under its path segment.
+ * Segments must be non-empty, must not contain '/', and are unique among siblings.
  *
  * @param parent A pointer to the parent Node under which the new node will be created.
  * @param path   A pointer to a character array (string) representing the path segment for the new node.
- * @return       A pointer to the newly created Node, or NULL if memory allocation fails.
+ * @return       A pointer to the newly created Node (allocated from the parent's allocator),
+ *               or NULL with errno set to ENOMEM, EINVAL (bad segment) or EEXIST (duplicate).
  */
 Node *create_node(Node *parent, int8_t *path);
 
+/**
+ * @brief Charges a Node's value arena and indexes to the meter of its allocator (see Allocator::bytes).
+ *
+ * create_node does this for the Nodes it creates; Nodes built by other means
+ * call it once their `alloc` is set, before anything is allocated for them.
+ *
+ * @param node A pointer to the Node.
+ */
+void node_meter(Node *node);
+
+/**
+ * @brief Looks up a direct child of a Node by its path segment.
+ *
+ * @param parent  A pointer to the Node whose children are searched.
+ * @param segment A pointer to the NUL-terminated path segment.
+ * @return        A pointer to the child Node, or NULL (with errno set to NoError) if there is none.
+ */
+Node *find_node(Node *parent, int8_t *segment);
+
+/**
+ * @brief Resolves a '/'-separated path such as "/a/b/c" to a Node.
+ *
+ * Empty segments are ignored, so "/a//b/" resolves like "/a/b", and "/" or ""
+ * resolves to `root` itself.
+ *
+ * @param root A pointer to the Node the path is relative to.
+ * @param path A pointer to the NUL-terminated path.
+ * @return     A pointer to the Node, or NULL with errno set to NoError (no such path)
+ *             or ENAMETOOLONG (a segment exceeds PathSegmentMax).
+ */
+Node *resolve_path(Node *root, const char *path);
+
 /**
  * @brief Finds the last Leaf in the 'east' linked list starting from a parent Node.
  *
@@ -143,22 +448,520 @@ Node *create_node(Node *parent, int8_t *path);
  */
 Leaf *find_last_linear(Node *parent);
 
+/**
+ * @brief Returns the last Leaf in the 'east' list using the Node's cached tail pointer.
+ *
+ * Runs in constant time regardless of list length. The tail pointer is maintained
+ * by every function that links or unlinks leaves under the Node.
+ *
+ * @param parent A pointer to the Node whose last leaf is requested.
+ * @return       A pointer to the last Leaf, or NULL (with errno set to NoError) if the list is empty.
+ */
+Leaf *find_last_tail(Node *parent);
+
 /**
  * @brief Creates and initializes a new Leaf node.
  *
  * This function allocates memory for a new Leaf, initializes its fields,
- * and links it to the provided 'west' tree element.
+ * and links it into the parent's 'east' list at its key's position: in
+ * constant time when the key sorts after every existing key, and in
+ * logarithmic time otherwise.
+ * Keys are unique per Node: if the key already exists, NULL is returned and
+ * errno is set to EEXIST (a leaf that has expired is deleted and replaced).
+ *
+ * @param parent A pointer to the Node that will own this new leaf.
+ * @param key    A pointer to the NUL-terminated key (truncated to LeafKeyMax bytes).
+ * @param count  The size of the value data associated with this leaf.
+ * @param value  A pointer to `count` bytes of value data, or NULL for a zero-filled value.
+ * @return       A pointer to the newly created Leaf, or NULL if memory allocation fails.
+ */
+Leaf *create_leaf(Node *parent, uint8_t *key, uint32_t count, uint8_t *value);
+
+/**
+ * @brief Creates a Leaf like create_leaf, taking over a value the caller already built in a ValueBlock.
+ *
+ * Values too large to go inline adopt the block as is, so they are never
+ * copied; inline-sized ones are copied and the block is released.
+ *
+ * @param parent A pointer to the Node that will own this new leaf.
+ * @param key    A pointer to the NUL-terminated key (truncated to LeafKeyMax bytes).
+ * @param block  A block from value_alloc holding `count` bytes of value data.
+ * @param count  The size of the value data.
+ * @return       A pointer to the newly created Leaf, or NULL with errno set (as for
+ *               create_leaf); the block then still belongs to the caller.
+ */
+Leaf *create_leaf_owned(Node *parent, uint8_t *key, ValueBlock *block, uint32_t count);
+
+/**
+ * @brief Creates many Leaves under a Node at once.
+ *
+ * All leaves and their values are carved from a single block of the Node's
+ * value arena, so loading K leaves costs one allocation and one index growth
+ * instead of K of each. When the keys are ascending and sort after every
+ * existing key, the leaves are also linked to each other in one pass and
+ * appended to the Node's leaf list with a single publish; otherwise each one
+ * is linked in at its key's position. The batch is all-or-nothing: on
+ * failure nothing has been created. The leaves are returned to the system
+ * together with the Node, so this suits bulk loads rather than short-lived keys.
+ *
+ * @param parent A pointer to the Node the leaves will belong to.
+ * @param specs  An array of `count` key/value descriptions.
+ * @param count  The number of leaves to create.
+ * @return       0 on success, or -1 with errno set to EEXIST if a key is
+ *               already present (or repeated in the batch), or ENOMEM.
+ */
+int8_t create_leaf_batch(Node *parent, const LeafSpec *specs, uint32_t count);
+
+/**
+ * @brief Looks up a Leaf under a Node by its key.
+ *
+ * Uses the Node's hashed key index, so the cost does not depend on the number
+ * of leaves under the Node. A leaf that has expired is not found.
+ *
+ * @param parent A pointer to the Node whose leaves are searched.
+ * @param key    A pointer to the NUL-terminated key to look up.
+ * @return       A pointer to the matching Leaf, or NULL (with errno set to NoError) if there is none.
+ */
+Leaf *find_leaf(Node *parent, uint8_t *key);
+
+/**
+ * @brief Unlinks a Leaf from its parent Node and frees it together with its value.
+ *
+ * The memory is reclaimed once no concurrent reader can still reach the leaf.
+ * A leaf that has expired is deleted too, but reported as ENOENT.
+ *
+ * @param parent A pointer to the Node that owns the leaf.
+ * @param key    A pointer to the NUL-terminated key of the leaf to delete.
+ * @return       0 on success, or -1 with errno set to ENOENT if no leaf has that key.
+ */
+int8_t delete_leaf(Node *parent, uint8_t *key);
+
+/**
+ * @brief Replaces the value of an existing Leaf, rewriting it in place when the new value fits.
+ *
+ * A value fits when it is no larger than the storage it replaces: the rest of
+ * the leaf's size class for inline values, the ValueBlock's capacity for heap
+ * values (unless a view pins the block) and the old size for arena values.
+ * Otherwise the new value gets storage of its own and the leaf is switched
+ * over to it; the old storage is reclaimed after a grace period. Either way
+ * the leaf keeps its place, so nothing is allocated for the common case of a
+ * value rewritten with the same size.
+ *
+ * Readers copying the value concurrently must use leaf_read_begin and
+ * leaf_read_retry (or leaf_view); every update advances the leaf's version.
+ *
+ * @param parent A pointer to the Node that owns the leaf.
+ * @param key    A pointer to the NUL-terminated key of the leaf to update.
+ * @param count  The size of the new value in bytes.
+ * @param value  A pointer to the new value bytes, or NULL for a zero-filled value.
+ * @return       0 on success, or -1 with errno set to ENOENT (no leaf has that key) or ENOMEM.
+ */
+int8_t update_leaf(Node *parent, uint8_t *key, uint32_t count, uint8_t *value);
+
+/**
+ * @brief Replaces the value of a Leaf like update_leaf, but only if its version is still `*version`.
+ *
+ * Take the version from leaf_read_begin. Versions count updates of one leaf:
+ * a leaf deleted and created again starts over.
  *
- * @param west  A pointer to the `Tree` (Node or Leaf) that will be the 'west' link to this new leaf.
- * @param key   A pointer to the key data for this leaf.
- * @param size  The size of the value data associated with this leaf.
- * @return      A pointer to the newly created Leaf, or NULL if memory allocation fails.
+ * @param parent  A pointer to the Node that owns the leaf.
+ * @param key     A pointer to the NUL-terminated key of the leaf to update.
+ * @param version The expected version; receives the current one (the new one on success).
+ * @param count   The size of the new value in bytes.
+ * @param value   A pointer to the new value bytes, or NULL for a zero-filled value.
+ * @return        0 on success, or -1 with errno set to ECANCELED (the version
+ *                differs), ENOENT or ENOMEM.
  */
-Leaf *create_leaf(Node *parent, uint8_t *key, uint16_t count, uint8_t value);
+int8_t update_leaf_cas(Node *parent, uint8_t *key, uint32_t *version, uint32_t count, uint8_t *value);
+
+/**
+ * @brief Starts a consistent read of a Leaf's value: returns its version and a matching pointer and size.
+ *
+ * Lock-free: waits out an update in progress. Copy the bytes (with
+ * value_copy, which also decompresses packed values), then call
+ * leaf_read_retry; if it reports an update, discard the copy and start over.
+ * The pointer stays valid until the epoch section ends, and `size` never
+ * exceeds the storage behind it, even if an update tears the bytes.
+ *
+ * @param leaf  A pointer to the Leaf, found inside the current epoch section.
+ * @param value Receives the value pointer.
+ * @param size  Receives the value size.
+ * @param flags Receives the storage flags, or NULL.
+ * @return      The (even) version of the value.
+ */
+uint32_t leaf_read_begin(const Leaf *leaf, const uint8_t **value, uint32_t *size, uint8_t *flags);
+
+/**
+ * @brief Reports whether a Leaf's value changed since leaf_read_begin returned `version`.
+ *
+ * @return Non-zero if the bytes read since then may be torn.
+ */
+int leaf_read_retry(const Leaf *leaf, uint32_t version);
+
+/**
+ * @brief Copies a value returned by leaf_read_begin into `dst`, decompressing it if it is packed.
+ *
+ * Call it between leaf_read_begin and leaf_read_retry, in place of a memcpy.
+ *
+ * @param dst   Output buffer of `size` bytes.
+ * @param value The value pointer from leaf_read_begin.
+ * @param size  The value size from leaf_read_begin.
+ * @param flags The storage flags from leaf_read_begin.
+ * @return      0 on success, or -1 with errno set to EINVAL if a packed value is corrupt.
+ */
+int8_t value_copy(uint8_t *dst, const uint8_t *value, uint32_t size, uint8_t flags);
+
+/**
+ * @brief Reports whether a Leaf's expiry has passed.
+ *
+ * Lookups (find_leaf, store_get, store_view and the batch lookups) already
+ * leave expired leaves out; walks of a Node's leaves call this to do the same.
+ *
+ * @param leaf A pointer to the Leaf.
+ * @param now  The current time from expire_clock, or 0 to read the clock only if the leaf has an expiry.
+ * @return     Non-zero if the leaf has expired.
+ */
+int leaf_expired(const Leaf *leaf, uint32_t now);
+
+/**
+ * @brief Arms the expiries of the leaves of a Node built from a snapshot, from any thread.
+ *
+ * Snapshot Nodes may be loaded by readers holding no lock, so the timers are
+ * handed to the shard's wheel through its inbox.
+ *
+ * @param node A pointer to the Node, whose leaves' `expires` are set.
+ * @return     0 on success, or -1 with errno set to ENOMEM (the leaves left
+ *             without a timer then only expire lazily).
+ */
+int8_t expire_post(Node *node);
+
+/**
+ * @brief Returns the bytes a Leaf costs: its slab object and the heap block of its value.
+ *
+ * This is what deleting the leaf gives back to the allocator once its grace
+ * period is over. Leaves carved from a Node's arena (snapshot and batch
+ * loads) and arena values cost nothing here: they go back with the Node.
+ *
+ * @param leaf A pointer to the Leaf.
+ * @return     The cost in bytes.
+ */
+size_t leaf_cost(const Leaf *leaf);
+
+/**
+ * @brief Returns the bytes a Node costs apart from its leaves: itself, its value arena and its indexes.
+ *
+ * @param node A pointer to the Node.
+ * @return     The cost in bytes.
+ */
+size_t node_cost(const Node *node);
+
+/**
+ * @brief Sets the memory limit and what happens once it is reached (see EvictClock).
+ *
+ * @param bytes  The most bytes the shards may hold, or 0 for no limit.
+ * @param policy EvictClock or EvictNone.
+ */
+void memory_limit(size_t bytes, uint8_t policy);
+
+/**
+ * @brief Returns the bytes held by every shard, as their allocators meter them. Any thread may call it.
+ */
+size_t memory_used(void);
+
+/**
+ * @brief Returns the memory limit set with memory_limit, or 0 if there is none.
+ */
+size_t memory_max(void);
+
+/**
+ * @brief Detaches a Node from its parent and frees it together with everything below it.
+ *
+ * Nodes and Leaves go back to their slabs, and each Node's value arena is
+ * released as a whole rather than value by value. The subtree becomes
+ * unreachable immediately and is freed once no concurrent reader can be in it;
+ * while the reaper runs, the shard's maintenance task does the freeing in the
+ * background, so the caller only pays for the detach.
+ *
+ * @param node A pointer to the Node to drop. Must not be the root.
+ */
+void drop_subtree(Node *node);
+
+/**
+ * @brief Drops the child Node under a path segment, together with its subtree (see drop_subtree).
+ *
+ * @param parent  A pointer to the parent Node.
+ * @param segment A pointer to the NUL-terminated path segment of the child.
+ * @return        0 on success, or -1 with errno set to ENOENT if there is no such child.
+ */
+int8_t delete_node(Node *parent, int8_t *segment);
+
+/**
+ * @brief Starts background maintenance of every shard on the pool, which must be running.
+ *
+ * From then on, each shard's maintenance task (pinned to the shard's home
+ * worker) frees dropped subtrees, reclaims retired items that no further
+ * writes would reach, compacts the indexes of Nodes that deletes have left
+ * sparse, deletes expired leaves and evicts leaves while memory is over the
+ * limit (see EvictClock); an expiry clock thread wakes the tasks
+ * of the shards with timers every ExpireTickMs. Until it is started, and after
+ * reaper_stop, drop_subtree's grace period ends with the subtree being freed
+ * in one go by whichever writer reclaims it, indexes are never shrunk, and
+ * expired leaves stay (unreadable) until something writes their key.
+ *
+ * @return 0 on success, or -1 with errno set to EINVAL if the pool is not running.
+ */
+int8_t reaper_start(void);
+
+/**
+ * @brief Stops background maintenance, waits for passes in progress and frees whatever was not reclaimed yet.
+ *
+ * Does nothing if maintenance is not running. Called by shards_release, and
+ * before pool_stop.
+ */
+void reaper_stop(void);
+
+/**
+ * @brief Initializes every shard with an empty root, an allocator and a writer lock.
+ */
+void shards_init(void);
+
+/**
+ * @brief Frees every shard's tree and allocator.
+ *
+ * No other thread may use the shards during or after the call.
+ */
+void shards_release(void);
+
+/**
+ * @brief Returns the shard owning a path.
+ *
+ * The shard is chosen by hashing the first segment of the path, so "/a/b" and
+ * "/a/c" always land in the same shard. Paths without any segment map to the
+ * shard of the empty segment.
+ *
+ * @param path A pointer to the NUL-terminated path (e.g. "/users/42").
+ * @return     A pointer to the owning shard; never NULL.
+ */
+Shard *shard_for_path(const char *path);
+
+/**
+ * @brief Resolves a path like resolve_path, creating every missing Node on the way.
+ *
+ * Must be called with the tree's writer lock held.
+ *
+ * @param root A pointer to the Node the path is relative to.
+ * @param path A pointer to the NUL-terminated path.
+ * @return     A pointer to the Node, or NULL with errno set (see create_node and resolve_path).
+ */
+Node *create_path(Node *root, const char *path);
+
+/**
+ * @brief Resolves a full path in the shard that owns it.
+ *
+ * Lock-free; must be called inside an epoch section.
+ *
+ * @param path A pointer to the NUL-terminated path.
+ * @return     A pointer to the Node, or NULL (errno as for resolve_path).
+ */
+Node *store_resolve(const char *path);
+
+/**
+ * @brief Looks up the Leaf stored under `key` at `path`.
+ *
+ * Lock-free; must be called inside an epoch section, and the Leaf is only
+ * valid until that section ends. Its value may be updated in place meanwhile;
+ * read it with leaf_read_begin / leaf_read_retry, or take a view.
+ *
+ * @param path A pointer to the NUL-terminated path of the Node.
+ * @param key  A pointer to the NUL-terminated key.
+ * @return     A pointer to the Leaf, or NULL (with errno set to NoError) if the path or key does not exist.
+ */
+Leaf *store_get(const char *path, uint8_t *key);
+
+/**
+ * @brief Allocates a ValueBlock for a value of `size` bytes, with one reference held by the caller.
+ *
+ * Fill in `data` and hand the block to create_leaf_owned or store_set_owned,
+ * or drop it with value_unref.
+ *
+ * @param size The size of the value in bytes.
+ * @return     A pointer to the block, or NULL with errno set to ENOMEM.
+ */
+ValueBlock *value_alloc(uint32_t size);
+
+/**
+ * @brief Drops one reference to a ValueBlock, freeing it with the last one. Safe from any thread.
+ *
+ * @param block A pointer to the block.
+ */
+void value_unref(ValueBlock *block);
+
+/**
+ * @brief Looks up a batch of keys like store_get, overlapping their memory accesses.
+ *
+ * Must be called inside an epoch section; the leaves found stay valid until it
+ * ends. The values of those leaves are prefetched as well, for the caller to
+ * read next.
+ *
+ * @param ops   The entries; `path` and `key` are read, `error`, `node` and `leaf` set
+ *              (`error` is ENOENT for a missing path or key, or ENAMETOOLONG).
+ * @param count The number of entries.
+ */
+void store_get_many(BatchOp *ops, uint32_t count);
+
+/**
+ * @brief Stores a batch of values like store_set, resolving their paths and keys as store_get_many does.
+ *
+ * Holds the writer locks of every shard the batch touches (taken in shard
+ * order) for the whole batch, so other writers see all of it or none of it;
+ * entries are applied and logged in order, so a later entry for the same key wins.
+ *
+ * @param ops   The entries; `path`, `key`, `value` and `size` are read, `error` and `leaf` (the Leaf written) set.
+ * @param count The number of entries.
+ * @return      0 if every entry was stored, or -1 with errno set to the error of the first entry that was not.
+ */
+int8_t store_set_many(BatchOp *ops, uint32_t count);
+
+/**
+ * @brief Makes a view of a Leaf's value that outlives the current epoch section.
+ *
+ * Must be called inside the epoch section the Leaf was found in. Large values
+ * are pinned in place rather than copied; small ones (stored inline or in the
+ * Node's arena) are copied into a block of their own, and packed ones are
+ * decompressed into one.
+ *
+ * @param leaf A pointer to the Leaf.
+ * @param view A pointer to the view to fill in; release it with view_release.
+ * @return     0 on success, or -1 with errno set to ENOMEM or EINVAL (corrupt packed value).
+ */
+int8_t leaf_view(Leaf *leaf, ValueView *view);
+
+/**
+ * @brief Looks up the value stored under `key` at `path` and returns a view of it.
+ *
+ * Lock-free, and needs no epoch section from the caller.
+ *
+ * @param path A pointer to the NUL-terminated path of the Node.
+ * @param key  A pointer to the NUL-terminated key.
+ * @param view A pointer to the view to fill in; release it with view_release.
+ * @return     0 on success, or -1 with errno set to ENOENT (no such path or key),
+ *             ENAMETOOLONG or ENOMEM.
+ */
+int8_t store_view(const char *path, uint8_t *key, ValueView *view);
+
+/**
+ * @brief Drops the reference a view holds on its value. The view must not be used afterwards.
+ *
+ * May be called from any thread, with or without an epoch section or shard lock.
+ *
+ * @param view A pointer to the view to release.
+ */
+void view_release(ValueView *view);
+
+/**
+ * @brief Stores a value under `key` at `path`, creating the path and replacing any existing value and expiry.
+ *
+ * Takes the owning shard's writer lock and appends the write to the
+ * write-ahead log (if open); use wal_wait to wait for it to become durable.
+ *
+ * @param path  A pointer to the NUL-terminated path of the Node.
+ * @param key   A pointer to the NUL-terminated key.
+ * @param size  The size of the value in bytes.
+ * @param value A pointer to the value bytes.
+ * @return      0 on success, or -1 with errno set (ENOMEM also when memory is
+ *              over the limit under EvictNone). If only the logging failed,
+ *              the value is stored in memory but will not survive a restart.
+ */
+int8_t store_set(const char *path, uint8_t *key, uint32_t size, uint8_t *value);
+
+/**
+ * @brief Stores a value like store_set, and makes it expire at a given time.
+ *
+ * @param path    A pointer to the NUL-terminated path of the Node.
+ * @param key     A pointer to the NUL-terminated key.
+ * @param size    The size of the value in bytes.
+ * @param value   A pointer to the value bytes.
+ * @param expires When the value expires, in Unix seconds (see expire_clock), or ExpireNever.
+ * @return        0 on success, or -1 with errno set (as for store_set).
+ */
+int8_t store_set_expiring(const char *path, uint8_t *key, uint32_t size, uint8_t *value, uint32_t expires);
+
+/**
+ * @brief Changes when the value under `key` at `path` expires, keeping the value.
+ *
+ * Takes the owning shard's writer lock and appends the change to the
+ * write-ahead log (if open), as store_set does. An expiry already passed
+ * deletes the value.
+ *
+ * @param path    A pointer to the NUL-terminated path of the Node.
+ * @param key     A pointer to the NUL-terminated key.
+ * @param expires When the value expires, in Unix seconds, or ExpireNever to keep it for good.
+ * @return        0 on success, or -1 with errno set to ENOENT (no such path or key) or ENOMEM.
+ */
+int8_t store_expire(const char *path, uint8_t *key, uint32_t expires);
+
+/**
+ * @brief Stores a value like store_set, taking over a ValueBlock the caller built instead of copying it.
+ *
+ * The block is consumed whether or not the call succeeds.
+ *
+ * @param path  A pointer to the NUL-terminated path of the Node.
+ * @param key   A pointer to the NUL-terminated key.
+ * @param block A block from value_alloc holding `size` bytes of value data.
+ * @param size  The size of the value in bytes.
+ * @return      0 on success, or -1 with errno set (as for store_set).
+ */
+int8_t store_set_owned(const char *path, uint8_t *key, ValueBlock *block, uint32_t size);
+
+/**
+ * @brief Replaces the value under `key` at `path` only if the Leaf's version is still `*version` (see update_leaf_cas).
+ *
+ * The leaf keeps its expiry. Takes the owning shard's writer lock and appends
+ * the write to the write-ahead log (if open), as store_set does.
+ *
+ * @param path    A pointer to the NUL-terminated path of the Node.
+ * @param key     A pointer to the NUL-terminated key.
+ * @param version The expected version; receives the current one (the new one on success).
+ * @param size    The size of the value in bytes.
+ * @param value   A pointer to the value bytes.
+ * @return        0 on success, or -1 with errno set to ECANCELED, ENOENT or ENOMEM.
+ */
+int8_t store_cas(const char *path, uint8_t *key, uint32_t *version, uint32_t size, uint8_t *value);
+
+/**
+ * @brief Deletes the Leaf under `key` at `path`, or the whole subtree at `path` if `key` is NULL or empty.
+ *
+ * Takes the owning shard's writer lock and appends the delete to the
+ * write-ahead log (if open), as store_set does.
+ *
+ * @param path A pointer to the NUL-terminated path.
+ * @param key  A pointer to the NUL-terminated key, or NULL.
+ * @return     0 on success, or -1 with errno set to ENOENT (no such path or key) or EINVAL (shard root).
+ */
+int8_t store_del(const char *path, uint8_t *key);
+
+/**
+ * @brief Sets the codec mode of the subtree at `path`, creating the path.
+ *
+ * Applies to the Node, every Node below it and every Node created below it
+ * later; a path without segments (such as "/") sets every shard root. Values
+ * of at least CodecMinSize bytes written from then on are stored compressed
+ * (CodecFast), or compressed against a dictionary each Node samples from its
+ * first values (CodecSampled), whenever that saves space. Values already stored
+ * keep their form until rewritten; CodecOff stores values raw again. Takes
+ * the shard writer locks and appends the change to the write-ahead log.
+ *
+ * @param path  A pointer to the NUL-terminated path.
+ * @param codec CodecOff, CodecFast or CodecSampled.
+ * @return      0 on success, or -1 with errno set to EINVAL (unknown mode) or ENOMEM.
+ */
+int8_t store_compress(const char *path, uint8_t codec);
 
 /**
  * @brief Main function - The entry point for the database server application.
  *
+ * Usage: my_in_memory_db.exe [port]. Serves requests until SIGINT or SIGTERM.
+ *
  * @param argc The number of command-line arguments.
  * @param argv An array of strings containing the command-line arguments.
  * @return     0 on successful execution, non-zero on error.
@@ -0,0 +1,508 @@
+/* metrics.c */
+#include "main.h"
+
+#include <time.h> // For clock_gettime
+
+/**
+ * @brief The counters of one thread. Only the owner writes them (except for
+ *        the shared overflow record); stats readers sum them with relaxed loads.
+ */
+struct s_metrics_thread {
+    uint64_t counts[MetricOpCount];                       ///< Operations performed, by operation.
+    uint64_t total_ns[MetricTimedCount];                  ///< Summed latency of the timed operations.
+    uint64_t buckets[MetricTimedCount][MetricBucketCount]; ///< Latency histograms of the timed operations.
+};
+typedef struct s_metrics_thread MetricsThread;
+
+/**
+ * @brief Allocator and tree statistics, summed over every shard.
+ */
+struct s_tree_stats {
+    uint64_t nodes;             ///< Loaded Nodes.
+    uint64_t pending;           ///< Nodes still waiting to be loaded from the snapshot.
+    uint64_t leaves;            ///< Leaves under loaded Nodes.
+    uint64_t slab_reserved[3];  ///< Bytes of slab chunks for Nodes, Leaves and towers.
+    uint64_t slab_live[3];      ///< Bytes of live slab objects for Nodes, Leaves and towers.
+    uint64_t arena_reserved;    ///< Bytes of Node value arena chunks.
+    uint64_t values[5];         ///< Value bytes stored inline, in arenas, on the heap, in the snapshot mapping and compressed.
+    uint64_t packed;            ///< Bytes the compressed values take (their PackedValue blocks).
+    uint64_t lengths[33];       ///< Nodes by leaf count: 0, then [2^(i-1), 2^i) for bucket i.
+    uint64_t length_sum;        ///< Leaves summed over the Nodes in `lengths`.
+    uint64_t timers;            ///< Expiry timers in the shard wheels.
+};
+typedef struct s_tree_stats TreeStats;
+
+static MetricsThread *records[MetricsMaxThreads]; // Private records, published in registration order.
+static uint32_t record_count = 0;                 // Slots handed out so far (may exceed MetricsMaxThreads).
+static MetricsThread shared;                      // Record of every thread without a private one.
+static _Thread_local MetricsThread *self = NULL;  // The calling thread's record.
+
+static const char *op_names[MetricOpCount] = {
+    "get", "set", "del", "view", "list", "scan", "get_many", "set_many",
+    "create_node", "create_leaf", "leaf_batch", "delete_leaf", "drop_subtree", "materialize",
+    "update_leaf", "update_in_place", "compact_index", "pack_value", "expire", "evict",
+};
+static const char *slab_names[3] = {"nodes", "leaves", "towers"};
+static const char *value_names[5] = {"inline", "arena", "heap", "mapped", "packed"};
+
+// Returns the calling thread's record, registering it on first use.
+static MetricsThread *metrics_self(void)
+{
+    uint32_t slot;
+    int error;
+
+    if (self != NULL)
+    {
+        return self;
+    }
+
+    // Registration must not disturb the errno of the operation being measured.
+    error = errno;
+    self = &shared;
+    slot = __atomic_fetch_add(&record_count, 1, __ATOMIC_RELAXED);
+    if (slot < MetricsMaxThreads)
+    {
+        self = (MetricsThread *)calloc(1, sizeof(MetricsThread));
+        if (self == NULL)
+        {
+            self = &shared;
+        }
+        else
+        {
+            store_ptr(records[slot], self);
+        }
+    }
+    errno = error;
+
+    return self;
+}
+
+// Adds `n` to a counter of the calling thread's record. A private record has
+// a single writer, so a plain relaxed store suffices; the shared one needs an
+// atomic add.
+static void bump(MetricsThread *rec, uint64_t *counter, uint64_t n)
+{
+    if (rec == &shared)
+    {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+}
+
+// Returns the histogram bucket of a latency: exact below 8 ns, then eight
+// buckets per power of two.
+static uint32_t bucket_of(uint64_t ns)
+{
+    uint32_t exp, index;
+
+    if (ns < 8)
+    {
+        return (uint32_t)ns;
+    }
+    exp = 63 - (uint32_t)__builtin_clzll(ns);
+    index = (exp - 2) * 8 + (uint32_t)((ns >> (exp - 3)) & 7);
+
+    return index < MetricBucketCount ? index : MetricBucketCount - 1;
+}
+
+// Returns the smallest latency that falls into `index` (the inverse of bucket_of).
+static uint64_t bucket_floor(uint32_t index)
+{
+    if (index < 8)
+    {
+        return index;
+    }
+
+    return (uint64_t)(8 + index % 8) << (index / 8 - 1);
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_record(uint8_t op, uint64_t ns)
+{
+    MetricsThread *rec = metrics_self();
+
+    assert(op < MetricTimedCount && "Error: Operation has no latency histogram.");
+
+    bump(rec, &rec->counts[op], 1);
+    bump(rec, &rec->total_ns[op], ns);
+    bump(rec, &rec->buckets[op][bucket_of(ns)], 1);
+}
+
+void metrics_count(uint8_t op)
+{
+    MetricsThread *rec = metrics_self();
+
+    assert(op < MetricOpCount && "Error: Unknown metrics operation.");
+
+    bump(rec, &rec->counts[op], 1);
+}
+
+// Adds every thread's counters into `sum`.
+static void metrics_sum(MetricsThread *sum)
+{
+    MetricsThread *rec;
+    uint32_t i, count, op, b;
+
+    zero((uint8_t *)sum, sizeof(MetricsThread));
+    count = __atomic_load_n(&record_count, __ATOMIC_RELAXED);
+
+    for (i = 0; i <= count && i <= MetricsMaxThreads; i++)
+    {
+        // The shared record goes last; unpublished slots are still NULL.
+        rec = i < count && i < MetricsMaxThreads ? load_ptr(records[i]) : &shared;
+        if (rec == NULL)
+        {
+            continue;
+        }
+        for (op = 0; op < MetricOpCount; op++)
+        {
+            sum->counts[op] += __atomic_load_n(&rec->counts[op], __ATOMIC_RELAXED);
+        }
+        for (op = 0; op < MetricTimedCount; op++)
+        {
+            sum->total_ns[op] += __atomic_load_n(&rec->total_ns[op], __ATOMIC_RELAXED);
+            for (b = 0; b < MetricBucketCount; b++)
+            {
+                sum->buckets[op][b] += __atomic_load_n(&rec->buckets[op][b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+// Returns the latency below which a fraction `q` of the recorded operations
+// fall, taken as the upper edge of the bucket holding that rank.
+static uint64_t quantile(const uint64_t *buckets, double q)
+{
+    uint64_t total = 0, seen = 0, rank;
+    uint32_t b;
+
+    for (b = 0; b < MetricBucketCount; b++)
+    {
+        total += buckets[b];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    rank = (uint64_t)(q * (double)(total - 1)) + 1;
+    for (b = 0; b < MetricBucketCount; b++)
+    {
+        seen += buckets[b];
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+
+    return b + 1 < MetricBucketCount ? bucket_floor(b + 1) - 1 : bucket_floor(b);
+}
+
+// Adds a slab's reserved and live bytes to `stats` under `kind`.
+static void slab_stats(TreeStats *stats, int kind, const Slab *slab)
+{
+    stats->slab_reserved[kind] += __atomic_load_n(&slab->reserved, __ATOMIC_RELAXED);
+    stats->slab_live[kind] += __atomic_load_n(&slab->live, __ATOMIC_RELAXED) * slab->object_size;
+}
+
+// Adds one loaded Node and its leaves to `stats`. The caller is inside an
+// epoch; writers may change the Node meanwhile.
+static void node_stats(TreeStats *stats, const Node *node)
+{
+    const Leaf *leaf;
+    const uint8_t *value;
+    uint32_t bucket = 0, count, size;
+    uint8_t flags;
+
+    count = __atomic_load_n(&node->count, __ATOMIC_RELAXED);
+    stats->nodes++;
+    stats->leaves += count;
+    stats->arena_reserved += __atomic_load_n(&node->values.bytes, __ATOMIC_RELAXED);
+    if (count > 0)
+    {
+        bucket = 32 - (uint32_t)__builtin_clz(count);
+    }
+    stats->lengths[bucket]++;
+    stats->length_sum += count;
+
+    for (leaf = load_ptr(node->east); leaf != NULL; leaf = load_ptr(leaf->east))
+    {
+        leaf_read_begin(leaf, &value, &size, &flags);
+        if (flags & LeafInline)
+        {
+            stats->values[0] += size;
+        }
+        else if (flags & LeafPacked)
+        {
+            stats->values[4] += size;
+            stats->packed += value_block(value)->capacity;
+        }
+        else if (flags & LeafHeap)
+        {
+            stats->values[2] += size;
+        }
+        else if (flags & LeafMapped)
+        {
+            stats->values[3] += size;
+        }
+        else
+        {
+            stats->values[1] += size;
+        }
+    }
+}
+
+// Adds one shard to `stats`. The caller is inside an epoch, and holds no lock:
+// the figures are a snapshot as of no single instant, and writers never wait.
+static int8_t shard_stats(TreeStats *stats, Shard *shard)
+{
+    Node **stack, **grown, *node, *child;
+    size_t depth = 0, capacity = 64;
+    uint32_t cursor, sclass;
+
+    slab_stats(stats, 0, &shard->alloc.nodes);
+    for (sclass = 0; sclass < LeafClassCount; sclass++)
+    {
+        slab_stats(stats, 1, &shard->alloc.leaves[sclass]);
+    }
+    for (sclass = 0; sclass < SkipMaxLevel; sclass++)
+    {
+        slab_stats(stats, 2, &shard->alloc.towers[sclass]);
+    }
+
+    stack = (Node **)malloc(capacity * sizeof(Node *));
+    if (stack == NULL)
+    {
+        retfail(ENOMEM);
+    }
+    stack[depth++] = &shard->root.node;
+
+    while (depth > 0)
+    {
+        node = stack[--depth];
+        if (load_ptr(node->pending) != NULL)
+        {
+            stats->pending++; // Stats never force a Node to load.
+            continue;
+        }
+        node_stats(stats, node);
+
+        cursor = 0;
+        while ((child = (Node *)index_next(&node->children, &cursor)) != NULL)
+        {
+            if (depth == capacity)
+            {
+                grown = (Node **)realloc(stack, 2 * capacity * sizeof(Node *));
+                if (grown == NULL)
+                {
+                    free(stack);
+                    retfail(ENOMEM);
+                }
+                stack = grown;
+                capacity *= 2;
+            }
+            stack[depth++] = child;
+        }
+    }
+
+    free(stack);
+
+    return NoError;
+}
+
+// Writes the replication metrics: the replicas a primary serves, or how far
+// behind its primary a replica is. Nothing if replication is off.
+static void metrics_repl(FILE *out)
+{
+    ReplStats repl;
+    ReplicaStats *replica;
+    uint32_t i;
+
+    repl_stats(&repl);
+    if (repl.role == ReplPrimary)
+    {
+        fprintf(out, "# HELP db_repl_replicas Replicas connected.\n# TYPE db_repl_replicas gauge\n");
+        fprintf(out, "db_repl_replicas %u\n", repl.replicas);
+        fprintf(out, "# HELP db_repl_bootstraps_total Snapshots sent to replicas.\n# TYPE db_repl_bootstraps_total counter\n");
+        fprintf(out, "db_repl_bootstraps_total %llu\n", (unsigned long long)repl.bootstraps);
+        fprintf(out, "# HELP db_repl_sent_bytes_total Log bytes sent, per replica.\n# TYPE db_repl_sent_bytes_total counter\n");
+        for (i = 0; i < repl.replicas; i++)
+        {
+            replica = &repl.replica[i];
+            fprintf(out, "db_repl_sent_bytes_total{replica=\"%s\"} %llu\n", replica->name,
+                    (unsigned long long)replica->sent_bytes);
+        }
+        fprintf(out, "# HELP db_repl_lag_records Records logged but not yet acknowledged, per replica.\n"
+                     "# TYPE db_repl_lag_records gauge\n");
+        for (i = 0; i < repl.replicas; i++)
+        {
+            replica = &repl.replica[i];
+            fprintf(out, "db_repl_lag_records{replica=\"%s\"} %llu\n", replica->name,
+                    (unsigned long long)(repl.written_lsn > replica->acked_lsn ? repl.written_lsn - replica->acked_lsn : 0));
+        }
+    }
+    else if (repl.role == ReplReplica)
+    {
+        fprintf(out, "# HELP db_repl_connected Whether the stream from the primary is up.\n# TYPE db_repl_connected gauge\n");
+        fprintf(out, "db_repl_connected %u\n", repl.connected);
+        fprintf(out, "# HELP db_repl_applied_lsn LSN of the last record applied.\n# TYPE db_repl_applied_lsn gauge\n");
+        fprintf(out, "db_repl_applied_lsn %llu\n", (unsigned long long)repl.applied_lsn);
+        fprintf(out, "# HELP db_repl_lag_records Records the primary had written but this replica had not applied, as of the last frame.\n"
+                     "# TYPE db_repl_lag_records gauge\n");
+        fprintf(out, "db_repl_lag_records %llu\n",
+                (unsigned long long)(repl.primary_lsn > repl.applied_lsn ? repl.primary_lsn - repl.applied_lsn : 0));
+        fprintf(out, "# HELP db_repl_lag_seconds Time since this replica last had every record the primary had written.\n"
+                     "# TYPE db_repl_lag_seconds gauge\n");
+        fprintf(out, "db_repl_lag_seconds %.3f\n", repl.lag_seconds);
+        fprintf(out, "# HELP db_repl_applied_records_total Records applied.\n# TYPE db_repl_applied_records_total counter\n");
+        fprintf(out, "db_repl_applied_records_total %llu\n", (unsigned long long)repl.applied_records);
+        fprintf(out, "# HELP db_repl_applied_bytes_total Log bytes applied.\n# TYPE db_repl_applied_bytes_total counter\n");
+        fprintf(out, "db_repl_applied_bytes_total %llu\n", (unsigned long long)repl.applied_bytes);
+    }
+}
+
+int8_t metrics_write(FILE *out)
+{
+    MetricsThread *sum;
+    TreeStats stats;
+    uint32_t op, i;
+    uint64_t cumulative = 0;
+    double reserved, live;
+    int8_t status = NoError;
+    static const double quantiles[4] = {0.5, 0.9, 0.99, 0.999};
+
+    assert(out != NULL && "Error: Stream cannot be NULL for metrics_write.");
+
+    sum = (MetricsThread *)malloc(sizeof(MetricsThread));
+    if (sum == NULL)
+    {
+        retfail(ENOMEM);
+    }
+    metrics_sum(sum);
+
+    zero((uint8_t *)&stats, sizeof(TreeStats));
+    for (i = 0; i < ShardCount && status == NoError; i++)
+    {
+        epoch_enter();
+        status = shard_stats(&stats, &shards[i]);
+        epoch_exit();
+        stats.timers += __atomic_load_n(&shards[i].wheel.count, __ATOMIC_RELAXED);
+    }
+    if (status != NoError)
+    {
+        free(sum);
+        return -1;
+    }
+
+    fprintf(out, "# HELP db_ops_total Operations performed.\n# TYPE db_ops_total counter\n");
+    for (op = 0; op < MetricOpCount; op++)
+    {
+        fprintf(out, "db_ops_total{op=\"%s\"} %llu\n", op_names[op], (unsigned long long)sum->counts[op]);
+    }
+
+    fprintf(out, "# HELP db_op_latency_seconds Latency of store operations.\n# TYPE db_op_latency_seconds summary\n");
+    for (op = 0; op < MetricTimedCount; op++)
+    {
+        for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+        {
+            fprintf(out, "db_op_latency_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n", op_names[op], quantiles[i],
+                    (double)quantile(sum->buckets[op], quantiles[i]) / 1e9);
+        }
+        fprintf(out, "db_op_latency_seconds_sum{op=\"%s\"} %.9f\n", op_names[op], (double)sum->total_ns[op] / 1e9);
+        fprintf(out, "db_op_latency_seconds_count{op=\"%s\"} %llu\n", op_names[op], (unsigned long long)sum->counts[op]);
+    }
+    free(sum);
+
+    fprintf(out, "# HELP db_nodes Nodes in the tree.\n# TYPE db_nodes gauge\n");
+    fprintf(out, "db_nodes{state=\"loaded\"} %llu\n", (unsigned long long)stats.nodes);
+    fprintf(out, "db_nodes{state=\"pending\"} %llu\n", (unsigned long long)stats.pending);
+    fprintf(out, "# HELP db_leaves Leaves under loaded Nodes.\n# TYPE db_leaves gauge\n");
+    fprintf(out, "db_leaves %llu\n", (unsigned long long)stats.leaves);
+
+    fprintf(out, "# HELP db_slab_reserved_bytes Bytes of slab chunks.\n# TYPE db_slab_reserved_bytes gauge\n");
+    for (i = 0; i < 3; i++)
+    {
+        fprintf(out, "db_slab_reserved_bytes{class=\"%s\"} %llu\n", slab_names[i], (unsigned long long)stats.slab_reserved[i]);
+    }
+    fprintf(out, "# HELP db_slab_live_bytes Bytes of live slab objects.\n# TYPE db_slab_live_bytes gauge\n");
+    for (i = 0; i < 3; i++)
+    {
+        fprintf(out, "db_slab_live_bytes{class=\"%s\"} %llu\n", slab_names[i], (unsigned long long)stats.slab_live[i]);
+    }
+    fprintf(out, "# HELP db_slab_fragmentation_ratio Share of reserved slab bytes not holding a live object.\n"
+                 "# TYPE db_slab_fragmentation_ratio gauge\n");
+    for (i = 0; i < 3; i++)
+    {
+        reserved = (double)stats.slab_reserved[i];
+        live = (double)stats.slab_live[i];
+        fprintf(out, "db_slab_fragmentation_ratio{class=\"%s\"} %.4f\n", slab_names[i],
+                reserved > 0 ? (reserved - live) / reserved : 0.0);
+    }
+    fprintf(out, "# HELP db_arena_reserved_bytes Bytes of Node value arena chunks.\n# TYPE db_arena_reserved_bytes gauge\n");
+    fprintf(out, "db_arena_reserved_bytes %llu\n", (unsigned long long)stats.arena_reserved);
+    if (numa_count() > 0)
+    {
+        fprintf(out, "# HELP db_pages_reserved_bytes Bytes mapped for slab and arena chunks, per NUMA node (\"none\": unplaced).\n"
+                     "# TYPE db_pages_reserved_bytes gauge\n");
+        for (i = 0; i < numa_count(); i++)
+        {
+            if (numa_at(i)->node < 0)
+            {
+                fprintf(out, "db_pages_reserved_bytes{node=\"none\"} %llu\n",
+                        (unsigned long long)__atomic_load_n(&numa_at(i)->reserved, __ATOMIC_RELAXED));
+            }
+            else
+            {
+                fprintf(out, "db_pages_reserved_bytes{node=\"%d\"} %llu\n", numa_at(i)->node,
+                        (unsigned long long)__atomic_load_n(&numa_at(i)->reserved, __ATOMIC_RELAXED));
+            }
+        }
+    }
+    fprintf(out, "# HELP db_value_bytes Value bytes, by where they are stored.\n# TYPE db_value_bytes gauge\n");
+    for (i = 0; i < 5; i++)
+    {
+        fprintf(out, "db_value_bytes{storage=\"%s\"} %llu\n", value_names[i], (unsigned long long)stats.values[i]);
+    }
+    fprintf(out, "# HELP db_packed_bytes Bytes the compressed values take.\n# TYPE db_packed_bytes gauge\n");
+    fprintf(out, "db_packed_bytes %llu\n", (unsigned long long)stats.packed);
+    fprintf(out, "# HELP db_memory_used_bytes Bytes the shard allocators hold.\n# TYPE db_memory_used_bytes gauge\n");
+    fprintf(out, "db_memory_used_bytes %llu\n", (unsigned long long)memory_used());
+    fprintf(out, "# HELP db_memory_limit_bytes Memory limit (0: none).\n# TYPE db_memory_limit_bytes gauge\n");
+    fprintf(out, "db_memory_limit_bytes %llu\n", (unsigned long long)memory_max());
+    metrics_repl(out);
+    fprintf(out, "# HELP db_expiry_timers Timers waiting in the shard wheels.\n# TYPE db_expiry_timers gauge\n");
+    fprintf(out, "db_expiry_timers %llu\n", (unsigned long long)stats.timers);
+    fprintf(out, "# HELP db_simd_kernels Key comparison kernels in use.\n# TYPE db_simd_kernels gauge\n");
+    fprintf(out, "db_simd_kernels{set=\"%s\"} 1\n", simd.name);
+
+    fprintf(out, "# HELP db_node_leaves Leaves per loaded Node.\n# TYPE db_node_leaves histogram\n");
+    for (i = 0; i < 33; i++)
+    {
+        cumulative += stats.lengths[i];
+        if (stats.lengths[i] > 0 || i == 0)
+        {
+            fprintf(out, "db_node_leaves_bucket{le=\"%llu\"} %llu\n", i == 0 ? 0ULL : (1ULL << i) - 1,
+                    (unsigned long long)cumulative);
+        }
+    }
+    fprintf(out, "db_node_leaves_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+    fprintf(out, "db_node_leaves_sum %llu\n", (unsigned long long)stats.length_sum);
+    fprintf(out, "db_node_leaves_count %llu\n", (unsigned long long)cumulative);
+
+    if (ferror(out))
+    {
+        retfail(EIO);
+    }
+
+    return NoError;
+}
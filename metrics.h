@@ -0,0 +1,120 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint64_t)
+#include <stdio.h>  // For FILE
+
+// =============================================================================
+// Metrics Definitions
+// =============================================================================
+// Every thread counts its own operations in a private record, so recording
+// never takes a lock or makes two threads write the same cache line; a stats
+// request sums the records of all threads. Store operations also record their
+// latency in a log-linear (HDR-style) histogram: eight buckets per power of
+// two, so every percentile is reported within 12.5% of the true value. The
+// faster tree operations underneath are only counted, which keeps the cost of
+// leaving metrics on to a clock read per store call.
+//
+// MetricsEnabled: Set to 0 at build time (-DMetricsEnabled=0) to compile every
+// recording site out.
+#ifndef MetricsEnabled
+#define MetricsEnabled 1
+#endif
+
+// Timed operations (counted and given a latency histogram).
+#define MetricGet 0  /* store_get */
+#define MetricSet 1  /* store_set / store_set_owned */
+#define MetricDel 2  /* store_del */
+#define MetricView 3 /* store_view */
+#define MetricList 4 /* LIST request */
+#define MetricScan 5 /* SCAN request */
+#define MetricGetMany 6 /* store_get_many (one sample per batch) */
+#define MetricSetMany 7 /* store_set_many (one sample per batch) */
+#define MetricTimedCount 8
+
+// Counted operations.
+#define MetricCreateNode 8   /* create_node */
+#define MetricCreateLeaf 9   /* create_leaf / create_leaf_owned */
+#define MetricLeafBatch 10   /* create_leaf_batch */
+#define MetricDeleteLeaf 11  /* delete_leaf */
+#define MetricDropSubtree 12 /* drop_subtree */
+#define MetricMaterialize 13 /* snapshot_materialize loading a Node */
+#define MetricUpdateLeaf 14  /* update_leaf / update_leaf_cas */
+#define MetricUpdateInPlace 15 /* Updates that rewrote the value where it was */
+#define MetricCompact 16     /* Nodes whose indexes the maintenance task compacted */
+#define MetricPackValue 17   /* Values stored compressed */
+#define MetricExpire 18      /* Expired leaves the shard wheels deleted */
+#define MetricEvict 19       /* Leaves evicted to keep memory under the limit */
+#define MetricOpCount 20
+
+#define MetricsMaxThreads 256   /* Threads with a private record; later ones share one */
+#define MetricBucketCount 304   /* Histogram buckets: exact below 8 ns, then 8 per power of two up to ~2^40 ns */
+
+// =============================================================================
+// Macro Definitions
+// =============================================================================
+
+// metric_start / metric_time / metric_count: Record one operation. Take the
+// start time with metric_start, then pass it to metric_time once the
+// operation is done; metric_count only counts. All three compile to nothing
+// with MetricsEnabled set to 0.
+#define metric_start() (MetricsEnabled ? metrics_now() : 0)
+#define metric_time(op, start)                                                   \
+    do                                                                           \
+    {                                                                            \
+        if (MetricsEnabled)                                                      \
+        {                                                                        \
+            metrics_record((op), metrics_now() - (start));                       \
+        }                                                                        \
+    } while (0)
+#define metric_count(op)                                                         \
+    do                                                                           \
+    {                                                                            \
+        if (MetricsEnabled)                                                      \
+        {                                                                        \
+            metrics_count(op);                                                   \
+        }                                                                        \
+    } while (0)
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Counts one timed operation and adds its latency to the histogram. Use metric_time instead.
+ *
+ * @param op The operation (below MetricTimedCount).
+ * @param ns Its latency in nanoseconds.
+ */
+void metrics_record(uint8_t op, uint64_t ns);
+
+/**
+ * @brief Counts one operation. Use metric_count instead.
+ *
+ * @param op The operation (below MetricOpCount).
+ */
+void metrics_count(uint8_t op);
+
+/**
+ * @brief Writes every metric in the Prometheus text exposition format.
+ *
+ * Besides the operation counters and latencies, this walks every shard for
+ * allocator and tree statistics, as a lock-free reader inside an epoch, so
+ * neither readers nor writers wait for it; the slab figures are kept up to
+ * date by the slabs themselves. Nodes still waiting to be loaded from a
+ * snapshot are counted but not loaded.
+ *
+ * @param out The stream to write to.
+ * @return    0 on success, or -1 with errno set if the statistics could not be gathered.
+ */
+int8_t metrics_write(FILE *out);
+
+#endif /* METRICS_H */
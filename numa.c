@@ -0,0 +1,224 @@
+/* numa.c */
+#include "main.h"
+
+#include <sched.h>             // For cpu_set_t, CPU_SET
+#include <sys/mman.h>          // For mmap, munmap, madvise
+#include <sys/syscall.h>       // For SYS_mbind
+#include <linux/mempolicy.h>   // For MPOL_PREFERRED
+
+static struct {
+    cpu_set_t cpus[NumaMaxNodes];      ///< The CPUs of each node.
+    uint8_t known[NumaMaxNodes];       ///< Whether sysfs listed the node.
+    uint32_t nodes;                    ///< Nodes listed.
+    Pages pages[NumaMaxNodes + 1];     ///< The Pages in use (one per node shards live on, or one for all).
+    uint32_t count;                    ///< Pages in use.
+    Pages *shard[ShardCount];          ///< The Pages of each shard, or NULL.
+} numa;
+
+// Parses a sysfs list such as "0-3,8,10-11" into `set`. Returns 0, or -1 if
+// the file cannot be read.
+static int8_t list_read(const char *path, cpu_set_t *set)
+{
+    char text[4096], *p, *end;
+    unsigned long first, last;
+    FILE *file;
+
+    CPU_ZERO(set);
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    p = fgets(text, sizeof(text), file);
+    fclose(file);
+    if (p == NULL)
+    {
+        retfail(EIO);
+    }
+
+    while (*p >= '0' && *p <= '9')
+    {
+        first = strtoul(p, &end, 10);
+        last = *end == '-' ? strtoul(end + 1, &end, 10) : first;
+        for (; first <= last && first < CPU_SETSIZE; first++)
+        {
+            CPU_SET(first, set);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return NoError;
+}
+
+// Returns the node a CPU belongs to, or -1 if no node lists it.
+static int cpu_node(uint32_t cpu)
+{
+    int node;
+
+    for (node = 0; node < NumaMaxNodes; node++)
+    {
+        if (numa.known[node] && CPU_ISSET(cpu, &numa.cpus[node]))
+        {
+            return node;
+        }
+    }
+
+    return -1;
+}
+
+// Returns the Pages for `node` (-1: unplaced), setting one up on first use.
+static Pages *node_pages(int node, size_t huge)
+{
+    uint32_t i;
+
+    for (i = 0; i < numa.count; i++)
+    {
+        if (numa.pages[i].node == node)
+        {
+            return &numa.pages[i];
+        }
+    }
+    pages_init(&numa.pages[numa.count], node, huge);
+
+    return &numa.pages[numa.count++];
+}
+
+int8_t numa_init(uint32_t workers, int enable, size_t huge)
+{
+    char path[128];
+    cpu_set_t online;
+    uint32_t i;
+    int node;
+
+    assert((huge == 0 || huge == NumaHuge2M || huge == NumaHuge1G) && "Error: Unsupported huge page size.");
+
+    zero((uint8_t *)&numa, sizeof(numa));
+    if (list_read(NumaSysfs "/online", &online) == NoError)
+    {
+        for (node = 0; node < NumaMaxNodes; node++)
+        {
+            snprintf(path, sizeof(path), NumaSysfs "/node%d/cpulist", node);
+            if (CPU_ISSET(node, &online) && list_read(path, &numa.cpus[node]) == NoError)
+            {
+                numa.known[node] = 1;
+                numa.nodes++;
+            }
+        }
+    }
+
+    // Placement only pays on more than one node; huge pages pay anywhere.
+    enable = enable && numa.nodes > 1;
+    workers = pool_size(workers);
+    for (i = 0; (enable || huge != 0) && i < ShardCount; i++)
+    {
+        node = enable ? cpu_node(pool_cpu(i % workers)) : -1;
+        numa.shard[i] = node_pages(node, huge);
+    }
+    trace(TraceInfo, "numa_init: %llu nodes, shards allocate from %llu Pages (0: malloc)", numa.nodes, numa.count);
+
+    return NoError;
+}
+
+Pages *numa_pages(uint32_t shard)
+{
+    return numa.shard[shard % ShardCount];
+}
+
+uint32_t numa_count(void)
+{
+    return numa.count;
+}
+
+Pages *numa_at(uint32_t i)
+{
+    assert(i < numa.count && "Error: No such Pages.");
+
+    return &numa.pages[i];
+}
+
+int8_t numa_pin(int node)
+{
+    int error;
+
+    if (node < 0 || node >= NumaMaxNodes || !numa.known[node] || CPU_COUNT(&numa.cpus[node]) == 0)
+    {
+        retfail(EINVAL);
+    }
+
+    error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa.cpus[node]);
+    if (error != 0)
+    {
+        retfail(error);
+    }
+
+    return NoError;
+}
+
+void *numa_map(size_t *size, int node, size_t huge)
+{
+    unsigned long mask[NumaMaxNodes / (8 * sizeof(unsigned long))];
+    uint8_t *region = MAP_FAILED, *aligned;
+    int shift;
+
+    // Explicit huge pages first: the region is one page, aligned by the kernel.
+    if (huge != 0)
+    {
+        shift = huge == NumaHuge1G ? 30 : 21;
+        *size = huge;
+        region = (uint8_t *)mmap(NULL, huge, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+    }
+
+    // Otherwise (or if none are reserved) a PagesRegionSize region, aligned so
+    // that transparent huge pages can back it whole.
+    if (region == MAP_FAILED)
+    {
+        *size = PagesRegionSize;
+        region = (uint8_t *)mmap(NULL, 2 * PagesRegionSize, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED)
+        {
+            reterr(ENOMEM);
+        }
+        aligned = (uint8_t *)align_up(region, PagesRegionSize);
+        if (aligned > region)
+        {
+            munmap(region, (size_t)(aligned - region));
+        }
+        munmap(aligned + PagesRegionSize, (size_t)(region + PagesRegionSize - aligned));
+        region = aligned;
+        if (huge != 0)
+        {
+            madvise(region, PagesRegionSize, MADV_HUGEPAGE);
+        }
+    }
+
+    // Best effort, like pinning: without the binding, pages land wherever the
+    // thread that first touches them runs, which is usually the node's worker.
+    if (node >= 0)
+    {
+        zero((uint8_t *)mask, sizeof(mask));
+        mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, region, *size, MPOL_PREFERRED, mask, NumaMaxNodes + 1, 0) != 0)
+        {
+            trace(TraceError, "numa_map: mbind to node %llu failed (errno %llu)", node, errno);
+        }
+    }
+
+    return region;
+}
+
+void numa_unmap(void *region, size_t size)
+{
+    munmap(region, size);
+}
+
+void numa_release(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < numa.count; i++)
+    {
+        pages_release(&numa.pages[i]);
+    }
+}
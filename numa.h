@@ -0,0 +1,104 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint32_t)
+#include <stddef.h> // For size_t
+
+#include "alloc.h" // For the Pages each node allocates from
+
+// =============================================================================
+// NUMA Definitions
+// =============================================================================
+// On a machine with several NUMA nodes, every shard's memory is placed on the
+// node of the worker that owns the shard (shard i belongs to worker
+// i % workers, pinned to CPU pool_cpu of it): each node gets a Pages whose
+// regions are bound to it, and the allocators of the shards on that node take
+// their slab and arena chunks from it (see allocator_place). The topology is
+// read from sysfs, and regions are bound with the mbind system call directly,
+// so there is nothing to link against; on a single node, or where sysfs
+// tells nothing, shards allocate from malloc as before.
+//
+// Regions may also be backed by huge pages, so that walking a tree touches
+// fewer TLB entries: explicit ones (hugetlbfs, 2 MiB or 1 GiB, which must be
+// reserved through /proc/sys/vm/nr_hugepages or the kernel command line), or,
+// where none are reserved, 2 MiB-aligned regions the kernel is advised to back
+// with transparent huge pages. Huge pages are used on a single node too.
+//
+// The hashed indexes of Nodes, and values too large for an arena, still come
+// from malloc: the first is resized in place, and the second is rare.
+#define NumaMaxNodes 64                    /* Nodes the topology is read for; CPUs of higher nodes stay unplaced */
+#define NumaHuge2M (2UL * 1024 * 1024)     /* Size of a 2 MiB huge page */
+#define NumaHuge1G (1024UL * 1024 * 1024)  /* Size of a 1 GiB huge page */
+#define NumaSysfs "/sys/devices/system/node" /* Where the kernel describes the nodes */
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Reads the topology and sets up one Pages per node that shards are placed on.
+ *
+ * Must be called before shards_init. Without it, or when placement is off and
+ * no huge pages are asked for, numa_pages returns NULL for every shard.
+ *
+ * @param workers The number of workers the pool will start (as given to pool_start).
+ * @param enable  Non-zero to place shards on the nodes of their workers.
+ * @param huge    NumaHuge2M or NumaHuge1G to map regions with huge pages, or 0.
+ * @return        0 on success, or -1 with errno set.
+ */
+int8_t numa_init(uint32_t workers, int enable, size_t huge);
+
+/**
+ * @brief Returns the Pages a shard allocates from, or NULL for malloc.
+ *
+ * @param shard The shard's index.
+ */
+Pages *numa_pages(uint32_t shard);
+
+/**
+ * @brief Returns the number of Pages set up by numa_init (0 when it placed nothing).
+ */
+uint32_t numa_count(void);
+
+/**
+ * @brief Returns one of the Pages set up by numa_init.
+ *
+ * @param i The index of the Pages, below numa_count().
+ */
+Pages *numa_at(uint32_t i);
+
+/**
+ * @brief Pins the calling thread to the CPUs of a node.
+ *
+ * @param node The node.
+ * @return     0 on success, or -1 with errno set (EINVAL if the node has no known CPUs).
+ */
+int8_t numa_pin(int node);
+
+/**
+ * @brief Maps a region for a Pages, bound to a node.
+ *
+ * @param size  Set to the size of the region mapped.
+ * @param node  The node to bind it to, or -1.
+ * @param huge  The huge page size to map it with, or 0.
+ * @return      The region, aligned to its huge page size (or PagesRegionSize), or NULL with errno set.
+ */
+void *numa_map(size_t *size, int node, size_t huge);
+
+/**
+ * @brief Unmaps a region mapped by numa_map.
+ *
+ * @param region The region.
+ * @param size   Its size, as numa_map set it.
+ */
+void numa_unmap(void *region, size_t size);
+
+/**
+ * @brief Unmaps every region of every Pages. Must be called after shards_release.
+ */
+void numa_release(void);
+
+#endif /* NUMA_H */
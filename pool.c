@@ -0,0 +1,448 @@
+/* pool.c */
+#include "main.h"
+
+#include <sched.h> // For cpu_set_t, CPU_SET, sched_yield
+#include <time.h>  // For clock_gettime, CLOCK_REALTIME
+
+/**
+ * @brief One worker thread and the queues it owns.
+ *
+ * `top` and `bottom` delimit the Chase-Lev deque in `ring`: only the worker
+ * pushes and pops at the bottom, thieves take from the top with a CAS. Each
+ * index sits on its own cache line, so thieves do not slow the owner down.
+ */
+struct s_worker {
+    _Alignas(64) int64_t top;  ///< Next task thieves take (the newest of the batch in the deque).
+    _Alignas(64) int64_t bottom; ///< One past the next task the worker runs.
+    Task *inbox;               ///< Tasks submitted by other threads, newest first (lock-free stack).
+    Task *later;               ///< Deferred tasks, newest first (lock-free stack).
+    uint64_t later_at;         ///< When the tasks in `later` are due, in metrics_now() nanoseconds (worker only).
+    uint8_t sleeping;          ///< Set while the worker is about to sleep or sleeping.
+    uint8_t woken;             ///< Set (under `lock`) to end the worker's sleep.
+    uint32_t id;               ///< Index of the worker.
+    uint32_t seed;             ///< Victim selection state (worker only).
+    pthread_t thread;          ///< The worker thread.
+    pthread_mutex_t lock;      ///< Protects `woken`.
+    pthread_cond_t wake;       ///< Signalled to end the worker's sleep.
+    Task *ring[PoolDequeSize]; ///< The deque's storage, indexed modulo PoolDequeSize.
+};
+typedef struct s_worker Worker;
+
+/**
+ * @brief State of the (single, process-wide) pool.
+ */
+struct s_pool {
+    Worker *workers;   ///< The workers, or NULL while the pool is not running.
+    uint32_t count;    ///< Number of workers.
+    uint32_t next;     ///< Round-robin home for PoolAnyHome tasks.
+    uint64_t pending;  ///< Tasks submitted and not finished yet, deferred ones included.
+    uint8_t stopping;  ///< Set by pool_stop: run what is left, deferred tasks at once, then exit.
+};
+typedef struct s_pool Pool;
+
+static Pool pool = {0};
+static _Thread_local Worker *self = NULL; // The worker running on this thread, if any.
+
+// --- Deque (Chase-Lev) ---
+
+// Pushes a task at the bottom of the worker's own deque. Returns 0 if it is full.
+static int deque_push(Worker *w, Task *task)
+{
+    int64_t bottom = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+
+    if (bottom - __atomic_load_n(&w->top, __ATOMIC_ACQUIRE) >= PoolDequeSize)
+    {
+        return 0;
+    }
+    __atomic_store_n(&w->ring[bottom & (PoolDequeSize - 1)], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, bottom + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+// Pops the task at the bottom of the worker's own deque, or returns NULL.
+static Task *deque_pop(Worker *w)
+{
+    int64_t bottom = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1, top;
+    Task *task;
+
+    // Claim the bottom slot before looking at `top`; a thief doing the
+    // opposite sees the claim, so the two never take the same task unless
+    // both go for the last one, which the CAS below settles.
+    __atomic_store_n(&w->bottom, bottom, __ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&w->top, __ATOMIC_SEQ_CST);
+    if (top > bottom)
+    {
+        __atomic_store_n(&w->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    task = __atomic_load_n(&w->ring[bottom & (PoolDequeSize - 1)], __ATOMIC_RELAXED);
+    if (top == bottom)
+    {
+        if (!__atomic_compare_exchange_n(&w->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            task = NULL; // A thief got it.
+        }
+        __atomic_store_n(&w->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    return task;
+}
+
+// Takes the task at the top of another worker's deque, or returns NULL.
+static Task *deque_steal(Worker *w)
+{
+    int64_t top = __atomic_load_n(&w->top, __ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&w->bottom, __ATOMIC_SEQ_CST);
+    Task *task;
+
+    if (top >= bottom)
+    {
+        return NULL;
+    }
+    task = __atomic_load_n(&w->ring[top & (PoolDequeSize - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&w->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return NULL; // Lost the race to the owner or another thief.
+    }
+
+    return task;
+}
+
+// --- Queues ---
+
+// Pushes a task onto a lock-free stack. Pushing has no ABA problem: the
+// only consumer takes the whole stack at once. Sequentially consistent, as
+// worker_wake relies on it.
+static void stack_push(Task **stack, Task *task)
+{
+    Task *head = __atomic_load_n(stack, __ATOMIC_RELAXED);
+
+    do
+    {
+        task->next = head;
+    } while (!__atomic_compare_exchange_n(stack, &head, task, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+// Moves a stack of tasks (newest first) into the worker's deque so that the
+// oldest ends up at the bottom, where the worker takes it first. Tasks that do
+// not fit go back to the inbox.
+static void deque_fill(Worker *w, Task *task)
+{
+    Task *next;
+
+    for (; task != NULL; task = next)
+    {
+        next = task->next;
+        if (!deque_push(w, task))
+        {
+            stack_push(&w->inbox, task);
+        }
+    }
+}
+
+// Wakes a worker that is sleeping or about to sleep.
+static void worker_wake(Worker *w)
+{
+    // Pairs with the store of `sleeping` in worker_sleep: either the worker
+    // sees the new task, or we see it going to sleep.
+    if (!__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST))
+    {
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->woken = 1;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Wakes one sleeping worker other than `busy`, so it can steal from it.
+static void worker_wake_thief(Worker *busy)
+{
+    uint32_t i;
+
+    for (i = 1; i < pool.count; i++)
+    {
+        if (__atomic_load_n(&pool.workers[(busy->id + i) % pool.count].sleeping, __ATOMIC_SEQ_CST))
+        {
+            worker_wake(&pool.workers[(busy->id + i) % pool.count]);
+            return;
+        }
+    }
+}
+
+static Worker *pool_home(uint32_t home)
+{
+    if (home == PoolAnyHome)
+    {
+        home = self != NULL ? self->id : __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED);
+    }
+
+    return &pool.workers[home % pool.count];
+}
+
+// --- Workers ---
+
+// Finds the next task for the worker: its own deque first, then its inbox and
+// its due deferred tasks, then the other workers' deques.
+static Task *worker_next(Worker *w)
+{
+    Task *task;
+    uint64_t now;
+    uint32_t i, victim;
+
+    task = deque_pop(w);
+    if (task != NULL)
+    {
+        return task;
+    }
+
+    if (__atomic_load_n(&w->later, __ATOMIC_ACQUIRE) != NULL)
+    {
+        now = metrics_now();
+        if (w->later_at == 0)
+        {
+            w->later_at = now + PoolDeferMs * 1000000ull;
+        }
+        if (now >= w->later_at || __atomic_load_n(&pool.stopping, __ATOMIC_ACQUIRE))
+        {
+            w->later_at = 0;
+            deque_fill(w, __atomic_exchange_n(&w->later, NULL, __ATOMIC_ACQUIRE));
+        }
+    }
+    if (__atomic_load_n(&w->inbox, __ATOMIC_ACQUIRE) != NULL)
+    {
+        deque_fill(w, __atomic_exchange_n(&w->inbox, NULL, __ATOMIC_ACQUIRE));
+    }
+    task = deque_pop(w);
+    if (task != NULL)
+    {
+        // More than one task came in: let an idle worker share them.
+        if (__atomic_load_n(&w->bottom, __ATOMIC_RELAXED) > __atomic_load_n(&w->top, __ATOMIC_RELAXED))
+        {
+            worker_wake_thief(w);
+        }
+        return task;
+    }
+
+    // Steal, starting from a different victim each time.
+    w->seed = w->seed * 1103515245u + 12345u;
+    for (i = 0; i < pool.count; i++)
+    {
+        victim = (w->seed / 65536 + i) % pool.count;
+        if (victim != w->id && (task = deque_steal(&pool.workers[victim])) != NULL)
+        {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+// Sleeps until woken, or until the worker's deferred tasks are due.
+static void worker_sleep(Worker *w)
+{
+    struct timespec deadline;
+    uint64_t wait_ns = PoolIdleMs * 1000000ull, now;
+
+    __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    // Look once more now that submitters can see us sleeping. A deferred
+    // task without a deadline yet sends us back to worker_next to set one.
+    if (__atomic_load_n(&w->inbox, __ATOMIC_SEQ_CST) == NULL && !__atomic_load_n(&pool.stopping, __ATOMIC_SEQ_CST) &&
+        (w->later_at != 0 || __atomic_load_n(&w->later, __ATOMIC_SEQ_CST) == NULL))
+    {
+        if (w->later_at != 0)
+        {
+            now = metrics_now();
+            wait_ns = w->later_at > now ? w->later_at - now : 0;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (!w->woken && wait_ns > 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += (time_t)(wait_ns / 1000000000ull);
+            deadline.tv_nsec += (long)(wait_ns % 1000000000ull);
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&w->wake, &w->lock, &deadline);
+        }
+        w->woken = 0;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+// Worker thread: runs tasks until the pool stops and nothing is left.
+static void *worker_main(void *arg)
+{
+    Worker *w = (Worker *)arg;
+    Task *task;
+
+    self = w;
+    for (;;)
+    {
+        task = worker_next(w);
+        if (task != NULL)
+        {
+            task->run(task);
+            __atomic_sub_fetch(&pool.pending, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (__atomic_load_n(&pool.stopping, __ATOMIC_ACQUIRE))
+        {
+            // A task still running elsewhere may yet submit more work here.
+            if (__atomic_load_n(&pool.pending, __ATOMIC_ACQUIRE) == 0)
+            {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        worker_sleep(w);
+    }
+    epoch_thread_exit();
+
+    return NULL;
+}
+
+// --- Pool ---
+
+uint32_t pool_size(uint32_t workers)
+{
+    long online;
+
+    if (workers == 0)
+    {
+        online = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = online > 0 ? (uint32_t)online : 1;
+    }
+    if (workers > PoolMaxWorkers)
+    {
+        workers = PoolMaxWorkers;
+    }
+
+    return workers;
+}
+
+uint32_t pool_cpu(uint32_t worker)
+{
+    return worker % CPU_SETSIZE;
+}
+
+int8_t pool_start(uint32_t workers)
+{
+    cpu_set_t cpus;
+    uint32_t i;
+    int error;
+
+    assert(pool.workers == NULL && "Error: The pool is already running.");
+
+    workers = pool_size(workers);
+
+    pool.workers = (Worker *)aligned_alloc(64, workers * sizeof(Worker));
+    if (pool.workers == NULL)
+    {
+        retfail(ENOMEM);
+    }
+    zero((uint8_t *)pool.workers, workers * sizeof(Worker));
+    pool.count = workers;
+    pool.stopping = 0;
+
+    for (i = 0; i < workers; i++)
+    {
+        pool.workers[i].id = i;
+        pool.workers[i].seed = i + 1;
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+        pthread_cond_init(&pool.workers[i].wake, NULL);
+    }
+    for (i = 0; i < workers; i++)
+    {
+        error = pthread_create(&pool.workers[i].thread, NULL, worker_main, &pool.workers[i]);
+        if (error != 0)
+        {
+            pool.count = i; // Stop the ones already running.
+            pool_stop();
+            retfail(error);
+        }
+
+        // One worker per core keeps each shard's tree on one core's caches.
+        // Best effort: the pool works unpinned too (e.g. in a restricted cpuset).
+        CPU_ZERO(&cpus);
+        CPU_SET(pool_cpu(i), &cpus);
+        pthread_setaffinity_np(pool.workers[i].thread, sizeof(cpus), &cpus);
+    }
+    trace(TraceInfo, "pool_start: %llu workers, deques of %llu tasks", workers, PoolDequeSize);
+
+    return NoError;
+}
+
+void pool_stop(void)
+{
+    uint32_t i;
+
+    if (pool.workers == NULL)
+    {
+        return;
+    }
+
+    __atomic_store_n(&pool.stopping, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < pool.count; i++)
+    {
+        pthread_mutex_lock(&pool.workers[i].lock);
+        pool.workers[i].woken = 1;
+        pthread_cond_signal(&pool.workers[i].wake);
+        pthread_mutex_unlock(&pool.workers[i].lock);
+    }
+    for (i = 0; i < pool.count; i++)
+    {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    for (i = 0; i < pool.count; i++)
+    {
+        pthread_mutex_destroy(&pool.workers[i].lock);
+        pthread_cond_destroy(&pool.workers[i].wake);
+    }
+    trace(TraceInfo, "pool_stop: stopped %llu workers, %llu tasks left", pool.count, pool.pending);
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.count = 0;
+}
+
+uint32_t pool_workers(void)
+{
+    return pool.count;
+}
+
+void pool_submit(Task *task, uint32_t home)
+{
+    Worker *w;
+
+    assert(task != NULL && task->run != NULL && "Error: A task needs a function for pool_submit.");
+    assert(pool.workers != NULL && "Error: The pool is not running.");
+
+    __atomic_add_fetch(&pool.pending, 1, __ATOMIC_RELAXED);
+    w = pool_home(home);
+    stack_push(&w->inbox, task);
+    worker_wake(w);
+}
+
+void pool_defer(Task *task, uint32_t home)
+{
+    Worker *w;
+
+    assert(task != NULL && task->run != NULL && "Error: A task needs a function for pool_defer.");
+    assert(pool.workers != NULL && "Error: The pool is not running.");
+
+    __atomic_add_fetch(&pool.pending, 1, __ATOMIC_RELAXED);
+    w = pool_home(home);
+    stack_push(&w->later, task);
+    worker_wake(w); // It sets the deadline; its sleep then ends when the task is due.
+}
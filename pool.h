@@ -0,0 +1,112 @@
+#ifndef POOL_H
+#define POOL_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint32_t)
+
+// =============================================================================
+// Thread Pool Definitions
+// =============================================================================
+// A work-stealing pool with one worker per core. Every task is submitted to a
+// home worker, normally the one that owns the shard the task touches (shard i
+// belongs to worker i % workers), so the shard's tree stays warm in that
+// core's caches. Other threads hand tasks over through the worker's lock-free
+// inbox; the worker moves them into its own deque, runs them oldest first,
+// and an idle worker steals work from the other end of a busy worker's deque
+// (Chase-Lev), so one hot shard cannot leave the other cores idle.
+#define PoolMaxWorkers 64     /* Workers the pool starts at most */
+#define PoolDequeSize 4096    /* Tasks a worker's deque holds (a power of two); overflow stays in its inbox */
+#define PoolDeferMs 2         /* Delay of pool_defer: long enough for grace periods to end */
+#define PoolIdleMs 1000       /* Longest a worker sleeps before looking for work again */
+#define PoolAnyHome UINT32_MAX /* Home of a task that touches no shard in particular */
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+struct s_task;
+
+/**
+ * @brief The function a task runs; it receives the task itself.
+ *
+ * The task is embedded in the caller's own state, so the function recovers its
+ * context from the task's address. The task may be submitted again as soon as
+ * its function has been called.
+ */
+typedef void (*TaskFn)(struct s_task *task);
+
+/**
+ * @brief One unit of work. Embed it in the state the task works on.
+ */
+struct s_task {
+    TaskFn run;           ///< The function to run.
+    struct s_task *next;  ///< Link in the worker's inbox (pool only).
+};
+typedef struct s_task Task;
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Starts the worker threads, each pinned to its own CPU where possible.
+ *
+ * @param workers The number of workers, or 0 for one per online CPU (at most PoolMaxWorkers).
+ * @return        0 on success, or -1 with errno set.
+ */
+int8_t pool_start(uint32_t workers);
+
+/**
+ * @brief Returns the number of workers pool_start(workers) starts.
+ *
+ * Known before the pool starts, so that shards can be placed on the NUMA node
+ * of the worker that will own them.
+ *
+ * @param workers The number of workers asked for, or 0 for one per online CPU.
+ */
+uint32_t pool_size(uint32_t workers);
+
+/**
+ * @brief Returns the CPU pool_start pins a worker to.
+ *
+ * @param worker The worker's index.
+ */
+uint32_t pool_cpu(uint32_t worker);
+
+/**
+ * @brief Runs every task still queued or deferred, then stops the workers.
+ *
+ * Does nothing if the pool is not running.
+ */
+void pool_stop(void);
+
+/**
+ * @brief Returns the number of running workers, or 0 if the pool is not running.
+ */
+uint32_t pool_workers(void);
+
+/**
+ * @brief Queues a task on its home worker. Never blocks; any thread may call it.
+ *
+ * The pool must be running. Tasks of the same home are not ordered with
+ * respect to each other, and any worker may end up running one (by stealing it).
+ *
+ * @param task The task; its `run` must be set.
+ * @param home The shard index the task works on, or PoolAnyHome.
+ */
+void pool_submit(Task *task, uint32_t home);
+
+/**
+ * @brief Queues a task on its home worker to run after at most about PoolDeferMs.
+ *
+ * For background work that waits on something other threads will finish soon,
+ * such as an epoch grace period. The pool must be running.
+ *
+ * @param task The task; its `run` must be set.
+ * @param home The shard index the task works on, or PoolAnyHome.
+ */
+void pool_defer(Task *task, uint32_t home);
+
+#endif /* POOL_H */
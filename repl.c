@@ -0,0 +1,957 @@
+/* repl.c */
+#include "main.h"
+
+#include <fcntl.h>        // For open, O_RDONLY
+#include <arpa/inet.h>    // For inet_pton, inet_ntop
+#include <netinet/in.h>   // For struct sockaddr_in, INADDR_ANY
+#include <netinet/tcp.h>  // For TCP_NODELAY
+#include <sys/sendfile.h> // For sendfile
+#include <sys/socket.h>   // For socket, bind, listen, accept4, connect
+#include <sys/stat.h>     // For fstat
+#include <time.h>         // For clock_gettime, CLOCK_REALTIME
+
+/**
+ * @brief One replica a primary is serving: the sender thread and its connection.
+ */
+struct s_sender {
+    pthread_t thread;   ///< The sender thread.
+    int fd;             ///< The replica's connection; closed by whoever joins the thread.
+    uint8_t used;       ///< Non-zero from the thread's start until it is joined.
+    uint8_t done;       ///< Set by the thread as it exits.
+    ReplicaStats stats; ///< What the metrics report about the replica.
+};
+typedef struct s_sender Sender;
+
+/**
+ * @brief State of replication, as a primary or as a replica (never both).
+ *
+ * `lock` guards the slots and connections; the counters are written by their
+ * one thread and read by the metrics without it.
+ */
+struct s_repl {
+    uint8_t role;            ///< ReplNone, ReplPrimary or ReplReplica.
+    uint8_t stopping;        ///< Set by repl_stop.
+    pthread_mutex_t lock;    ///< Protects the fields below it.
+    pthread_cond_t wake;     ///< Cuts a replica's pause before reconnecting short.
+    // Primary.
+    int listen_fd;           ///< The replication port.
+    char *wal_path;          ///< The log the senders tail.
+    char *scratch;           ///< Where bootstrap snapshots are saved.
+    pthread_t listener;      ///< Accepts replicas.
+    pthread_mutex_t save;    ///< Lets one bootstrap snapshot be saved at a time.
+    uint64_t bootstraps;     ///< Snapshots sent.
+    Sender senders[ReplMaxReplicas]; ///< One slot per replica being served.
+    // Replica.
+    int fd;                  ///< The stream from the primary, or -1 while reconnecting.
+    struct sockaddr_in primary; ///< The primary's replication address.
+    pthread_t follower;      ///< Applies the stream.
+    uint8_t following;       ///< Non-zero once `follower` is started.
+    uint8_t connected;       ///< Non-zero while the stream is up.
+    uint64_t applied_lsn;    ///< LSN of the last record applied.
+    uint64_t primary_lsn;    ///< Last LSN the primary reported writing.
+    uint64_t applied_records; ///< Records applied (or skipped as already in the snapshot).
+    uint64_t applied_bytes;  ///< Log bytes applied.
+    uint64_t caught_up;      ///< metrics_now() when the replica last had everything the primary had written.
+};
+typedef struct s_repl Repl;
+
+static Repl repl = {.listen_fd = -1, .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER,
+                    .wake = PTHREAD_COND_INITIALIZER, .save = PTHREAD_MUTEX_INITIALIZER};
+
+// Sends all of `data`. Returns 0, or -1 with errno set.
+static int8_t send_all(int fd, const uint8_t *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR && !__atomic_load_n(&repl.stopping, __ATOMIC_ACQUIRE))
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+
+    return NoError;
+}
+
+// Receives exactly `len` bytes. Returns 0, or -1 with errno set (ECONNRESET if the peer hung up).
+static int8_t recv_all(int fd, uint8_t *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = recv(fd, data, len, 0);
+        if (n == 0)
+        {
+            retfail(ECONNRESET);
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR && !__atomic_load_n(&repl.stopping, __ATOMIC_ACQUIRE))
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+
+    return NoError;
+}
+
+// Returns the file offset of the first record in the log after `lsn`, or
+// UINT64_MAX if the log (written up to `end`, the last record being
+// `written`) no longer holds every record after it.
+static uint64_t log_find(int log_fd, uint64_t end, uint64_t lsn, uint64_t written)
+{
+    uint8_t header[WalRecordHeaderSize];
+    uint64_t offset = 0, rec_lsn;
+
+    while (offset < end)
+    {
+        if (pread(log_fd, header, sizeof(header), (off_t)offset) != (ssize_t)sizeof(header))
+        {
+            return UINT64_MAX;
+        }
+        rec_lsn = get_u64(header + 8);
+        if (rec_lsn > lsn)
+        {
+            // The log starts with the first record after its last snapshot.
+            return offset == 0 && rec_lsn > lsn + 1 ? UINT64_MAX : offset;
+        }
+        offset += get_u32(header + 4);
+    }
+
+    return lsn == written ? end : UINT64_MAX;
+}
+
+// Saves a snapshot of the live store, sends it after the handshake, and sets
+// `*offset` to where the log goes on from. Returns 0, or -1 with errno set.
+static int8_t send_snapshot(Sender *sender, int log_fd, uint64_t *offset)
+{
+    uint8_t reply[ReplHandshakeSize], header[SnapshotHeaderSize];
+    struct stat st;
+    uint64_t from = UINT64_MAX, lsn, end;
+    off_t sent = 0;
+    ssize_t n;
+    uint32_t i;
+    int fd, error;
+
+    pthread_mutex_lock(&repl.save);
+    fd = snapshot_save(repl.scratch) == NoError ? open(repl.scratch, O_RDONLY | O_CLOEXEC) : -1;
+    error = errno;
+    if (fd >= 0)
+    {
+        unlink(repl.scratch); // Lives on until closed.
+    }
+    pthread_mutex_unlock(&repl.save);
+    if (fd < 0)
+    {
+        trace(TraceError, "send_snapshot: saving failed with errno %llu (%llu bootstraps so far)", error, repl.bootstraps);
+        retfail(error);
+    }
+
+    // The log goes on after the oldest record a shard of the snapshot lacks.
+    if (fstat(fd, &st) != 0 || pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        error = errno != 0 ? errno : EIO;
+        close(fd);
+        retfail(error);
+    }
+    for (i = 0; i < ShardCount; i++)
+    {
+        lsn = get_u64(header + 32 + 16 * i);
+        from = lsn < from ? lsn : from;
+    }
+
+    memcpy(reply, ReplMagic, 8);
+    zero(reply + 8, 8);
+    reply[8] = ReplBootstrap;
+    put_u64(reply + 16, (uint64_t)st.st_size);
+    if (send_all(sender->fd, reply, sizeof(reply)) != NoError)
+    {
+        error = errno;
+        close(fd);
+        retfail(error);
+    }
+    while (sent < st.st_size)
+    {
+        n = sendfile(sender->fd, fd, &sent, (size_t)(st.st_size - sent));
+        if (n == 0 || (n < 0 && errno != EINTR))
+        {
+            error = n == 0 ? EIO : errno;
+            close(fd);
+            retfail(error);
+        }
+    }
+    close(fd);
+    __atomic_add_fetch(&repl.bootstraps, 1, __ATOMIC_RELAXED);
+
+    // Records the snapshot counts as applied may still be on their way to the file.
+    end = wal_written(0, 0, &lsn);
+    while (lsn < from && !__atomic_load_n(&repl.stopping, __ATOMIC_ACQUIRE))
+    {
+        end = wal_written(end, ReplHeartbeatMs, &lsn);
+    }
+    *offset = log_find(log_fd, end, from, lsn);
+    if (*offset == UINT64_MAX)
+    {
+        retfail(EIO);
+    }
+    trace(TraceInfo, "send_snapshot: %llu bytes, log from LSN %llu", (uint64_t)st.st_size, from);
+
+    return NoError;
+}
+
+// Sends the log from `offset` on, one frame per ReplFrameMax bytes of whole
+// records (or heartbeat), reading the replica's acknowledgements in between,
+// until the connection breaks or replication stops.
+static void send_log(Sender *sender, int log_fd, uint64_t offset)
+{
+    uint8_t *frame, *grown, ack[8];
+    size_t cap = ReplFrameHeaderSize + ReplFrameMax, len, pos, last, acked = 0;
+    uint64_t end, written;
+    uint32_t length = 0;
+    ssize_t n;
+
+    frame = (uint8_t *)malloc(cap);
+    if (frame == NULL)
+    {
+        return;
+    }
+
+    while (!__atomic_load_n(&repl.stopping, __ATOMIC_ACQUIRE))
+    {
+        end = wal_written(offset, ReplHeartbeatMs, &written);
+        len = end - offset > ReplFrameMax ? ReplFrameMax : (size_t)(end - offset);
+        if (len > 0 && pread(log_fd, frame + ReplFrameHeaderSize, len, (off_t)offset) != (ssize_t)len)
+        {
+            break;
+        }
+
+        // Cut the frame after its last whole record; a record larger than a
+        // frame is read on its own.
+        for (pos = last = 0; len - pos >= WalRecordHeaderSize; pos += length)
+        {
+            length = get_u32(frame + ReplFrameHeaderSize + pos + 4);
+            if (length < WalRecordHeaderSize || length > len - pos)
+            {
+                break;
+            }
+            last = pos;
+        }
+        if (pos == 0 && len >= WalRecordHeaderSize && length >= WalRecordHeaderSize)
+        {
+            if (ReplFrameHeaderSize + (size_t)length > cap)
+            {
+                grown = (uint8_t *)realloc(frame, ReplFrameHeaderSize + (size_t)length);
+                if (grown == NULL)
+                {
+                    break;
+                }
+                frame = grown;
+                cap = ReplFrameHeaderSize + (size_t)length;
+            }
+            if (pread(log_fd, frame + ReplFrameHeaderSize, length, (off_t)offset) != (ssize_t)length)
+            {
+                break;
+            }
+            pos = length;
+        }
+
+        put_u32(frame, (uint32_t)pos);
+        put_u32(frame + 4, 0);
+        put_u64(frame + 8, written);
+        if (send_all(sender->fd, frame, ReplFrameHeaderSize + pos) != NoError)
+        {
+            break;
+        }
+        if (pos > 0)
+        {
+            __atomic_store_n(&sender->stats.sent_lsn, get_u64(frame + ReplFrameHeaderSize + last + 8), __ATOMIC_RELAXED);
+            __atomic_add_fetch(&sender->stats.sent_bytes, pos, __ATOMIC_RELAXED);
+        }
+        offset += pos;
+
+        // Take in whatever acknowledgements have arrived, without waiting.
+        while ((n = recv(sender->fd, ack + acked, sizeof(ack) - acked, MSG_DONTWAIT)) > 0)
+        {
+            acked += (size_t)n;
+            if (acked == sizeof(ack))
+            {
+                __atomic_store_n(&sender->stats.acked_lsn, get_u64(ack), __ATOMIC_RELAXED);
+                acked = 0;
+            }
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            break; // The replica hung up.
+        }
+    }
+
+    free(frame);
+}
+
+// A sender thread: answers the replica's handshake, bootstraps it if it
+// needs a snapshot, then streams the log to it.
+static void *repl_sender(void *arg)
+{
+    Sender *sender = (Sender *)arg;
+    uint8_t hello[ReplHandshakeSize], reply[ReplHandshakeSize];
+    uint64_t lsn, written, end, offset = UINT64_MAX;
+    int log_fd, one = 1;
+
+    setsockopt(sender->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    log_fd = open(repl.wal_path, O_RDONLY | O_CLOEXEC);
+    if (log_fd >= 0 && recv_all(sender->fd, hello, sizeof(hello)) == NoError && memcmp(hello, ReplMagic, 8) == 0)
+    {
+        lsn = get_u64(hello + 16);
+        if (hello[8] == ReplResume)
+        {
+            end = wal_written(0, 0, &written);
+            offset = log_find(log_fd, end, lsn, written);
+        }
+        if (offset != UINT64_MAX)
+        {
+            memcpy(reply, ReplMagic, 8);
+            zero(reply + 8, 16); // No snapshot.
+            reply[8] = ReplResume;
+            if (send_all(sender->fd, reply, sizeof(reply)) != NoError)
+            {
+                offset = UINT64_MAX;
+            }
+            __atomic_store_n(&sender->stats.acked_lsn, lsn, __ATOMIC_RELAXED);
+        }
+        else if (send_snapshot(sender, log_fd, &offset) != NoError)
+        {
+            offset = UINT64_MAX;
+        }
+        trace(TraceInfo, "repl_sender: replica at LSN %llu, log from offset %llu", lsn, offset);
+        if (offset != UINT64_MAX)
+        {
+            send_log(sender, log_fd, offset);
+        }
+    }
+    if (log_fd >= 0)
+    {
+        close(log_fd);
+    }
+
+    shutdown(sender->fd, SHUT_RDWR);
+    pthread_mutex_lock(&repl.lock);
+    sender->done = 1;
+    pthread_mutex_unlock(&repl.lock);
+
+    return NULL;
+}
+
+// Joins a sender thread and frees its slot: one that is done, with `lock`
+// held, or (from repl_stop) any, without it.
+static void sender_reap(Sender *sender)
+{
+    pthread_join(sender->thread, NULL);
+    close(sender->fd);
+    sender->fd = -1;
+    sender->used = 0;
+}
+
+// The listener thread: hands every replica that connects a slot and a sender thread.
+static void *repl_listener(void *arg)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    Sender *slot;
+    char ip[INET_ADDRSTRLEN];
+    uint32_t i;
+    int fd;
+
+    (void)arg;
+
+    for (;;)
+    {
+        addr_len = sizeof(addr);
+        fd = accept4(repl.listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (!__atomic_load_n(&repl.stopping, __ATOMIC_ACQUIRE) && (errno == EINTR || errno == ECONNABORTED))
+            {
+                continue;
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&repl.lock);
+        slot = NULL;
+        for (i = 0; i < ReplMaxReplicas; i++)
+        {
+            if (repl.senders[i].used && repl.senders[i].done)
+            {
+                sender_reap(&repl.senders[i]);
+            }
+            if (!repl.senders[i].used && slot == NULL)
+            {
+                slot = &repl.senders[i];
+            }
+        }
+        if (slot != NULL && !repl.stopping)
+        {
+            zero((uint8_t *)slot, sizeof(Sender));
+            slot->fd = fd;
+            inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+            snprintf(slot->stats.name, sizeof(slot->stats.name), "%s:%u", ip, (unsigned)ntohs(addr.sin_port));
+            slot->used = pthread_create(&slot->thread, NULL, repl_sender, slot) == 0;
+        }
+        if (slot == NULL || !slot->used)
+        {
+            trace(TraceError, "repl_listener: turned a replica away (%llu slots, fd %llu)", ReplMaxReplicas, fd);
+            close(fd);
+        }
+        pthread_mutex_unlock(&repl.lock);
+    }
+
+    return NULL;
+}
+
+int8_t repl_serve(uint16_t port, const char *wal_path)
+{
+    struct sockaddr_in addr;
+    int one = 1, error;
+
+    assert(wal_path != NULL && "Error: Log path cannot be NULL for repl_serve.");
+    assert(repl.role == ReplNone && "Error: Replication is already running.");
+
+    repl.wal_path = strdup(wal_path);
+    repl.scratch = (char *)malloc(strlen(wal_path) + sizeof(ReplSnapshotSuffix));
+    if (repl.wal_path == NULL || repl.scratch == NULL)
+    {
+        free(repl.wal_path);
+        free(repl.scratch);
+        retfail(ENOMEM);
+    }
+    sprintf(repl.scratch, "%s%s", wal_path, ReplSnapshotSuffix);
+
+    repl.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (repl.listen_fd >= 0)
+    {
+        setsockopt(repl.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        zero((uint8_t *)&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+    }
+    error = repl.listen_fd < 0 || bind(repl.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(repl.listen_fd, ReplMaxReplicas) != 0 ? errno
+                                                        : pthread_create(&repl.listener, NULL, repl_listener, NULL);
+    if (error != NoError)
+    {
+        if (repl.listen_fd >= 0)
+        {
+            close(repl.listen_fd);
+            repl.listen_fd = -1;
+        }
+        free(repl.wal_path);
+        free(repl.scratch);
+        repl.wal_path = repl.scratch = NULL;
+        retfail(error);
+    }
+    repl.role = ReplPrimary;
+    trace(TraceInfo, "repl_serve: replication port %llu, %llu replicas at most", port, ReplMaxReplicas);
+
+    return NoError;
+}
+
+// Connects to the primary and exchanges handshakes, asking for mode `want`
+// after `lsn`. Sets `*mode` (the mode given) and `*size` (of the snapshot
+// that follows, if any). Returns the
+// connection, or -1 with errno set.
+static int repl_connect(uint8_t want, uint64_t lsn, uint8_t *mode, uint64_t *size)
+{
+    uint8_t hello[ReplHandshakeSize], reply[ReplHandshakeSize];
+    int fd, one = 1, error;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memcpy(hello, ReplMagic, 8);
+    zero(hello + 8, 8);
+    hello[8] = want;
+    put_u64(hello + 16, lsn);
+    if (connect(fd, (struct sockaddr *)&repl.primary, sizeof(repl.primary)) != 0 ||
+        send_all(fd, hello, sizeof(hello)) != NoError || recv_all(fd, reply, sizeof(reply)) != NoError)
+    {
+        error = errno;
+        close(fd);
+        retfail(error);
+    }
+    if (memcmp(reply, ReplMagic, 8) != 0 || (reply[8] != ReplResume && reply[8] != ReplBootstrap))
+    {
+        close(fd);
+        retfail(EPROTO);
+    }
+    *mode = reply[8];
+    *size = get_u64(reply + 16);
+
+    return fd;
+}
+
+int8_t repl_bootstrap(const char *host, uint16_t port, const char *snapshot_path)
+{
+    uint8_t mode, *chunk;
+    uint64_t size, got = 0;
+    size_t want;
+    uint32_t i;
+    char *tmp;
+    int fd, out, error = NoError;
+
+    assert(host != NULL && snapshot_path != NULL && "Error: Arguments cannot be NULL for repl_bootstrap.");
+    assert(repl.role == ReplNone && "Error: Replication is already running.");
+
+    zero((uint8_t *)&repl.primary, sizeof(repl.primary));
+    repl.primary.sin_family = AF_INET;
+    repl.primary.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &repl.primary.sin_addr) != 1)
+    {
+        retfail(EINVAL);
+    }
+
+    fd = repl_connect(ReplBootstrap, 0, &mode, &size);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (mode != ReplBootstrap)
+    {
+        close(fd);
+        retfail(EPROTO);
+    }
+
+    // Write the snapshot next to its path and rename it over, as snapshot_save does.
+    tmp = (char *)malloc(strlen(snapshot_path) + 5);
+    chunk = (uint8_t *)malloc(ReplFrameMax);
+    out = -1;
+    if (tmp == NULL || chunk == NULL)
+    {
+        error = ENOMEM;
+    }
+    else
+    {
+        sprintf(tmp, "%s.tmp", snapshot_path);
+        out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        error = out < 0 ? errno : NoError;
+    }
+    while (error == NoError && got < size)
+    {
+        want = size - got > ReplFrameMax ? ReplFrameMax : (size_t)(size - got);
+        if (recv_all(fd, chunk, want) != NoError || write(out, chunk, want) != (ssize_t)want)
+        {
+            error = errno != 0 ? errno : EIO;
+        }
+        got += want;
+    }
+    if (out >= 0 && (fsync(out) != 0 || close(out) != 0) && error == NoError)
+    {
+        error = errno;
+    }
+    if (error == NoError && rename(tmp, snapshot_path) != 0)
+    {
+        error = errno;
+    }
+    if (error != NoError && tmp != NULL)
+    {
+        unlink(tmp);
+    }
+    free(chunk);
+    free(tmp);
+    if (error == NoError && snapshot_load(snapshot_path) != NoError)
+    {
+        error = errno;
+    }
+    if (error != NoError)
+    {
+        close(fd);
+        retfail(error);
+    }
+
+    // The stream goes on after the oldest record a shard of the snapshot lacks.
+    repl.applied_lsn = shards[0].lsn;
+    for (i = 1; i < ShardCount; i++)
+    {
+        repl.applied_lsn = shards[i].lsn < repl.applied_lsn ? shards[i].lsn : repl.applied_lsn;
+    }
+    repl.fd = fd;
+    repl.role = ReplReplica;
+    repl.caught_up = metrics_now();
+    trace(TraceInfo, "repl_bootstrap: %llu snapshot bytes, stream from LSN %llu", size, repl.applied_lsn);
+
+    return NoError;
+}
+
+// Applies the whole records of one frame, a batch of WalSet records at a time.
+// `text` (at least `len` bytes) holds the NUL-terminated paths and keys.
+// Returns 0, or -1 with errno set to EIO if a record is corrupt.
+static int8_t repl_apply(uint8_t *data, size_t len, char *text)
+{
+    BatchOp ops[ReplBatch];
+    uint8_t *rec;
+    char *path;
+    uint8_t *key;
+    size_t off = 0, used = 0;
+    uint64_t lsn = 0, records = 0;
+    uint32_t count = 0, value_len, now = expire_clock();
+    uint16_t path_len;
+    uint8_t key_len;
+    int64_t length;
+
+    while (off < len)
+    {
+        rec = data + off;
+        length = wal_check(rec, len - off);
+        if (length <= 0)
+        {
+            retfail(EIO); // Frames only ever carry whole records.
+        }
+        key_len = rec[17];
+        path_len = get_u16(rec + 18);
+        value_len = get_u32(rec + 20);
+
+        // Header bytes outnumber the two NULs, so `text` never runs out.
+        path = text + used;
+        memcpy(path, rec + WalRecordHeaderSize, path_len);
+        path[path_len] = '\0';
+        key = (uint8_t *)path + path_len + 1;
+        memcpy(key, rec + WalRecordHeaderSize + path_len, key_len);
+        key[key_len] = '\0';
+        used += path_len + key_len + 2u;
+
+        if (get_u64(rec + 8) <= shard_for_path(path)->lsn)
+        {
+            // Already contained in the snapshot the replica was bootstrapped from.
+        }
+        else if (rec[16] == WalSet)
+        {
+            ops[count].path = path;
+            ops[count].key = key;
+            ops[count].value = rec + WalRecordHeaderSize + path_len + key_len;
+            ops[count].size = value_len;
+            if (++count == ReplBatch)
+            {
+                store_set_many(ops, count);
+                count = 0;
+            }
+        }
+        else
+        {
+            // Everything else keeps its place in the order.
+            if (count > 0)
+            {
+                store_set_many(ops, count);
+                count = 0;
+            }
+            wal_apply(rec[16], path, key, key_len, rec + WalRecordHeaderSize + path_len + key_len, value_len, now);
+        }
+
+        lsn = get_u64(rec + 8);
+        records++;
+        off += (size_t)length;
+    }
+    if (count > 0)
+    {
+        store_set_many(ops, count);
+    }
+
+    if (records > 0)
+    {
+        __atomic_store_n(&repl.applied_lsn, lsn, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&repl.applied_records, records, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&repl.applied_bytes, len, __ATOMIC_RELAXED);
+    }
+
+    return NoError;
+}
+
+// Applies frames from the primary and acknowledges each one, until the
+// stream breaks. Returns -1 with errno set.
+static int8_t repl_stream(int fd)
+{
+    uint8_t header[ReplFrameHeaderSize], ack[8], *data = NULL, *grown;
+    char *text = NULL;
+    size_t cap = 0;
+    uint32_t len;
+    uint64_t primary;
+    int error;
+
+    for (;;)
+    {
+        if (recv_all(fd, header, sizeof(header)) != NoError)
+        {
+            break;
+        }
+        len = get_u32(header);
+        primary = get_u64(header + 8);
+        if (len > cap)
+        {
+            grown = (uint8_t *)realloc(data, len);
+            if (grown == NULL)
+            {
+                errno = ENOMEM;
+                break;
+            }
+            data = grown;
+            grown = (uint8_t *)realloc(text, len);
+            if (grown == NULL)
+            {
+                errno = ENOMEM;
+                break;
+            }
+            text = (char *)grown;
+            cap = len;
+        }
+        if (recv_all(fd, data, len) != NoError || repl_apply(data, len, text) != NoError)
+        {
+            break;
+        }
+
+        __atomic_store_n(&repl.primary_lsn, primary, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&repl.applied_lsn, __ATOMIC_RELAXED) >= primary)
+        {
+            __atomic_store_n(&repl.caught_up, metrics_now(), __ATOMIC_RELAXED);
+        }
+        put_u64(ack, __atomic_load_n(&repl.applied_lsn, __ATOMIC_RELAXED));
+        if (send_all(fd, ack, sizeof(ack)) != NoError)
+        {
+            break;
+        }
+    }
+
+    error = errno;
+    free(data);
+    free(text);
+    retfail(error);
+}
+
+// The follower thread: applies the stream, and reconnects (resuming after
+// the last record applied) whenever it breaks.
+static void *repl_follower(void *arg)
+{
+    struct timespec deadline;
+    uint64_t size;
+    uint8_t mode;
+    int fd;
+
+    (void)arg;
+
+    pthread_mutex_lock(&repl.lock);
+    while (!repl.stopping)
+    {
+        if (repl.fd < 0)
+        {
+            // Pause before trying again, unless stopping.
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += ReplRetryMs / 1000;
+            deadline.tv_nsec += (long)(ReplRetryMs % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&repl.wake, &repl.lock, &deadline);
+            if (repl.stopping)
+            {
+                break;
+            }
+            pthread_mutex_unlock(&repl.lock);
+            fd = repl_connect(ReplResume, __atomic_load_n(&repl.applied_lsn, __ATOMIC_RELAXED), &mode, &size);
+            pthread_mutex_lock(&repl.lock);
+            if (fd >= 0 && mode != ReplResume)
+            {
+                fprintf(stderr, "ERROR: The primary no longer holds the log after LSN %llu; "
+                                "restart the replica to bootstrap it again.\n",
+                        (unsigned long long)repl.applied_lsn);
+                close(fd);
+                break;
+            }
+            if (fd < 0)
+            {
+                continue;
+            }
+            repl.fd = fd;
+            if (repl.stopping)
+            {
+                break;
+            }
+        }
+
+        repl.connected = 1;
+        pthread_mutex_unlock(&repl.lock);
+        repl_stream(repl.fd);
+        trace(TraceError, "repl_follower: stream broke with errno %llu at LSN %llu", errno, repl.applied_lsn);
+        pthread_mutex_lock(&repl.lock);
+        repl.connected = 0;
+        close(repl.fd);
+        repl.fd = -1;
+    }
+    pthread_mutex_unlock(&repl.lock);
+
+    return NULL;
+}
+
+int8_t repl_follow(void)
+{
+    int error;
+
+    assert(repl.role == ReplReplica && "Error: repl_follow needs repl_bootstrap first.");
+
+    error = pthread_create(&repl.follower, NULL, repl_follower, NULL);
+    if (error != 0)
+    {
+        retfail(error);
+    }
+    repl.following = 1;
+
+    return NoError;
+}
+
+void repl_stop(void)
+{
+    uint64_t last;
+    uint32_t i, waited;
+    int behind;
+
+    if (repl.role == ReplNone)
+    {
+        return;
+    }
+
+    // A primary about to truncate its log lets the replicas catch up first, for a while.
+    for (waited = 0; repl.role == ReplPrimary && waited < ReplDrainMs; waited += 10)
+    {
+        last = wal_last_lsn();
+        behind = 0;
+        pthread_mutex_lock(&repl.lock);
+        for (i = 0; i < ReplMaxReplicas; i++)
+        {
+            behind |= repl.senders[i].used && !repl.senders[i].done &&
+                      __atomic_load_n(&repl.senders[i].stats.acked_lsn, __ATOMIC_RELAXED) < last;
+        }
+        pthread_mutex_unlock(&repl.lock);
+        if (!behind)
+        {
+            break;
+        }
+        usleep(10 * 1000);
+    }
+
+    // Wake every thread out of its accept, recv or pause.
+    pthread_mutex_lock(&repl.lock);
+    __atomic_store_n(&repl.stopping, 1, __ATOMIC_RELEASE);
+    if (repl.listen_fd >= 0)
+    {
+        shutdown(repl.listen_fd, SHUT_RDWR);
+    }
+    for (i = 0; i < ReplMaxReplicas; i++)
+    {
+        if (repl.senders[i].used)
+        {
+            shutdown(repl.senders[i].fd, SHUT_RDWR);
+        }
+    }
+    if (repl.fd >= 0)
+    {
+        shutdown(repl.fd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&repl.wake);
+    pthread_mutex_unlock(&repl.lock);
+
+    if (repl.role == ReplPrimary)
+    {
+        pthread_join(repl.listener, NULL);
+        close(repl.listen_fd);
+        repl.listen_fd = -1;
+        // With the listener gone nothing else reaps, and the senders take the lock to exit.
+        for (i = 0; i < ReplMaxReplicas; i++)
+        {
+            if (repl.senders[i].used)
+            {
+                sender_reap(&repl.senders[i]);
+            }
+        }
+        free(repl.wal_path);
+        free(repl.scratch);
+        repl.wal_path = repl.scratch = NULL;
+    }
+    else
+    {
+        if (repl.following)
+        {
+            pthread_join(repl.follower, NULL);
+            repl.following = 0;
+        }
+        if (repl.fd >= 0)
+        {
+            close(repl.fd);
+            repl.fd = -1;
+        }
+    }
+    repl.role = ReplNone;
+    repl.stopping = 0;
+}
+
+int repl_replica(void)
+{
+    return repl.role == ReplReplica;
+}
+
+void repl_stats(ReplStats *stats)
+{
+    Sender *sender;
+    uint64_t now;
+    uint32_t i;
+
+    zero((uint8_t *)stats, sizeof(ReplStats));
+    stats->role = repl.role;
+
+    if (repl.role == ReplPrimary)
+    {
+        stats->written_lsn = wal_last_lsn();
+        stats->bootstraps = __atomic_load_n(&repl.bootstraps, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&repl.lock);
+        for (i = 0; i < ReplMaxReplicas; i++)
+        {
+            sender = &repl.senders[i];
+            if (sender->used && !sender->done)
+            {
+                memcpy(stats->replica[stats->replicas].name, sender->stats.name, sizeof(sender->stats.name));
+                stats->replica[stats->replicas].acked_lsn = __atomic_load_n(&sender->stats.acked_lsn, __ATOMIC_RELAXED);
+                stats->replica[stats->replicas].sent_lsn = __atomic_load_n(&sender->stats.sent_lsn, __ATOMIC_RELAXED);
+                stats->replica[stats->replicas].sent_bytes = __atomic_load_n(&sender->stats.sent_bytes, __ATOMIC_RELAXED);
+                stats->replicas++;
+            }
+        }
+        pthread_mutex_unlock(&repl.lock);
+    }
+    else if (repl.role == ReplReplica)
+    {
+        stats->connected = __atomic_load_n(&repl.connected, __ATOMIC_RELAXED);
+        stats->applied_lsn = __atomic_load_n(&repl.applied_lsn, __ATOMIC_RELAXED);
+        stats->primary_lsn = __atomic_load_n(&repl.primary_lsn, __ATOMIC_RELAXED);
+        stats->applied_records = __atomic_load_n(&repl.applied_records, __ATOMIC_RELAXED);
+        stats->applied_bytes = __atomic_load_n(&repl.applied_bytes, __ATOMIC_RELAXED);
+        now = metrics_now();
+        if (!stats->connected || stats->applied_lsn < stats->primary_lsn)
+        {
+            stats->lag_seconds = (double)(now - __atomic_load_n(&repl.caught_up, __ATOMIC_RELAXED)) / 1e9;
+        }
+    }
+}
@@ -0,0 +1,154 @@
+#ifndef REPL_H
+#define REPL_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint64_t)
+#include <stddef.h> // For size_t
+
+// =============================================================================
+// Replication Definitions
+// =============================================================================
+// A primary streams its write-ahead log to any number of read replicas, which
+// apply it asynchronously. There is no replication log of its own: each
+// replica has a sender thread on the primary that tails the log file as the
+// flusher writes it (see wal_written) and sends the records verbatim, so
+// every record a replica applies is one the primary has already applied and
+// written, in LSN order. Writes are never held back for replicas.
+//
+// A replica knows the LSN of the last record it applied. It reconnects with
+// that LSN and, if the primary's log still holds every record after it, the
+// stream simply resumes there. A fresh replica, or one too far behind, is
+// bootstrapped instead: the primary saves a snapshot of its live
+// store (see snapshot_save, which takes one shard lock at a time) and sends
+// the file, which the replica writes to its own snapshot path and maps like
+// any snapshot, then the log from the oldest LSN a shard of that snapshot
+// holds. Records a shard's snapshot already contains are skipped, as replay
+// does. Only an empty replica can take a snapshot, so one that has applied
+// anything and is asked to bootstrap stops replicating until it is restarted.
+// That happens when a primary restarts from its own snapshot (which empties
+// its log) before the replica has caught up; a primary that shuts down gives
+// its replicas a moment to catch up first.
+//
+// Replicas apply runs of WalSet records with store_set_many, a batch at a
+// time, and everything else as replay does (see wal_apply). They keep no log
+// of their own and refuse writes from clients (StatusReadOnly).
+//
+// Wire format (little-endian):
+//   replica -> primary, once:  u8[8] ReplMagic, u8 mode wanted (ReplResume / ReplBootstrap),
+//                              u8[7] reserved, u64 LSN applied
+//   primary -> replica, once:  u8[8] ReplMagic, u8 mode given, u8[7] reserved,
+//                              u64 snapshot length (0 when resuming), snapshot bytes
+//   primary -> replica, then:  frames of u32 length, u32 reserved, u64 primary LSN
+//                              (last record written), then `length` bytes of whole
+//                              log records; a frame with no records is a heartbeat
+//   replica -> primary, then:  u64 LSN applied, after every frame
+#define ReplMagic "DBREPL\0\1"       /* First 8 bytes of either side's handshake */
+#define ReplResume 1                  /* Handshake mode: the stream goes on after the replica's LSN */
+#define ReplBootstrap 2               /* Handshake mode: a snapshot comes first */
+#define ReplHandshakeSize 24          /* Bytes in either side's handshake (before the snapshot) */
+#define ReplFrameHeaderSize 16        /* Bytes in a frame header */
+#define ReplFrameMax (1024 * 1024)    /* Record bytes per frame (one record larger than this gets a frame of its own) */
+#define ReplHeartbeatMs 500           /* A frame goes out at least this often, records or not */
+#define ReplRetryMs 1000              /* Pause before a replica reconnects to its primary */
+#define ReplDrainMs 2000              /* How long a stopping primary waits for its replicas to acknowledge everything */
+#define ReplBatch 256                 /* WalSet records a replica applies per store_set_many */
+#define ReplMaxReplicas 16            /* Replicas a primary serves at once */
+#define ReplSnapshotSuffix ".repl"    /* Appended to the log path for the bootstrap snapshots a primary saves */
+
+#define ReplNone 0    /* Role: neither (replication off) */
+#define ReplPrimary 1 /* Role: serves replicas */
+#define ReplReplica 2 /* Role: follows a primary */
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+/**
+ * @brief What a primary knows about one connected replica.
+ */
+struct s_replica_stats {
+    char name[48];       ///< The replica's address, "ip:port".
+    uint64_t acked_lsn;  ///< The last LSN it reported applying.
+    uint64_t sent_lsn;   ///< The LSN of the last record sent to it.
+    uint64_t sent_bytes; ///< Log bytes sent to it (snapshots not included).
+};
+typedef struct s_replica_stats ReplicaStats;
+
+/**
+ * @brief Replication state, as the metrics report it.
+ */
+struct s_repl_stats {
+    uint8_t role;                              ///< ReplNone, ReplPrimary or ReplReplica.
+    // Primary.
+    uint32_t replicas;                         ///< Replicas connected.
+    uint64_t written_lsn;                      ///< LSN of the last record written to the log.
+    uint64_t bootstraps;                       ///< Snapshots sent to replicas.
+    ReplicaStats replica[ReplMaxReplicas];     ///< The first `replicas` entries are set.
+    // Replica.
+    uint8_t connected;                         ///< Non-zero while the stream from the primary is up.
+    uint64_t applied_lsn;                      ///< LSN of the last record applied.
+    uint64_t primary_lsn;                      ///< Last LSN the primary reported writing.
+    uint64_t applied_records;                  ///< Records applied (skipped ones included).
+    uint64_t applied_bytes;                    ///< Log bytes received and applied.
+    double lag_seconds;                        ///< Time since the replica last had every record the primary had written.
+};
+typedef struct s_repl_stats ReplStats;
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Starts serving replicas on a TCP port. The log must be open.
+ *
+ * @param port     The TCP port to listen on (all interfaces).
+ * @param wal_path The log file the senders tail.
+ * @return         0 on success, or -1 with errno set.
+ */
+int8_t repl_serve(uint16_t port, const char *wal_path);
+
+/**
+ * @brief Connects to a primary and bootstraps the (empty) store from its snapshot.
+ *
+ * Must be called after shards_init and instead of snapshot_load and wal_open.
+ * The snapshot is written to `snapshot_path` and mapped from there. The
+ * connection is kept for repl_follow.
+ *
+ * @param host          The primary's IPv4 address.
+ * @param port          The primary's replication port.
+ * @param snapshot_path Where to store the snapshot.
+ * @return              0 on success, or -1 with errno set.
+ */
+int8_t repl_bootstrap(const char *host, uint16_t port, const char *snapshot_path);
+
+/**
+ * @brief Starts applying the primary's log, after repl_bootstrap. Reconnects whenever the stream breaks.
+ *
+ * @return 0 on success, or -1 with errno set if the thread could not start.
+ */
+int8_t repl_follow(void);
+
+/**
+ * @brief Stops serving or following, and waits for the replication threads to exit.
+ *
+ * A primary first waits up to ReplDrainMs for its replicas to acknowledge
+ * every record logged. Must be called before wal_close, once nothing writes
+ * any more. Does nothing if replication is off.
+ */
+void repl_stop(void);
+
+/**
+ * @brief Returns non-zero if this server is a replica (and so refuses writes from clients).
+ */
+int repl_replica(void);
+
+/**
+ * @brief Fills in the replication state for the metrics.
+ *
+ * @param stats The state to fill in.
+ */
+void repl_stats(ReplStats *stats);
+
+#endif /* REPL_H */
@@ -0,0 +1,1489 @@
+/* server.c */
+#include "main.h"
+
+#include <signal.h>      // For sigaction, SIGINT, SIGTERM, SIGPIPE
+#include <fcntl.h>       // For fcntl, O_NONBLOCK
+#include <sys/epoll.h>   // For epoll_create1, epoll_ctl, epoll_wait
+#include <sys/eventfd.h> // For eventfd
+#include <sys/socket.h>  // For socket, bind, listen, accept4
+#include <netinet/in.h>  // For struct sockaddr_in, INADDR_ANY
+#include <netinet/tcp.h> // For TCP_NODELAY
+#include <sys/uio.h>     // For struct iovec
+
+#define ServerMaxPath 4096                  /* Longest path accepted in a request */
+#define ServerMaxPending (16 * 1024 * 1024) /* Output bytes after which input processing pauses */
+#define ServerMaxScan (1024 * 1024)         /* SCAN body bytes after which the response ends with StatusMore */
+#define ServerZeroCopyMin (16 * 1024)       /* GET values from this size on are sent from the store, not copied */
+#define ServerMaxIov 64                     /* I/O vectors per sendmsg */
+
+/**
+ * @brief A pinned value to be sent straight from the store, without being copied into the output buffer.
+ *
+ * Positions count output buffer bytes only: the value goes out once every
+ * buffered byte before `at` has been sent, and before any byte after it.
+ */
+struct s_segment {
+    uint64_t at;    ///< Position in the buffered output stream that the value follows.
+    size_t sent;    ///< Bytes of the value already written.
+    ValueView view; ///< The pinned value.
+};
+typedef struct s_segment Segment;
+
+/**
+ * @brief State of one client connection.
+ */
+struct s_connection {
+    int fd;             ///< The client socket.
+    Buffer in;          ///< Received bytes not yet parsed into requests.
+    Buffer out;         ///< Encoded responses not yet written to the socket.
+    uint64_t out_sent;  ///< Buffered output bytes written since the connection opened.
+    Segment *segs;      ///< Pinned values waiting to be sent, in order, from `seg_head` to `seg_len`.
+    size_t seg_head;    ///< First unsent segment.
+    size_t seg_len;     ///< End of the queued segments.
+    size_t seg_cap;     ///< Allocated length of `segs`.
+    size_t seg_bytes;   ///< Unsent bytes of the queued segments.
+    uint32_t events;    ///< epoll events currently registered for the socket.
+    uint64_t wait_lsn;  ///< While non-zero, output is held until this LSN is durable (see connection_respond).
+    struct s_connection *wait_prev; ///< Previous connection in `waiters`.
+    struct s_connection *wait_next; ///< Next connection in `waiters`.
+    uint64_t lsn;       ///< LSN that covers every write the executed requests made or could have seen.
+    Task task;          ///< Executes the connection's requests on the pool (see connection_execute).
+    uint8_t busy;       ///< Set while a worker owns `in`, `out` and the segments; the event loop leaves them alone.
+    uint8_t failed;     ///< The socket failed while busy; the connection closes once the worker is done.
+    struct s_connection *done_next; ///< Next connection in `done`.
+    Buffer batch;       ///< Decoded MGET / MSET entries of the request being executed.
+};
+typedef struct s_connection Connection;
+
+static volatile sig_atomic_t stopping = 0; // Set by server_stop.
+static Connection *waiters = NULL;         // Connections holding output until their writes are durable.
+static uint8_t wal_marker;                 // epoll data pointer of the WAL notification eventfd.
+static uint8_t done_marker;                // epoll data pointer of `done_fd`.
+static Connection *done = NULL;            // Connections whose requests a worker has executed (lock-free stack).
+static int done_fd = -1;                   // Eventfd the workers write after pushing onto `done`.
+static uint32_t busy_count = 0;            // Connections currently owned by a worker.
+
+// --- Buffers ---
+
+// Makes room for at least `extra` more bytes at the end of the buffer.
+static int8_t buffer_reserve(Buffer *buf, size_t extra)
+{
+    uint8_t *data;
+    size_t cap;
+
+    // Drop the consumed prefix before growing.
+    if (buf->off > 0 && buf->len + extra > buf->cap)
+    {
+        memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+        buf->len -= buf->off;
+        buf->off = 0;
+    }
+    if (buf->len + extra <= buf->cap)
+    {
+        return NoError;
+    }
+
+    cap = buf->cap == 0 ? ServerReadChunk : buf->cap;
+    while (cap < buf->len + extra)
+    {
+        cap *= 2;
+    }
+    data = (uint8_t *)realloc(buf->data, cap);
+    if (data == NULL)
+    {
+        retfail(ENOMEM);
+    }
+    buf->data = data;
+    buf->cap = cap;
+
+    return NoError;
+}
+
+// Appends `len` bytes to the buffer.
+static int8_t buffer_append(Buffer *buf, const void *bytes, size_t len)
+{
+    if (buffer_reserve(buf, len) != NoError)
+    {
+        return -1;
+    }
+    memcpy(buf->data + buf->len, bytes, len);
+    buf->len += len;
+
+    return NoError;
+}
+
+// Appends a value read with leaf_read_begin, decompressing it if it is packed.
+static int8_t buffer_append_value(Buffer *buf, const uint8_t *value, uint32_t size, uint8_t flags)
+{
+    if (buffer_reserve(buf, size) != NoError || value_copy(buf->data + buf->len, value, size, flags) != NoError)
+    {
+        return -1;
+    }
+    buf->len += size;
+
+    return NoError;
+}
+
+static void buffer_release(Buffer *buf)
+{
+    free(buf->data);
+    zero((uint8_t *)buf, sizeof(Buffer));
+}
+
+// --- Responses ---
+
+// Returns the bytes of output still waiting for the socket, pinned values included.
+static size_t connection_pending(Connection *conn)
+{
+    return conn->out.len - conn->out.off + conn->seg_bytes;
+}
+
+// Encodes a response header announcing `body_len` body bytes.
+static void response_header(uint8_t *header, uint8_t status, uint32_t id, uint32_t body_len)
+{
+    header[0] = ProtocolMagic;
+    header[1] = status;
+    put_u16(header + 2, 0);
+    put_u32(header + 4, id);
+    put_u32(header + 8, body_len);
+}
+
+// Appends a response header announcing `body_len` body bytes; the caller appends the body.
+static int8_t respond(Connection *conn, uint8_t status, uint32_t id, uint32_t body_len)
+{
+    uint8_t header[ResponseHeaderSize];
+
+    response_header(header, status, id, body_len);
+
+    return buffer_append(&conn->out, header, sizeof(header));
+}
+
+// Appends `head`, with the value size stored at `head + size_at`, and queues a
+// pinned view of the leaf's value to follow it.
+static int8_t append_view(Connection *conn, Leaf *leaf, uint8_t *head, size_t head_len, size_t size_at)
+{
+    Segment *segs;
+    size_t cap;
+
+    if (conn->seg_len == conn->seg_cap)
+    {
+        cap = conn->seg_cap == 0 ? 16 : conn->seg_cap * 2;
+        segs = (Segment *)realloc(conn->segs, cap * sizeof(Segment));
+        if (segs == NULL)
+        {
+            retfail(ENOMEM);
+        }
+        conn->segs = segs;
+        conn->seg_cap = cap;
+    }
+    if (leaf_view(leaf, &conn->segs[conn->seg_len].view) != NoError)
+    {
+        return -1;
+    }
+    put_u32(head + size_at, conn->segs[conn->seg_len].view.size);
+    if (buffer_append(&conn->out, head, head_len) != NoError)
+    {
+        view_release(&conn->segs[conn->seg_len].view);
+        return -1;
+    }
+
+    conn->segs[conn->seg_len].at = conn->out_sent + (conn->out.len - conn->out.off);
+    conn->segs[conn->seg_len].sent = 0;
+    conn->seg_bytes += conn->segs[conn->seg_len].view.size;
+    conn->seg_len++;
+
+    return NoError;
+}
+
+// Appends `head` (a response or MGET entry header), with the value size stored
+// at `head + size_at`, followed by the leaf's value. Large values that stay
+// put (heap blocks or the snapshot) are pinned and sent from where they are;
+// the rest are copied (or decompressed), and copied again if an update tore
+// the copy.
+static int8_t append_value(Connection *conn, Leaf *leaf, uint8_t *head, size_t head_len, size_t size_at)
+{
+    const uint8_t *value;
+    uint32_t size, version;
+    uint8_t flags;
+    size_t head_at;
+
+    for (;;)
+    {
+        version = leaf_read_begin(leaf, &value, &size, &flags);
+        if (size >= ServerZeroCopyMin && (flags & (LeafHeap | LeafMapped)) && !(flags & LeafPacked))
+        {
+            return append_view(conn, leaf, head, head_len, size_at);
+        }
+
+        head_at = conn->out.len - conn->out.off; // Appending may compact the buffer.
+        put_u32(head + size_at, size);
+        if (buffer_append(&conn->out, head, head_len) != NoError || buffer_append_value(&conn->out, value, size, flags) != NoError)
+        {
+            return -1;
+        }
+        if (!leaf_read_retry(leaf, version))
+        {
+            return NoError;
+        }
+        conn->out.len = conn->out.off + head_at;
+    }
+}
+
+// Appends a StatusOk response carrying the leaf's value.
+static int8_t respond_value(Connection *conn, uint32_t id, Leaf *leaf)
+{
+    uint8_t header[ResponseHeaderSize];
+
+    response_header(header, StatusOk, id, 0);
+
+    return append_value(conn, leaf, header, sizeof(header), 8);
+}
+
+// Maps the errno of a failed store operation to a response status.
+static uint8_t status_from_errno(void)
+{
+    switch (errno)
+    {
+    case ENOENT:
+    case NoError:
+        return StatusNotFound;
+    case EINVAL:
+    case ENAMETOOLONG:
+        return StatusBadRequest;
+    default:
+        return StatusError;
+    }
+}
+
+// Appends one LIST entry to the output buffer.
+static int8_t list_entry(Connection *conn, uint8_t kind, const uint8_t *name, uint16_t len)
+{
+    uint8_t entry[3];
+
+    entry[0] = kind;
+    put_u16(entry + 1, len);
+    if (buffer_append(&conn->out, entry, sizeof(entry)) != NoError)
+    {
+        return -1;
+    }
+
+    return buffer_append(&conn->out, name, len);
+}
+
+// Executes a LIST request: one entry per child Node, then one per live Leaf.
+static int8_t execute_list(Connection *conn, const char *path, uint32_t id)
+{
+    Node *node, *child;
+    Leaf *leaf;
+    uint32_t cursor = 0, now = expire_clock();
+    size_t header_at, body_at;
+    int8_t status = NoError;
+
+    epoch_enter();
+
+    node = store_resolve(path);
+    if (node == NULL || node_ready(node) != NoError)
+    {
+        epoch_exit();
+        return respond(conn, status_from_errno(), id, 0);
+    }
+
+    // Write the header first and patch its body length once the entries are in.
+    // Positions count from `off`, since appending may compact the buffer.
+    header_at = conn->out.len - conn->out.off;
+    if (respond(conn, StatusOk, id, 0) != NoError)
+    {
+        epoch_exit();
+        return -1;
+    }
+    body_at = conn->out.len - conn->out.off;
+
+    while (status == NoError && (child = (Node *)index_next(&node->children, &cursor)) != NULL)
+    {
+        status = list_entry(conn, ListNode, child->path, (uint16_t)strnlen((char *)child->path, PathSegmentMax));
+    }
+    for (leaf = load_ptr(node->east); status == NoError && leaf != NULL; leaf = load_ptr(leaf->east))
+    {
+        if (!leaf_expired(leaf, now))
+        {
+            status = list_entry(conn, ListLeaf, leaf->key, leaf->keylen);
+        }
+    }
+
+    epoch_exit();
+
+    if (status == NoError)
+    {
+        put_u32(conn->out.data + conn->out.off + header_at + 8, (uint32_t)(conn->out.len - conn->out.off - body_at));
+    }
+
+    return status;
+}
+
+// Executes a SCAN request: one entry per Leaf with a key in [key, end), in key
+// order, or from `key` onwards if `end` is empty.
+static int8_t execute_scan(Connection *conn, const char *path, const uint8_t *key, uint16_t key_len,
+                           const uint8_t *end, uint16_t end_len, uint32_t id)
+{
+    Cursor cursor;
+    Node *node;
+    Leaf *leaf;
+    const uint8_t *value;
+    uint32_t size, version, now = expire_clock();
+    uint8_t entry[6], code = StatusOk, flags;
+    size_t header_at, body_at, entry_at;
+    int8_t status = NoError;
+
+    epoch_enter();
+
+    node = store_resolve(path);
+    if (node == NULL || node_ready(node) != NoError)
+    {
+        epoch_exit();
+        return respond(conn, status_from_errno(), id, 0);
+    }
+
+    // Write the header first and patch its status and body length once the entries are in.
+    // Positions count from `off`, since appending may compact the buffer.
+    header_at = conn->out.len - conn->out.off;
+    if (respond(conn, StatusOk, id, 0) != NoError)
+    {
+        epoch_exit();
+        return -1;
+    }
+    body_at = conn->out.len - conn->out.off;
+
+    for (leaf = cursor_seek(&cursor, node, key, key_len); status == NoError && leaf != NULL; leaf = cursor_next(&cursor))
+    {
+        if (end_len > 0 && leaf_compare(leaf, end, end_len) >= 0)
+        {
+            break;
+        }
+        if (conn->out.len - conn->out.off - body_at >= ServerMaxScan)
+        {
+            code = StatusMore;
+            break;
+        }
+        if (leaf_expired(leaf, now))
+        {
+            continue;
+        }
+
+        // Copy the entry again if an update tears the value meanwhile.
+        entry_at = conn->out.len - conn->out.off;
+        do
+        {
+            conn->out.len = conn->out.off + entry_at;
+            version = leaf_read_begin(leaf, &value, &size, &flags);
+            put_u16(entry, leaf->keylen);
+            put_u32(entry + 2, size);
+            status = buffer_append(&conn->out, entry, sizeof(entry));
+            if (status == NoError)
+            {
+                status = buffer_append(&conn->out, leaf->key, leaf->keylen);
+            }
+            if (status == NoError)
+            {
+                status = buffer_append_value(&conn->out, value, size, flags);
+            }
+        } while (status == NoError && leaf_read_retry(leaf, version));
+    }
+
+    epoch_exit();
+
+    if (status == NoError)
+    {
+        conn->out.data[conn->out.off + header_at + 1] = code;
+        put_u32(conn->out.data + conn->out.off + header_at + 8, (uint32_t)(conn->out.len - conn->out.off - body_at));
+    }
+
+    return status;
+}
+
+// Executes a STATS request: the metrics text becomes the body.
+static int8_t execute_stats(Connection *conn, uint32_t id)
+{
+    FILE *out;
+    char *text = NULL;
+    size_t len = 0;
+    int8_t status;
+
+    out = open_memstream(&text, &len);
+    if (out == NULL)
+    {
+        return respond(conn, StatusError, id, 0);
+    }
+    status = metrics_write(out);
+    if (fclose(out) != 0)
+    {
+        status = -1;
+    }
+    if (status != NoError)
+    {
+        free(text);
+        return respond(conn, StatusError, id, 0);
+    }
+
+    status = respond(conn, StatusOk, id, (uint32_t)len);
+    if (status == NoError)
+    {
+        status = buffer_append(&conn->out, text, len);
+    }
+    free(text);
+
+    return status;
+}
+
+// Decodes the entries of an MGET request (or, with `values` set, an MSET
+// request) into BatchOps in the connection's batch buffer, with NUL-terminated
+// copies of their paths and keys; MSET values are used where they are, in the
+// request. Entries with an empty path use `path`. On success `*ops` and
+// `*count` describe the entries. Returns 0, or -1 with errno set to EINVAL
+// (malformed entries) or ENOMEM.
+static int8_t batch_decode(Connection *conn, const char *path, const uint8_t *data, uint32_t len, int values,
+                           BatchOp **ops, uint32_t *count)
+{
+    uint32_t head = values ? 8 : 4, at, value_len = 0, i;
+    uint16_t path_len = 0, key_len = 0;
+    size_t strings = 0;
+    char *text;
+    BatchOp *op;
+
+    // Check every entry and size the copies first.
+    *count = 0;
+    for (at = 0; at < len; at += head + path_len + key_len + value_len)
+    {
+        if (len - at < head || *count == ServerMaxBatch)
+        {
+            retfail(EINVAL);
+        }
+        path_len = get_u16(data + at);
+        key_len = get_u16(data + at + 2);
+        value_len = values ? get_u32(data + at + 4) : 0;
+        if ((uint64_t)head + path_len + key_len + value_len > len - at || path_len > ServerMaxPath ||
+            key_len == 0 || key_len > LeafKeyMax || memchr(data + at + head, '\0', path_len + key_len) != NULL)
+        {
+            retfail(EINVAL);
+        }
+        strings += (size_t)path_len + key_len + 2;
+        (*count)++;
+    }
+
+    conn->batch.off = conn->batch.len = 0;
+    if (buffer_reserve(&conn->batch, *count * sizeof(BatchOp) + strings) != NoError)
+    {
+        return -1;
+    }
+    *ops = (BatchOp *)conn->batch.data;
+    text = (char *)(conn->batch.data + *count * sizeof(BatchOp));
+
+    for (at = 0, i = 0; i < *count; i++, at += head + path_len + key_len + value_len)
+    {
+        op = &(*ops)[i];
+        path_len = get_u16(data + at);
+        key_len = get_u16(data + at + 2);
+        value_len = values ? get_u32(data + at + 4) : 0;
+
+        op->path = path;
+        if (path_len > 0)
+        {
+            memcpy(text, data + at + head, path_len);
+            text[path_len] = '\0';
+            op->path = text;
+            text += path_len + 1;
+        }
+        memcpy(text, data + at + head + path_len, key_len);
+        text[key_len] = '\0';
+        op->key = (uint8_t *)text;
+        text += key_len + 1;
+        op->value = (uint8_t *)data + at + head + path_len + key_len;
+        op->size = value_len;
+    }
+
+    return NoError;
+}
+
+// Maps the error of a batch entry to its status.
+static uint8_t status_from_error(int error)
+{
+    if (error == NoError)
+    {
+        return StatusOk;
+    }
+    errno = error;
+
+    return status_from_errno();
+}
+
+// Executes an MGET request: the paths and keys are resolved together (see
+// store_get_many), then every entry gets its status and value. Once the body
+// reaches ServerMaxRequest bytes, the remaining entries are not read and
+// report StatusMore.
+static int8_t execute_mget(Connection *conn, const char *path, const uint8_t *data, uint32_t len, uint32_t id)
+{
+    BatchOp *ops;
+    uint32_t count, i;
+    uint8_t entry[5];
+    size_t header_at, body_at, seg_bytes;
+    int8_t status = NoError;
+
+    if (batch_decode(conn, path, data, len, 0, &ops, &count) != NoError)
+    {
+        return respond(conn, status_from_errno(), id, 0);
+    }
+
+    // Write the header first and patch its body length once the entries are
+    // in; large values are sent from the store, so the body also counts the
+    // segments queued meanwhile. Positions count from `off`, since appending
+    // may compact the buffer.
+    header_at = conn->out.len - conn->out.off;
+    if (respond(conn, StatusOk, id, 0) != NoError)
+    {
+        return -1;
+    }
+    body_at = conn->out.len - conn->out.off;
+    seg_bytes = conn->seg_bytes;
+
+    epoch_enter();
+    store_get_many(ops, count);
+    for (i = 0; i < count && status == NoError; i++)
+    {
+        entry[0] = status_from_error(ops[i].error);
+        put_u32(entry + 1, 0);
+        if (ops[i].leaf == NULL)
+        {
+            status = buffer_append(&conn->out, entry, sizeof(entry));
+        }
+        else if (conn->out.len - conn->out.off - body_at + conn->seg_bytes - seg_bytes >= ServerMaxRequest)
+        {
+            entry[0] = StatusMore;
+            status = buffer_append(&conn->out, entry, sizeof(entry));
+        }
+        else
+        {
+            status = append_value(conn, ops[i].leaf, entry, sizeof(entry), 1);
+        }
+    }
+    epoch_exit();
+
+    if (status == NoError)
+    {
+        put_u32(conn->out.data + conn->out.off + header_at + 8,
+                (uint32_t)(conn->out.len - conn->out.off - body_at + conn->seg_bytes - seg_bytes));
+    }
+
+    return status;
+}
+
+// Executes an MSET request: every entry is stored (see store_set_many) and
+// gets its status byte.
+static int8_t execute_mset(Connection *conn, const char *path, const uint8_t *data, uint32_t len, uint32_t id)
+{
+    BatchOp *ops;
+    uint32_t count, i;
+    uint8_t code;
+    int8_t status;
+
+    if (batch_decode(conn, path, data, len, 1, &ops, &count) != NoError)
+    {
+        return respond(conn, status_from_errno(), id, 0);
+    }
+
+    store_set_many(ops, count); // Every entry reports its own error.
+
+    status = respond(conn, StatusOk, id, count);
+    for (i = 0; i < count && status == NoError; i++)
+    {
+        code = status_from_error(ops[i].error);
+        status = buffer_append(&conn->out, &code, 1);
+    }
+
+    return status;
+}
+
+// Turns a time to live in seconds into an expiry time, or ExpireNever for 0.
+// A TTL reaching past what a u32 clock can tell means the last second it can.
+static uint32_t expiry_from_ttl(uint32_t ttl)
+{
+    uint32_t now;
+
+    if (ttl == 0)
+    {
+        return ExpireNever;
+    }
+    now = expire_clock();
+
+    return ttl > UINT32_MAX - now ? UINT32_MAX : now + ttl;
+}
+
+// Executes a TTL request: the seconds left as a u32, or an empty body for a key that never expires.
+static int8_t execute_ttl(Connection *conn, const char *path, uint8_t *key, uint32_t id)
+{
+    Leaf *leaf;
+    uint32_t expires, now;
+    uint8_t body[4];
+
+    epoch_enter();
+    leaf = store_get(path, key);
+    expires = leaf != NULL ? __atomic_load_n(&leaf->expires, __ATOMIC_RELAXED) : ExpireNever;
+    epoch_exit();
+
+    if (leaf == NULL)
+    {
+        return respond(conn, status_from_errno(), id, 0);
+    }
+    if (expires == ExpireNever)
+    {
+        return respond(conn, StatusOk, id, 0);
+    }
+    now = expire_clock();
+    put_u32(body, expires > now ? expires - now : 0);
+    if (respond(conn, StatusOk, id, sizeof(body)) != NoError)
+    {
+        return -1;
+    }
+
+    return buffer_append(&conn->out, body, sizeof(body));
+}
+
+// Executes one decoded request and appends its response.
+static int8_t execute(Connection *conn, uint8_t op, const char *path, uint8_t *key, uint16_t key_len,
+                      uint8_t *value, uint32_t value_len, uint32_t id)
+{
+    Leaf *leaf;
+    int8_t status;
+    uint64_t start;
+
+    // A replica only changes as its primary's log says.
+    if (repl_replica() && (op == OpSet || op == OpDel || op == OpCompress || op == OpMset ||
+                           op == OpExpire || op == OpSetex))
+    {
+        return respond(conn, StatusReadOnly, id, 0);
+    }
+
+    switch (op)
+    {
+    case OpGet:
+        if (key_len == 0)
+        {
+            return respond(conn, StatusBadRequest, id, 0);
+        }
+        epoch_enter();
+        leaf = store_get(path, key);
+        if (leaf == NULL)
+        {
+            status = respond(conn, status_from_errno(), id, 0);
+        }
+        else
+        {
+            status = respond_value(conn, id, leaf);
+        }
+        epoch_exit();
+        return status;
+
+    case OpSet:
+        if (key_len == 0)
+        {
+            return respond(conn, StatusBadRequest, id, 0);
+        }
+        if (store_set(path, key, value_len, value) != NoError)
+        {
+            return respond(conn, status_from_errno(), id, 0);
+        }
+        return respond(conn, StatusOk, id, 0);
+
+    case OpDel:
+        if (store_del(path, key) != NoError)
+        {
+            return respond(conn, status_from_errno(), id, 0);
+        }
+        return respond(conn, StatusOk, id, 0);
+
+    case OpList:
+        start = metric_start();
+        status = execute_list(conn, path, id);
+        metric_time(MetricList, start);
+        return status;
+
+    case OpScan:
+        if (value_len > LeafKeyMax)
+        {
+            return respond(conn, StatusBadRequest, id, 0);
+        }
+        start = metric_start();
+        status = execute_scan(conn, path, key, key_len, value, (uint16_t)value_len, id);
+        metric_time(MetricScan, start);
+        return status;
+
+    case OpStats:
+        return execute_stats(conn, id);
+
+    case OpCompress:
+        if (key_len != 0 || value_len != 1 || value[0] > CodecSampled)
+        {
+            return respond(conn, StatusBadRequest, id, 0);
+        }
+        if (store_compress(path, value[0]) != NoError)
+        {
+            return respond(conn, status_from_errno(), id, 0);
+        }
+        return respond(conn, StatusOk, id, 0);
+
+    case OpExpire:
+        if (key_len == 0 || value_len != 4)
+        {
+            return respond(conn, StatusBadRequest, id, 0);
+        }
+        if (store_expire(path, key, expiry_from_ttl(get_u32(value))) != NoError)
+        {
+            return respond(conn, status_from_errno(), id, 0);
+        }
+        return respond(conn, StatusOk, id, 0);
+
+    case OpSetex:
+        if (key_len == 0 || value_len < 4 || get_u32(value) == 0)
+        {
+            return respond(conn, StatusBadRequest, id, 0);
+        }
+        if (store_set_expiring(path, key, value_len - 4, value + 4, expiry_from_ttl(get_u32(value))) != NoError)
+        {
+            return respond(conn, status_from_errno(), id, 0);
+        }
+        return respond(conn, StatusOk, id, 0);
+
+    case OpTtl:
+        if (key_len == 0)
+        {
+            return respond(conn, StatusBadRequest, id, 0);
+        }
+        return execute_ttl(conn, path, key, id);
+
+    case OpMget:
+    case OpMset:
+        if (key_len != 0)
+        {
+            return respond(conn, StatusBadRequest, id, 0);
+        }
+        return op == OpMget ? execute_mget(conn, path, value, value_len, id) : execute_mset(conn, path, value, value_len, id);
+
+    default:
+        return respond(conn, StatusBadRequest, id, 0);
+    }
+}
+
+// Parses and executes every complete request in the input buffer (pipelining).
+// Returns -1 if the connection must be closed.
+static int8_t process_input(Connection *conn)
+{
+    char path[ServerMaxPath + 1];
+    uint8_t key[LeafKeyMax + 1];
+    uint8_t *req;
+    uint16_t path_len, key_len;
+    uint32_t value_len, id;
+    size_t total;
+    int8_t status;
+
+    while (conn->in.len - conn->in.off >= RequestHeaderSize)
+    {
+        // Stop parsing while a slow reader has a large backlog of responses.
+        if (connection_pending(conn) >= ServerMaxPending)
+        {
+            break;
+        }
+
+        req = conn->in.data + conn->in.off;
+        if (req[0] != ProtocolMagic)
+        {
+            return -1; // Lost framing; nothing after this can be trusted.
+        }
+
+        path_len = get_u16(req + 2);
+        key_len = get_u16(req + 4);
+        value_len = get_u32(req + 8);
+        id = get_u32(req + 12);
+
+        total = (size_t)RequestHeaderSize + path_len + key_len + value_len;
+        if (total > ServerMaxRequest)
+        {
+            return -1;
+        }
+        if (conn->in.len - conn->in.off < total)
+        {
+            break; // Wait for the rest of the request.
+        }
+        conn->in.off += total;
+
+        // Paths and keys are NUL-terminated strings inside the tree.
+        if (path_len > ServerMaxPath || key_len > LeafKeyMax ||
+            memchr(req + RequestHeaderSize, '\0', path_len) != NULL ||
+            memchr(req + RequestHeaderSize + path_len, '\0', key_len) != NULL)
+        {
+            status = respond(conn, StatusBadRequest, id, 0);
+        }
+        else
+        {
+            memcpy(path, req + RequestHeaderSize, path_len);
+            path[path_len] = '\0';
+            memcpy(key, req + RequestHeaderSize + path_len, key_len);
+            key[key_len] = '\0';
+
+            status = execute(conn, req[1], path, key, key_len,
+                             req + RequestHeaderSize + path_len + key_len, value_len, id);
+        }
+        if (status != NoError)
+        {
+            return -1;
+        }
+    }
+
+    if (conn->in.off == conn->in.len)
+    {
+        conn->in.off = conn->in.len = 0;
+    }
+
+    return NoError;
+}
+
+// --- Connections ---
+
+// Releases a connection held for durability from `waiters`.
+static void connection_release(Connection *conn)
+{
+    if (conn->wait_lsn == 0)
+    {
+        return;
+    }
+    if (conn->wait_prev != NULL)
+    {
+        conn->wait_prev->wait_next = conn->wait_next;
+    }
+    else
+    {
+        waiters = conn->wait_next;
+    }
+    if (conn->wait_next != NULL)
+    {
+        conn->wait_next->wait_prev = conn->wait_prev;
+    }
+    conn->wait_prev = conn->wait_next = NULL;
+    conn->wait_lsn = 0;
+}
+
+static void connection_close(Connection *conn)
+{
+    trace(TraceInfo, "connection_close: fd %llu, %llu unparsed bytes", conn->fd, conn->in.len - conn->in.off);
+    connection_release(conn);
+    close(conn->fd);
+    buffer_release(&conn->in);
+    buffer_release(&conn->out);
+    buffer_release(&conn->batch);
+    while (conn->seg_head < conn->seg_len)
+    {
+        view_release(&conn->segs[conn->seg_head++].view);
+    }
+    free(conn->segs);
+    free(conn);
+}
+
+// Updates the epoll registration for the connection's current state: writable
+// interest while output is pending (and not held for durability), readable
+// interest unless the output backlog is large enough that input processing is
+// paused, and neither while a worker executes its requests.
+static int8_t connection_watch(int epfd, Connection *conn)
+{
+    struct epoll_event ev;
+    size_t pending = connection_pending(conn);
+    uint32_t events;
+
+    events = (pending > 0 && conn->wait_lsn == 0 ? EPOLLOUT : 0) | (pending < ServerMaxPending ? EPOLLIN : 0);
+    if (conn->busy)
+    {
+        events = 0; // The socket is left alone until the worker is done with the buffers.
+    }
+    if (conn->events == events)
+    {
+        return NoError;
+    }
+
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0)
+    {
+        return -1;
+    }
+    conn->events = events;
+
+    return NoError;
+}
+
+// Gathers the pending output into `iov`, in stream order: buffered bytes up to
+// the first segment, the rest of that segment, buffered bytes up to the next,
+// and so on. Returns the number of vectors used.
+static int connection_gather(Connection *conn, struct iovec *iov)
+{
+    uint64_t pos = conn->out_sent, end = conn->out_sent + (conn->out.len - conn->out.off);
+    uint64_t limit;
+    size_t seg = conn->seg_head;
+    int count = 0;
+
+    while (count < ServerMaxIov && (pos < end || seg < conn->seg_len))
+    {
+        limit = seg < conn->seg_len ? conn->segs[seg].at : end;
+        if (pos < limit)
+        {
+            iov[count].iov_base = conn->out.data + conn->out.off + (pos - conn->out_sent);
+            iov[count].iov_len = (size_t)(limit - pos);
+            count++;
+            pos = limit;
+        }
+        else
+        {
+            iov[count].iov_base = (void *)(conn->segs[seg].view.data + conn->segs[seg].sent);
+            iov[count].iov_len = conn->segs[seg].view.size - conn->segs[seg].sent;
+            count++;
+            seg++;
+        }
+    }
+
+    return count;
+}
+
+// Consumes `n` written bytes from the front of the pending output, releasing
+// each pinned value once it has been sent in full.
+static void connection_consume(Connection *conn, size_t n)
+{
+    Segment *seg;
+    size_t take;
+
+    while (n > 0)
+    {
+        seg = conn->seg_head < conn->seg_len ? &conn->segs[conn->seg_head] : NULL;
+        if (seg != NULL && seg->at == conn->out_sent)
+        {
+            take = seg->view.size - seg->sent < n ? seg->view.size - seg->sent : n;
+            seg->sent += take;
+            conn->seg_bytes -= take;
+            if (seg->sent == seg->view.size)
+            {
+                view_release(&seg->view);
+                conn->seg_head++;
+            }
+        }
+        else
+        {
+            take = seg != NULL ? (size_t)(seg->at - conn->out_sent) : conn->out.len - conn->out.off;
+            take = take < n ? take : n;
+            conn->out.off += take;
+            conn->out_sent += take;
+        }
+        n -= take;
+    }
+
+    if (conn->seg_head == conn->seg_len)
+    {
+        conn->seg_head = conn->seg_len = 0;
+    }
+}
+
+// Writes as much pending output as the socket accepts, pinned values included,
+// unless it is held for durability.
+static int8_t connection_flush(int epfd, Connection *conn)
+{
+    struct iovec iov[ServerMaxIov];
+    struct msghdr msg;
+    ssize_t n;
+
+    while (conn->wait_lsn == 0 && connection_pending(conn) > 0)
+    {
+        zero((uint8_t *)&msg, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)connection_gather(conn, iov);
+        n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        connection_consume(conn, (size_t)n);
+    }
+
+    if (conn->out.off == conn->out.len)
+    {
+        conn->out.off = conn->out.len = 0;
+    }
+
+    return connection_watch(epfd, conn);
+}
+
+// Flushes the responses of the requests executed so far, but only once the
+// sync policy considers their writes durable. Instead of blocking the event
+// loop on the fsync, a connection whose writes are not durable yet is held in
+// `waiters` until the log's eventfd reports that they are; meanwhile it keeps
+// executing requests, and one fsync covers all of them (group commit). The
+// LSN waited for is the one connection_execute recorded.
+static int8_t connection_respond(int epfd, Connection *conn)
+{
+    uint64_t lsn = conn->lsn;
+    int durable;
+
+    if (connection_pending(conn) == 0)
+    {
+        return connection_watch(epfd, conn);
+    }
+
+    durable = wal_poll(lsn);
+    if (durable < 0)
+    {
+        return -1;
+    }
+    if (durable)
+    {
+        connection_release(conn);
+    }
+    else
+    {
+        if (conn->wait_lsn == 0)
+        {
+            conn->wait_prev = NULL;
+            conn->wait_next = waiters;
+            if (waiters != NULL)
+            {
+                waiters->wait_prev = conn;
+            }
+            waiters = conn;
+        }
+        conn->wait_lsn = lsn;
+    }
+
+    return connection_flush(epfd, conn);
+}
+
+// Task of a connection handed to the pool: executes its requests on the
+// worker, then hands it back to the event loop through `done`.
+static void connection_task(Task *task)
+{
+    Connection *conn = (Connection *)((uint8_t *)task - offsetof(Connection, task));
+    Connection *head;
+    uint64_t lsn, one = 1;
+
+    if (process_input(conn) != NoError)
+    {
+        __atomic_store_n(&conn->failed, 1, __ATOMIC_RELAXED); // The loop may set it too meanwhile.
+    }
+
+    // Other workers' writes the requests read may not be durable yet either,
+    // so wait for everything logged so far, like the single-threaded loop did.
+    lsn = wal_last_lsn();
+    conn->lsn = lsn > conn->lsn ? lsn : conn->lsn;
+
+    head = __atomic_load_n(&done, __ATOMIC_RELAXED);
+    do
+    {
+        conn->done_next = head;
+    } while (!__atomic_compare_exchange_n(&done, &head, conn, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (write(done_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        trace(TraceError, "connection_task: notify failed with errno %llu on fd %llu", errno, conn->fd);
+    }
+}
+
+// Returns the home of the connection's next request: the shard that owns its
+// path, or PoolAnyHome if the path has not arrived in full yet.
+static uint32_t connection_home(Connection *conn)
+{
+    char path[ServerMaxPath + 1];
+    const uint8_t *req = conn->in.data + conn->in.off;
+    uint16_t path_len = get_u16(req + 2);
+
+    if (path_len > ServerMaxPath || conn->in.len - conn->in.off < (size_t)RequestHeaderSize + path_len ||
+        memchr(req + RequestHeaderSize, '\0', path_len) != NULL)
+    {
+        return PoolAnyHome;
+    }
+    memcpy(path, req + RequestHeaderSize, path_len);
+    path[path_len] = '\0';
+
+    return (uint32_t)(shard_for_path(path) - shards);
+}
+
+// Reports whether the input holds a complete request that has not run yet.
+// process_input leaves such requests behind once the output backlog reaches
+// ServerMaxPending; when a flush then sends all of it, no socket event is due
+// to run them, so whoever flushed has to.
+static int connection_ready(Connection *conn)
+{
+    const uint8_t *req = conn->in.data + conn->in.off;
+    size_t avail = conn->in.len - conn->in.off;
+
+    return avail >= RequestHeaderSize &&
+           avail >= (size_t)RequestHeaderSize + get_u16(req + 2) + get_u16(req + 4) + get_u32(req + 8);
+}
+
+// Executes every complete request in the input buffer and responds. With the
+// pool running, the requests run on the worker that owns the shard of the
+// first one, and the response goes out once connection_completed gets the
+// connection back; a connection's requests always run as one batch on one
+// worker at a time, so they execute and answer in order.
+static int8_t connection_execute(int epfd, Connection *conn)
+{
+    do
+    {
+        if (pool_workers() == 0)
+        {
+            if (process_input(conn) != NoError)
+            {
+                return -1;
+            }
+            conn->lsn = wal_thread_lsn(); // The loop logged every write itself.
+        }
+        else if (conn->in.len - conn->in.off >= RequestHeaderSize && connection_pending(conn) < ServerMaxPending)
+        {
+            conn->busy = 1;
+            busy_count++;
+            if (connection_watch(epfd, conn) != NoError)
+            {
+                conn->failed = 1; // Closed once the task is done.
+            }
+            conn->task.run = connection_task;
+            pool_submit(&conn->task, connection_home(conn));
+            return NoError;
+        }
+
+        // Otherwise there is nothing to execute yet, or the backlog is too large.
+        if (connection_respond(epfd, conn) != NoError)
+        {
+            return -1;
+        }
+    } while (connection_pending(conn) == 0 && connection_ready(conn));
+
+    return NoError;
+}
+
+// Takes back every connection the workers are done with, then sends its
+// responses or closes it.
+static void connection_completed(int epfd)
+{
+    Connection *conn, *next;
+    uint64_t count;
+
+    while (read(done_fd, &count, sizeof(count)) > 0)
+    {
+        // Drain the eventfd; the stack below holds every completed connection.
+    }
+
+    for (conn = __atomic_exchange_n(&done, NULL, __ATOMIC_ACQUIRE); conn != NULL; conn = next)
+    {
+        next = conn->done_next;
+        conn->busy = 0;
+        busy_count--;
+        if (conn->failed || connection_respond(epfd, conn) != NoError ||
+            (connection_pending(conn) == 0 && connection_ready(conn) && connection_execute(epfd, conn) != NoError))
+        {
+            connection_close(conn);
+        }
+    }
+}
+
+// Sends the held output of every connection whose writes have become durable.
+static void connection_notified(int epfd, int notify_fd)
+{
+    Connection *conn, *next;
+    uint64_t count;
+    int durable;
+
+    while (read(notify_fd, &count, sizeof(count)) > 0)
+    {
+        // Drain the eventfd; one pass below covers every notification.
+    }
+
+    for (conn = waiters; conn != NULL; conn = next)
+    {
+        next = conn->wait_next;
+        if (conn->busy)
+        {
+            continue; // connection_completed responds, and checks durability again.
+        }
+        durable = wal_poll(conn->wait_lsn);
+        if (durable == 0)
+        {
+            continue;
+        }
+        connection_release(conn);
+        // Requests held back while the output backlog was large can resume too.
+        if (durable < 0 || connection_flush(epfd, conn) != NoError || connection_execute(epfd, conn) != NoError)
+        {
+            connection_close(conn);
+        }
+    }
+}
+
+// Reads everything available, executes the complete requests and flushes the
+// responses. With the pool running, reads stop after ServerMaxPending bytes,
+// which then execute as one batch.
+static int8_t connection_readable(int epfd, Connection *conn)
+{
+    size_t start = conn->in.len - conn->in.off;
+    ssize_t n;
+
+    // Stop reading while responses pile up; connection_watch drops EPOLLIN meanwhile.
+    while (connection_pending(conn) < ServerMaxPending &&
+           (pool_workers() == 0 || conn->in.len - conn->in.off - start < ServerMaxPending))
+    {
+        if (buffer_reserve(&conn->in, ServerReadChunk) != NoError)
+        {
+            return -1;
+        }
+        n = read(conn->fd, conn->in.data + conn->in.len, conn->in.cap - conn->in.len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        if (n == 0)
+        {
+            return -1; // The client closed the connection.
+        }
+        conn->in.len += (size_t)n;
+
+        // Execute as we go so a large pipelined burst does not pile up in memory.
+        if (pool_workers() == 0 && process_input(conn) != NoError)
+        {
+            return -1;
+        }
+    }
+
+    return connection_execute(epfd, conn);
+}
+
+static void accept_clients(int epfd, int listen_fd)
+{
+    struct epoll_event ev;
+    Connection *conn;
+    int fd, one = 1;
+
+    for (;;)
+    {
+        fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            return; // EAGAIN once the backlog is empty; other errors are per-client.
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn = (Connection *)calloc(1, sizeof(Connection));
+        if (conn == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            connection_close(conn);
+            continue;
+        }
+        trace(TraceInfo, "accept_clients: fd %llu on listener %llu", fd, listen_fd);
+    }
+}
+
+// --- Server ---
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    server_stop();
+}
+
+void server_stop(void)
+{
+    stopping = 1;
+}
+
+int8_t server_run(uint16_t port)
+{
+    struct epoll_event ev, events[ServerMaxEvents];
+    struct sockaddr_in addr;
+    struct sigaction sa;
+    Connection *conn;
+    int listen_fd, epfd, notify_fd, n, i, notified, one = 1;
+
+    // Stop on SIGINT / SIGTERM. No SA_RESTART, so epoll_wait returns EINTR.
+    zero((uint8_t *)&sa, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        perror("ERROR: Failed to create the listening socket");
+        return -1;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    zero((uint8_t *)&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0)
+    {
+        perror("ERROR: Failed to listen on the server port");
+        close(listen_fd);
+        return -1;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        perror("ERROR: Failed to create the epoll instance");
+        close(listen_fd);
+        return -1;
+    }
+    // The listening socket and the eventfds are the only registrations without a Connection.
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    notify_fd = wal_notify_fd();
+    if (notify_fd >= 0)
+    {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wal_marker;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, notify_fd, &ev);
+    }
+    // Workers hand executed connections back through another eventfd.
+    if (pool_workers() > 0)
+    {
+        done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (done_fd < 0)
+        {
+            perror("ERROR: Failed to create the completion eventfd");
+            close(epfd);
+            close(listen_fd);
+            return -1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &done_marker;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, done_fd, &ev);
+    }
+
+    fprintf(stderr, "Listening on port %u.\n", port);
+
+    while (!stopping)
+    {
+        n = epoll_wait(epfd, events, ServerMaxEvents, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("ERROR: epoll_wait failed");
+            break;
+        }
+
+        notified = 0;
+        for (i = 0; i < n; i++)
+        {
+            conn = (Connection *)events[i].data.ptr;
+            if (conn == NULL)
+            {
+                accept_clients(epfd, listen_fd);
+                continue;
+            }
+            if (events[i].data.ptr == &wal_marker)
+            {
+                // Handled after the loop: it may close connections that also have events in this batch.
+                notified |= 1;
+                continue;
+            }
+            if (events[i].data.ptr == &done_marker)
+            {
+                notified |= 2;
+                continue;
+            }
+
+            if (conn->busy)
+            {
+                // A worker owns the buffers. Stop watching a failed socket,
+                // which would report the failure again and again meanwhile.
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    __atomic_store_n(&conn->failed, 1, __ATOMIC_RELAXED);
+                }
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                connection_close(conn);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && connection_flush(epfd, conn) != NoError)
+            {
+                connection_close(conn);
+                continue;
+            }
+            // Requests held back while the output backlog was large can resume now.
+            if ((events[i].events & EPOLLOUT) && !conn->busy && connection_execute(epfd, conn) != NoError)
+            {
+                connection_close(conn);
+                continue;
+            }
+            if ((events[i].events & EPOLLIN) && !conn->busy && connection_readable(epfd, conn) != NoError)
+            {
+                connection_close(conn);
+            }
+        }
+        if (notified & 2)
+        {
+            connection_completed(epfd);
+        }
+        if (notified & 1)
+        {
+            connection_notified(epfd, notify_fd);
+        }
+    }
+
+    // Workers may still be executing requests; their connections must not be
+    // touched (or left behind with tasks queued) once the loop is gone.
+    while (busy_count > 0)
+    {
+        connection_completed(epfd);
+        if (busy_count > 0)
+        {
+            sched_yield();
+        }
+    }
+    if (done_fd >= 0)
+    {
+        close(done_fd);
+        done_fd = -1;
+    }
+
+    // Open connections are dropped with the process; only the shared fds are closed here.
+    close(epfd);
+    close(listen_fd);
+    fprintf(stderr, "Server stopped.\n");
+
+    return NoError;
+}
@@ -0,0 +1,133 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint32_t)
+#include <stddef.h> // For size_t
+
+// =============================================================================
+// Protocol Definitions
+// =============================================================================
+// Every request is a fixed 16-byte header followed by the path, key and value
+// bytes it announces. Every response is a fixed 12-byte header followed by its
+// body. All integers are little-endian. Clients may send any number of requests
+// without waiting; responses come back in request order and carry the request's
+// `id`, so one connection can keep many operations in flight.
+//
+// Request header:                      Response header:
+//   u8  magic (ProtocolMagic)            u8  magic (ProtocolMagic)
+//   u8  op (Op*)                         u8  status (Status*)
+//   u16 path length                      u16 reserved (0)
+//   u16 key length                       u32 id (copied from the request)
+//   u16 reserved (0)                     u32 body length
+//   u32 value length
+//   u32 id
+//
+// GET returns the value as the body. SET stores the value. DEL removes the key,
+// or the whole subtree at the path when the key is empty. LIST returns one entry
+// per child Node and Leaf under the path: u8 kind (ListNode / ListLeaf), u16
+// name length, then the name. SCAN returns, in key order, every Leaf under the
+// path whose key is at least the request key and, unless the value is empty,
+// sorts before the value: u16 key length, u32 value length, key, value. A scan
+// too large for one response ends early with StatusMore; scanning again from
+// the last key returned picks up where it stopped (that key comes back first).
+// STATS ignores the path and key and returns every metric as Prometheus text
+// (see metrics_write). COMPRESS sets the codec mode of the subtree at the path
+// (see store_compress); the key is empty and the value is the one mode byte.
+//
+// MGET and MSET carry up to ServerMaxBatch entries in the value, and an empty
+// key. An MGET entry is u16 path length, u16 key length, path, key; an MSET
+// entry is u16 path length, u16 key length, u32 value length, path, key,
+// value. An entry with an empty path uses the request's path. The body of an
+// MGET response holds, per entry in order, u8 status, u32 value length, value;
+// that of an MSET response one status byte per entry. The response status is
+// StatusOk whenever the entries could be decoded, whatever their own status;
+// MGET entries that would grow the body past ServerMaxRequest bytes are not
+// read and report StatusMore. MSET applies all of its entries at once, as far
+// as other writers can tell (see store_set_many).
+//
+// Expiry times are given as a time to live, in whole seconds from now. EXPIRE
+// sets that of an existing key (the value is the u32 TTL; 0 keeps the key for
+// good). SETEX stores the value like SET with a TTL (not 0) in front of it:
+// u32 TTL, then the value. TTL returns a u32 of the seconds the key has left
+// as the body, or an empty body if it never expires. Expired keys read as absent
+// everywhere, LIST and SCAN included, and are deleted soon after expiring.
+//
+// A replica (see repl.h) answers every request that would write with
+// StatusReadOnly, and serves reads as of the last record it applied.
+#define ProtocolMagic 0xDB     /* First byte of every request and response */
+#define RequestHeaderSize 16   /* Bytes in a request header */
+#define ResponseHeaderSize 12  /* Bytes in a response header */
+
+#define OpGet 1  /* Read the value under path + key */
+#define OpSet 2  /* Write the value under path + key, creating the path */
+#define OpDel 3  /* Delete path + key, or the subtree at path */
+#define OpList 4 /* List the children and keys under path */
+#define OpScan 5 /* Return the keys and values under path in a key range, in order */
+#define OpStats 6 /* Return operation, allocator and tree metrics as text */
+#define OpCompress 7 /* Set the codec mode (Codec*) of the subtree at path */
+#define OpMget 8 /* Read the values of many paths and keys */
+#define OpMset 9 /* Write the values of many paths and keys */
+#define OpExpire 10 /* Set or clear the time to live of path + key */
+#define OpSetex 11 /* Write the value under path + key with a time to live */
+#define OpTtl 12 /* Return the seconds path + key has left to live */
+
+#define StatusOk 0         /* The operation succeeded */
+#define StatusNotFound 1   /* The path or key does not exist */
+#define StatusBadRequest 2 /* The request was malformed */
+#define StatusError 3      /* The operation failed (e.g. out of memory) */
+#define StatusMore 4       /* The body is complete but partial; more entries follow in the range */
+#define StatusReadOnly 5   /* The server is a replica; writes go to its primary */
+
+#define ListNode 1 /* LIST entry naming a child Node */
+#define ListLeaf 2 /* LIST entry naming a Leaf key */
+
+// =============================================================================
+// Server Constants
+// =============================================================================
+#define ServerDefaultPort 7379          /* Port used when none is given on the command line */
+#define ServerMaxEvents 256             /* epoll events handled per wakeup */
+#define ServerReadChunk (64 * 1024)     /* Minimum free input space per read() */
+#define ServerMaxRequest (64 * 1024 * 1024) /* Largest request accepted (header and payload) */
+#define ServerMaxBatch 1024             /* Entries an MGET or MSET request may carry */
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+/**
+ * @brief A growable byte buffer with a consumed-prefix offset.
+ *
+ * Bytes in [off, len) are pending; the consumed prefix is compacted lazily.
+ */
+struct s_buffer {
+    uint8_t *data; ///< Buffer storage.
+    size_t off;    ///< Start of the pending bytes.
+    size_t len;    ///< End of the pending bytes.
+    size_t cap;    ///< Allocated size of `data`.
+};
+typedef struct s_buffer Buffer;
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Runs the request server on the given TCP port until server_stop is called.
+ *
+ * Installs SIGINT and SIGTERM handlers that call server_stop. The shards must
+ * already be initialized.
+ *
+ * @param port The TCP port to listen on (all interfaces).
+ * @return     0 after a clean shutdown, or -1 with errno set if the server could not start.
+ */
+int8_t server_run(uint16_t port);
+
+/**
+ * @brief Asks a running server to shut down. Safe to call from a signal handler.
+ */
+void server_stop(void);
+
+#endif /* SERVER_H */
@@ -0,0 +1,368 @@
+/* simd.c */
+#include "main.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h> // For the SSE2 and AVX2 intrinsics (AVX2 functions are compiled for it one by one)
+#elif defined(__aarch64__)
+#include <arm_neon.h> // For the NEON intrinsics (part of every ARM64 CPU)
+#endif
+
+// -----------------------------------------------------------------------------
+// Portable kernels: 8 bytes at a time, then byte by byte.
+// -----------------------------------------------------------------------------
+
+static size_t scalar_mismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint64_t x, y;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8)
+    {
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y)
+        {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return i + (size_t)(__builtin_ctzll(x ^ y) >> 3);
+#else
+            break; // The byte loop finds it.
+#endif
+        }
+    }
+    while (i < len && a[i] == b[i])
+    {
+        i++;
+    }
+
+    return i;
+}
+
+static int scalar_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint64_t x, y;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8)
+    {
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y)
+        {
+            return 0;
+        }
+    }
+    for (; i < len; i++)
+    {
+        if (a[i] != b[i])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Index writers store lanes with atomic stores while readers probe them (see
+// index.c), so every match_lanes kernel reads its group one lane at a time
+// through relaxed atomic loads, which are plain loads on x86-64 and ARM64,
+// and compares the copy. Only the single vector load is given up for it.
+static inline uint32_t lane_load(const uint32_t *lanes, uint32_t lane)
+{
+    return __atomic_load_n(lanes + lane, __ATOMIC_RELAXED);
+}
+
+static uint32_t scalar_match_lanes(const uint32_t *lanes, uint32_t hash)
+{
+    uint32_t mask = 0;
+    uint32_t lane;
+
+    for (lane = 0; lane < SimdLanes; lane++)
+    {
+        mask |= (uint32_t)(lane_load(lanes, lane) == hash) << lane;
+    }
+
+    return mask;
+}
+
+static const SimdKernels scalar_kernels = {"scalar", 8, scalar_equal, scalar_mismatch, scalar_match_lanes};
+SimdKernels simd = {"scalar", 8, scalar_equal, scalar_mismatch, scalar_match_lanes};
+
+#if defined(__x86_64__)
+// -----------------------------------------------------------------------------
+// SSE2 kernels: 16 bytes per compare and movemask.
+// -----------------------------------------------------------------------------
+
+// Returns a bitmask of the bytes that differ among the 16 at `a` and `b`.
+static uint32_t sse2_diff16(const uint8_t *a, const uint8_t *b)
+{
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a), _mm_loadu_si128((const __m128i *)b));
+
+    return ~(uint32_t)_mm_movemask_epi8(eq) & 0xFFFFu;
+}
+
+static size_t sse2_mismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint32_t diff;
+    size_t i = 0;
+
+    if (len < 16)
+    {
+        return scalar_mismatch(a, b, len);
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        diff = sse2_diff16(a + i, b + i);
+        if (diff != 0)
+        {
+            return i + (size_t)__builtin_ctz(diff);
+        }
+    }
+    // The last 16 bytes overlap bytes already known to be equal, so the first
+    // difference among them is still the first one overall.
+    if (i < len)
+    {
+        i = len - 16;
+        diff = sse2_diff16(a + i, b + i);
+        if (diff != 0)
+        {
+            return i + (size_t)__builtin_ctz(diff);
+        }
+    }
+
+    return len;
+}
+
+static int sse2_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint32_t diff = 0;
+    size_t i = 0;
+
+    if (len < 16)
+    {
+        return scalar_equal(a, b, len);
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        diff |= sse2_diff16(a + i, b + i);
+    }
+    if (i < len)
+    {
+        diff |= sse2_diff16(a + len - 16, b + len - 16);
+    }
+
+    return diff == 0;
+}
+
+static uint32_t sse2_match_lanes(const uint32_t *lanes, uint32_t hash)
+{
+    __m128i needle = _mm_set1_epi32((int)hash);
+    __m128i low = _mm_cmpeq_epi32(_mm_setr_epi32((int)lane_load(lanes, 0), (int)lane_load(lanes, 1),
+                                                 (int)lane_load(lanes, 2), (int)lane_load(lanes, 3)), needle);
+    __m128i high = _mm_cmpeq_epi32(_mm_setr_epi32((int)lane_load(lanes, 4), (int)lane_load(lanes, 5),
+                                                  (int)lane_load(lanes, 6), (int)lane_load(lanes, 7)), needle);
+
+    return (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(low)) | (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(high)) << 4;
+}
+
+// -----------------------------------------------------------------------------
+// AVX2 kernels: 32 bytes per compare, and all SimdLanes lanes in one.
+// -----------------------------------------------------------------------------
+
+__attribute__((target("avx2"))) static uint32_t avx2_diff32(const uint8_t *a, const uint8_t *b)
+{
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)a), _mm256_loadu_si256((const __m256i *)b));
+
+    return ~(uint32_t)_mm256_movemask_epi8(eq);
+}
+
+__attribute__((target("avx2"))) static size_t avx2_mismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint32_t diff;
+    size_t i = 0;
+
+    if (len < 32)
+    {
+        return sse2_mismatch(a, b, len);
+    }
+    for (; i + 32 <= len; i += 32)
+    {
+        diff = avx2_diff32(a + i, b + i);
+        if (diff != 0)
+        {
+            return i + (size_t)__builtin_ctz(diff);
+        }
+    }
+    if (i < len)
+    {
+        i = len - 32;
+        diff = avx2_diff32(a + i, b + i);
+        if (diff != 0)
+        {
+            return i + (size_t)__builtin_ctz(diff);
+        }
+    }
+
+    return len;
+}
+
+__attribute__((target("avx2"))) static int avx2_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint32_t diff = 0;
+    size_t i = 0;
+
+    if (len < 32)
+    {
+        return sse2_equal(a, b, len);
+    }
+    for (; i + 32 <= len; i += 32)
+    {
+        diff |= avx2_diff32(a + i, b + i);
+    }
+    if (i < len)
+    {
+        diff |= avx2_diff32(a + len - 32, b + len - 32);
+    }
+
+    return diff == 0;
+}
+
+__attribute__((target("avx2"))) static uint32_t avx2_match_lanes(const uint32_t *lanes, uint32_t hash)
+{
+    __m256i group = _mm256_setr_epi32((int)lane_load(lanes, 0), (int)lane_load(lanes, 1), (int)lane_load(lanes, 2),
+                                      (int)lane_load(lanes, 3), (int)lane_load(lanes, 4), (int)lane_load(lanes, 5),
+                                      (int)lane_load(lanes, 6), (int)lane_load(lanes, 7));
+    __m256i eq = _mm256_cmpeq_epi32(group, _mm256_set1_epi32((int)hash));
+
+    return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq));
+}
+
+static const SimdKernels sse2_kernels = {"sse2", 16, sse2_equal, sse2_mismatch, sse2_match_lanes};
+static const SimdKernels avx2_kernels = {"avx2", 32, avx2_equal, avx2_mismatch, avx2_match_lanes};
+
+#elif defined(__aarch64__)
+// -----------------------------------------------------------------------------
+// NEON kernels: 16 bytes per compare. NEON has no movemask; narrowing the
+// compare result by 4 bits per byte gives a 64-bit mask with a nibble per byte.
+// -----------------------------------------------------------------------------
+
+// Returns a mask with the nibble of every byte that differs among the 16 at `a` and `b` set.
+static uint64_t neon_diff16(const uint8_t *a, const uint8_t *b)
+{
+    uint8x16_t eq = vceqq_u8(vld1q_u8(a), vld1q_u8(b));
+
+    return ~vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static size_t neon_mismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint64_t diff;
+    size_t i = 0;
+
+    if (len < 16)
+    {
+        return scalar_mismatch(a, b, len);
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        diff = neon_diff16(a + i, b + i);
+        if (diff != 0)
+        {
+            return i + (size_t)(__builtin_ctzll(diff) >> 2);
+        }
+    }
+    if (i < len)
+    {
+        i = len - 16;
+        diff = neon_diff16(a + i, b + i);
+        if (diff != 0)
+        {
+            return i + (size_t)(__builtin_ctzll(diff) >> 2);
+        }
+    }
+
+    return len;
+}
+
+static int neon_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint64_t diff = 0;
+    size_t i = 0;
+
+    if (len < 16)
+    {
+        return scalar_equal(a, b, len);
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        diff |= neon_diff16(a + i, b + i);
+    }
+    if (i < len)
+    {
+        diff |= neon_diff16(a + len - 16, b + len - 16);
+    }
+
+    return diff == 0;
+}
+
+static uint32_t neon_match_lanes(const uint32_t *lanes, uint32_t hash)
+{
+    static const uint32_t bits[4] = {1, 2, 4, 8};
+    uint32x4_t needle = vdupq_n_u32(hash), weights = vld1q_u32(bits);
+    uint32_t group[SimdLanes];
+    uint32_t lane;
+
+    for (lane = 0; lane < SimdLanes; lane++)
+    {
+        group[lane] = lane_load(lanes, lane);
+    }
+
+    return vaddvq_u32(vandq_u32(vceqq_u32(vld1q_u32(group), needle), weights)) |
+           vaddvq_u32(vandq_u32(vceqq_u32(vld1q_u32(group + 4), needle), weights)) << 4;
+}
+
+static const SimdKernels neon_kernels = {"neon", 16, neon_equal, neon_mismatch, neon_match_lanes};
+#endif
+
+void simd_init(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    simd = __builtin_cpu_supports("avx2") ? avx2_kernels : sse2_kernels;
+#elif defined(__aarch64__)
+    simd = neon_kernels;
+#endif
+    trace(TraceInfo, "simd_init: key kernels compare %llu bytes per step, %llu hash lanes per probe",
+          simd.width, SimdLanes);
+}
+
+int8_t simd_select(const char *name)
+{
+    assert(name != NULL && "Error: Name cannot be NULL for simd_select.");
+
+    if (strcmp(name, "scalar") == 0)
+    {
+        simd = scalar_kernels;
+        return NoError;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0)
+    {
+        simd = sse2_kernels;
+        return NoError;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    {
+        simd = avx2_kernels;
+        return NoError;
+    }
+#elif defined(__aarch64__)
+    if (strcmp(name, "neon") == 0)
+    {
+        simd = neon_kernels;
+        return NoError;
+    }
+#endif
+
+    retfail(EINVAL);
+}
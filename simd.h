@@ -0,0 +1,61 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint32_t)
+#include <stddef.h> // For size_t
+
+// =============================================================================
+// SIMD Kernel Definitions
+// =============================================================================
+// Key comparisons and index probes go through a table of kernels picked once,
+// at startup, for the CPU the server runs on: AVX2 (32 bytes per step) where
+// the CPU has it, else SSE2 (16 bytes, part of every x86-64 CPU), NEON on
+// ARM64, and a portable word-at-a-time version everywhere else. Kernels never
+// read outside the `len` bytes they are given: a tail shorter than a vector
+// is handled by one more load that overlaps the previous one, or by words.
+#define SimdLanes 8 /* Hash lanes simd.match_lanes compares at once (IndexGroup) */
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+/**
+ * @brief The kernels in use; every entry is always valid (the portable version until simd_init).
+ */
+struct s_simd_kernels {
+    const char *name; ///< The instruction set the kernels use ("avx2", "sse2", "neon" or "scalar").
+    uint32_t width;   ///< Bytes `equal` and `mismatch` compare per step.
+    int (*equal)(const uint8_t *a, const uint8_t *b, size_t len);       ///< Non-zero if the `len` bytes at `a` and `b` are equal.
+    size_t (*mismatch)(const uint8_t *a, const uint8_t *b, size_t len); ///< Offset of the first byte where `a` and `b` differ, or `len`.
+    uint32_t (*match_lanes)(const uint32_t *lanes, uint32_t hash);      ///< Bitmask of the SimdLanes lanes equal to `hash` (bit i: lane i).
+};
+typedef struct s_simd_kernels SimdKernels;
+
+extern SimdKernels simd; // The kernels in use.
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Selects the fastest kernels the CPU supports.
+ *
+ * Called by shards_init, before any other thread runs; calling it again is harmless.
+ */
+void simd_init(void);
+
+/**
+ * @brief Replaces the kernels simd_init picked with a given set, for benchmarking or working around a CPU.
+ *
+ * Must be called before any other thread runs.
+ *
+ * @param name "avx2", "sse2", "neon" or "scalar".
+ * @return     0 on success, or -1 with errno set to EINVAL if the set is unknown
+ *             or this CPU cannot run it.
+ */
+int8_t simd_select(const char *name);
+
+#endif /* SIMD_H */
@@ -0,0 +1,486 @@
+/* skiplist.c */
+#include "main.h"
+
+// Returns the tower height of a key with index hash `hash`: the number of zero
+// bit pairs at the bottom of the remixed hash, so that each level is a quarter
+// as likely as the one below it. Zero means the leaf gets no tower.
+static uint8_t skip_height(uint32_t hash)
+{
+    uint8_t height = 0;
+
+    // The index picks groups from the low bits of the same hash; remix it so
+    // tower heights do not correlate with index positions.
+    hash ^= hash >> 16;
+    hash *= 0x7feb352dU;
+    hash ^= hash >> 15;
+
+    while (height < SkipMaxLevel && (hash & 3) == 0)
+    {
+        height++;
+        hash >>= 2;
+    }
+
+    return height;
+}
+
+// ReclaimFn for towers unlinked by skip_remove; `ctx` is the owning Allocator.
+static void reclaim_tower(void *ctx, void *ptr)
+{
+    Skip *tower = (Skip *)ptr;
+
+    slab_free(&((Allocator *)ctx)->towers[tower->height - 1], tower);
+}
+
+// Allocates an unlinked tower of `height` levels from `arena`, or from the
+// shard's tower slabs if `arena` is NULL. Returns NULL if memory is short.
+static Skip *tower_alloc(Node *node, uint8_t height, Arena *arena)
+{
+    Skip *tower;
+
+    if (arena != NULL)
+    {
+        tower = (Skip *)arena_alloc(arena, offsetof(Skip, next) + height * sizeof(Skip *));
+    }
+    else
+    {
+        tower = (Skip *)slab_alloc(&node->alloc->towers[height - 1]);
+    }
+    if (tower == NULL)
+    {
+        return NULL;
+    }
+
+    zero((uint8_t *)tower, (uint16_t)(offsetof(Skip, next) + height * sizeof(Skip *)));
+    tower->height = height;
+    tower->flags = arena != NULL ? SkipArena : 0;
+
+    return tower;
+}
+
+// Returns the skiplist head of `node`, creating an empty one on first use.
+static Skip *skip_head(Node *node, Arena *arena)
+{
+    Skip *head = node->skip;
+
+    if (head == NULL)
+    {
+        head = tower_alloc(node, SkipMaxLevel, arena);
+        if (head == NULL)
+        {
+            return NULL;
+        }
+        head->height = 0; // No level is in use yet.
+        store_ptr(node->skip, head);
+    }
+
+    return head;
+}
+
+// Returns non-zero if the leaf of `tower` sorts before `key`, whose key_prefix
+// is `prefix`; the leaf is only read when the prefixes are equal.
+static int tower_before(const Skip *tower, const uint8_t *key, uint16_t len, uint32_t prefix)
+{
+    if (tower->prefix != prefix)
+    {
+        return tower->prefix < prefix;
+    }
+
+    return leaf_compare(tower->leaf, key, len) < 0;
+}
+
+// Walks the towers of `node` down to the last leaf whose key sorts before
+// `key`, then finishes the walk along 'east'. Returns that leaf (NULL if no
+// leaf sorts before `key`) and stores the first leaf at or after `key` in
+// `*succ`. Writers may pass `preds` to collect the last tower before `key` at
+// every level (the head where there is none); the Node must then have a head.
+static Leaf *skip_search(Node *node, const uint8_t *key, uint16_t len, Skip **preds, Leaf **succ)
+{
+    Skip *head, *at, *next;
+    Leaf *pred = NULL, *leaf;
+    uint32_t prefix = key_prefix(key, len);
+    uint8_t levels = 0;
+    int level;
+
+    head = load_ptr(node->skip);
+    assert((preds == NULL || head != NULL) && "Error: Collecting skiplist predecessors requires a head.");
+
+    if (head != NULL)
+    {
+        levels = __atomic_load_n(&head->height, __ATOMIC_ACQUIRE);
+        at = head;
+        for (level = SkipMaxLevel - 1; level >= 0; level--)
+        {
+            if (level < levels)
+            {
+                while ((next = load_ptr(at->next[level])) != NULL && tower_before(next, key, len, prefix))
+                {
+                    at = next;
+                }
+            }
+            if (preds != NULL)
+            {
+                preds[level] = at;
+            }
+        }
+        pred = at->leaf;
+    }
+
+    leaf = pred == NULL ? load_ptr(node->east) : load_ptr(pred->east);
+    while (leaf != NULL && leaf_compare(leaf, key, len) < 0)
+    {
+        pred = leaf;
+        leaf = load_ptr(leaf->east);
+    }
+
+    if (succ != NULL)
+    {
+        *succ = leaf;
+    }
+
+    return pred;
+}
+
+// Links `tower` in after `preds` at each of its levels, then raises the number
+// of levels in use if the tower is the first to reach that high.
+static void skip_link(Node *node, Skip *tower, Skip **preds)
+{
+    uint8_t level;
+
+    for (level = 0; level < tower->height; level++)
+    {
+        tower->next[level] = preds[level]->next[level];
+        store_ptr(preds[level]->next[level], tower);
+    }
+    if (tower->height > node->skip->height)
+    {
+        __atomic_store_n(&node->skip->height, tower->height, __ATOMIC_RELEASE);
+    }
+}
+
+int key_compare(const uint8_t *a, uint16_t a_len, const uint8_t *b, uint16_t b_len)
+{
+    uint16_t common = a_len < b_len ? a_len : b_len;
+    size_t at = simd.mismatch(a, b, common);
+
+    return at < common ? (int)a[at] - (int)b[at] : (int)a_len - (int)b_len;
+}
+
+uint32_t key_prefix(const uint8_t *key, uint16_t len)
+{
+    uint32_t prefix = 0;
+    uint16_t i;
+
+    for (i = 0; i < 4; i++)
+    {
+        prefix = prefix << 8 | (i < len ? key[i] : 0);
+    }
+
+    return prefix;
+}
+
+int leaf_compare(const Leaf *leaf, const uint8_t *key, uint16_t len)
+{
+    return key_compare(leaf->key, leaf->keylen, key, len);
+}
+
+void skip_insert(Node *node, Leaf *leaf, uint32_t hash)
+{
+    Skip *preds[SkipMaxLevel];
+    Skip *tower = NULL;
+    Leaf *pred, *succ;
+    uint8_t height;
+
+    assert(node != NULL && leaf != NULL && "Error: Node and leaf cannot be NULL for skip_insert.");
+
+    // Take the tower first: if it cannot be had, the leaf simply goes without.
+    height = skip_height(hash);
+    if (height > 0 && skip_head(node, NULL) != NULL)
+    {
+        tower = tower_alloc(node, height, NULL);
+    }
+
+    // Find the neighbours. Keys arriving in ascending order (bulk loads,
+    // sequential ids) skip the search unless they need tower predecessors.
+    if (tower != NULL)
+    {
+        pred = skip_search(node, leaf->key, leaf->keylen, preds, &succ);
+    }
+    else if (node->tail == NULL || leaf_compare(node->tail, leaf->key, leaf->keylen) < 0)
+    {
+        pred = node->tail;
+        succ = NULL;
+    }
+    else
+    {
+        pred = skip_search(node, leaf->key, leaf->keylen, NULL, &succ);
+    }
+    assert((succ == NULL || leaf_compare(succ, leaf->key, leaf->keylen) != 0) && "Error: Key is already linked.");
+
+    // Link the leaf into 'east' first, so any tower pointing at it leads to a linked leaf.
+    leaf->west = pred == NULL ? (Tree *)node : (Tree *)pred;
+    leaf->east = succ;
+    if (pred == NULL)
+    {
+        store_ptr(node->east, leaf);
+    }
+    else
+    {
+        store_ptr(pred->east, leaf);
+    }
+    if (succ == NULL)
+    {
+        node->tail = leaf;
+    }
+    else
+    {
+        store_ptr(succ->west, (Tree *)leaf);
+    }
+
+    if (tower != NULL)
+    {
+        tower->leaf = leaf;
+        tower->prefix = key_prefix(leaf->key, leaf->keylen);
+        skip_link(node, tower, preds);
+    }
+}
+
+void skip_append_run(Node *node, Leaf *first, Arena *arena)
+{
+    Skip *preds[SkipMaxLevel];
+    Skip *tower;
+    Leaf *leaf;
+    uint8_t height, level;
+    int searched = 0;
+
+    assert(node != NULL && first != NULL && "Error: Node and leaf cannot be NULL for skip_append_run.");
+
+    // The run ends the list, so each new tower goes after the previous one
+    // and the predecessors only need to be searched for once.
+    for (leaf = first; leaf != NULL; leaf = leaf->east)
+    {
+        height = skip_height(index_hash(leaf->key, leaf->keylen));
+        if (height == 0)
+        {
+            continue;
+        }
+        if (!searched)
+        {
+            if (skip_head(node, arena) == NULL)
+            {
+                return;
+            }
+            skip_search(node, first->key, first->keylen, preds, NULL);
+            searched = 1;
+        }
+
+        tower = tower_alloc(node, height, arena);
+        if (tower == NULL)
+        {
+            return; // The remaining leaves go without towers.
+        }
+        tower->leaf = leaf;
+        tower->prefix = key_prefix(leaf->key, leaf->keylen);
+        skip_link(node, tower, preds);
+        for (level = 0; level < height; level++)
+        {
+            preds[level] = tower;
+        }
+    }
+}
+
+void skip_remove(Node *node, Leaf *leaf, uint32_t hash)
+{
+    Skip *preds[SkipMaxLevel];
+    Skip *tower;
+    uint8_t level;
+
+    assert(node != NULL && leaf != NULL && "Error: Node and leaf cannot be NULL for skip_remove.");
+
+    if (skip_height(hash) == 0 || node->skip == NULL)
+    {
+        return;
+    }
+
+    // The leaf's tower, if it got one, follows the predecessors at every level.
+    skip_search(node, leaf->key, leaf->keylen, preds, NULL);
+    tower = preds[0]->next[0];
+    if (tower == NULL || tower->leaf != leaf)
+    {
+        return;
+    }
+
+    for (level = 0; level < tower->height; level++)
+    {
+        assert(preds[level]->next[level] == tower && "Error: Skiplist tower is not linked at every level.");
+        store_ptr(preds[level]->next[level], tower->next[level]);
+    }
+
+    // Readers may still be walking the tower; free it after their grace
+    // period. Arena towers go away with the Node's arena.
+    if (!(tower->flags & SkipArena))
+    {
+        limbo_retire(&node->alloc->limbo, tower, reclaim_tower, node->alloc);
+    }
+}
+
+void skip_release(Node *node)
+{
+    skip_release_some(node, SIZE_MAX);
+}
+
+size_t skip_release_some(Node *node, size_t budget)
+{
+    Skip *tower;
+    size_t done = 0;
+
+    assert(node != NULL && "Error: Node cannot be NULL for skip_release_some.");
+
+    if (node->skip == NULL)
+    {
+        return 0;
+    }
+
+    // Every tower is at least one level high, so level 0 reaches them all.
+    // Unlinking from the front keeps the head valid between slices.
+    while (done < budget && (tower = node->skip->next[0]) != NULL)
+    {
+        node->skip->next[0] = tower->next[0];
+        if (!(tower->flags & SkipArena))
+        {
+            slab_free(&node->alloc->towers[tower->height - 1], tower);
+        }
+        done++;
+    }
+    if (done < budget)
+    {
+        if (!(node->skip->flags & SkipArena))
+        {
+            slab_free(&node->alloc->towers[SkipMaxLevel - 1], node->skip);
+        }
+        node->skip = NULL;
+        done++;
+    }
+
+    return done;
+}
+
+// Makes `leaf` the cursor's current leaf, or ends the iteration if it falls
+// outside the cursor's prefix.
+static Leaf *cursor_move(Cursor *cursor, Leaf *leaf)
+{
+    if (leaf != NULL && cursor->prefix != NULL &&
+        (leaf->keylen < cursor->prefix_len || !simd.equal(leaf->key, cursor->prefix, cursor->prefix_len)))
+    {
+        leaf = NULL;
+    }
+    cursor->leaf = leaf;
+
+    return leaf;
+}
+
+Leaf *cursor_seek(Cursor *cursor, Node *node, const uint8_t *key, uint16_t len)
+{
+    Leaf *leaf;
+
+    assert(cursor != NULL && node != NULL && "Error: Cursor and node cannot be NULL for cursor_seek.");
+    assert((key != NULL || len == 0) && "Error: Key cannot be NULL for cursor_seek.");
+
+    cursor->node = node;
+    cursor->prefix = NULL;
+    cursor->prefix_len = 0;
+    skip_search(node, key, len, NULL, &leaf);
+
+    return cursor_move(cursor, leaf);
+}
+
+Leaf *cursor_prefix(Cursor *cursor, Node *node, const uint8_t *prefix, uint16_t len)
+{
+    Leaf *leaf;
+
+    // Every key with the prefix sorts at or after the prefix itself, and they are contiguous.
+    cursor_seek(cursor, node, prefix, len);
+    leaf = cursor->leaf;
+    if (len > 0)
+    {
+        cursor->prefix = prefix;
+        cursor->prefix_len = len;
+    }
+
+    return cursor_move(cursor, leaf);
+}
+
+Leaf *cursor_first(Cursor *cursor, Node *node)
+{
+    assert(cursor != NULL && node != NULL && "Error: Cursor and node cannot be NULL for cursor_first.");
+
+    cursor->node = node;
+    cursor->prefix = NULL;
+    cursor->prefix_len = 0;
+
+    return cursor_move(cursor, load_ptr(node->east));
+}
+
+Leaf *cursor_last(Cursor *cursor, Node *node)
+{
+    Skip *at, *next;
+    Leaf *leaf = NULL, *next_leaf;
+    int level;
+
+    assert(cursor != NULL && node != NULL && "Error: Cursor and node cannot be NULL for cursor_last.");
+
+    cursor->node = node;
+    cursor->prefix = NULL;
+    cursor->prefix_len = 0;
+
+    // The cached tail belongs to the writers; readers run to the end of every level instead.
+    at = load_ptr(node->skip);
+    if (at != NULL)
+    {
+        for (level = __atomic_load_n(&at->height, __ATOMIC_ACQUIRE) - 1; level >= 0; level--)
+        {
+            while ((next = load_ptr(at->next[level])) != NULL)
+            {
+                at = next;
+            }
+        }
+        leaf = at->leaf;
+    }
+
+    next_leaf = leaf == NULL ? load_ptr(node->east) : load_ptr(leaf->east);
+    while (next_leaf != NULL)
+    {
+        leaf = next_leaf;
+        next_leaf = load_ptr(leaf->east);
+    }
+
+    return cursor_move(cursor, leaf);
+}
+
+Leaf *cursor_next(Cursor *cursor)
+{
+    assert(cursor != NULL && "Error: Cursor cannot be NULL for cursor_next.");
+
+    if (cursor->leaf == NULL)
+    {
+        return NULL;
+    }
+
+    return cursor_move(cursor, load_ptr(cursor->leaf->east));
+}
+
+Leaf *cursor_prev(Cursor *cursor)
+{
+    Tree *west;
+
+    assert(cursor != NULL && "Error: Cursor cannot be NULL for cursor_prev.");
+
+    if (cursor->leaf == NULL)
+    {
+        return NULL;
+    }
+
+    // The first leaf links back to the Node itself.
+    west = load_ptr(cursor->leaf->west);
+
+    return cursor_move(cursor, (Node *)west == cursor->node ? NULL : &west->leaf);
+}
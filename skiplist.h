@@ -0,0 +1,189 @@
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint8_t)
+#include <stddef.h> // For size_t
+
+// =============================================================================
+// Ordered Leaf Definitions
+// =============================================================================
+// The 'east' list of every Node is kept sorted by key (bytewise, shorter keys
+// first on a tie), so it doubles as the bottom level of a skiplist. About one
+// leaf in four also gets a tower of express links to leaves further along;
+// towers are small separate objects, so leaves keep their compact layout. A
+// seek walks down the towers and finishes with a few steps along 'east'.
+//
+// Every tower also keeps the first bytes of its leaf's key, so a seek decides
+// most steps from the tower alone and only reads the leaves whose key starts
+// like the one it looks for.
+//
+// A leaf's height comes from its key hash, so it needs no random state and a
+// Node rebuilt from the same keys gets the same towers. Towers are only an
+// accelerator: a leaf without one (for instance because its tower could not
+// be allocated) is still found, just a little more slowly.
+#define SkipMaxLevel 16 /* Maximum tower height; fine for 4^16 leaves per Node */
+#define SkipArena 0x01  /* Tower flag: the tower lives in the Node's arena (snapshot loading) */
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+struct s_node;
+struct s_leaf;
+struct s_arena;
+
+/**
+ * @brief The express links of one leaf, or the head of a Node's skiplist.
+ *
+ * `next[i]` is the next tower that reaches level i + 1. The head (stored in
+ * Node::skip) has no leaf, room for SkipMaxLevel links, and `height` set to
+ * the number of levels currently in use instead.
+ */
+struct s_skip {
+    struct s_leaf *leaf;    ///< The leaf the tower belongs to (NULL for the head).
+    uint8_t height;         ///< Number of entries in `next`.
+    uint8_t flags;          ///< Storage flags (SkipArena).
+    uint16_t reserved;      ///< Padding.
+    uint32_t prefix;        ///< key_prefix of the leaf's key (0 for the head).
+    struct s_skip *next[];  ///< Forward links, one per level.
+};
+typedef struct s_skip Skip;
+
+/**
+ * @brief A position in the ordered leaves of one Node.
+ *
+ * Cursors are read-side objects: they must be used inside an epoch section,
+ * and the leaves they return are only valid until it ends. If a writer
+ * changes the Node meanwhile, the cursor still moves in key order but may or
+ * may not see the inserted or deleted leaves.
+ */
+struct s_cursor {
+    struct s_node *node;    ///< The Node being iterated.
+    struct s_leaf *leaf;    ///< The current leaf, or NULL once past either end.
+    const uint8_t *prefix;  ///< When set, iteration stops at the first key without this prefix.
+    uint16_t prefix_len;    ///< Length of `prefix`.
+};
+typedef struct s_cursor Cursor;
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Compares two keys in leaf order: bytewise, and shorter first when one is a prefix of the other.
+ *
+ * @return A negative value, zero or a positive value if `a` sorts before, equal to or after `b`.
+ */
+int key_compare(const uint8_t *a, uint16_t a_len, const uint8_t *b, uint16_t b_len);
+
+/**
+ * @brief Returns the first 4 bytes of a key as a big-endian word, zero-padded if the key is shorter.
+ *
+ * Keys hold no NUL bytes, so two different prefixes order their keys as
+ * key_compare does; only keys with equal prefixes need a full compare.
+ */
+uint32_t key_prefix(const uint8_t *key, uint16_t len);
+
+/**
+ * @brief Compares a leaf's key with a lookup key, as key_compare does.
+ *
+ * @return A negative value, zero or a positive value if the leaf's key sorts
+ *         before, equal to or after `key`.
+ */
+int leaf_compare(const struct s_leaf *leaf, const uint8_t *key, uint16_t len);
+
+/**
+ * @brief Links a new Leaf into its Node's sorted 'east' list, towers included.
+ *
+ * Writers only. A key that sorts after the current tail is appended in O(1)
+ * (plus a seek for the one leaf in four that gets a tower); anything else
+ * costs one seek. Maintains the Node's tail, but not its count. The leaf must
+ * not already be linked.
+ *
+ * @param node A pointer to the Node the leaf belongs to.
+ * @param leaf The fully initialized leaf.
+ * @param hash The index hash of the leaf's key (picks its tower height).
+ */
+void skip_insert(struct s_node *node, struct s_leaf *leaf, uint32_t hash);
+
+/**
+ * @brief Builds the towers of a run of leaves that was just appended after the old tail.
+ *
+ * Writers only, or the thread loading a Node from a snapshot. The leaves from
+ * `first` up to the tail must already be linked in key order.
+ *
+ * @param node  A pointer to the Node the leaves belong to.
+ * @param first The first leaf of the run.
+ * @param arena Where to allocate the towers (flagged SkipArena), or NULL for the shard's slabs.
+ */
+void skip_append_run(struct s_node *node, struct s_leaf *first, struct s_arena *arena);
+
+/**
+ * @brief Unlinks a Leaf's tower, if it has one, and retires it. Writers only.
+ *
+ * The leaf itself stays linked; delete_leaf unlinks it from 'east'.
+ *
+ * @param node A pointer to the Node the leaf belongs to.
+ * @param leaf The leaf about to be deleted.
+ * @param hash The index hash of the leaf's key.
+ */
+void skip_remove(struct s_node *node, struct s_leaf *leaf, uint32_t hash);
+
+/**
+ * @brief Frees every tower of a Node immediately (the Node is being dropped).
+ *
+ * @param node A pointer to the Node whose towers are freed.
+ */
+void skip_release(struct s_node *node);
+
+/**
+ * @brief Frees up to `budget` towers of a Node that is being dropped, for reclaiming it in slices.
+ *
+ * The head goes last, once every tower is gone.
+ *
+ * @param node   A pointer to the Node whose towers are freed.
+ * @param budget The most towers to free.
+ * @return       The number of towers (and head) freed; less than `budget` once none are left.
+ */
+size_t skip_release_some(struct s_node *node, size_t budget);
+
+/**
+ * @brief Positions a cursor on the first leaf whose key is >= `key`.
+ *
+ * @param cursor A pointer to the cursor to position.
+ * @param node   A pointer to the Node to iterate; must already be loaded (see node_ready).
+ * @param key    The key bytes to seek to.
+ * @param len    The key length.
+ * @return       The leaf found, or NULL if every key sorts before `key`.
+ */
+struct s_leaf *cursor_seek(Cursor *cursor, struct s_node *node, const uint8_t *key, uint16_t len);
+
+/**
+ * @brief Positions a cursor on the first leaf whose key starts with `prefix`,
+ *        and limits cursor_next / cursor_prev to such leaves.
+ *
+ * `prefix` must stay valid while the cursor is used.
+ *
+ * @return The first matching leaf, or NULL if there is none.
+ */
+struct s_leaf *cursor_prefix(Cursor *cursor, struct s_node *node, const uint8_t *prefix, uint16_t len);
+
+/**
+ * @brief Positions a cursor on the Node's first (or, with cursor_last, last) leaf.
+ *
+ * @return The leaf, or NULL if the Node has no leaves.
+ */
+struct s_leaf *cursor_first(Cursor *cursor, struct s_node *node);
+struct s_leaf *cursor_last(Cursor *cursor, struct s_node *node);
+
+/**
+ * @brief Moves a cursor to the next (or, with cursor_prev, previous) leaf in key order.
+ *
+ * @return The new current leaf, or NULL once past the end (or the prefix range).
+ */
+struct s_leaf *cursor_next(Cursor *cursor);
+struct s_leaf *cursor_prev(Cursor *cursor);
+
+#endif /* SKIPLIST_H */
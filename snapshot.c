@@ -0,0 +1,581 @@
+/* snapshot.c */
+#include "main.h"
+
+#include <fcntl.h>    // For open, O_RDONLY
+#include <sched.h>    // For sched_yield
+#include <sys/mman.h> // For mmap, munmap
+#include <sys/stat.h> // For fstat
+
+static const uint8_t *map = NULL; // The mapped snapshot, or NULL if none is loaded.
+static size_t map_size = 0;       // Length of the mapping in bytes.
+
+// Returns the mapped bytes at `offset` if `len` bytes starting there lie
+// within the snapshot, so a corrupt offset can never read past the mapping.
+static const uint8_t *snapshot_at(uint64_t offset, uint64_t len)
+{
+    if (map == NULL || offset > map_size || len > map_size - offset)
+    {
+        return NULL;
+    }
+
+    return map + offset;
+}
+
+// Returns the bytes a Leaf built from a snapshot entry takes in its Node's
+// arena: small values are copied inline, larger ones stay in the mapping.
+static size_t mapped_leaf_bytes(uint8_t key_len, uint32_t value_len)
+{
+    size_t size = offsetof(Leaf, key) + key_len + 1;
+
+    return align_up(size + value_len <= LeafInlineSize ? size + value_len : size, sizeof(void *));
+}
+
+// Frees the children materialize has built under `node` so far; none of them
+// was ever visible.
+static void unbuild_children(Node *node)
+{
+    uint32_t i = 0;
+    Node *child;
+
+    while ((child = (Node *)index_next(&node->children, &i)) != NULL)
+    {
+        index_remove(&node->children, index_hash(child->path, (uint16_t)strlen((char *)child->path)), child);
+        meter_sub(&node->alloc->bytes, sizeof(Node));
+        free(child);
+    }
+}
+
+// Builds the children and leaves of `node` from its snapshot record. Nothing
+// is published until every allocation has succeeded.
+static int8_t materialize(Node *node, const uint8_t *rec)
+{
+    const uint8_t *offsets, *entry, *child_rec, *value, *prev_key = NULL;
+    uint64_t base, pos;
+    uint32_t child_count, leaf_count, value_len, i, expiring = 0;
+    uint16_t path_len;
+    uint8_t key_len, prev_len = 0;
+    size_t bytes = 0, size;
+    uint8_t *cursor = NULL;
+    Leaf *first = NULL, *prev = NULL, *leaf;
+    Node *child;
+
+    base = (uint64_t)(rec - map);
+    child_count = get_u32(rec);
+    leaf_count = get_u32(rec + 4);
+    path_len = get_u16(rec + 8);
+
+    pos = base + SnapshotNodeSize + align_up(path_len, 8);
+    offsets = snapshot_at(pos, (uint64_t)child_count * 8);
+    if (offsets == NULL)
+    {
+        retfail(EIO);
+    }
+
+    // First pass: check every leaf entry against the mapping, and that the keys
+    // are in strictly ascending order, and size the arena block.
+    pos += (uint64_t)child_count * 8;
+    for (i = 0; i < leaf_count; i++)
+    {
+        entry = snapshot_at(pos, SnapshotLeafSize);
+        if (entry == NULL || entry[4] > LeafKeyMax ||
+            snapshot_at(pos, SnapshotLeafSize + entry[4] + (uint64_t)get_u32(entry)) == NULL ||
+            (prev_key != NULL && key_compare(prev_key, prev_len, entry + SnapshotLeafSize, entry[4]) >= 0))
+        {
+            retfail(EIO);
+        }
+        prev_key = entry + SnapshotLeafSize;
+        prev_len = entry[4];
+        bytes += mapped_leaf_bytes(entry[4], get_u32(entry));
+        pos += align_up(SnapshotLeafSize + entry[4] + (uint64_t)get_u32(entry), 8);
+    }
+
+    // Size both indexes up front. The node is still pending,
+    // so nobody else can see its indexes, and they have no old table to retire.
+    if (index_reserve(&node->index, leaf_count, NULL) != NoError ||
+        index_reserve(&node->children, child_count, NULL) != NoError)
+    {
+        return -1;
+    }
+
+    // Children come next; each starts out pending on its own record. They are
+    // allocated with malloc because the shard's slabs belong to its writers,
+    // and this may run on a reader without the shard lock.
+    for (i = 0; i < child_count; i++)
+    {
+        child_rec = snapshot_at(get_u64(offsets + 8 * i), SnapshotNodeSize);
+        if (child_rec == NULL || get_u16(child_rec + 8) == 0 || get_u16(child_rec + 8) > PathSegmentMax ||
+            snapshot_at(get_u64(offsets + 8 * i), SnapshotNodeSize + get_u16(child_rec + 8)) == NULL)
+        {
+            errno = EIO;
+            child = NULL;
+        }
+        else
+        {
+            child = (Node *)calloc(1, sizeof(Node));
+        }
+        if (child == NULL)
+        {
+            unbuild_children(node);
+            return -1;
+        }
+
+        path_len = get_u16(child_rec + 8);
+        memcpy(child->path, child_rec + SnapshotNodeSize, path_len);
+        child->path[path_len] = '\0';
+        child->tag = TagNode;
+        child->flags = NodeHeap;
+        child->north = node;
+        child->alloc = node->alloc;
+        child->pending = child_rec;
+        child->codec = child_rec[10] <= CodecSampled ? child_rec[10] : CodecOff;
+        node_meter(child);
+        meter_add(&node->alloc->bytes, sizeof(Node));
+        index_insert(&node->children, index_hash(child->path, path_len), child, NULL);
+    }
+
+    // The arena block comes last: a failure above would otherwise strand it,
+    // and every retry of the still pending node would take another.
+    if (leaf_count > 0)
+    {
+        cursor = (uint8_t *)arena_alloc(&node->values, bytes);
+        if (cursor == NULL)
+        {
+            unbuild_children(node);
+            return -1;
+        }
+    }
+
+    // Second pass: build the leaves and chain them together, as create_leaf_batch does.
+    pos = base + SnapshotNodeSize + align_up(get_u16(rec + 8), 8) + (uint64_t)child_count * 8;
+    for (i = 0; i < leaf_count; i++)
+    {
+        entry = map + pos;
+        value_len = get_u32(entry);
+        key_len = entry[4];
+        value = entry + SnapshotLeafSize + key_len;
+        size = offsetof(Leaf, key) + key_len + 1;
+
+        leaf = (Leaf *)cursor;
+        zero((uint8_t *)leaf, offsetof(Leaf, key));
+        leaf->tag = TagLeaf;
+        memcpy(leaf->key, entry + SnapshotLeafSize, key_len);
+        leaf->key[key_len] = '\0';
+        leaf->keylen = key_len;
+        leaf->size = value_len;
+        leaf->expires = get_u32(entry + 8);
+        expiring += leaf->expires != ExpireNever;
+        if (size + value_len <= LeafInlineSize)
+        {
+            leaf->flags = LeafArena | LeafInline;
+            leaf->value = leaf->key + key_len + 1;
+            memcpy(leaf->value, value, value_len);
+        }
+        else
+        {
+            // The mapping is read-only; the value is never written in place.
+            leaf->flags = LeafArena | LeafMapped;
+            leaf->value = (uint8_t *)value;
+        }
+        cursor += mapped_leaf_bytes(key_len, value_len);
+
+        if (prev == NULL)
+        {
+            first = leaf;
+            leaf->west = (Tree *)node;
+        }
+        else
+        {
+            leaf->west = (Tree *)prev;
+            prev->east = leaf;
+        }
+        prev = leaf;
+
+        index_insert(&node->index, index_hash(leaf->key, key_len), leaf, NULL);
+        pos += align_up(SnapshotLeafSize + key_len + (uint64_t)value_len, 8);
+    }
+
+    store_ptr(node->east, first);
+    node->tail = prev;
+    __atomic_store_n(&node->count, leaf_count, __ATOMIC_RELAXED);
+
+    // The towers go in the same arena; if it runs out, the remaining leaves
+    // just go without.
+    if (first != NULL)
+    {
+        skip_append_run(node, first, &node->values);
+    }
+
+    // Without a timer a leaf still expires, but waits for a write of its key to be deleted.
+    if (expiring > 0 && expire_post(node) != NoError)
+    {
+        trace(TraceError, "materialize: %llu expiring leaves left without timers, error %llu", expiring, errno);
+    }
+
+    return NoError;
+}
+
+int8_t snapshot_materialize(Node *node)
+{
+    const uint8_t *rec;
+    int error;
+
+    assert(node != NULL && "Error: Node cannot be NULL for snapshot_materialize.");
+
+    // Claim the node, or wait for whoever already claimed it to finish.
+    for (;;)
+    {
+        rec = load_ptr(node->pending);
+        if (rec == NULL)
+        {
+            return NoError;
+        }
+        if (rec != SnapshotBusy &&
+            __atomic_compare_exchange_n(&node->pending, &rec, SnapshotBusy, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+        sched_yield();
+    }
+
+    if (materialize(node, rec) != NoError)
+    {
+        // Leave the node pending, so the next access tries again.
+        error = errno;
+        store_ptr(node->pending, rec);
+        trace(TraceError, "snapshot_materialize: node %#llx failed with error %llu", (uintptr_t)node, error);
+        retfail(error);
+    }
+
+    // Everything built above becomes visible together with this store.
+    store_ptr(node->pending, NULL);
+    metric_count(MetricMaterialize);
+    trace(TraceDebug, "snapshot_materialize: node %#llx, %llu leaves", (uintptr_t)node, node->count);
+
+    return NoError;
+}
+
+// Returns the size of the snapshot record of a loaded Node.
+static uint64_t record_size(Node *node)
+{
+    uint64_t size;
+    Leaf *leaf;
+
+    size = SnapshotNodeSize + align_up(strnlen((char *)node->path, PathSegmentMax), 8) + 8 * (uint64_t)node->children.count;
+    for (leaf = node->east; leaf != NULL; leaf = leaf->east)
+    {
+        size += align_up(SnapshotLeafSize + leaf->keylen + (uint64_t)leaf->size, 8);
+    }
+
+    return size;
+}
+
+// Writes the zero padding that brings `len` written bytes up to the next multiple of 8.
+static int8_t write_pad(FILE *out, size_t len)
+{
+    static const uint8_t pad[8] = {0};
+    size_t n = align_up(len, 8) - len;
+
+    if (fwrite(pad, 1, n, out) != n)
+    {
+        retfail(EIO);
+    }
+
+    return NoError;
+}
+
+// Serializes the tree below `root`, which must be locked, starting at file
+// offset `*offset`. Records are written breadth-first, so each child's offset
+// is known (from the sizes of the records queued before it) by the time its
+// parent is written, and the file is written strictly sequentially.
+static int8_t save_tree(FILE *out, Node *root, uint64_t *offset)
+{
+    Node **queue, **grown, *node, *child;
+    size_t head = 0, len = 0, cap = 64;
+    uint8_t header[SnapshotNodeSize], entry[SnapshotLeafSize], word[8];
+    uint8_t *scratch = NULL, *bigger;
+    const uint8_t *value;
+    uint32_t cursor, scratch_cap = 0;
+    uint16_t path_len;
+    Leaf *leaf;
+    int8_t status = NoError;
+
+    queue = (Node **)malloc(cap * sizeof(Node *));
+    if (queue == NULL || node_ready(root) != NoError)
+    {
+        free(queue);
+        retfail(ENOMEM);
+    }
+    queue[len++] = root;
+    *offset += record_size(root);
+
+    while (status == NoError && head < len)
+    {
+        node = queue[head++];
+
+        path_len = (uint16_t)strnlen((char *)node->path, PathSegmentMax);
+        zero(header, sizeof(header));
+        put_u32(header, node->children.count);
+        put_u32(header + 4, node->count);
+        put_u16(header + 8, path_len);
+        header[10] = node->codec;
+        if (fwrite(header, 1, sizeof(header), out) != sizeof(header) ||
+            fwrite(node->path, 1, path_len, out) != path_len || write_pad(out, path_len) != NoError)
+        {
+            errno = EIO;
+            status = -1;
+            break;
+        }
+
+        // Queue the children, handing each the next free offset.
+        cursor = 0;
+        while (status == NoError && (child = (Node *)index_next(&node->children, &cursor)) != NULL)
+        {
+            if (head > cap / 2)
+            {
+                // Reuse the consumed front of the queue before growing it.
+                memmove(queue, queue + head, (len - head) * sizeof(Node *));
+                len -= head;
+                head = 0;
+            }
+            if (len == cap)
+            {
+                grown = (Node **)realloc(queue, 2 * cap * sizeof(Node *));
+                if (grown == NULL)
+                {
+                    errno = ENOMEM;
+                    status = -1;
+                    break;
+                }
+                queue = grown;
+                cap *= 2;
+            }
+            if (node_ready(child) != NoError)
+            {
+                status = -1;
+                break;
+            }
+            put_u64(word, *offset);
+            if (fwrite(word, 1, sizeof(word), out) != sizeof(word))
+            {
+                errno = EIO;
+                status = -1;
+                break;
+            }
+            queue[len++] = child;
+            *offset += record_size(child);
+        }
+
+        for (leaf = node->east; status == NoError && leaf != NULL; leaf = leaf->east)
+        {
+            // Snapshots hold values as written; they are compressed again when rewritten.
+            value = leaf->value;
+            if (leaf->flags & LeafPacked)
+            {
+                if (leaf->size > scratch_cap)
+                {
+                    bigger = (uint8_t *)realloc(scratch, leaf->size);
+                    if (bigger == NULL)
+                    {
+                        errno = ENOMEM;
+                        status = -1;
+                        break;
+                    }
+                    scratch = bigger;
+                    scratch_cap = leaf->size;
+                }
+                if (value_copy(scratch, leaf->value, leaf->size, leaf->flags) != NoError)
+                {
+                    status = -1;
+                    break;
+                }
+                value = scratch;
+            }
+
+            zero(entry, sizeof(entry));
+            put_u32(entry, leaf->size);
+            entry[4] = leaf->keylen;
+            put_u32(entry + 8, leaf->expires); // Expired leaves too: they expire again after a load.
+            if (fwrite(entry, 1, sizeof(entry), out) != sizeof(entry) ||
+                fwrite(leaf->key, 1, leaf->keylen, out) != leaf->keylen ||
+                fwrite(value, 1, leaf->size, out) != leaf->size ||
+                write_pad(out, leaf->keylen + (size_t)leaf->size) != NoError)
+            {
+                errno = EIO;
+                status = -1;
+            }
+        }
+    }
+
+    free(scratch);
+    free(queue);
+
+    return status;
+}
+
+int8_t snapshot_save(const char *path)
+{
+    uint8_t header[SnapshotHeaderSize];
+    uint64_t offset = SnapshotHeaderSize, root_offset, lsn;
+    char *tmp;
+    FILE *out;
+    uint32_t i;
+    int8_t status = NoError;
+    int error;
+
+    assert(path != NULL && "Error: Path cannot be NULL for snapshot_save.");
+
+    tmp = (char *)malloc(strlen(path) + 5);
+    if (tmp == NULL)
+    {
+        retfail(ENOMEM);
+    }
+    sprintf(tmp, "%s.tmp", path);
+
+    out = fopen(tmp, "wb");
+    if (out == NULL)
+    {
+        error = errno;
+        free(tmp);
+        retfail(error);
+    }
+    setvbuf(out, NULL, _IOFBF, 1024 * 1024);
+
+    // The header is written last, once the root offsets are known.
+    zero(header, sizeof(header));
+    memcpy(header, SnapshotMagic, 8);
+    put_u32(header + 8, SnapshotVersion);
+    put_u32(header + 12, ShardCount);
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header))
+    {
+        status = -1;
+    }
+
+    for (i = 0; i < ShardCount && status == NoError; i++)
+    {
+        pthread_mutex_lock(&shards[i].lock);
+        // Every record this shard has logged so far is applied to its tree.
+        lsn = wal_last_lsn() > shards[i].lsn ? wal_last_lsn() : shards[i].lsn;
+        root_offset = offset;
+        status = save_tree(out, &shards[i].root.node, &offset);
+        pthread_mutex_unlock(&shards[i].lock);
+
+        put_u64(header + 24 + 16 * i, root_offset);
+        put_u64(header + 32 + 16 * i, lsn);
+    }
+    put_u64(header + 16, offset);
+
+    if (status == NoError &&
+        (fseek(out, 0, SEEK_SET) != 0 || fwrite(header, 1, sizeof(header), out) != sizeof(header) ||
+         fflush(out) != 0 || fsync(fileno(out)) != 0))
+    {
+        status = -1;
+    }
+    error = errno;
+    if (fclose(out) != 0 && status == NoError)
+    {
+        error = errno;
+        status = -1;
+    }
+
+    // Only a complete snapshot replaces the previous one.
+    if (status == NoError && rename(tmp, path) != 0)
+    {
+        error = errno;
+        status = -1;
+    }
+    if (status != NoError)
+    {
+        unlink(tmp);
+    }
+    free(tmp);
+
+    if (status != NoError)
+    {
+        retfail(error);
+    }
+    trace(TraceInfo, "snapshot_save: %llu bytes, %llu shards", offset, ShardCount);
+
+    return NoError;
+}
+
+int8_t snapshot_load(const char *path)
+{
+    struct stat st;
+    const uint8_t *root;
+    uint8_t *mapped;
+    uint32_t i;
+    int fd, error;
+
+    assert(path != NULL && "Error: Path cannot be NULL for snapshot_load.");
+    assert(map == NULL && "Error: A snapshot is already loaded.");
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0)
+    {
+        error = errno;
+        close(fd);
+        retfail(error);
+    }
+    if ((size_t)st.st_size < SnapshotHeaderSize)
+    {
+        close(fd);
+        retfail(EINVAL);
+    }
+
+    mapped = (uint8_t *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    error = errno;
+    close(fd); // The mapping keeps the file alive.
+    if (mapped == MAP_FAILED)
+    {
+        retfail(error);
+    }
+
+    // A snapshot only fits the build it was taken with: the shard of a path
+    // depends on ShardCount.
+    if (memcmp(mapped, SnapshotMagic, 8) != 0 || get_u32(mapped + 8) != SnapshotVersion ||
+        get_u32(mapped + 12) != ShardCount || get_u64(mapped + 16) != (uint64_t)st.st_size)
+    {
+        munmap(mapped, (size_t)st.st_size);
+        retfail(EINVAL);
+    }
+    map = mapped;
+    map_size = (size_t)st.st_size;
+
+    for (i = 0; i < ShardCount; i++)
+    {
+        root = snapshot_at(get_u64(mapped + 24 + 16 * i), SnapshotNodeSize);
+        if (root == NULL)
+        {
+            snapshot_release();
+            retfail(EINVAL);
+        }
+        shards[i].root.node.pending = root;
+        shards[i].root.node.codec = root[10] <= CodecSampled ? root[10] : CodecOff;
+        shards[i].lsn = get_u64(mapped + 32 + 16 * i);
+    }
+    trace(TraceInfo, "snapshot_load: %llu bytes, %llu shards", map_size, ShardCount);
+
+    return NoError;
+}
+
+void snapshot_release(void)
+{
+    uint32_t i;
+
+    if (map == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < ShardCount; i++)
+    {
+        shards[i].root.node.pending = NULL;
+    }
+    munmap((void *)map, map_size);
+    map = NULL;
+    map_size = 0;
+}
@@ -0,0 +1,95 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint64_t)
+#include <stddef.h> // For size_t
+
+// =============================================================================
+// Snapshot Format Definitions
+// =============================================================================
+// A snapshot is the whole tree serialized into one file with file offsets in
+// place of pointers, so it can be mapped and used without being parsed first.
+// At start the file is mapped read-only and each shard root just points at its
+// record. A Node's children and leaves are only loaded the first time the
+// Node is touched (see node_ready). Leaf values are never copied; they point
+// straight into the mapping. Writes after that never modify the mapping: new
+// or replaced values live in memory like any other, patching the snapshot
+// copy-on-write, one Node at a time.
+//
+// File layout (little-endian, every record 8-byte aligned):
+//   header:  u8[8] magic, u32 version, u32 shard count, u64 file size,
+//            then per shard: u64 root record offset, u64 WAL LSN
+//   node:    u32 child count, u32 leaf count, u16 path length, u8 codec mode
+//            (see store_compress), u8 reserved, u32 reserved, path bytes (padded to 8),
+//            u64 child record offsets[child count],
+//            per leaf: u32 value length, u8 key length, u8[3] reserved,
+//                      u32 expiry (Unix seconds, 0: never), u32 reserved,
+//                      key bytes, value bytes (padded to 8), in key order
+// A shard's LSN is that of the last WAL record contained in the snapshot, so
+// replaying the log afterwards only applies what came later.
+#define SnapshotMagic "DBSNAP\0\1"        /* First 8 bytes of a snapshot file */
+#define SnapshotVersion 3                 /* Format version written and accepted (2: leaves in key order, 3: expiry times) */
+#define SnapshotHeaderSize (24 + 16 * ShardCount) /* Bytes in the file header */
+#define SnapshotNodeSize 16               /* Bytes in a node record before its path */
+#define SnapshotLeafSize 16               /* Bytes in a leaf entry before its key */
+#define SnapshotDefaultPath "my_in_memory_db.snap" /* Snapshot file used when DB_SNAPSHOT is not set */
+#define SnapshotBusy ((const uint8_t *)1) /* Node::pending while a thread is loading the node */
+
+// =============================================================================
+// Macro Definitions
+// =============================================================================
+
+// node_ready: Makes sure a Node's children and leaves are loaded before they
+// are looked at. Evaluates to 0, or to -1 (errno set) if loading failed. Costs
+// a single load once the Node is loaded, which every Node not restored from a
+// snapshot always is. Readers and writers may both call it.
+#define node_ready(n) (load_ptr((n)->pending) == NULL ? NoError : snapshot_materialize(n))
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+struct s_node;
+
+/**
+ * @brief Writes the whole store to a snapshot file.
+ *
+ * Each shard is serialized under its writer lock, so it is consistent with the
+ * WAL LSN recorded for it. The file is written next to `path` and renamed over
+ * it once complete and fsynced, so a crash never leaves a partial snapshot.
+ *
+ * @param path The snapshot file to write.
+ * @return     0 on success, or -1 with errno set.
+ */
+int8_t snapshot_save(const char *path);
+
+/**
+ * @brief Maps a snapshot file and attaches it to the (empty) shards.
+ *
+ * Must be called after shards_init and before the WAL is replayed. Nothing but
+ * the header is read; Nodes are loaded on first use.
+ *
+ * @param path The snapshot file.
+ * @return     0 on success, or -1 with errno set (ENOENT if there is no snapshot,
+ *             EINVAL if the file is not a snapshot for this build).
+ */
+int8_t snapshot_load(const char *path);
+
+/**
+ * @brief Loads the children and leaves of a Node restored from a snapshot. Use node_ready instead.
+ *
+ * If another thread is already loading the Node, waits for it to finish.
+ *
+ * @param node The Node to load.
+ * @return     0 on success, or -1 with errno set (ENOMEM, or EIO if the record is corrupt).
+ */
+int8_t snapshot_materialize(struct s_node *node);
+
+/**
+ * @brief Unmaps the snapshot. Call only after the shards have been released.
+ */
+void snapshot_release(void);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,92 @@
+/* trace.c */
+#include "main.h"
+
+#include <time.h> // For clock_gettime, CLOCK_MONOTONIC
+
+_Static_assert((TraceRingSize & (TraceRingSize - 1)) == 0, "TraceRingSize must be a power of two.");
+
+/**
+ * @brief One recorded event.
+ *
+ * `seq` is the event's position in the ring plus one, written last; zero
+ * while a writer is filling the entry in. A dump only trusts entries whose
+ * `seq` reads the same before and after copying them.
+ */
+struct s_trace_event {
+    uint64_t seq;     ///< Ring position + 1, or 0 while being written.
+    uint64_t nanos;   ///< CLOCK_MONOTONIC timestamp in nanoseconds.
+    const char *fmt;  ///< Format string of the event.
+    uint64_t a;       ///< First format argument.
+    uint64_t b;       ///< Second format argument.
+    uint64_t level;   ///< Trace level of the event.
+};
+typedef struct s_trace_event TraceEvent;
+
+int trace_enabled = 0;                   // See trace.h.
+static uint64_t trace_head = 0;          // Number of events ever recorded.
+static TraceEvent ring[TraceRingSize];   // The most recent TraceRingSize events.
+
+static const char *const level_names[] = {"off", "error", "info", "debug"};
+
+void trace_enable(int enabled)
+{
+    __atomic_store_n(&trace_enabled, enabled != 0, __ATOMIC_RELAXED);
+}
+
+void trace_record(uint8_t level, const char *fmt, uint64_t a, uint64_t b)
+{
+    struct timespec now;
+    TraceEvent *event;
+    uint64_t pos;
+
+    clock_gettime(CLOCK_MONOTONIC, &now); // Served from the vDSO: no system call.
+
+    // Each writer claims its own entry, so concurrent writers never collide.
+    pos = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    event = &ring[pos & (TraceRingSize - 1)];
+
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&event->nanos, (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->fmt, fmt, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->a, a, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->b, b, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->level, level, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void trace_dump(FILE *out)
+{
+    TraceEvent copy, *event;
+    uint64_t head, pos;
+
+    assert(out != NULL && "Error: Output stream cannot be NULL for trace_dump.");
+
+    head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    pos = head > TraceRingSize ? head - TraceRingSize : 0;
+
+    for (; pos < head; pos++)
+    {
+        event = &ring[pos & (TraceRingSize - 1)];
+
+        copy.seq = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+        copy.nanos = __atomic_load_n(&event->nanos, __ATOMIC_RELAXED);
+        copy.fmt = __atomic_load_n(&event->fmt, __ATOMIC_RELAXED);
+        copy.a = __atomic_load_n(&event->a, __ATOMIC_RELAXED);
+        copy.b = __atomic_load_n(&event->b, __ATOMIC_RELAXED);
+        copy.level = __atomic_load_n(&event->level, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // Skip entries still being written or already overwritten by a newer event.
+        if (copy.seq != pos + 1 || __atomic_load_n(&event->seq, __ATOMIC_RELAXED) != copy.seq)
+        {
+            continue;
+        }
+
+        fprintf(out, "[%llu.%09llu] %-5s ", (unsigned long long)(copy.nanos / 1000000000u),
+                (unsigned long long)(copy.nanos % 1000000000u),
+                copy.level <= TraceDebug ? level_names[copy.level] : "?");
+        fprintf(out, copy.fmt, (unsigned long long)copy.a, (unsigned long long)copy.b);
+        fputc('\n', out);
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint64_t)
+#include <stdio.h>  // For FILE
+
+// =============================================================================
+// Trace Levels
+// =============================================================================
+// Tracing is filtered twice. At compile time, events above TraceLevel test a
+// constant false condition and are removed by the compiler as dead code, so
+// they cost nothing at all. At run time, the remaining events are recorded
+// only while tracing is enabled (trace_enable), and then only into an
+// in-memory ring: formatting and output are deferred to trace_dump, so
+// recording an event never takes a lock or makes a system call.
+#define TraceOff 0   /* No events */
+#define TraceError 1 /* Failures worth recording even in production */
+#define TraceInfo 2  /* Lifecycle events (connections, shutdown) */
+#define TraceDebug 3 /* Per-operation events (node creation, deletes) */
+
+// TraceLevel: Highest level compiled into the binary. Release builds
+// (-DNDEBUG) compile tracing out entirely unless a level is given explicitly,
+// e.g. -DTraceLevel=TraceInfo.
+#ifndef TraceLevel
+#ifdef NDEBUG
+#define TraceLevel TraceOff
+#else
+#define TraceLevel TraceDebug
+#endif
+#endif
+
+#define TraceRingSize 4096 /* Events kept in the ring (a power of two); older events are overwritten */
+
+// =============================================================================
+// Macro Definitions
+// =============================================================================
+
+// Records an event: `fmt` must be a string literal taking exactly two
+// unsigned long long arguments (e.g. "%llu", "%#llx"), and `a` and `b` are
+// stored unformatted. With `level` above TraceLevel the whole statement is
+// compiled out, arguments included.
+#define trace(level, fmt, a, b)                                                  \
+    do                                                                           \
+    {                                                                            \
+        if ((level) <= TraceLevel && trace_enabled)                              \
+        {                                                                        \
+            trace_record((level), (fmt), (uint64_t)(a), (uint64_t)(b));          \
+        }                                                                        \
+    } while (0)
+
+// =============================================================================
+// Global Variables
+// =============================================================================
+extern int trace_enabled; // Non-zero while events are being recorded.
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Starts or stops recording trace events.
+ *
+ * @param enabled Non-zero to record events, zero to stop.
+ */
+void trace_enable(int enabled);
+
+/**
+ * @brief Appends one event to the trace ring. Use the trace macro instead.
+ *
+ * Safe to call from any thread; never blocks.
+ *
+ * @param level The event's trace level.
+ * @param fmt   The event's format string (must outlive the ring).
+ * @param a     First format argument.
+ * @param b     Second format argument.
+ */
+void trace_record(uint8_t level, const char *fmt, uint64_t a, uint64_t b);
+
+/**
+ * @brief Formats and writes the events currently in the ring, oldest first.
+ *
+ * Events being overwritten while the ring is dumped are skipped.
+ *
+ * @param out The stream to write to.
+ */
+void trace_dump(FILE *out);
+
+#endif /* TRACE_H */
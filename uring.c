@@ -0,0 +1,187 @@
+/* uring.c */
+#include "main.h"
+
+#include <sys/mman.h>    // For mmap, munmap
+#include <sys/syscall.h> // For SYS_io_uring_setup, SYS_io_uring_enter, SYS_io_uring_register
+
+int8_t uring_init(Uring *ring, uint32_t entries)
+{
+    struct io_uring_params params;
+    uint8_t *sq, *cq;
+    int fd, error;
+
+    assert(ring != NULL && "Error: Ring cannot be NULL for uring_init.");
+    assert(entries > 0 && (entries & (entries - 1)) == 0 && "Error: Ring size must be a power of two.");
+
+    zero((uint8_t *)ring, sizeof(Uring));
+    ring->fd = -1;
+    zero((uint8_t *)&params, sizeof(params));
+
+    fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // Map the rings; kernels with IORING_FEAT_SINGLE_MMAP share one mapping.
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+
+    sq = (uint8_t *)mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        error = errno;
+        close(fd);
+        retfail(error);
+    }
+    ring->sq_ring = sq;
+    cq = sq;
+    if (ring->cq_ring_size > 0)
+    {
+        cq = (uint8_t *)mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            error = errno;
+            munmap(sq, ring->sq_ring_size);
+            close(fd);
+            retfail(error);
+        }
+        ring->cq_ring = cq;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        error = errno;
+        if (ring->cq_ring != NULL)
+        {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(sq, ring->sq_ring_size);
+        close(fd);
+        retfail(error);
+    }
+
+    ring->fd = fd;
+    ring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+    ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    ring->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return NoError;
+}
+
+void uring_release(Uring *ring)
+{
+    assert(ring != NULL && "Error: Ring cannot be NULL for uring_release.");
+
+    if (ring->fd < 0)
+    {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    zero((uint8_t *)ring, sizeof(Uring));
+    ring->fd = -1;
+}
+
+int8_t uring_register_files(Uring *ring, const int *fds, uint32_t count)
+{
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, count) < 0)
+    {
+        return -1;
+    }
+
+    return NoError;
+}
+
+int8_t uring_register_buffers(Uring *ring, const struct iovec *iov, uint32_t count)
+{
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) < 0)
+    {
+        return -1;
+    }
+
+    return NoError;
+}
+
+struct io_uring_sqe *uring_sqe(Uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t tail, head;
+
+    tail = *ring->sq_tail + ring->sq_pending;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->sq_entries)
+    {
+        return NULL;
+    }
+
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    zero((uint8_t *)sqe, sizeof(*sqe));
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    ring->sq_pending++;
+
+    return sqe;
+}
+
+int uring_submit(Uring *ring, uint32_t wait)
+{
+    uint32_t submit = ring->sq_pending;
+    long n;
+
+    // Publish the filled entries to the kernel before entering.
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    for (;;)
+    {
+        n = syscall(SYS_io_uring_enter, ring->fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0)
+        {
+            return (int)n;
+        }
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+        // Interrupted: submit whatever the kernel has not consumed yet, and wait again.
+        submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+}
+
+int uring_complete(Uring *ring, struct io_uring_cqe *cqe)
+{
+    uint32_t head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    *cqe = ring->cqes[head & ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
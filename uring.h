@@ -0,0 +1,109 @@
+#ifndef URING_H
+#define URING_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h>         // For fixed-width integer types (e.g., uint32_t)
+#include <stddef.h>         // For size_t
+#include <sys/uio.h>        // For struct iovec
+#include <linux/io_uring.h> // For the io_uring ABI (struct io_uring_sqe, IORING_OP_*)
+
+// =============================================================================
+// io_uring Definitions
+// =============================================================================
+// A minimal io_uring ring: just enough for the write-ahead log to queue
+// batches of writes and an fsync, submit them with one system call and reap
+// the completions. It talks to the kernel through the raw system calls, so
+// there is no liburing dependency; where io_uring is unavailable (old kernels,
+// seccomp filters), uring_init fails and callers fall back to plain writes.
+#define UringEntries 64 /* Submission queue entries of a ring */
+
+// =============================================================================
+// Type Definitions
+// =============================================================================
+
+/**
+ * @brief One io_uring instance with its mapped submission and completion queues.
+ *
+ * Single-threaded: only one thread may use a ring at a time.
+ */
+struct s_uring {
+    int fd;                       ///< The io_uring file descriptor, or -1.
+    uint32_t *sq_head;            ///< Submission queue head (advanced by the kernel).
+    uint32_t *sq_tail;            ///< Submission queue tail (advanced by us).
+    uint32_t *sq_array;           ///< Submission queue index array.
+    uint32_t sq_mask;             ///< Submission queue index mask.
+    uint32_t sq_entries;          ///< Submission queue size.
+    uint32_t sq_pending;          ///< Entries queued but not yet submitted.
+    struct io_uring_sqe *sqes;    ///< Submission queue entries.
+    uint32_t *cq_head;            ///< Completion queue head (advanced by us).
+    uint32_t *cq_tail;            ///< Completion queue tail (advanced by the kernel).
+    uint32_t cq_mask;             ///< Completion queue index mask.
+    struct io_uring_cqe *cqes;    ///< Completion queue entries.
+    void *sq_ring;                ///< Mapping of the submission ring (and the completion ring, if shared).
+    void *cq_ring;                ///< Mapping of the completion ring.
+    size_t sq_ring_size;          ///< Size of the `sq_ring` mapping.
+    size_t cq_ring_size;          ///< Size of the `cq_ring` mapping (0 if shared with `sq_ring`).
+    size_t sqes_size;             ///< Size of the `sqes` mapping.
+};
+typedef struct s_uring Uring;
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Creates an io_uring instance and maps its queues.
+ *
+ * @param ring    A pointer to the ring to initialize.
+ * @param entries The submission queue size (a power of two).
+ * @return        0 on success, or -1 with errno set (e.g. ENOSYS without io_uring).
+ */
+int8_t uring_init(Uring *ring, uint32_t entries);
+
+/**
+ * @brief Unmaps the queues and closes a ring.
+ *
+ * @param ring A pointer to the ring; does nothing if it was never initialized.
+ */
+void uring_release(Uring *ring);
+
+/**
+ * @brief Registers files with the ring, so SQEs can name them by index (IOSQE_FIXED_FILE).
+ *
+ * @return 0 on success, or -1 with errno set.
+ */
+int8_t uring_register_files(Uring *ring, const int *fds, uint32_t count);
+
+/**
+ * @brief Registers buffers with the ring, so IORING_OP_WRITE_FIXED can use them without mapping them per request.
+ *
+ * @return 0 on success, or -1 with errno set.
+ */
+int8_t uring_register_buffers(Uring *ring, const struct iovec *iov, uint32_t count);
+
+/**
+ * @brief Returns the next free submission queue entry, zeroed, or NULL if the queue is full.
+ *
+ * The entry is submitted by the next uring_submit.
+ */
+struct io_uring_sqe *uring_sqe(Uring *ring);
+
+/**
+ * @brief Submits every queued entry and waits until at least `wait` completions are available.
+ *
+ * @return The number of entries submitted, or -1 with errno set.
+ */
+int uring_submit(Uring *ring, uint32_t wait);
+
+/**
+ * @brief Takes the oldest completion, if any.
+ *
+ * @param ring A pointer to the ring.
+ * @param cqe  Receives a copy of the completion.
+ * @return     1 if a completion was taken, 0 if the queue is empty.
+ */
+int uring_complete(Uring *ring, struct io_uring_cqe *cqe);
+
+#endif /* URING_H */
@@ -0,0 +1,996 @@
+/* wal.c */
+#include "main.h"
+
+#include <fcntl.h>       // For open, O_RDWR, O_CREAT
+#include <sys/eventfd.h> // For eventfd
+#include <sys/mman.h>    // For mmap, munmap
+#include <sys/stat.h>    // For fstat
+#include <time.h>        // For clock_gettime, CLOCK_REALTIME
+
+/**
+ * @brief One encoded record waiting in the append queue.
+ *
+ * The queue is a stack of records, newest first, whose bottom is always a
+ * sentinel (a record with `size` 0). Writers push onto it with one CAS; the
+ * flusher takes everything above the sentinel at once by swapping in a new
+ * sentinel. Records are freed through the flusher's Limbo, because a writer
+ * may still be reading the `lsn` of the record it is about to push onto.
+ */
+struct s_wal_record {
+    struct s_wal_record *next; ///< The record pushed before this one (after the flusher takes it: the next one to write).
+    uint64_t lsn;              ///< LSN of the record; for a sentinel, of the last record taken before it.
+    uint32_t size;             ///< Bytes in `data`, or 0 for a sentinel.
+    uint8_t data[];            ///< The encoded record; the flusher fills in its LSN and CRC.
+};
+typedef struct s_wal_record WalRecord;
+
+/**
+ * @brief One write handed to the kernel but not yet known to be complete.
+ */
+struct s_wal_io {
+    const uint8_t *data; ///< The bytes written (a registered buffer or a record).
+    size_t len;          ///< Their length.
+    uint64_t offset;     ///< File offset they are written to.
+};
+typedef struct s_wal_io WalIo;
+
+/**
+ * @brief State of the (single, process-wide) write-ahead log.
+ *
+ * Writers never lock anything to append: they push onto `head`. The flusher
+ * alone touches the file, the ring, the staging buffers and `limbo`; `lock`
+ * only guards the durability state writers and the server wait on.
+ */
+struct s_wal {
+    int fd;                 ///< The log file, or -1 while the log is closed.
+    int notify;             ///< Eventfd written whenever `durable_lsn` advances (WalSyncAlways only), or -1.
+    uint8_t policy;         ///< WalSync* policy.
+    uint8_t open;           ///< Non-zero while records are being logged.
+    uint8_t stopping;       ///< Set by wal_close to make the flusher drain and exit.
+    uint8_t uring;          ///< Non-zero if `ring` is set up; otherwise the flusher uses pwrite and fdatasync.
+    int error;              ///< errno of the first failed write or fsync, 0 if none.
+    pthread_t flusher;      ///< The flusher thread.
+    WalRecord *head;        ///< The append queue: the newest record, or the sentinel if it is empty.
+    size_t queued;          ///< Bytes of records in the queue and not yet written.
+    uint64_t offset;        ///< File offset of the next record to write (flusher only).
+    uint64_t closed_lsn;    ///< LSN of the last record, once the log is closed.
+    Uring ring;             ///< The ring the flusher submits its writes and fsyncs to.
+    uint8_t *io;            ///< WalIoBuffers staging buffers of WalIoBufferSize bytes, registered with `ring`.
+    WalIo pending[UringEntries]; ///< Writes in flight, indexed by their `user_data`.
+    uint32_t pending_count; ///< Entries used in `pending`.
+    Limbo limbo;            ///< Written batches waiting for their grace period (flusher only).
+    pthread_mutex_t lock;   ///< Protects every field below, and `error`.
+    pthread_cond_t work;    ///< Wakes the flusher.
+    pthread_cond_t done;    ///< Signalled whenever the flusher has written or synced a batch.
+    uint64_t written_lsn;   ///< LSN of the last record handed to the kernel.
+    uint64_t written_offset; ///< File offset just past the last record known to be written.
+    uint64_t durable_lsn;   ///< LSN of the last record known to be on disk.
+    uint64_t wanted_lsn;    ///< Highest LSN a wal_wait or wal_poll caller is waiting for.
+};
+typedef struct s_wal Wal;
+
+static Wal wal = {.fd = -1, .notify = -1, .lock = PTHREAD_MUTEX_INITIALIZER,
+                  .work = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+static _Thread_local uint64_t thread_lsn = 0; // See wal_thread_lsn.
+static uint32_t crc_table[256];                // CRC-32C lookup table, filled by crc_init.
+
+// Fills the table for the byte-at-a-time CRC-32C (Castagnoli, reflected).
+static void crc_init(void)
+{
+    uint32_t i, bit, crc;
+
+    for (i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        }
+        crc_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        crc = (crc >> 8) ^ crc_table[(crc ^ data[i]) & 0xFF];
+    }
+
+    return ~crc;
+}
+
+// Writes all of `data` at `offset`, retrying short writes. Returns 0 or an errno value.
+static int pwrite_all(int fd, const uint8_t *data, size_t len, uint64_t offset)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = pwrite(fd, data, len, (off_t)offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno;
+        }
+        data += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+
+    return NoError;
+}
+
+// Frees a written batch of records, oldest first, ending with the sentinel it was taken above.
+static void reclaim_batch(void *ctx, void *ptr)
+{
+    WalRecord *rec = (WalRecord *)ptr, *next;
+
+    (void)ctx;
+    while (rec != NULL)
+    {
+        next = rec->next;
+        free(rec);
+        rec = next;
+    }
+}
+
+// Creates the ring, registers the log file and the staging buffers with it,
+// or falls back to plain writes if any of that fails. Returns 0 or an errno value.
+static int wal_io_init(void)
+{
+    struct iovec iov[WalIoBuffers];
+    uint32_t i;
+
+    wal.io = (uint8_t *)mmap(NULL, (size_t)WalIoBuffers * WalIoBufferSize, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (wal.io == MAP_FAILED)
+    {
+        wal.io = NULL;
+        return errno;
+    }
+
+    for (i = 0; i < WalIoBuffers; i++)
+    {
+        iov[i].iov_base = wal.io + (size_t)i * WalIoBufferSize;
+        iov[i].iov_len = WalIoBufferSize;
+    }
+    wal.uring = uring_init(&wal.ring, UringEntries) == NoError &&
+                uring_register_files(&wal.ring, &wal.fd, 1) == NoError &&
+                uring_register_buffers(&wal.ring, iov, WalIoBuffers) == NoError;
+    if (!wal.uring)
+    {
+        trace(TraceInfo, "wal_io_init: io_uring unavailable (errno %llu), using pwrite for %llu buffers",
+              errno, WalIoBuffers);
+        uring_release(&wal.ring);
+    }
+
+    return NoError;
+}
+
+// Writes `len` bytes at the end of the log: queued on the ring (from staging
+// buffer `buffer`, or straight from `data` if `buffer` is negative), or
+// written at once without one. Returns 0 or an errno value.
+static int wal_io_write(const uint8_t *data, size_t len, int buffer)
+{
+    struct io_uring_sqe *sqe;
+    uint64_t offset = wal.offset;
+
+    wal.offset += len;
+    if (!wal.uring)
+    {
+        return pwrite_all(wal.fd, data, len, offset);
+    }
+
+    sqe = uring_sqe(&wal.ring);
+    assert(sqe != NULL && "Error: The WAL ring has no free submission entry.");
+    sqe->opcode = buffer >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0; // Index of the log in the registered files.
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (uint32_t)len;
+    sqe->off = offset;
+    sqe->buf_index = buffer >= 0 ? (uint16_t)buffer : 0;
+    sqe->user_data = wal.pending_count;
+    wal.pending[wal.pending_count].data = data;
+    wal.pending[wal.pending_count].len = len;
+    wal.pending[wal.pending_count].offset = offset;
+    wal.pending_count++;
+
+    return NoError;
+}
+
+// Waits for every write queued by wal_io_write, behind an fsync of all of
+// them if `sync` is set. Short writes are finished with pwrite. Returns 0 or
+// an errno value.
+static int wal_io_complete(int sync)
+{
+    struct io_uring_cqe cqe;
+    struct io_uring_sqe *sqe;
+    WalIo *io;
+    uint32_t total, reaped;
+    int error = NoError, resync = 0, status;
+
+    if (!wal.uring)
+    {
+        return sync && fdatasync(wal.fd) != 0 ? errno : NoError;
+    }
+
+    if (sync)
+    {
+        // IOSQE_IO_DRAIN holds the fsync back until every write before it has completed.
+        sqe = uring_sqe(&wal.ring);
+        assert(sqe != NULL && "Error: The WAL ring has no free submission entry.");
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_DRAIN;
+        sqe->fd = 0;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = UINT64_MAX;
+    }
+    total = wal.pending_count + (sync ? 1u : 0u);
+    if (total == 0)
+    {
+        return NoError;
+    }
+
+    // One system call submits the whole batch and waits for all of it.
+    if (uring_submit(&wal.ring, total) < 0)
+    {
+        return errno;
+    }
+    for (reaped = 0; reaped < total;)
+    {
+        if (!uring_complete(&wal.ring, &cqe))
+        {
+            if (uring_submit(&wal.ring, 1) < 0)
+            {
+                return errno;
+            }
+            continue;
+        }
+        reaped++;
+
+        if (cqe.user_data == UINT64_MAX)
+        {
+            status = cqe.res < 0 ? -cqe.res : NoError;
+        }
+        else if (cqe.res < 0)
+        {
+            status = -cqe.res;
+        }
+        else
+        {
+            // A short write is finished synchronously; the fsync above may have missed it.
+            io = &wal.pending[cqe.user_data];
+            status = NoError;
+            if ((size_t)cqe.res < io->len)
+            {
+                status = pwrite_all(wal.fd, io->data + cqe.res, io->len - (size_t)cqe.res,
+                                    io->offset + (uint64_t)cqe.res);
+                resync = 1;
+            }
+        }
+        if (error == NoError)
+        {
+            error = status;
+        }
+    }
+    wal.pending_count = 0;
+
+    if (error == NoError && sync && resync && fdatasync(wal.fd) != 0)
+    {
+        error = errno;
+    }
+
+    return error;
+}
+
+// Takes every queued record, in LSN order, by swapping a new sentinel in, and
+// sets `*lsn` to the LSN of the last record taken. Returns NULL if the queue
+// is empty (or no sentinel could be allocated; the records are then taken
+// next round).
+static WalRecord *wal_take(uint64_t *lsn)
+{
+    WalRecord *head, *sentinel, *rec, *prev, *next;
+
+    head = __atomic_load_n(&wal.head, __ATOMIC_ACQUIRE);
+    *lsn = head->lsn;
+    if (head->size == 0)
+    {
+        return NULL;
+    }
+    sentinel = (WalRecord *)calloc(1, sizeof(WalRecord));
+    if (sentinel == NULL)
+    {
+        *lsn = wal.written_lsn;
+        return NULL;
+    }
+    do
+    {
+        // Writers go on numbering from the last record taken.
+        sentinel->lsn = head->lsn;
+    } while (!__atomic_compare_exchange_n(&wal.head, &head, sentinel, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    *lsn = head->lsn;
+
+    // Reverse the records above the old sentinel, then hang the old sentinel
+    // (whose `next` is NULL) off the newest one so the batch is freed with it.
+    prev = NULL;
+    for (rec = head; rec->size != 0; rec = next)
+    {
+        next = rec->next;
+        rec->next = prev;
+        prev = rec;
+    }
+    head->next = rec;
+
+    return prev;
+}
+
+// Writes a batch taken by wal_take, copying the records into the staging
+// buffers (records too large for one go out on their own) and submitting a
+// ring's worth of writes at a time, then fsyncs it if `sync` is set.
+// Returns 0 or an errno value.
+static int wal_write_batch(WalRecord *batch, int sync)
+{
+    WalRecord *rec;
+    size_t fill = 0;
+    int buffer = 0, error = NoError;
+
+    for (rec = batch; rec != NULL && rec->size != 0 && error == NoError; rec = rec->next)
+    {
+        // Computing the CRC here keeps it off the writers' path.
+        put_u64(rec->data + 8, rec->lsn);
+        put_u32(rec->data, crc32c(rec->data + 4, rec->size - 4));
+
+        if (rec->size > WalIoBufferSize - fill)
+        {
+            if (fill > 0)
+            {
+                error = wal_io_write(wal.io + (size_t)buffer * WalIoBufferSize, fill, buffer);
+                buffer++;
+                fill = 0;
+            }
+            // Reuse the buffers once everything queued so far is complete; keep room for an fsync.
+            if (error == NoError && (buffer == WalIoBuffers || wal.pending_count + 3 > UringEntries))
+            {
+                error = wal_io_complete(0);
+                buffer = 0;
+            }
+            if (rec->size > WalIoBufferSize)
+            {
+                error = error == NoError ? wal_io_write(rec->data, rec->size, -1) : error;
+                continue;
+            }
+        }
+        memcpy(wal.io + (size_t)buffer * WalIoBufferSize + fill, rec->data, rec->size);
+        fill += rec->size;
+    }
+
+    if (error == NoError && fill > 0)
+    {
+        error = wal_io_write(wal.io + (size_t)buffer * WalIoBufferSize, fill, buffer);
+    }
+    if (error == NoError)
+    {
+        error = wal_io_complete(sync);
+    }
+
+    return error;
+}
+
+// The flusher thread: takes the queued records in batches, writes them out
+// and fsyncs them as the policy demands, until wal_close asks it to stop.
+static void *wal_flusher(void *arg)
+{
+    struct timespec deadline;
+    WalRecord *batch, *rec;
+    uint64_t lsn, one = 1;
+    size_t bytes;
+    int stopping, sync, error;
+
+    (void)arg;
+
+    pthread_mutex_lock(&wal.lock);
+    for (;;)
+    {
+        // Sleep for one interval unless a waiter needs durability, the queue
+        // is filling up, or the log is closing.
+        if (!wal.stopping && wal.wanted_lsn <= wal.durable_lsn &&
+            __atomic_load_n(&wal.queued, __ATOMIC_ACQUIRE) < WalBufferMax / 2)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += WalSyncIntervalMs * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&wal.work, &wal.lock, &deadline);
+        }
+        stopping = wal.stopping;
+        pthread_mutex_unlock(&wal.lock);
+
+        // Take the whole queue; writers carry on pushing onto the new sentinel meanwhile.
+        batch = wal_take(&lsn);
+        bytes = 0;
+        for (rec = batch; rec != NULL && rec->size != 0; rec = rec->next)
+        {
+            bytes += rec->size;
+        }
+        sync = lsn > wal.durable_lsn && (wal.policy != WalSyncNone || stopping);
+
+        // One submission and at most one fsync cover every record in the batch.
+        error = batch != NULL || sync ? wal_write_batch(batch, sync) : NoError;
+        if (batch != NULL)
+        {
+            __atomic_sub_fetch(&wal.queued, bytes, __ATOMIC_RELEASE);
+            limbo_retire(&wal.limbo, batch, reclaim_batch, NULL);
+        }
+        limbo_reclaim(&wal.limbo);
+
+        pthread_mutex_lock(&wal.lock);
+        if (error != NoError)
+        {
+            if (wal.error == NoError)
+            {
+                __atomic_store_n(&wal.error, error, __ATOMIC_RELEASE);
+                trace(TraceError, "wal_flusher: I/O error %llu at LSN %llu", error, lsn);
+            }
+        }
+        else
+        {
+            wal.written_lsn = lsn;
+            wal.written_offset = wal.offset;
+            if (sync)
+            {
+                wal.durable_lsn = lsn;
+            }
+        }
+        pthread_cond_broadcast(&wal.done); // Writers waiting for queue space or durability can go on.
+        if (wal.policy == WalSyncAlways && (sync || error != NoError))
+        {
+            // Tell the server that responses held for durability can go out (or fail).
+            if (write(wal.notify, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            {
+                trace(TraceError, "wal_flusher: notify failed with errno %llu at LSN %llu", errno, lsn);
+            }
+        }
+
+        if (stopping && __atomic_load_n(&wal.head, __ATOMIC_ACQUIRE)->size == 0)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wal.lock);
+
+    return NULL;
+}
+
+int64_t wal_check(const uint8_t *rec, size_t len)
+{
+    uint32_t length;
+
+    if (crc_table[1] == 0)
+    {
+        crc_init(); // A replica checks records without ever opening a log.
+    }
+    if (len < WalRecordHeaderSize)
+    {
+        return 0;
+    }
+    length = get_u32(rec + 4);
+    if (length < WalRecordHeaderSize || rec[17] > LeafKeyMax ||
+        (uint64_t)WalRecordHeaderSize + get_u16(rec + 18) + rec[17] + get_u32(rec + 20) != length)
+    {
+        errno = EIO;
+        return -1;
+    }
+    if (length > len)
+    {
+        return 0;
+    }
+    if (crc32c(rec + 4, length - 4) != get_u32(rec))
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    return length;
+}
+
+void wal_apply(uint8_t type, const char *path, uint8_t *key, uint8_t key_len, const uint8_t *value,
+               uint32_t value_len, uint32_t now)
+{
+    uint32_t expires;
+
+    if (type == WalSet)
+    {
+        store_set(path, key, value_len, (uint8_t *)value);
+    }
+    else if (type == WalDel)
+    {
+        store_del(path, key_len > 0 ? key : NULL);
+    }
+    else if (type == WalCodec && value_len == 1)
+    {
+        store_compress(path, value[0]);
+    }
+    else if ((type == WalExpire && value_len == 4) || (type == WalSetExpiring && value_len >= 4))
+    {
+        // What expired while the record was on its way is as good as deleted.
+        expires = get_u32(value);
+        if (expires != ExpireNever && expires <= now)
+        {
+            store_del(path, key);
+        }
+        else if (type == WalExpire)
+        {
+            store_expire(path, key, expires);
+        }
+        else
+        {
+            store_set_expiring(path, key, value_len - 4, (uint8_t *)value + 4, expires);
+        }
+    }
+}
+
+// Applies every intact record in the log to the store. Sets `*end` to the
+// offset just past the last intact record and `*last_lsn` to its LSN.
+static int8_t wal_replay(int fd, size_t *end, uint64_t *last_lsn)
+{
+    struct stat st;
+    uint8_t *map, *rec;
+    uint8_t key[LeafKeyMax + 1];
+    char *path = NULL, *grown;
+    size_t off = 0, path_cap = 0, applied = 0;
+    uint32_t length, value_len, now = expire_clock();
+    uint16_t path_len;
+    uint8_t key_len;
+
+    *end = 0;
+    *last_lsn = 0;
+
+    if (fstat(fd, &st) != 0)
+    {
+        return -1;
+    }
+    if (st.st_size == 0)
+    {
+        return NoError;
+    }
+
+    map = (uint8_t *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    while ((size_t)st.st_size - off >= WalRecordHeaderSize)
+    {
+        rec = map + off;
+        length = get_u32(rec + 4);
+        key_len = rec[17];
+        path_len = get_u16(rec + 18);
+        value_len = get_u32(rec + 20);
+
+        // Anything inconsistent from here on is a torn write: stop replaying.
+        if (wal_check(rec, (size_t)st.st_size - off) <= 0)
+        {
+            break;
+        }
+
+        if (path_len + 1u > path_cap)
+        {
+            grown = (char *)realloc(path, path_len + 1u);
+            if (grown == NULL)
+            {
+                free(path);
+                munmap(map, (size_t)st.st_size);
+                retfail(ENOMEM);
+            }
+            path = grown;
+            path_cap = path_len + 1u;
+        }
+        memcpy(path, rec + WalRecordHeaderSize, path_len);
+        path[path_len] = '\0';
+        memcpy(key, rec + WalRecordHeaderSize + path_len, key_len);
+        key[key_len] = '\0';
+
+        // The log is not open yet, so applying a record does not log it again.
+        // A record that fails to apply failed the same way when it was logged,
+        // and one already contained in the shard's snapshot is skipped.
+        if (get_u64(rec + 8) > shard_for_path(path)->lsn)
+        {
+            wal_apply(rec[16], path, key, key_len, rec + WalRecordHeaderSize + path_len + key_len, value_len, now);
+        }
+
+        *last_lsn = get_u64(rec + 8);
+        off += length;
+        applied++;
+    }
+
+    free(path);
+    munmap(map, (size_t)st.st_size);
+
+    if (off < (size_t)st.st_size)
+    {
+        fprintf(stderr, "WARNING: Discarding %zu bytes of torn records at the end of the log.\n",
+                (size_t)st.st_size - off);
+    }
+    trace(TraceInfo, "wal_replay: %llu records up to LSN %llu", applied, *last_lsn);
+    *end = off;
+
+    return NoError;
+}
+
+int8_t wal_open(const char *path, uint8_t policy)
+{
+    size_t end;
+    uint64_t lsn;
+    uint32_t i;
+    int fd, error;
+
+    assert(path != NULL && "Error: Path cannot be NULL for wal_open.");
+    assert(policy <= WalSyncAlways && "Error: Unknown WAL sync policy.");
+    assert(wal.fd < 0 && "Error: The write-ahead log is already open.");
+
+    crc_init();
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // Recover, then cut off any torn tail so new records follow the last good one.
+    if (wal_replay(fd, &end, &lsn) != NoError || ftruncate(fd, (off_t)end) != 0)
+    {
+        error = errno;
+        close(fd);
+        retfail(error);
+    }
+
+    // A snapshot may cover records of a log that has since been truncated;
+    // new records must still sort after them.
+    for (i = 0; i < ShardCount; i++)
+    {
+        if (shards[i].lsn > lsn)
+        {
+            lsn = shards[i].lsn;
+        }
+    }
+
+    wal.fd = fd;
+    wal.policy = policy;
+    wal.stopping = 0;
+    wal.error = NoError;
+    wal.offset = end;
+    wal.queued = 0;
+    wal.written_lsn = wal.durable_lsn = wal.wanted_lsn = lsn;
+    wal.written_offset = end;
+    wal.head = (WalRecord *)calloc(1, sizeof(WalRecord));
+    wal.notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    error = wal.head == NULL ? ENOMEM : wal.notify < 0 ? errno : wal_io_init();
+    if (error == NoError)
+    {
+        wal.head->lsn = lsn;
+        error = pthread_create(&wal.flusher, NULL, wal_flusher, NULL);
+    }
+    if (error != NoError)
+    {
+        uring_release(&wal.ring);
+        if (wal.io != NULL)
+        {
+            munmap(wal.io, (size_t)WalIoBuffers * WalIoBufferSize);
+            wal.io = NULL;
+        }
+        if (wal.notify >= 0)
+        {
+            close(wal.notify);
+            wal.notify = -1;
+        }
+        free(wal.head);
+        wal.head = NULL;
+        close(fd);
+        wal.fd = -1;
+        retfail(error);
+    }
+    trace(TraceInfo, "wal_open: appending at offset %llu, io_uring %llu", end, wal.uring);
+    __atomic_store_n(&wal.open, 1, __ATOMIC_RELEASE);
+
+    return NoError;
+}
+
+void wal_close(void)
+{
+    if (wal.fd < 0)
+    {
+        return;
+    }
+
+    // Stop logging first; the flusher drains whatever is still queued.
+    pthread_mutex_lock(&wal.lock);
+    __atomic_store_n(&wal.open, 0, __ATOMIC_RELEASE);
+    wal.stopping = 1;
+    pthread_cond_signal(&wal.work);
+    pthread_mutex_unlock(&wal.lock);
+
+    pthread_join(wal.flusher, NULL);
+
+    if (wal.error != NoError)
+    {
+        errno = wal.error;
+        perror("ERROR: Failed to write the write-ahead log");
+    }
+
+    // Nobody appends any more, so the last sentinel can go without a grace period.
+    limbo_drain(&wal.limbo);
+    free(wal.limbo.items);
+    zero((uint8_t *)&wal.limbo, sizeof(Limbo));
+    wal.closed_lsn = wal.head->lsn;
+    free(wal.head);
+    wal.head = NULL;
+
+    uring_release(&wal.ring);
+    wal.uring = 0;
+    munmap(wal.io, (size_t)WalIoBuffers * WalIoBufferSize);
+    wal.io = NULL;
+    close(wal.notify);
+    wal.notify = -1;
+    close(wal.fd);
+    wal.fd = -1;
+}
+
+// Shared body of wal_append and wal_append_set: the record's value is the
+// `prefix_len` bytes at `prefix` followed by the value.
+static int8_t wal_push(uint8_t type, const char *path, const uint8_t *key, uint8_t key_len,
+                       const uint8_t *prefix, uint32_t prefix_len, const uint8_t *value, uint32_t value_len)
+{
+    WalRecord *rec, *head;
+    uint8_t *data;
+    size_t path_len, size, queued;
+    uint64_t lsn;
+    int error;
+
+    if (!__atomic_load_n(&wal.open, __ATOMIC_ACQUIRE))
+    {
+        return NoError;
+    }
+
+    path_len = strlen(path);
+    if (path_len > UINT16_MAX)
+    {
+        retfail(ENAMETOOLONG);
+    }
+    size = WalRecordHeaderSize + path_len + key_len + (size_t)prefix_len + value_len;
+    if (size > UINT32_MAX)
+    {
+        retfail(EFBIG); // The record length field is 32 bits.
+    }
+
+    // Back-pressure: let the flusher catch up rather than queue without bound.
+    if (__atomic_load_n(&wal.queued, __ATOMIC_ACQUIRE) >= WalBufferMax)
+    {
+        pthread_mutex_lock(&wal.lock);
+        while (__atomic_load_n(&wal.queued, __ATOMIC_ACQUIRE) >= WalBufferMax && wal.error == NoError)
+        {
+            pthread_cond_signal(&wal.work);
+            pthread_cond_wait(&wal.done, &wal.lock);
+        }
+        pthread_mutex_unlock(&wal.lock);
+    }
+    error = __atomic_load_n(&wal.error, __ATOMIC_ACQUIRE);
+    if (error != NoError)
+    {
+        retfail(error);
+    }
+
+    // Encode everything but the LSN and CRC, which the flusher fills in.
+    rec = (WalRecord *)malloc(sizeof(WalRecord) + size);
+    if (rec == NULL)
+    {
+        retfail(ENOMEM);
+    }
+    rec->size = (uint32_t)size;
+    data = rec->data;
+    put_u32(data + 4, (uint32_t)size);
+    data[16] = type;
+    data[17] = key_len;
+    put_u16(data + 18, (uint16_t)path_len);
+    put_u32(data + 20, prefix_len + value_len);
+    memcpy(data + WalRecordHeaderSize, path, path_len);
+    if (key_len > 0)
+    {
+        memcpy(data + WalRecordHeaderSize + path_len, key, key_len);
+    }
+    if (prefix_len > 0)
+    {
+        memcpy(data + WalRecordHeaderSize + path_len + key_len, prefix, prefix_len);
+    }
+    if (value != NULL)
+    {
+        memcpy(data + WalRecordHeaderSize + path_len + key_len + prefix_len, value, value_len);
+    }
+    else
+    {
+        memset(data + WalRecordHeaderSize + path_len + key_len + prefix_len, 0, value_len);
+    }
+
+    // Push it, numbering it after the record it lands on. Inside the epoch
+    // section that record cannot be freed under us even if the flusher has
+    // already written it.
+    epoch_enter();
+    head = __atomic_load_n(&wal.head, __ATOMIC_ACQUIRE);
+    do
+    {
+        lsn = head->lsn + 1;
+        rec->lsn = lsn;
+        rec->next = head;
+    } while (!__atomic_compare_exchange_n(&wal.head, &head, rec, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    epoch_exit();
+
+    // The flusher wakes up on its own every interval; only hurry it along
+    // once enough has piled up.
+    queued = __atomic_add_fetch(&wal.queued, size, __ATOMIC_ACQ_REL);
+    if (queued >= WalBufferMax / 2 && queued - size < WalBufferMax / 2)
+    {
+        pthread_mutex_lock(&wal.lock);
+        pthread_cond_signal(&wal.work);
+        pthread_mutex_unlock(&wal.lock);
+    }
+
+    thread_lsn = lsn;
+
+    return NoError;
+}
+
+int8_t wal_append(uint8_t type, const char *path, const uint8_t *key, uint8_t key_len,
+                  const uint8_t *value, uint32_t value_len)
+{
+    return wal_push(type, path, key, key_len, NULL, 0, value, value_len);
+}
+
+int8_t wal_append_set(const char *path, const uint8_t *key, uint8_t key_len, uint32_t expires,
+                      const uint8_t *value, uint32_t value_len)
+{
+    uint8_t word[4];
+
+    if (expires == ExpireNever)
+    {
+        return wal_push(WalSet, path, key, key_len, NULL, 0, value, value_len);
+    }
+    put_u32(word, expires);
+
+    return wal_push(WalSetExpiring, path, key, key_len, word, sizeof(word), value, value_len);
+}
+
+uint64_t wal_thread_lsn(void)
+{
+    return thread_lsn;
+}
+
+uint64_t wal_last_lsn(void)
+{
+    WalRecord *head;
+    uint64_t lsn;
+
+    if (!__atomic_load_n(&wal.open, __ATOMIC_ACQUIRE))
+    {
+        return wal.closed_lsn;
+    }
+
+    epoch_enter();
+    head = __atomic_load_n(&wal.head, __ATOMIC_ACQUIRE);
+    lsn = head->lsn;
+    epoch_exit();
+
+    return lsn;
+}
+
+int8_t wal_wait(uint64_t lsn)
+{
+    int error = NoError;
+
+    if (wal.policy != WalSyncAlways || lsn == 0)
+    {
+        return NoError;
+    }
+
+    pthread_mutex_lock(&wal.lock);
+    if (wal.durable_lsn < lsn)
+    {
+        // Everyone waiting while an fsync is in flight shares the next one.
+        if (wal.wanted_lsn < lsn)
+        {
+            wal.wanted_lsn = lsn;
+            pthread_cond_signal(&wal.work);
+        }
+        while (wal.durable_lsn < lsn && wal.error == NoError)
+        {
+            pthread_cond_wait(&wal.done, &wal.lock);
+        }
+        if (wal.durable_lsn < lsn)
+        {
+            error = wal.error;
+        }
+    }
+    pthread_mutex_unlock(&wal.lock);
+
+    if (error != NoError)
+    {
+        retfail(error);
+    }
+
+    return NoError;
+}
+
+int wal_poll(uint64_t lsn)
+{
+    int durable = 1, error = NoError;
+
+    if (wal.policy != WalSyncAlways || lsn == 0)
+    {
+        return 1;
+    }
+
+    pthread_mutex_lock(&wal.lock);
+    if (wal.durable_lsn < lsn)
+    {
+        error = wal.error;
+        durable = 0;
+        if (error == NoError && wal.wanted_lsn < lsn)
+        {
+            wal.wanted_lsn = lsn;
+            pthread_cond_signal(&wal.work);
+        }
+    }
+    pthread_mutex_unlock(&wal.lock);
+
+    if (error != NoError)
+    {
+        errno = error;
+        return -1;
+    }
+
+    return durable;
+}
+
+uint64_t wal_written(uint64_t offset, uint32_t timeout_ms, uint64_t *lsn)
+{
+    struct timespec deadline;
+    uint64_t end;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&wal.lock);
+    while (wal.written_offset <= offset && __atomic_load_n(&wal.open, __ATOMIC_ACQUIRE))
+    {
+        if (pthread_cond_timedwait(&wal.done, &wal.lock, &deadline) != 0)
+        {
+            break; // Timed out: report what there is.
+        }
+    }
+    end = wal.written_offset;
+    *lsn = wal.written_lsn;
+    pthread_mutex_unlock(&wal.lock);
+
+    return end;
+}
+
+int wal_notify_fd(void)
+{
+    return wal.fd >= 0 && wal.policy == WalSyncAlways ? wal.notify : -1;
+}
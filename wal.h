@@ -0,0 +1,203 @@
+#ifndef WAL_H
+#define WAL_H
+
+// =============================================================================
+// Standard Library Includes
+// =============================================================================
+#include <stdint.h> // For fixed-width integer types (e.g., uint64_t)
+#include <stddef.h> // For size_t
+
+// =============================================================================
+// Write-Ahead Log Definitions
+// =============================================================================
+// Every successful store_set / store_del is appended to an append-only log
+// file as one binary record, tagged with a log sequence number (LSN). On start
+// the log is replayed into the empty tree, so a restart recovers every write
+// that reached the disk.
+//
+// Writers never touch the file themselves: they encode their record and push
+// it onto a lock-free queue with one CAS, which also gives it its LSN. A
+// single flusher thread takes the whole queue at once, copies the records
+// into buffers registered with an io_uring, and submits their writes (to the
+// log registered as a fixed file) together with the fsync the sync policy
+// asks for, in one system call; all records that arrived while the previous
+// fsync was in progress share the next one (group commit). Without io_uring
+// the flusher falls back to pwrite and fdatasync.
+//
+// Record layout (little-endian):
+//   u32 CRC-32C of everything after this field
+//   u32 total record length, header included
+//   u64 LSN
+//   u8  record type (WalSet / WalDel / WalCodec / WalExpire / WalSetExpiring)
+//   u8  key length
+//   u16 path length
+//   u32 value length
+//   path, key and value bytes
+// Replay stops at the first record that is short or fails its checksum (a
+// write torn by a crash) and truncates the file there.
+#define WalSet 1 /* Record: store_set(path, key, value) */
+#define WalDel 2 /* Record: store_del(path, key), or of the subtree at path when the key is empty */
+#define WalCodec 3 /* Record: store_compress(path, mode), the mode being the one value byte */
+#define WalExpire 4 /* Record: store_expire(path, key, expires), the value being the u32 expiry */
+#define WalSetExpiring 5 /* Record: store_set_expiring(path, key, value, expires), the value being the u32 expiry and the value */
+
+#define WalRecordHeaderSize 24 /* Bytes in a record header */
+
+#define WalSyncNone 0     /* Write records out, but leave fsync to the OS (and wal_close) */
+#define WalSyncInterval 1 /* fsync at most every WalSyncIntervalMs; a crash loses at most that much */
+#define WalSyncAlways 2   /* wal_wait blocks (and wal_poll reports 0) until the record is on disk */
+
+#define WalDefaultPath "my_in_memory_db.wal" /* Log file used when DB_WAL is not set */
+#define WalSyncIntervalMs 10                 /* fsync period for WalSyncInterval */
+#define WalBufferMax (8 * 1024 * 1024)       /* Queued bytes at which writers wait for the flusher */
+#define WalIoBuffers 4                       /* Staging buffers registered with the flusher's ring */
+#define WalIoBufferSize (1024 * 1024)        /* Bytes per staging buffer; larger records are written on their own */
+
+// =============================================================================
+// Function Prototypes
+// =============================================================================
+
+/**
+ * @brief Replays the log at `path` into the store and starts logging to it.
+ *
+ * Must be called after shards_init (and snapshot_load, if any) and before any
+ * other thread writes to the store. Records already contained in a shard's
+ * snapshot, or that fail to apply, are skipped. A torn tail is truncated away.
+ *
+ * @param path   The log file, created if it does not exist.
+ * @param policy The sync policy (WalSyncNone, WalSyncInterval or WalSyncAlways).
+ * @return       0 on success, or -1 with errno set if the log could not be opened or read.
+ */
+int8_t wal_open(const char *path, uint8_t policy);
+
+/**
+ * @brief Writes out and fsyncs everything logged so far, stops the flusher and closes the log.
+ *
+ * Does nothing if the log is not open.
+ */
+void wal_close(void);
+
+/**
+ * @brief Appends one record to the log. Does nothing if the log is not open.
+ *
+ * Called by the store with the shard lock held, so records of the same shard
+ * are logged in the order they were applied. Takes no lock and never waits
+ * for I/O, except when more than WalBufferMax bytes are already waiting for
+ * the flusher.
+ *
+ * @param type      WalSet, WalDel, WalCodec or WalExpire.
+ * @param path      The NUL-terminated path.
+ * @param key       The key bytes (may be NULL if `key_len` is 0).
+ * @param key_len   The key length.
+ * @param value     The value bytes, or NULL for a zero-filled value.
+ * @param value_len The value length.
+ * @return          0 on success, or -1 with errno set if the record could not be queued
+ *                  (ENAMETOOLONG for a path over 64 KiB, EFBIG for a record over 4 GiB, ENOMEM,
+ *                  or the error of an earlier failed write).
+ */
+int8_t wal_append(uint8_t type, const char *path, const uint8_t *key, uint8_t key_len,
+                  const uint8_t *value, uint32_t value_len);
+
+/**
+ * @brief Appends the record of a store_set, or of a store_set_expiring if the value expires, like wal_append.
+ *
+ * @param path      The NUL-terminated path.
+ * @param key       The key bytes.
+ * @param key_len   The key length.
+ * @param expires   When the value expires, in Unix seconds, or ExpireNever.
+ * @param value     The value bytes, or NULL for a zero-filled value.
+ * @param value_len The value length.
+ * @return          0 on success, or -1 with errno set (as for wal_append).
+ */
+int8_t wal_append_set(const char *path, const uint8_t *key, uint8_t key_len, uint32_t expires,
+                      const uint8_t *value, uint32_t value_len);
+
+/**
+ * @brief Returns the LSN of the last record appended by the calling thread (0 if none).
+ */
+uint64_t wal_thread_lsn(void);
+
+/**
+ * @brief Returns the LSN of the last record appended by any thread (0 if none).
+ *
+ * Called with a shard lock held, every record of that shard up to the result
+ * is already applied to its tree.
+ */
+uint64_t wal_last_lsn(void);
+
+/**
+ * @brief Makes the record with the given LSN durable as the sync policy demands.
+ *
+ * With WalSyncAlways, blocks until the record and all before it are fsynced;
+ * otherwise returns at once. Must not be called with a shard lock held.
+ *
+ * @param lsn The LSN to wait for (e.g. wal_thread_lsn()).
+ * @return    0 on success, or -1 with errno set if the log could not be written.
+ */
+int8_t wal_wait(uint64_t lsn);
+
+/**
+ * @brief Checks, without blocking, whether the record with the given LSN is as durable as the sync policy demands.
+ *
+ * The non-blocking form of wal_wait, for event loops: if the record is not on
+ * disk yet, the flusher is asked to sync it, and wal_notify_fd becomes
+ * readable once it (or any later record) is.
+ *
+ * @param lsn The LSN to check (e.g. wal_thread_lsn()).
+ * @return    1 if the record is durable (always, unless the policy is WalSyncAlways), 0 if not yet,
+ *            or -1 with errno set if the log could not be written.
+ */
+int wal_poll(uint64_t lsn);
+
+/**
+ * @brief Waits until the log holds written records past `offset`, or `timeout_ms` have passed.
+ *
+ * Used to tail the log file: every byte before the result belongs to a record
+ * the flusher has finished writing (though not necessarily fsynced), and the
+ * file never shrinks while the log is open. Returns at once if the log is
+ * closed.
+ *
+ * @param offset     The file offset the caller has read up to.
+ * @param timeout_ms How long to wait for more, in milliseconds.
+ * @param lsn        Set to the LSN of the last record written.
+ * @return           The file offset just past the last record written.
+ */
+uint64_t wal_written(uint64_t offset, uint32_t timeout_ms, uint64_t *lsn);
+
+/**
+ * @brief Checks the record at the start of `len` bytes.
+ *
+ * @param rec The bytes, starting with a record header.
+ * @param len The number of bytes available.
+ * @return    The length of the record if it is complete and its checksum matches, 0 if the
+ *            bytes end before it does, or -1 with errno set to EIO if it is corrupt.
+ */
+int64_t wal_check(const uint8_t *rec, size_t len);
+
+/**
+ * @brief Applies one record to the store, as replay does.
+ *
+ * Failures are ignored: a record that fails to apply failed the same way when
+ * it was logged. An expiring value whose time has already come is deleted.
+ *
+ * @param type      The record type (Wal*); unknown types are ignored.
+ * @param path      The NUL-terminated path.
+ * @param key       The NUL-terminated key.
+ * @param key_len   The key length (0 for a WalDel of the subtree at `path`).
+ * @param value     The value bytes of the record.
+ * @param value_len Their length.
+ * @param now       The current time, in Unix seconds (see expire_clock).
+ */
+void wal_apply(uint8_t type, const char *path, uint8_t *key, uint8_t key_len, const uint8_t *value,
+               uint32_t value_len, uint32_t now);
+
+/**
+ * @brief Returns an eventfd that becomes readable whenever more records are durable, or the log failed.
+ *
+ * Read it to clear it (it is non-blocking), then call wal_poll again.
+ *
+ * @return The eventfd, or -1 if the log is closed or the policy is not WalSyncAlways (wal_poll never returns 0 then).
+ */
+int wal_notify_fd(void);
+
+#endif /* WAL_H */